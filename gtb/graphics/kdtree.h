@@ -393,6 +393,16 @@ public:
 //    void Insert(IT first, IT last)
 
     void MakeTree();
+
+    //
+    // Flatten the tree into preorder arrays, and rebuild it from them,
+    // so a built tree can be cached.  nodes holds the axis of each inner
+    // node (cut point in the same slot of cuts), or -1-n for a leaf whose
+    // n objects come next in objects.
+    //
+    void Serialize(std::vector<int>& nodes, std::vector<REAL>& cuts, std::vector<T>& objects) const;
+    template <class CUT>
+    void Deserialize(const int* nodes, const CUT* cuts, const T* objects);
     
 
     // Info only, defined bellow
@@ -970,6 +980,10 @@ public:
 
     void MakeTree(TreeNode* root);
 
+    void SerializeNode(const Node* node, std::vector<int>& nodes, std::vector<REAL>& cuts, std::vector<T>& objects) const;
+    template <class CUT>
+    Node* DeserializeNode(const int*& nodes, const CUT*& cuts, const T*& objects);
+
 protected: // JS moved
 
     //
@@ -1351,6 +1365,70 @@ void KDTree<T, REAL, GETPOINT>::MakeTree(TreeNode* arg_root)
 }
 
 
+template<class T, class REAL, class GETPOINT>
+void KDTree<T, REAL, GETPOINT>::Serialize(std::vector<int>& nodes, std::vector<REAL>& cuts, std::vector<T>& objects) const
+{
+    nodes.clear();
+    cuts.clear();
+    objects.clear();
+    SerializeNode(root, nodes, cuts, objects);
+}
+
+template<class T, class REAL, class GETPOINT>
+void KDTree<T, REAL, GETPOINT>::SerializeNode(const Node* node, std::vector<int>& nodes, std::vector<REAL>& cuts, std::vector<T>& objects) const
+{
+    if (node->Type() == Node::tree)
+    {
+        const TreeNode* tn = static_cast<const TreeNode*>(node);
+        nodes.push_back(tn->axis);
+        cuts.push_back(tn->cut_point);
+        SerializeNode(tn->l, nodes, cuts, objects);
+        SerializeNode(tn->r, nodes, cuts, objects);
+    }
+    else
+    {
+        // only leaves and inner nodes get built by Insert/MakeTree
+        const LeafNode* ln = static_cast<const LeafNode*>(node);
+        nodes.push_back(-1 - (int)ln->objects.size());
+        cuts.push_back(0);
+        objects.insert(objects.end(), ln->objects.begin(), ln->objects.end());
+    }
+}
+
+template<class T, class REAL, class GETPOINT>
+template<class CUT>
+void KDTree<T, REAL, GETPOINT>::Deserialize(const int* nodes, const CUT* cuts, const T* objects)
+{
+    delete root;
+    root = DeserializeNode(nodes, cuts, objects);
+}
+
+template<class T, class REAL, class GETPOINT>
+template<class CUT>
+typename KDTree<T, REAL, GETPOINT>::Node* KDTree<T, REAL, GETPOINT>::DeserializeNode(const int*& nodes, const CUT*& cuts, const T*& objects)
+{
+    int code = *nodes++;
+    REAL cut = (REAL)*cuts++;
+
+    if (code >= 0)
+    {
+        TreeNode* tn = new TreeNode;
+        tn->axis = (typename TreeNode::t_axis)code;
+        tn->cut_point = cut;
+        tn->l = DeserializeNode(nodes, cuts, objects);
+        tn->r = DeserializeNode(nodes, cuts, objects);
+        return tn;
+    }
+    else
+    {
+        LeafNode* ln = new LeafNode;
+        ln->Insert(objects, objects + (-1 - code));
+        objects += -1 - code;
+        return ln;
+    }
+}
+
+
 template<class T, class REAL, class GETPOINT>
 typename KDTree<T, REAL, GETPOINT>::LeafNode* KDTree<T, REAL, GETPOINT>::Find(const tPoint3<REAL>& p, typename KDTree<T, REAL, GETPOINT>::TreeNode*& parent) const
 {
@@ -1706,6 +1784,9 @@ inline void SplitBBox(
 
 // kd tree that allows overlapping bounding boxes - each object only exists in the tree in one place
 
+// the tree is dynamic: Insert/Remove keep the bounding boxes tight on the way back up, and any
+// subtree that gets too lopsided is rebuilt locally (scapegoat style), so it never needs a full ReBuild
+
 
 // DISTBOXCLASS	must provide two typenames and two functions:
 // typename DISTBOXCLASS::Box3
@@ -1720,9 +1801,11 @@ class BoxKDTree {
 public:
 
 #define BOXKDTREE_MAXLEAFSIZE	10
+#define BOXKDTREE_BALANCE	0.75	// rebuild a subtree when one child holds more than this fraction of it
 
 	BoxKDTree() {
 		children[0] = children[1] = NULL;
+		count = 0;
 	}
 	~BoxKDTree() {
 		if (children[0]) delete children[0];
@@ -1730,20 +1813,22 @@ public:
 	}
 
 
-	BoxKDTree(const std::vector<OBJECT> &iobjects, const DISTBOXCLASS &boxclass, int axis=0) {
+	BoxKDTree(const std::vector<OBJECT> &iobjects, const DISTBOXCLASS &boxclass, int axis=0, bool median=false) {
 
 		children[0] = children[1] = NULL;
 
-		ReBuild(iobjects, boxclass, axis);
+		ReBuild(iobjects, boxclass, axis, median);
 	}
 
-	void ReBuild(const std::vector<OBJECT> &iobjects, const DISTBOXCLASS &boxclass, int axis=0) {
+	// median splits every node in half by count, rather than at the middle of its bounding box
+	void ReBuild(const std::vector<OBJECT> &iobjects, const DISTBOXCLASS &boxclass, int axis=0, bool median=false) {
 
 		if (children[0]) delete children[0];
 		if (children[1]) delete children[1];
 		children[0] = children[1] = NULL;
 
 		objects = iobjects;
+		count = objects.size();
 
 		// make the bounding box
         bbox = boxclass.bounding_box(objects[0]);
@@ -1751,11 +1836,14 @@ public:
 			bbox = DISTBOXCLASS::Box3::make_union(bbox, boxclass.bounding_box(objects[i]));
 		}
 
-		Split(boxclass, axis);
+		Split(boxclass, axis, median);
 
 	}
 
 
+	int size() const { return count; }
+
+
 	// get all the objects who's bounding boxes intersect the given box
 	void GetIntersectedBoxes(const DISTBOXCLASS &boxclass, const typename DISTBOXCLASS::Box3 &ibox, std::vector<OBJECT> &intersected) const {
 
@@ -1805,7 +1893,8 @@ public:
 	}
 
 
-	void Insert(const DISTBOXCLASS &boxclass, const OBJECT &o, int axis=0) {
+	// returns the number of objects that had to be moved by local rebuilds
+	int Insert(const DISTBOXCLASS &boxclass, const OBJECT &o, int axis=0) {
 
 		typename DISTBOXCLASS::Box3 obox = boxclass.bounding_box(o);
 
@@ -1869,13 +1958,16 @@ public:
 
 		
 		// expand our own bounding box
-		bbox = (addside==-1 && objects.size()==0) ? obox : DISTBOXCLASS::Box3::make_union(bbox, obox);
+		bbox = (addside==-1 && count==0) ? obox : DISTBOXCLASS::Box3::make_union(bbox, obox);
+		count++;
 
 		if (addside == -1) {
 			objects.push_back(o);
 			Split(boxclass, axis);
+			return 0;
 		} else {
-			children[addside]->Insert(boxclass, o, (axis+1)%3);
+			int moved = children[addside]->Insert(boxclass, o, (axis+1)%3);
+			return moved + Rebalance(boxclass, axis);
 		}
 
 	}
@@ -1883,6 +1975,12 @@ public:
 
 
 	bool Remove(const DISTBOXCLASS &boxclass, const OBJECT &o) {
+		int moved;
+		return Remove(boxclass, o, moved, 0);
+	}
+
+	bool Remove(const DISTBOXCLASS &boxclass, const OBJECT &o, int &moved, int axis=0) {
+		moved = 0;
 
 		if (bbox.classify_position(boxclass.bounding_box(o)) == DISTBOXCLASS::Box3::OUTSIDE)
 			return false;
@@ -1897,6 +1995,7 @@ public:
 					objects[i] = objects.back();
 				}
 				objects.pop_back();
+				count--;
 
 				// recompute the bounding box
 				if (objects.size() > 0) {
@@ -1921,7 +2020,8 @@ public:
 		// if we got here, we didn't find a match is the object list - check the children
 
 		for (int c=0; c<2; c++) {
-			if (children[c] && children[c]->Remove(boxclass, o)) {
+			if (children[c] && children[c]->Remove(boxclass, o, moved, (axis+1)%3)) {
+				count--;
 				int dangle = children[c]->dangling();
 				if (dangle != -1) {
 
@@ -1937,6 +2037,9 @@ public:
 					children[c] = NULL;
 				}
 
+				// shrink our box to what's left, and rebuild if we got lopsided
+				Refit(boxclass);
+				moved += Rebalance(boxclass, axis);
 				return true;
 			}
 		}
@@ -2003,7 +2106,7 @@ public:
 
 
 private:
-	void Split(const DISTBOXCLASS &boxclass, int axis=-1) {
+	void Split(const DISTBOXCLASS &boxclass, int axis=-1, bool median=false) {
 
 
 		// check if we should stop splitting
@@ -2025,7 +2128,7 @@ private:
 			// split the list by the axis
 			std::vector<OBJECT> cobjects[2];
 
-			if (objects.size() < 500) {
+			if (objects.size() < 500 || median) {
 				std::vector< std::pair<double,OBJECT> > sorter(objects.size());
 
 				for (unsigned i=0; i<objects.size(); i++) {
@@ -2033,7 +2136,11 @@ private:
 					sorter[i] = std::pair<double,OBJECT>((double)obox.centroid()[axis], objects[i]);
 				}
 
-				std::sort(sorter.begin(), sorter.end());
+				// only the halves matter, not the order within them
+				if (objects.size() < 500)
+					std::sort(sorter.begin(), sorter.end());
+				else
+					std::nth_element(sorter.begin(), sorter.begin() + sorter.size()/2, sorter.end());
 
 
 				unsigned i;
@@ -2065,14 +2172,54 @@ private:
 
 				assert(!children[0] && !children[1]);
 
-				children[0] = new BoxKDTree(cobjects[0], boxclass, (axis+1)%3);
-				children[1] = new BoxKDTree(cobjects[1], boxclass, (axis+1)%3);
+				children[0] = new BoxKDTree(cobjects[0], boxclass, (axis+1)%3, median);
+				children[1] = new BoxKDTree(cobjects[1], boxclass, (axis+1)%3, median);
 
 			}
 		}
 	}
 
 
+	// recompute the bounding box from the children and our own objects
+	void Refit(const DISTBOXCLASS &boxclass) {
+		bool first = true;
+		for (int c=0; c<2; c++) {
+			if (!children[c]) continue;
+			bbox = first ? children[c]->bbox : DISTBOXCLASS::Box3::make_union(bbox, children[c]->bbox);
+			first = false;
+		}
+		for (unsigned i=0; i<objects.size(); i++) {
+			typename DISTBOXCLASS::Box3 obox = boxclass.bounding_box(objects[i]);
+			bbox = first ? obox : DISTBOXCLASS::Box3::make_union(bbox, obox);
+			first = false;
+		}
+	}
+
+	// rebuild this subtree if one side holds too much of it, returns how many objects were moved.
+	// the rebuild splits at medians, so it comes out even and the subtree has to take about half
+	// again as many edits before it can go out of balance again
+	int Rebalance(const DISTBOXCLASS &boxclass, int axis) {
+		if (count < 4*BOXKDTREE_MAXLEAFSIZE)
+			return 0;
+
+		int c0 = children[0] ? children[0]->count : 0;
+		int c1 = children[1] ? children[1]->count : 0;
+		if (std::max(c0, c1) <= BOXKDTREE_BALANCE * count)
+			return 0;
+
+		std::vector<OBJECT> all;
+		all.reserve(count);
+		Gather(all);
+		ReBuild(all, boxclass, axis, true);
+		return (int)all.size();
+	}
+
+	void Gather(std::vector<OBJECT> &all) const {
+		all.insert(all.end(), objects.begin(), objects.end());
+		if (children[0])	children[0]->Gather(all);
+		if (children[1])	children[1]->Gather(all);
+	}
+
 	bool empty() {
 		return (!children[0] && !children[1] && !objects.size());
 	}
@@ -2091,6 +2238,9 @@ private:
 	// internal node
 	BoxKDTree* children[2];
 
+	// number of objects in this subtree
+	int count;
+
 	typename DISTBOXCLASS::Box3 bbox;
 
 };
@@ -0,0 +1,97 @@
+#include "stdafx.h"
+
+#include "Condition.h"
+
+#include <cassert>
+#include <iostream>
+using namespace std;
+
+BEGIN_THREADLIB_NAMESPACE
+
+#ifdef WIN32
+Condition::Condition()
+{
+    InitializeCriticalSection(&_cs);
+    InitializeConditionVariable(&_cond);
+}
+
+Condition::~Condition()
+{
+    DeleteCriticalSection(&_cs);
+}
+
+void Condition::enter()
+{
+    EnterCriticalSection(&_cs);
+}
+
+void Condition::leave()
+{
+    LeaveCriticalSection(&_cs);
+}
+
+void Condition::wait()
+{
+    SleepConditionVariableCS(&_cond, &_cs, INFINITE);
+}
+
+void Condition::signal()
+{
+    WakeConditionVariable(&_cond);
+}
+
+void Condition::broadcast()
+{
+    WakeAllConditionVariable(&_cond);
+}
+#endif
+
+#if defined(__gnu_linux__) || defined(__APPLE__)
+Condition::Condition()
+{
+    pthread_mutex_init(&_cs, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+Condition::~Condition()
+{
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_cs);
+}
+
+void Condition::enter()
+{
+    if (pthread_mutex_lock(&_cs)) {
+	cerr << "Condition::enter() failed" << endl;
+	assert(0);
+    }
+}
+
+void Condition::leave()
+{
+    if (pthread_mutex_unlock(&_cs)) {
+	cerr << "Condition::leave() failed" << endl;
+	assert(0);
+    }
+}
+
+void Condition::wait()
+{
+    if (pthread_cond_wait(&_cond, &_cs)) {
+	cerr << "Condition::wait() failed" << endl;
+	assert(0);
+    }
+}
+
+void Condition::signal()
+{
+    pthread_cond_signal(&_cond);
+}
+
+void Condition::broadcast()
+{
+    pthread_cond_broadcast(&_cond);
+}
+#endif
+
+END_THREADLIB_NAMESPACE
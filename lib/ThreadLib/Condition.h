@@ -0,0 +1,53 @@
+#ifndef __CONDITION_H
+#define __CONDITION_H
+
+#include "threadsall.h"
+
+/*
+ * Condition variable class, bundled with the mutex that guards the
+ * predicate being waited on.
+ * Sample usage:
+ *
+ * Condition cond;
+ * ...
+ * consumer:
+ *     cond.enter();
+ *     while (queue.empty()) cond.wait();   // sleeps, releasing the mutex
+ *     ... take from queue ...
+ *     cond.leave();
+ *
+ * producer:
+ *     cond.enter();
+ *     ... add to queue ...
+ *     cond.signal();
+ *     cond.leave();
+ */
+
+BEGIN_THREADLIB_NAMESPACE
+
+class Condition
+{
+public:
+    Condition();
+    ~Condition(); // NOTE: not virtual
+
+    void enter();
+    void leave();
+
+    // must be called between enter() and leave()
+    void wait();
+    void signal();      // wake one waiter
+    void broadcast();   // wake all waiters
+
+private:
+    // don't allow copies
+    Condition(const Condition &);
+    Condition& operator=(const Condition &);
+
+    CriticalSection _cs;
+    PrimitiveCondition _cond;
+};
+
+END_THREADLIB_NAMESPACE
+
+#endif // __CONDITION_H
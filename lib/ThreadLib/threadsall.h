@@ -28,12 +28,14 @@ BEGIN_THREADLIB_NAMESPACE
 typedef pthread_mutex_t CriticalSection;
 typedef ::sem_t PrimitiveSemaphore;
 typedef pthread_t PrimitiveThread;
+typedef pthread_cond_t PrimitiveCondition;
 #endif
 
 #ifdef WIN32
 typedef CRITICAL_SECTION CriticalSection;
 typedef HANDLE PrimitiveSemaphore;
 typedef HANDLE PrimitiveThread;
+typedef CONDITION_VARIABLE PrimitiveCondition;
 #endif
 
 END_THREADLIB_NAMESPACE
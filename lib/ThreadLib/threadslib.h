@@ -4,6 +4,7 @@
 #include "threadsall.h"
 #include "CriticalSection.h"
 #include "Sem.h"
+#include "Condition.h"
 #include "Thread.h"
 
 // For now
@@ -109,6 +109,7 @@ public:
     static bool WeightedPlaneThroughPoint(surfelset_view& nbhd, const Point3& r, WF* theta, Plane& plane);
 
     static bool PowellMLSPlane(surfelset_view& nbhd, const Point3& r, areal radius, Plane& plane, WF* theta);
+    static bool PlaneInitialValues(surfelset_view& nbhd, const Point3& r, areal radius, areal& ir, areal& is, areal& it);
 
 
     static bool WeightedPolyFit(
@@ -183,8 +184,6 @@ public:
     int _polynomial_degree;
 
 protected:
-    static bool PlaneInitialValues(surfelset_view& nbhd, const Point3& r, areal radius, areal& ir, areal& is, areal& it);
-
     //
     // A function object to evaluate the "value" of a plane.
     // used by the nonlinear optimization of the plane for the MLS projection.
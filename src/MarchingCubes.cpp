@@ -3,6 +3,12 @@
 #include "guidance.h"
 #include "triangulator.h"
 #include "triangulate_iso.h"
+#include "parallel.h"
+#include "profile.h"
+
+#include <map>
+#include <set>
+#include <algorithm>
 
 
 #define	MARCH_NOP		0
@@ -604,141 +610,691 @@ bool mc_testmatch(int index, int trans, bool extra, int *tris, int *ntris)
 }
 
 
-int mc_xyz2index(const RegularVolume &v, int x, int y, int z) {
-  return (z*(v.GetDim(0)+1)*(v.GetDim(1)+1) + y*(v.GetDim(0)+1) + x);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// slab parallel marching cubes
+//
+// the volume is marched in slabs of z layers, each slab on its own thread, keeping only a couple
+// of layers of values and vertex indices around.  the vertices are numbered up front from a
+// counting pass, so every slab knows the global indices of its vertices (and of the next slab's
+// first layer) without waiting on anyone, and the output is the same welded mesh a serial march gives.
+//
+// within a layer the x and y edge vertices are numbered first, then the z edges, so the cells
+// below a layer can find its x/y vertices without looking at the values above it.
+
+
+static const int mc_slab_layers = 16;
+
+
+// the cube cases with the transforms already undone, built once from mc_testmatch
+static int mc_case_ntris[256];
+static int mc_case_tris[256][5*3];
+static bool mc_cases_built = false;
+
+static void mc_build_cases() {
+
+    if (mc_cases_built) return;
+
+    for (int index=0; index<256; index++) {
+
+	int n_tris=0;
+	int *tris = mc_case_tris[index];
+
+	// first check the extra cases with no inversion
+	bool vol_march_found = false;
+	int trans;
+	for (trans=0; trans<24; trans++) {
+	    if (mc_testmatch(index, trans, true, tris, &n_tris)) {
+		vol_march_found=true; break;
+	    }
+	}
+
+	// check the reglar cases, and do the inversions
+	if (!vol_march_found) {
+	    for (trans = 0; trans<48; trans++) {
+		if (mc_testmatch(index, trans, false, tris, &n_tris)) {
+		    vol_march_found=true; break;
+		}
+	    }
+	}
+
+	if (!vol_march_found) {
+	    cerr<<"didn't find match for cube!"<<endl;
+	    n_tris = 0;
+	}
+
+	// rotate all the tris back
+	for (int t=6; t>=0; t--) {
+	    mc_transform_tri(tris, n_tris, mc_transforms[trans][t]);
+	}
+
+	mc_case_ntris[index] = n_tris;
+    }
+
+    mc_cases_built = true;
 }
 
-void MarchingCubes(const RegularVolume &v, TriangulatorController &tc, real_type isovalue) {
 
-    int num_verts=0;
-    int num_tris =0;
-    int *vertindices = new int[(v.GetDim(0)+1)*(v.GetDim(1)+1)*(v.GetDim(2)+1) * 3];
+// the grid edge each of the 12 cube edges lives on - offset of its grid point from the cell corner, and axis
+static const int mc_edge_grid[12][4] = {
+    { 0,0,0, 0 }, { 1,0,0, 1 }, { 0,1,0, 0 }, { 0,0,0, 1 },
+    { 0,0,0, 2 }, { 1,0,0, 2 }, { 1,1,0, 2 }, { 0,1,0, 2 },
+    { 0,0,1, 0 }, { 1,0,1, 1 }, { 0,1,1, 0 }, { 0,0,1, 1 },
+};
 
-    // find all the vertices (on the edges) 
-    cerr<<"Finding verts and normals...";
-    for (int z=v.GetBoundaryCells(); z<v.GetDim(2)-v.GetBoundaryCells()+0; z++) {
-	for (int y=v.GetBoundaryCells(); y<v.GetDim(1)-v.GetBoundaryCells()+0; y++) {
-	    for (int x=v.GetBoundaryCells(); x<v.GetDim(0)-v.GetBoundaryCells()+0; x++) {
-		// x-edge
-		if ((x != v.GetDim(0)-1) && (v.GetValue(x,y,z)<isovalue) ^ (v.GetValue(x+1,y,z)<isovalue)) {
-		    real_type s = (isovalue - v.GetValue(x,y,z)) / (v.GetValue(x+1,y,z) - v.GetValue(x,y,z));
-		    tc.AddVertex(num_verts, Point3(v.GetAspect(0)*(x+s),v.GetAspect(1)*y,v.GetAspect(2)*z), Vector3(0,0,0), false);
-		    vertindices[mc_xyz2index(v,x,y,z)*3+0] = num_verts;
-		    num_verts++;
-		} else {
-		    vertindices[mc_xyz2index(v,x,y,z)*3+0] = -1;
+
+// a surface edge that might be on the boundary of the marched surface (both ends on the same face of the marched block)
+class MCBoundaryEdge {
+    public:
+    int v[2];
+    Point3 p[2];
+};
+
+
+// everything one slab produces
+class MCSlab {
+    public:
+    int z0, z1;			// vertex layers [z0,z1)
+    vector<Point3> verts;	// in index order, starting at the slab's first index
+    vector<int> tris;
+    vector<unsigned char> tri_same_cell;	// seeds only: bit i set if edge i->i+1 doesn't cross a partition cell
+    vector<MCBoundaryEdge> boundary_edges;	// seeds only
+};
+
+
+class MCGrid {
+    public:
+
+    MCGrid(const RegularVolume &_v, real_type iso, bool _bspline, const real_type *_values, int _pcells=0)
+	: v(_v), values(_values), isovalue(iso), bspline(_bspline), pcells(_pcells) {
+
+	mc_build_cases();
+	ranges = &v.ValueRanges(bspline || values, values);
+
+	for (int i=0; i<3; i++)
+	    dim[i] = v.GetDim(i);
+	bc = v.GetBoundaryCells();
+	zend = dim[2]-bc;
+
+	if (pcells > 0) {
+	    pbox = v.bounding_box();
+	    pcellsize[0] = (pbox.x_max()-pbox.x_min()) / pcells;
+	    pcellsize[1] = (pbox.y_max()-pbox.y_min()) / pcells;
+	    pcellsize[2] = (pbox.z_max()-pbox.z_min()) / pcells;
+	}
+
+	for (int z=bc; z<zend; z+=mc_slab_layers) {
+	    slabs.push_back(MCSlab());
+	    slabs.back().z0 = z;
+	    slabs.back().z1 = std::min(z+mc_slab_layers, zend);
+	}
+    }
+
+
+    // bspline evaluates the prefiltered values on the fly, for volumes too big to prefilter in memory.
+    // points away from the surface get a stand-in on the right side of the isovalue instead
+    void FillValues(int z, real_type *vals) const {
+	vector<unsigned char> known(dim[0]);
+	for (int y=0; y<dim[1]; y++) {
+	    real_type *row = &vals[y*dim[0]];
+	    ranges->UniformPoints(y, z, isovalue, row, &known[0]);
+	    for (int x=0; x<dim[0]; x++) {
+		if (!known[x])
+		    row[x] = (values) ? values[v.xyz2index(x,y,z)] : (bspline) ? v.BSplineValue(x,y,z) : v.GetValue(x,y,z);
+	    }
+	}
+    }
+
+    bool Crosses(real_type a, real_type b) const {
+	return (a<isovalue) ^ (b<isovalue);
+    }
+
+    Point3 EdgePoint(int x, int y, int z, int axis, real_type a, real_type b) const {
+	real_type s = (isovalue - a) / (b - a);
+	real_type p[3] = { (real_type)x, (real_type)y, (real_type)z };
+	p[axis] += s;
+	return Point3(v.GetAspect(0)*p[0], v.GetAspect(1)*p[1], v.GetAspect(2)*p[2]);
+    }
+
+    int PartitionCell(const Point3 &p) const {
+	int ci[3] = { (int)((p[0]-pbox.x_min()) / pcellsize[0]),
+		      (int)((p[1]-pbox.y_min()) / pcellsize[1]),
+		      (int)((p[2]-pbox.z_min()) / pcellsize[2]) };
+	for (int k=0; k<3; k++) ci[k] = std::max(0, std::min(ci[k], pcells-1));
+	return (ci[2]*pcells + ci[1])*pcells + ci[0];
+    }
+
+    // which faces of the marched block a vertex is on
+    int FaceMask(int x, int y, int z, int axis) const {
+	int g[3] = { x, y, z };
+	int mask=0;
+	for (int i=0; i<3; i++) {
+	    if (i==axis) continue;
+	    if (g[i]==bc)		mask |= 1<<(2*i);
+	    if (g[i]==dim[i]-1-bc)	mask |= 1<<(2*i+1);
+	}
+	return mask;
+    }
+
+
+    // number of vertices owned by the layer v0 - v1 is the layer above, NULL at the top
+    int CountLayer(const real_type *v0, const real_type *v1) const {
+	int count=0;
+	for (int y=bc; y<dim[1]-bc; y++) {
+	    for (int x=bc; x<dim[0]-bc; x++) {
+		int p = y*dim[0]+x;
+		if (x != dim[0]-1 && Crosses(v0[p], v0[p+1]))		count++;
+		if (y != dim[1]-1 && Crosses(v0[p], v0[p+dim[0]]))	count++;
+		if (v1 && Crosses(v0[p], v1[p]))			count++;
+	    }
+	}
+	return count;
+    }
+
+
+    // number the vertices of layer z - the z edges only if v1 is given
+    void IndexLayer(const real_type *v0, const real_type *v1, int z, int *xy, int *ze, vector<Point3> *verts) const {
+
+	int next = layer_base[z];
+
+	for (int y=bc; y<dim[1]-bc; y++) {
+	    for (int x=bc; x<dim[0]-bc; x++) {
+		int p = y*dim[0]+x;
+
+		xy[p*2+0] = xy[p*2+1] = -1;
+
+		if (x != dim[0]-1 && Crosses(v0[p], v0[p+1])) {
+		    if (verts) verts->push_back(EdgePoint(x,y,z, 0, v0[p], v0[p+1]));
+		    xy[p*2+0] = next++;
 		}
 
-		// y-edge
-		if ((y != v.GetDim(1)-1) && (v.GetValue(x,y,z)<isovalue) ^ (v.GetValue(x,y+1,z)<isovalue)) {
-		    real_type s = (isovalue - v.GetValue(x,y,z)) / (v.GetValue(x,y+1,z) - v.GetValue(x,y,z));
-		    tc.AddVertex(num_verts, Point3(v.GetAspect(0)*x,v.GetAspect(1)*(y+s),v.GetAspect(2)*z), Vector3(0,0,0), false);
-		    vertindices[mc_xyz2index(v,x,y,z)*3+1] = num_verts;
-		    num_verts++;
-		} else {
-		    vertindices[mc_xyz2index(v,x,y,z)*3+1] = -1;
+		if (y != dim[1]-1 && Crosses(v0[p], v0[p+dim[0]])) {
+		    if (verts) verts->push_back(EdgePoint(x,y,z, 1, v0[p], v0[p+dim[0]]));
+		    xy[p*2+1] = next++;
 		}
+	    }
+	}
 
+	if (!v1) return;
 
-		// z-edge
-		if ((z != v.GetDim(2)-1) && (v.GetValue(x,y,z)<isovalue) ^ (v.GetValue(x,y,z+1)<isovalue)) {
-		    real_type s = (isovalue - v.GetValue(x,y,z)) / (v.GetValue(x,y,z+1) - v.GetValue(x,y,z));
-		    tc.AddVertex(num_verts, Point3(v.GetAspect(0)*x,v.GetAspect(1)*y,v.GetAspect(2)*(z+s)), Vector3(0,0,0), false);
-		    vertindices[mc_xyz2index(v,x,y,z)*3+2] = num_verts;
-		    num_verts++;
-		} else {
-		    vertindices[mc_xyz2index(v,x,y,z)*3+2] = -1;
+	for (int y=bc; y<dim[1]-bc; y++) {
+	    for (int x=bc; x<dim[0]-bc; x++) {
+		int p = y*dim[0]+x;
+		ze[p] = -1;
+		if (Crosses(v0[p], v1[p])) {
+		    if (verts) verts->push_back(EdgePoint(x,y,z, 2, v0[p], v1[p]));
+		    ze[p] = next++;
 		}
 	    }
 	}
     }
-    cerr<<"OK"<<endl;
 
-    // find all the triangles
-    cerr<<"finding triangles...";
-    for (int z=v.GetBoundaryCells(); z<v.GetDim(2)-1-v.GetBoundaryCells(); z++)
-	{
-	    for (int y=v.GetBoundaryCells(); y<v.GetDim(1)-1-v.GetBoundaryCells(); y++)
-		{
-		    for (int x=v.GetBoundaryCells(); x<v.GetDim(0)-1-v.GetBoundaryCells(); x++)
-			{
-			    int index = 0;
-			    if (v.GetValue(x  ,y  ,z  )>isovalue)	index |= 1<<0;
-			    if (v.GetValue(x+1,y  ,z  )>isovalue)	index |= 1<<1;
-			    if (v.GetValue(x+1,y+1,z  )>isovalue)	index |= 1<<2;
-			    if (v.GetValue(x  ,y+1,z  )>isovalue)	index |= 1<<3;
-			    if (v.GetValue(x  ,y  ,z+1)>isovalue)	index |= 1<<4;
-			    if (v.GetValue(x+1,y  ,z+1)>isovalue)	index |= 1<<5;
-			    if (v.GetValue(x+1,y+1,z+1)>isovalue)	index |= 1<<6;
-			    if (v.GetValue(x  ,y+1,z+1)>isovalue)	index |= 1<<7;
-
-
-			    // first check the extra cases with no inversion
-			    bool vol_march_found = false;
-
-			    int n_tris;
-			    int tris[5*3];
-
-
-			    int trans;
-			    for (trans=0; trans<24; trans++)
-				{
-				    if (mc_testmatch(index, trans, true, tris, &n_tris))
-					{
-					    vol_march_found=true; break;
-					}
-				}
-			    
-			    // check the reglar cases, and do the inversions
-			    if (!vol_march_found) {
-				for (trans = 0; trans<48; trans++)
-				    {
-					if (mc_testmatch(index, trans, false, tris, &n_tris))
-					    {
-						vol_march_found=true; break;
-					    }
-				    }
-			    }
 
-			    if (!vol_march_found)
-				cerr<<"didn't find match for cube!"<<endl;
-
-
-
-			    // rotate all the tris back
-			    for (int t=6; t>=0; t--)
-				{
-				    mc_transform_tri(tris, n_tris, mc_transforms[trans][t]);
-				}
-
-			    for (int t=0; t<(n_tris*3); t++)
-				{
-				    switch (tris[t])
-					{
-					case 0:	tris[t] = vertindices[mc_xyz2index(v,x  ,y  ,z  )*3+0];	break;
-					case 1:	tris[t] = vertindices[mc_xyz2index(v,x+1,y  ,z  )*3+1];	break;
-					case 2:	tris[t] = vertindices[mc_xyz2index(v,x  ,y+1,z  )*3+0];	break;
-					case 3:	tris[t] = vertindices[mc_xyz2index(v,x  ,y  ,z  )*3+1];	break;
-					case 4:	tris[t] = vertindices[mc_xyz2index(v,x  ,y  ,z  )*3+2];	break;
-					case 5:	tris[t] = vertindices[mc_xyz2index(v,x+1,y  ,z  )*3+2];	break;
-					case 6:	tris[t] = vertindices[mc_xyz2index(v,x+1,y+1,z  )*3+2];	break;
-					case 7:	tris[t] = vertindices[mc_xyz2index(v,x  ,y+1,z  )*3+2];	break;
-					case 8:	tris[t] = vertindices[mc_xyz2index(v,x  ,y  ,z+1)*3+0];	break;
-					case 9:	tris[t] = vertindices[mc_xyz2index(v,x+1,y  ,z+1)*3+1];	break;
-					case 10:tris[t] = vertindices[mc_xyz2index(v,x  ,y+1,z+1)*3+0];	break;
-					case 11:tris[t] = vertindices[mc_xyz2index(v,x  ,y  ,z+1)*3+1];	break;
-					}
-				}
-
-			    for (int t=0; t<n_tris*3; t+=3) {
-				tc.AddTriangle(num_tris++, tris[t+0], tris[t+1], tris[t+2]);
+    // the triangles of the cells between layers z and z+1
+    void MarchCells(const real_type *v0, const real_type *v1, const int *xy0, const int *ze0, const int *xy1,
+		    int z, bool seeds, MCSlab &s) const {
+
+	const real_type *vl[2] = { v0, v1 };
+
+	for (int y=bc; y<dim[1]-1-bc; y++) {
+	    if (!ranges->RowActive(y, z, isovalue)) continue;
+
+	    for (int x=bc; x<dim[0]-1-bc; x++) {
+		int p = y*dim[0]+x;
+
+		int index = 0;
+		if (v0[p           ]>isovalue)	index |= 1<<0;
+		if (v0[p+1         ]>isovalue)	index |= 1<<1;
+		if (v0[p+1+dim[0]  ]>isovalue)	index |= 1<<2;
+		if (v0[p  +dim[0]  ]>isovalue)	index |= 1<<3;
+		if (v1[p           ]>isovalue)	index |= 1<<4;
+		if (v1[p+1         ]>isovalue)	index |= 1<<5;
+		if (v1[p+1+dim[0]  ]>isovalue)	index |= 1<<6;
+		if (v1[p  +dim[0]  ]>isovalue)	index |= 1<<7;
+
+		int n_tris = mc_case_ntris[index];
+		const int *tris = mc_case_tris[index];
+
+		for (int t=0; t<n_tris*3; t+=3) {
+
+		    int vi[3];
+		    int fmask[3];
+		    Point3 vp[3];
+
+		    for (int k=0; k<3; k++) {
+			const int *eg = mc_edge_grid[tris[t+k]];
+			int gp = p + eg[1]*dim[0] + eg[0];
+			vi[k] = (eg[3]==2) ? ze0[gp] : (eg[2] ? xy1 : xy0)[gp*2 + eg[3]];
+
+			if (seeds) {
+			    fmask[k] = FaceMask(x+eg[0], y+eg[1], z+eg[2], eg[3]);
+			    if (pcells>0 || fmask[k]) {
+				const real_type *vals = vl[eg[2]];
+				real_type b = (eg[3]==0) ? vals[gp+1] : (eg[3]==1) ? vals[gp+dim[0]] : v1[gp];
+				vp[k] = EdgePoint(x+eg[0], y+eg[1], z+eg[2], eg[3], vals[gp], b);
 			    }
 			}
+		    }
+
+		    s.tris.push_back(vi[0]);
+		    s.tris.push_back(vi[1]);
+		    s.tris.push_back(vi[2]);
+
+		    if (!seeds) continue;
+
+		    if (pcells>0) {
+			int cells[3] = { PartitionCell(vp[0]), PartitionCell(vp[1]), PartitionCell(vp[2]) };
+			unsigned char same = 0;
+			for (int k=0; k<3; k++) {
+			    if (cells[k]==cells[(k+1)%3])
+				same |= 1<<k;
+			}
+			s.tri_same_cell.push_back(same);
+		    }
+
+		    for (int k=0; k<3; k++) {
+			if (fmask[k] & fmask[(k+1)%3]) {
+			    MCBoundaryEdge be;
+			    be.v[0] = vi[k];		be.p[0] = vp[k];
+			    be.v[1] = vi[(k+1)%3];	be.p[1] = vp[(k+1)%3];
+			    s.boundary_edges.push_back(be);
+			}
+		    }
 		}
+	    }
+	}
+    }
+
+
+    void CountSlab(const MCSlab &s, vector<int> &counts) const {
+
+	int n = dim[0]*dim[1];
+	vector<real_type> va(n), vb(n);
+	real_type *v0=&va[0], *v1=&vb[0];
+
+	FillValues(s.z0, v0);
+	for (int z=s.z0; z<s.z1; z++) {
+	    bool top = (z+1 >= dim[2]);
+	    if (!top) FillValues(z+1, v1);
+	    counts[z] = CountLayer(v0, (top) ? NULL : v1);
+	    std::swap(v0, v1);
+	}
+    }
+
+
+    void MarchSlab(MCSlab &s, bool seeds) const {
+
+	int n = dim[0]*dim[1];
+	vector<real_type> va(n), vb(n), vc(n);
+	real_type *v0=&va[0], *v1=&vb[0], *v2=&vc[0];
+	vector<int> xy0(2*n), ze0(n), xy1(2*n), ze1(n);
+
+	// seeds don't need the vertex positions
+	vector<Point3> *verts = (seeds) ? NULL : &s.verts;
+
+	FillValues(s.z0, v0);
+	if (s.z0+1 < dim[2]) FillValues(s.z0+1, v1);
+	IndexLayer(v0, (s.z0+1 < dim[2]) ? v1 : NULL, s.z0, &xy0[0], &ze0[0], verts);
+
+	for (int z=s.z0; z<s.z1; z++) {
+
+	    // the next layer - the first layer of the next slab only needs its x/y vertex indices
+	    if (z+1 < zend) {
+		bool owned = (z+1 < s.z1);
+		bool above = (owned && z+2 < dim[2]);
+		if (above) FillValues(z+2, v2);
+		IndexLayer(v1, (above) ? v2 : NULL, z+1, &xy1[0], &ze1[0], (owned) ? verts : NULL);
+	    }
+
+	    if (z < dim[2]-1-bc)
+		MarchCells(v0, v1, &xy0[0], &ze0[0], &xy1[0], z, seeds, s);
+
+	    std::swap(v0, v1);
+	    std::swap(v1, v2);
+	    xy0.swap(xy1);
+	    ze0.swap(ze1);
 	}
+    }
+
+
+    // count the vertices in each layer and number them
+    void NumberVertices() {
+	vector<int> counts(dim[2]+1, 0);
+	ParallelExecutor(idealNumThreads, makeClassFunctor(this, &MCGrid::CountParallel), counts);
+
+	layer_base.resize(dim[2]+1);
+	int total=0;
+	for (int z=0; z<=dim[2]; z++) {
+	    layer_base[z] = total;
+	    total += counts[z];
+	}
+    }
+
+    void CountParallel(int nt, int id, vector<int> &counts) {
+	for (unsigned i=id; i<slabs.size(); i+=nt)
+	    CountSlab(slabs[i], counts);
+    }
+
+    void MarchParallel(int /*nt*/, int id, int first, bool seeds) {
+	if (first+id < (int)slabs.size())
+	    MarchSlab(slabs[first+id], seeds);
+    }
+
+    int NumVerts() const { return layer_base.back(); }
+
+
+    const RegularVolume &v;
+    const real_type *values;	// prefiltered, if we were given them
+    const MinMaxPyramid *ranges;
+    real_type isovalue;
+    bool bspline;
+
+    int dim[3];
+    int bc;
+    int zend;			// one past the last vertex layer
+    vector<int> layer_base;	// index of the first vertex in each layer
+
+    int pcells;
+    Box3 pbox;
+    real_type pcellsize[3];
+
+    vector<MCSlab> slabs;
+};
+
+
+
+void MarchingCubes(const RegularVolume &v, TriangulatorController &tc, real_type isovalue, bool bspline, const real_type *prefiltered) {
+
+    MCGrid grid(v, isovalue, bspline, prefiltered);
+
+    cerr<<"Finding verts and normals...";
+    grid.NumberVertices();
     cerr<<"OK"<<endl;
 
-    delete [] vertindices;
+    // march a batch of slabs at a time, and send them out in order.  a slab's triangles use the
+    // first layer of vertices of the next slab, so the last slab of a batch holds its triangles
+    // back until the next batch has sent its vertices
+    cerr<<"finding triangles...";
+    int num_verts=0;
+    int num_tris=0;
+    vector<int> pending;
+
+    for (int first=0; first<(int)grid.slabs.size(); first+=idealNumThreads) {
 
+	bool seeds=false;
+	ParallelExecutor(idealNumThreads, makeClassFunctor(&grid, &MCGrid::MarchParallel), first, seeds);
+
+	int last = std::min(first+idealNumThreads, (int)grid.slabs.size());
+	for (int i=first; i<last; i++) {
+	    MCSlab &s = grid.slabs[i];
+	    for (unsigned j=0; j<s.verts.size(); j++)
+		tc.AddVertex(num_verts++, s.verts[j], Vector3(0,0,0), false);
+	    vector<Point3>().swap(s.verts);
+	}
+
+	for (unsigned t=0; t<pending.size(); t+=3)
+	    tc.AddTriangle(num_tris++, pending[t+0], pending[t+1], pending[t+2]);
+	pending.clear();
+
+	for (int i=first; i<last; i++) {
+	    MCSlab &s = grid.slabs[i];
+	    if (i == last-1) {
+		pending.swap(s.tris);
+	    } else {
+		for (unsigned t=0; t<s.tris.size(); t+=3)
+		    tc.AddTriangle(num_tris++, s.tris[t+0], s.tris[t+1], s.tris[t+2]);
+	    }
+	    vector<int>().swap(s.tris);
+	}
+    }
+
+    for (unsigned t=0; t<pending.size(); t+=3)
+	tc.AddTriangle(num_tris++, pending[t+0], pending[t+1], pending[t+2]);
+
+    cerr<<"OK"<<endl;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// seeds straight from the march
+//
+// connected components come from a union-find over the vertex indices as the triangles stream
+// by, and the pieces inside each partition cell from a second one that only joins edges that
+// stay inside a cell.  only the few seed points are ever positioned, by re-marching their layers.
+
+
+static int mc_find(vector<int> &parent, int i) {
+    while (parent[i] != i) {
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+    }
+    return i;
 }
 
+static void mc_union(vector<int> &parent, int a, int b) {
+    if (parent[a] < 0) parent[a] = a;
+    if (parent[b] < 0) parent[b] = b;
+    a = mc_find(parent, a);
+    b = mc_find(parent, b);
+    if (a < b)		parent[b] = a;
+    else if (b < a)	parent[a] = b;
+}
+
+
+// one component or piece being seeded
+class MCSeedSet {
+    public:
+    MCSeedSet() : size(0), seen(0), index(-1), boundary(false) { }
+    int size;
+    int seen;
+    int index;
+    bool boundary;
+    vector<int> picks;
+};
+
+
+// up to 10 vertices spread over each set, in index order
+static void mc_pick_seeds(vector<int> &parent, std::map<int,MCSeedSet> &sets) {
+
+    for (unsigned i=0; i<parent.size(); i++) {
+	if (parent[i] < 0) continue;
+	std::map<int,MCSeedSet>::iterator si = sets.find(mc_find(parent, i));
+	if (si == sets.end()) continue;
+
+	MCSeedSet &ss = si->second;
+	while ((int)ss.picks.size() < 10 && (int)ss.picks.size()*ss.size / 10 == ss.seen)
+	    ss.picks.push_back(i);
+	ss.seen++;
+    }
+}
+
+
+void FindMarchingCubesSeeds(const RegularVolume &v, real_type isovalue, bool bspline, int partition_cells, MarchingCubesSeeds &seeds, const real_type *prefiltered) {
+
+    ProfileTimer pt(PROF_TIME_MC_SEEDS);
+    double seed_start = Profile::Now();
+
+    MCGrid grid(v, isovalue, bspline, prefiltered, partition_cells);
+    grid.NumberVertices();
+
+    int nv = grid.NumVerts();
+    vector<int> component(nv, -1);	// union-find parents, -1 for vertices no triangle uses
+    vector<int> piece((partition_cells>0) ? nv : 0, -1);
+
+    // edges on the faces of the marched block, and how many triangles use them
+    std::map< std::pair<int,int>, std::pair<MCBoundaryEdge,int> > block_edges;
+
+    for (int first=0; first<(int)grid.slabs.size(); first+=idealNumThreads) {
+
+	bool dseeds=true;
+	ParallelExecutor(idealNumThreads, makeClassFunctor(&grid, &MCGrid::MarchParallel), first, dseeds);
+
+	int last = std::min(first+idealNumThreads, (int)grid.slabs.size());
+	for (int i=first; i<last; i++) {
+	    MCSlab &s = grid.slabs[i];
+
+	    for (unsigned t=0; t<s.tris.size(); t+=3) {
+		mc_union(component, s.tris[t+0], s.tris[t+1]);
+		mc_union(component, s.tris[t+1], s.tris[t+2]);
+
+		if (partition_cells>0) {
+		    for (int k=0; k<3; k++) {
+			int a = s.tris[t+k], b = s.tris[t+(k+1)%3];
+			if (piece[a] < 0) piece[a] = a;
+			if (piece[b] < 0) piece[b] = b;
+			if (s.tri_same_cell[t/3] & (1<<k))
+			    mc_union(piece, a, b);
+		    }
+		}
+	    }
+
+	    for (unsigned e=0; e<s.boundary_edges.size(); e++) {
+		const MCBoundaryEdge &be = s.boundary_edges[e];
+		std::pair<int,int> key(std::min(be.v[0], be.v[1]), std::max(be.v[0], be.v[1]));
+		std::map< std::pair<int,int>, std::pair<MCBoundaryEdge,int> >::iterator bi = block_edges.find(key);
+		if (bi == block_edges.end())
+		    block_edges.insert(std::make_pair(key, std::make_pair(be, 1)));
+		else
+		    bi->second.second++;
+	    }
+
+	    vector<int>().swap(s.tris);
+	    vector<unsigned char>().swap(s.tri_same_cell);
+	    vector<MCBoundaryEdge>().swap(s.boundary_edges);
+	}
+    }
+
+
+    // the block edges only used once are the surface boundary - chain them up into loops,
+    // following the triangle orientation like TriangleMesh::GetBoundaries
+    std::multimap<int, const MCBoundaryEdge*> next;
+    for (std::map< std::pair<int,int>, std::pair<MCBoundaryEdge,int> >::iterator bi=block_edges.begin(); bi!=block_edges.end(); ++bi) {
+	if (bi->second.second == 1)
+	    next.insert(std::make_pair(bi->second.first.v[0], &bi->second.first));
+    }
+
+    std::set<int> boundary_roots;
+    seeds.boundaries.clear();
+    while (!next.empty()) {
+	std::multimap<int, const MCBoundaryEdge*>::iterator ni = next.begin();
+	int start = ni->first;
+	vector<Point3> loop;
+	bool closed = false;
+	while (ni != next.end()) {
+	    const MCBoundaryEdge *be = ni->second;
+	    next.erase(ni);
+	    loop.push_back(be->p[0]);
+	    boundary_roots.insert(mc_find(component, be->v[0]));
+	    if (be->v[1] == start) {
+		closed = true;
+		break;
+	    }
+	    ni = next.find(be->v[1]);
+	}
+	if (closed)
+	    seeds.boundaries.push_back(loop);
+    }
+
+
+    // the components, numbered in vertex order
+    std::map<int,MCSeedSet> components;
+    for (int i=0; i<nv; i++) {
+	if (component[i] < 0) continue;
+	MCSeedSet &ss = components[mc_find(component, i)];
+	if (ss.index < 0) ss.index = (int)components.size()-1;
+	ss.size++;
+    }
+    for (std::set<int>::iterator bi=boundary_roots.begin(); bi!=boundary_roots.end(); ++bi) {
+	components[*bi].boundary = true;
+    }
+
+    // only seed the closed ones, the rest get started from their boundary loops
+    std::map<int,MCSeedSet> closed;
+    for (std::map<int,MCSeedSet>::iterator ci=components.begin(); ci!=components.end(); ++ci) {
+	if (ci->second.boundary)
+	    cerr<<"skipped connected component with boundary"<<endl;
+	else
+	    closed.insert(*ci);
+    }
+    mc_pick_seeds(component, closed);
+
+    std::map<int,MCSeedSet> pieces;
+    if (partition_cells > 0) {
+	for (int i=0; i<nv; i++) {
+	    if (piece[i] < 0) continue;
+	    pieces[mc_find(piece, i)].size++;
+	}
+
+	// slivers along the cell walls get picked up by the stitch pass
+	std::map<int,MCSeedSet>::iterator pi = pieces.begin();
+	while (pi != pieces.end()) {
+	    if (pi->second.size < 10)
+		pieces.erase(pi++);
+	    else
+		++pi;
+	}
+	mc_pick_seeds(piece, pieces);
+    }
+
+
+    // march just the layers the picked vertices are on to find where they are
+    std::map<int,Point3> positions;
+    for (std::map<int,MCSeedSet>::iterator ci=closed.begin(); ci!=closed.end(); ++ci) {
+	for (unsigned j=0; j<ci->second.picks.size(); j++)
+	    positions[ci->second.picks[j]] = Point3(0,0,0);
+    }
+    for (std::map<int,MCSeedSet>::iterator pi=pieces.begin(); pi!=pieces.end(); ++pi) {
+	for (unsigned j=0; j<pi->second.picks.size(); j++)
+	    positions[pi->second.picks[j]] = Point3(0,0,0);
+    }
+
+    {
+	int n = grid.dim[0]*grid.dim[1];
+	vector<real_type> v0(n), v1(n);
+	vector<int> xy(2*n), ze(n);
+	vector<Point3> verts;
+
+	std::map<int,Point3>::iterator pi = positions.begin();
+	while (pi != positions.end()) {
+	    int z = (int)(std::upper_bound(grid.layer_base.begin(), grid.layer_base.end(), pi->first) - grid.layer_base.begin()) - 1;
+	    bool top = (z+1 >= grid.dim[2]);
+	    grid.FillValues(z, &v0[0]);
+	    if (!top) grid.FillValues(z+1, &v1[0]);
+	    verts.clear();
+	    grid.IndexLayer(&v0[0], (top) ? NULL : &v1[0], z, &xy[0], &ze[0], &verts);
+
+	    for ( ; pi!=positions.end() && pi->first < grid.layer_base[z+1]; ++pi)
+		pi->second = verts[pi->first - grid.layer_base[z]];
+	}
+    }
+
+
+    seeds.component_seeds.clear();
+    seeds.component_ids.clear();
+    for (std::map<int,MCSeedSet>::iterator ci=closed.begin(); ci!=closed.end(); ++ci) {
+	seeds.component_seeds.push_back(vector<Point3>());
+	for (unsigned j=0; j<ci->second.picks.size(); j++)
+	    seeds.component_seeds.back().push_back(positions[ci->second.picks[j]]);
+	seeds.component_ids.push_back(ci->second.index);
+    }
+
+    seeds.piece_seeds.clear();
+    seeds.piece_cell.clear();
+    seeds.piece_component.clear();
+    for (std::map<int,MCSeedSet>::iterator pi=pieces.begin(); pi!=pieces.end(); ++pi) {
+	seeds.piece_seeds.push_back(vector<Point3>());
+	for (unsigned j=0; j<pi->second.picks.size(); j++)
+	    seeds.piece_seeds.back().push_back(positions[pi->second.picks[j]]);
+	seeds.piece_cell.push_back(grid.PartitionCell(seeds.piece_seeds.back()[0]));
+	seeds.piece_component.push_back(components[mc_find(component, pi->first)].index);
+    }
+
+    double seed_elapsed = Profile::Now() - seed_start;
+    cerr << "[TIMING] Marching cubes seeds found in " << seed_elapsed << " seconds using " << idealNumThreads << " threads" << endl;
+
+    cerr<<nv<<" marching cubes vertices, "<<components.size()<<" components, "
+	<<seeds.boundaries.size()<<" boundary loops";
+    if (partition_cells > 0)
+	cerr<<", "<<pieces.size()<<" partition cell pieces";
+    cerr<<endl;
+}
@@ -66,26 +66,18 @@ void OutputControllerEdgeFlipper::AddTriangle(int index, int v1, int v2, int v3)
 
     // figure out which verts are ready to remove
     // this stuff could probably be fancier
-    std::set<int> prv;
+    vector<int> &remove_verts = scratch_verts;
+    remove_verts.clear();
     for (int i=0; i<3; i++) {
-	
-	for (std::set<int>::iterator vi=verts[t.vi[i]].incidentVerticesLocal.begin();
-	     vi!=verts[t.vi[i]].incidentVerticesLocal.end();
-	     ++vi) {
-	    
+	const EdgeFlipperSet &nbrs = verts[t.vi[i]].incidentVerticesLocal;
+	for (const int *vi=nbrs.begin(); vi!=nbrs.end(); ++vi) {
 	    if (VertexRemovable(*vi)) {
-		prv.insert(*vi);
+		remove_verts.push_back(*vi);
 	    }
 	}
     }
-    
-    
-    vector<int> remove_verts;
-    for (std::set<int>::iterator i=prv.begin(); i!=prv.end(); ++i) {
-	if (VertexRemovable(*i)) {
-	    remove_verts.push_back(*i);
-	}
-    }
+    std::sort(remove_verts.begin(), remove_verts.end());
+    remove_verts.erase(std::unique(remove_verts.begin(), remove_verts.end()), remove_verts.end());
     
     
     DoEdgeFlips(remove_verts);
@@ -106,15 +98,7 @@ void OutputControllerEdgeFlipper::Finish() {
     }
 
     for (unsigned t=0; t<tris.size(); t++) {
-	bool used=true;
-	for (unsigned i=0; i<available_tris.size(); i++) {
-	    if (available_tris[i] == t) {
-		used = false;
-		break;
-	    }
-	}
-
-	if (used) {
+	if (!tri_free[t]) {
 
 	    if (verts[tris[t].vi[0]].index != verts[tris[t].vi[1]].index &&
 		verts[tris[t].vi[1]].index != verts[tris[t].vi[2]].index &&
@@ -132,6 +116,8 @@ void OutputControllerEdgeFlipper::Finish() {
     verts.clear();
     available_tris.clear();
     available_verts.clear();
+    tri_free.clear();
+    global_to_local_vi.clear();
 
 
     child->Finish();
@@ -212,9 +198,8 @@ bool OutputControllerEdgeFlipper::TryFlip(int v1, int v2) {
     }
 
 
-    for (std::set<int>::iterator ti=verts[v1].incidentTriangles.begin();
-	 ti!=verts[v1].incidentTriangles.end();
-	 ++ti) {
+    const EdgeFlipperSet &v1tris = verts[v1].incidentTriangles;
+    for (const int *ti=v1tris.begin(); ti!=v1tris.end(); ++ti) {
 
 	if (*ti < 0)
 	    continue;
@@ -255,38 +240,21 @@ bool OutputControllerEdgeFlipper::TryFlip(int v1, int v2) {
 
 
     // remove the old stuff
-    std::set<int>::iterator i;
     int vs[2] = { v1, v2 };
     for (int v=0; v<2; v++) {
 
-	i = verts[vs[v]].incidentVerticesLocal.find(vs[1-v]);
-	if (i == verts[vs[v]].incidentVerticesLocal.end()) {
+	if (!verts[vs[v]].incidentVerticesLocal.erase(vs[1-v]))
 	    cerr<<"flip: local vert not found!"<<endl;
-	} else {
-	    verts[vs[v]].incidentVerticesLocal.erase(i);
-	}
 
-	i = verts[vs[v]].incidentVerticesGlobal.find(verts[vs[1-v]].index);
-	if (i == verts[vs[v]].incidentVerticesGlobal.end()) {
+	if (!verts[vs[v]].incidentVerticesGlobal.erase(verts[vs[1-v]].index))
 	    cerr<<"flip: global vert not found!"<<endl;
-	} else {
-	    verts[vs[v]].incidentVerticesGlobal.erase(i);
-	}
     }
 
-    i = verts[v1].incidentTriangles.find(t2);
-    if (i == verts[v1].incidentTriangles.end()) {
+    if (!verts[v1].incidentTriangles.erase(t2))
 	cerr<<"flip: v1 tri not found!"<<endl;
-    } else {
-	verts[v1].incidentTriangles.erase(i);
-    }
 
-    i = verts[v2].incidentTriangles.find(t1);
-    if (i == verts[v2].incidentTriangles.end()) {
+    if (!verts[v2].incidentTriangles.erase(t1))
 	cerr<<"flip: v2 tri not found!"<<endl;
-    } else {
-	verts[v2].incidentTriangles.erase(i);
-    }
 
 
     // change where things are pointing
@@ -330,35 +298,35 @@ bool OutputControllerEdgeFlipper::TryFlip(int v1, int v2) {
 
 void OutputControllerEdgeFlipper::DoEdgeFlips(const vector<int> &rv) {
 
-    std::set< std::pair<int,int> > toflip;
+    // sorted and unique, so the edges get tried in the same order as always
+    vector< std::pair<int,int> > &toflip = scratch_edges;
 
     while (1) {
 
+	toflip.clear();
 	for (unsigned v=0; v<rv.size(); v++) {
 
-	    for (std::set<int>::iterator ti=verts[rv[v]].incidentTriangles.begin();
-		 ti!=verts[rv[v]].incidentTriangles.end();
-		 ++ti) {
+	    const EdgeFlipperSet &vtris = verts[rv[v]].incidentTriangles;
+	    for (const int *ti=vtris.begin(); ti!=vtris.end(); ++ti) {
 
 		if (*ti > 0) {
 		    for (int i=0; i<3; i++) {
 			std::pair<int,int> edge(tris[*ti].vi[(i+0)%3], tris[*ti].vi[(i+1)%3]);
 			if (edge.second < edge.first)
 			    std::swap(edge.first, edge.second);
-			toflip.insert(edge);
+			toflip.push_back(edge);
 		    }
 		}
 
 	    }
 	}
+	std::sort(toflip.begin(), toflip.end());
+	toflip.erase(std::unique(toflip.begin(), toflip.end()), toflip.end());
 
 
 	bool didflip = false;
-	while (!toflip.empty()) {
-	    std::pair<int,int> edge = *toflip.begin();
-	    toflip.erase(toflip.begin());
-	    
-	    didflip |= TryFlip(edge.first, edge.second);
+	for (unsigned e=0; e<toflip.size(); e++) {
+	    didflip |= TryFlip(toflip[e].first, toflip[e].second);
 	}
 
 	if (!didflip) break;
@@ -374,15 +342,7 @@ void OutputControllerEdgeFlipper::Draw() {
     dbgClear();
 
     for (unsigned t=0; t<tris.size(); t++) {
-	bool inuse=true;
-
-	for (unsigned i=0; i<available_tris.size(); i++) {
-	    if (t == available_tris[i]) {
-		inuse = false;
-		break;
-	    }
-	}
-	if (!inuse) continue;
+	if (tri_free[t]) continue;
 
 	int vof = 0;
 	for (int i=0; i<3; i++) {
@@ -457,7 +417,7 @@ bool OutputControllerEdgeFlipper::VertexRemovable(int vi) const {
     if (v.OnFront())
 	return false;
 
-    for (std::set<int>::iterator iv=v.incidentVerticesLocal.begin();
+    for (const int *iv=v.incidentVerticesLocal.begin();
 	 iv != v.incidentVerticesLocal.end();
 	 ++iv) {
 	if (verts[*iv].OnFront())
@@ -485,7 +445,7 @@ void OutputControllerEdgeFlipper::FinishVertex(int v) {
 
     // free each triangle that is still here
     vector<int> ft;
-    for (std::set<int>::iterator ti=verts[v].incidentTriangles.begin();
+    for (const int *ti=verts[v].incidentTriangles.begin();
 	 ti!=verts[v].incidentTriangles.end();
 	 ++ti) {
 
@@ -500,18 +460,15 @@ void OutputControllerEdgeFlipper::FinishVertex(int v) {
 
 
     // remove v from it's neighbors as incident
-    for (std::set<int>::iterator vi=verts[v].incidentVerticesLocal.begin();
+    for (const int *vi=verts[v].incidentVerticesLocal.begin();
 	 vi!=verts[v].incidentVerticesLocal.end();
 	 ++vi) {
-
-	std::set<int>::iterator vi2 = verts[*vi].incidentVerticesLocal.find(v);
-	if (vi2 != verts[*vi].incidentVerticesLocal.end())
-	    verts[*vi].incidentVerticesLocal.erase(vi2);
+	verts[*vi].incidentVerticesLocal.erase(v);
     }
 
 
 
-    for (std::set<int>::iterator ti=verts[v].incidentTriangles.begin();
+    for (const int *ti=verts[v].incidentTriangles.begin();
 	 ti!=verts[v].incidentTriangles.end();
 	 ++ti) {
 
@@ -521,7 +478,7 @@ void OutputControllerEdgeFlipper::FinishVertex(int v) {
     }
 
 
-    global_to_local_vi.erase(global_to_local_vi.find(verts[v].index));
+    global_to_local_vi.erase(verts[v].index);
     FreeVert(v);
 
 }
@@ -535,11 +492,9 @@ void OutputControllerEdgeFlipper::FinishTriangle(int t) {
     // "remove" the triangle from its 3 vertices
     for (int i=0; i<3; i++) {
 	EdgeFlipperVertex &v = verts[tri.vi[i]];
-	std::set<int>::iterator ti = v.incidentTriangles.find(t);
-	if (ti == v.incidentTriangles.end()) {
+	if (!v.incidentTriangles.erase(t)) {
 	    cerr<<"triangle not found in it's vertex!"<<endl;
 	} else {
-	    v.incidentTriangles.erase(ti);
 	    v.incidentTriangles.insert(-t-1);
 	}
     }
@@ -577,10 +532,12 @@ int OutputControllerEdgeFlipper::AllocTri() {
     if (!available_tris.size()) {
 	available_tris.push_back(tris.size());
 	tris.resize(tris.size()+1);
+	tri_free.push_back(1);
     }
 
     int ret = available_tris.back();
     available_tris.resize(available_tris.size()-1);
+    tri_free[ret] = 0;
     return ret;
 }
 
@@ -591,4 +548,74 @@ void OutputControllerEdgeFlipper::FreeVert(int v) {
 
 void OutputControllerEdgeFlipper::FreeTri(int t) {
     available_tris.push_back(t);
+    tri_free[t] = 1;
+}
+
+
+
+int& EdgeFlipperIndexMap::operator[](int key) {
+    if (2*(count+1) > (int)keys.size())
+	Grow();
+
+    unsigned mask = keys.size()-1;
+    unsigned i = Slot(key);
+    while (keys[i] != -1) {
+	if (keys[i] == key)
+	    return values[i];
+	i = (i+1) & mask;
+    }
+    keys[i] = key;
+    values[i] = 0;
+    count++;
+    return values[i];
+}
+
+
+// shift the rest of the probe run back over the hole, so lookups never need tombstones
+void EdgeFlipperIndexMap::erase(int key) {
+    unsigned mask = keys.size()-1;
+    unsigned i = Slot(key);
+    while (keys[i] != key) {
+	if (keys[i] == -1)
+	    return;
+	i = (i+1) & mask;
+    }
+
+    unsigned j = i;
+    while (1) {
+	j = (j+1) & mask;
+	if (keys[j] == -1)
+	    break;
+	unsigned k = Slot(keys[j]);
+	// leave it if its home slot is cyclically in (i,j]
+	if ((i<=j) ? (i<k && k<=j) : (i<k || k<=j))
+	    continue;
+	keys[i] = keys[j];
+	values[i] = values[j];
+	i = j;
+    }
+    keys[i] = -1;
+    count--;
+}
+
+
+void EdgeFlipperIndexMap::clear() {
+    keys.assign(64, -1);
+    values.assign(64, 0);
+    count = 0;
+}
+
+
+void EdgeFlipperIndexMap::Grow() {
+    vector<int> okeys, ovalues;
+    okeys.swap(keys);
+    ovalues.swap(values);
+
+    keys.assign(okeys.size()*2, -1);
+    values.assign(okeys.size()*2, 0);
+    count = 0;
+    for (unsigned i=0; i<okeys.size(); i++) {
+	if (okeys[i] != -1)
+	    (*this)[okeys[i]] = ovalues[i];
+    }
 }
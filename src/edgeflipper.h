@@ -3,16 +3,105 @@
 #define __OUTPUT_CONTROLLER_EDGEFLIPPER_H
 
 #include "triangulator.h"
+#include <algorithm>
 
 
 
+// a sorted set of ints, stored inline while it's small - which for a vertex's neighbors and
+// triangles it nearly always is.  iterates in the same order a std::set would
+class EdgeFlipperSet {
+    public:
+    EdgeFlipperSet() : n(0), cap(INLINE), data(inline_data) { }
+    EdgeFlipperSet(const EdgeFlipperSet &s) : n(0), cap(INLINE), data(inline_data) { *this = s; }
+    ~EdgeFlipperSet() { if (data != inline_data) delete [] data; }
+
+    EdgeFlipperSet& operator=(const EdgeFlipperSet &s) {
+	if (this == &s) return *this;
+	n = 0;
+	Reserve(s.n);
+	for (int i=0; i<s.n; i++) data[i] = s.data[i];
+	n = s.n;
+	return *this;
+    }
+
+    int size() const { return n; }
+    bool empty() const { return n==0; }
+    const int* begin() const { return data; }
+    const int* end() const { return data+n; }
+    void clear() { n = 0; }
+
+    bool contains(int v) const {
+	const int *i = std::lower_bound(begin(), end(), v);
+	return (i != end() && *i == v);
+    }
+
+    bool insert(int v) {
+	int *i = std::lower_bound(data, data+n, v);
+	if (i != data+n && *i == v) return false;
+	int at = i - data;
+	Reserve(n+1);
+	for (int j=n; j>at; j--) data[j] = data[j-1];
+	data[at] = v;
+	n++;
+	return true;
+    }
+
+    bool erase(int v) {
+	int *i = std::lower_bound(data, data+n, v);
+	if (i == data+n || *i != v) return false;
+	for (int j=i-data; j<n-1; j++) data[j] = data[j+1];
+	n--;
+	return true;
+    }
+
+    private:
+    enum { INLINE = 8 };
+
+    void Reserve(int s) {
+	if (s <= cap) return;
+	int ncap = std::max(s, 2*cap);
+	int *nd = new int[ncap];
+	for (int i=0; i<n; i++) nd[i] = data[i];
+	if (data != inline_data) delete [] data;
+	data = nd;
+	cap = ncap;
+    }
+
+    int n;
+    int cap;
+    int *data;
+    int inline_data[INLINE];
+};
+
+
+// global to local vertex index, open addressing with linear probing.  only the verts in the
+// band are ever in it, so it stays small however big the output gets
+class EdgeFlipperIndexMap {
+    public:
+    EdgeFlipperIndexMap() { clear(); }
+
+    // inserts 0 if it's not there, like std::map
+    int& operator[](int key);
+    void erase(int key);
+    void clear();
+
+    private:
+    unsigned Slot(int key) const { return ((unsigned)key * 2654435761u) & (keys.size()-1); }
+    void Grow();
+
+    vector<int> keys;		// -1 for empty
+    vector<int> values;
+    int count;
+};
+
+
 class EdgeFlipperVertex {
     public:
     
     bool boundary;
-    std::set<int> incidentTriangles;
-    std::set<int> incidentVerticesLocal;
-    std::set<int> incidentVerticesGlobal;
+    EdgeFlipperSet incidentTriangles;	// finished ones are kept as -t-1
+    EdgeFlipperSet incidentVerticesLocal;
+    EdgeFlipperSet incidentVerticesGlobal;
     int index;  // global index
 
     Point3 position;
@@ -56,10 +145,15 @@ protected:
     vector<EdgeFlipperVertex> verts;
     vector<EdgeFlipperTriangle> tris;
 
-    std::map<int,int> global_to_local_vi;
+    EdgeFlipperIndexMap global_to_local_vi;
 
     vector<int> available_verts;
     vector<int> available_tris;
+    vector<unsigned char> tri_free;	// so Finish doesn't have to search available_tris
+
+    // reused between triangles
+    vector<int> scratch_verts;
+    vector< std::pair<int,int> > scratch_edges;
     int AllocVert();
     int AllocTri();
     void FreeVert(int v);
@@ -1,76 +1,112 @@
 
 #include "common.h"
 #include "front.h"
+#include <new>
 
 
-Front::Front() {
+FrontElementPool::~FrontElementPool() {
+    for (unsigned i=0; i<slabs.size(); i++) {
+	::operator delete(slabs[i]);
+    }
 }
 
-Front::feli Front::AddElement(FrontElement &e) {
-    e.front = this;
-    elements.push_back(e);
-    return (--elements.end());
+FrontElement* FrontElementPool::Allocate(const FrontElement &e) {
+
+    if (!free_list) {
+	// grab a new slab and chain it onto the free list
+	FrontElement *slab = (FrontElement*)::operator new(slab_size * sizeof(FrontElement));
+	slabs.push_back(slab);
+	for (int i=slab_size-1; i>=0; i--) {
+	    slab[i].next = free_list;
+	    free_list = &slab[i];
+	}
+    }
+
+    FrontElement *ret = free_list;
+    free_list = free_list->next;
+    return new (ret) FrontElement(e);
 }
 
+void FrontElementPool::Free(FrontElement *e) {
+    e->~FrontElement();
+    e->next = free_list;
+    free_list = e;
+}
 
 
-// split the front at verts i1 and i2, return a pointer to the new front created
-Front* Front::Split(feli i1, feli i2, feli &n1, feli &n2) 
-{
-    if (i1->front != i2->front) BREAK;
 
-    Front *f1 = i1->front;
-    Front *f2 = new Front();
+Front::Front(FrontElementPool *_pool) : head(NULL), pool(_pool) {
+}
 
-    feli cutstart, cutend;
 
-    cutstart = cutend = i2;
+FrontElement* Front::Link(FrontElement *next, const FrontElement &e, Front *f) {
+    FrontElement *n = f->pool->Allocate(e);
+    n->front = f;
 
-    while (cutend != f1->elements.end() && cutend !=i1) {
-	cutend->front = f2;
-	++cutend; 
+    if (!next) {
+	n->next = n->prev = n;
+    } else {
+	n->next = next;
+	n->prev = next->prev;
+	next->prev->next = n;
+	next->prev = n;
     }
+    return n;
+}
 
 
-    if (cutend == f1->elements.end()) {
-	f2->elements.splice(f2->elements.end(), f1->elements, cutstart, cutend);
+Front::feli Front::AddElement(FrontElement &e) {
+    e.front = this;
 
-	// got to the end before finding i1, have to start again at the beginning
-	cutstart = cutend = f1->elements.begin();
+    // the end of the circular list is just before the head
+    FrontElement *n = Link(head, e, this);
+    if (!head)
+	head = n;
+    return n;
+}
 
-	while (cutend != f1->elements.end() && cutend !=i1) {
-	    cutend->front = f2;
-	    ++cutend;
-	}
 
-	if (cutend == f1->elements.end()) BREAK;
 
-	f2->elements.splice(f2->elements.end(), f1->elements, cutstart, cutend);
-    } else {
-	f2->elements.splice(f2->elements.end(), f1->elements, cutstart, cutend);
-    }
+// split the front at verts i1 and i2, return a pointer to the new front created
+Front* Front::Split(feli i1, feli i2, feli &n1, feli &n2) 
+{
+    if (i1->front != i2->front) BREAK;
+
+    Front *f1 = i1->front;
+    Front *f2 = new Front(f1->pool);
 
+    FrontElement *a = &*i1->prev;
+    FrontElement *b = &*i2->prev;
 
-    // i1 is still in f1, i2 is now in f2
+    // everything from i2 up to i1 goes to the new front
+    for (FrontElement *i = &*i2; i != &*i1; i = i->next) {
+	i->front = f2;
+    }
+
+    // close each loop with a copy of the vert the other one got:
+    // f2 is n1 -> i2 ... a -> n1, f1 is n2 -> i1 ... b -> n2
+    FrontElement *c1 = f1->pool->Allocate(*i1);
+    c1->front = f2;
+    c1->prev = a;	a->next = c1;
+    c1->next = &*i2;	i2->prev = c1;
 
-    // add a copy of i1 to f2 just before i2
-    n1 = i2;
-    f2->elements.insert(n1, *i1);
-    --n1;
-    n1->front = f2;
+    FrontElement *c2 = f1->pool->Allocate(*i2);
+    c2->front = f1;
+    c2->prev = b;	b->next = c2;
+    c2->next = &*i1;	i1->prev = c2;
 
-    // add a copy of i2 to f1 just before i1
-    n2 = i1;
-    f1->elements.insert(n2, *i2);
-    --n2;
-    n2->front = f1;
+    n1 = c1;
+    n2 = c2;
 
+    f1->head = &*i1;
+    f2->head = c1;
 
     return f2;
 }
 
 
 
+
 // merge two fronts, i1's front grows, i2's front will need to be deleted
 void Front::Merge(feli i1, feli i2, feli &n1, feli &n2) {
 
@@ -80,73 +116,54 @@ void Front::Merge(feli i1, feli i2, feli &n1, feli &n2) {
     Front *f2 = i2->front;
 
     // reset the fronts that f2 is pointing to
-    for (feli i=f2->elements.begin(); i!=f2->elements.end(); ++i) {
+    FrontElement *i = &*i2;
+    do {
 	i->front = f1;
-    }
-
-    // copy from i2 to the end of f2 to just before i1
-    f1->elements.splice(i1, f2->elements, i2, f2->elements.end());
-
-    // copy the rest of the list
-    f1->elements.splice(i1, f2->elements, f2->elements.begin(), f2->elements.end());
-
-
-    // add a copy of i1 to f2 just before i2
-    n1 = i2;
-    f2->elements.insert(n1, *i1);
-    --n1;
-
-    // add a copy of i2 to f1 just before i1
-    n2 = i1;
-    f1->elements.insert(n2, *i2);
-    --n2;
-}
-
-
-
+	i = i->next;
+    } while (i != &*i2);
 
+    FrontElement *a = &*i1->prev;
+    FrontElement *b = &*i2->prev;
 
+    // splice all of f2 in just before i1, with copies of i1 and i2 on either side:
+    // a -> n1 -> i2 ... b -> n2 -> i1
+    FrontElement *c1 = f1->pool->Allocate(*i1);
+    c1->prev = a;	a->next = c1;
+    c1->next = &*i2;	i2->prev = c1;
 
-// get the next/prev element on the front
-Front::feli Front::NextElement(feli i) {
+    FrontElement *c2 = f1->pool->Allocate(*i2);
+    c2->front = f1;
+    c2->prev = b;	b->next = c2;
+    c2->next = &*i1;	i1->prev = c2;
 
-    Front *f = i->front;
-
-    ++i;
-
-    // if we went off the end, go back to the beginning
-    if (i == f->elements.end())
-	return f->elements.begin();
-
-    return i;
-}
-
-Front::feli Front::PrevElement(feli i) {
-
-    Front *f = i->front;
-
-    // if we're at the beginning, go back to the end
-    if (i == f->elements.begin())
-	return (--f->elements.end());
+    n1 = c1;
+    n2 = c2;
 
-    return --i;
+    f2->head = NULL;
 }
 
-Front::feli Front::FirstElement() {
-    return elements.begin();
-}
 
 
 Front::feli Front::InsertElement(feli next, FrontElement &e) {
     Front *f = next->front;
     e.front = f;
-    f->elements.insert(next, e);
-    return --next;
+    return Link(&*next, e, f);
 }
 
 void Front::RemoveElement(feli i) {
     Front *f = i->front;
-    f->elements.erase(i);
+    FrontElement *e = &*i;
+
+    if (e->next == e) {
+	f->head = NULL;
+    } else {
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	if (f->head == e)
+	    f->head = e->next;
+    }
+
+    f->pool->Free(e);
 }
 
 
@@ -8,7 +8,7 @@
 #ifndef _FRONT_H
 #define _FRONT_H
 
-#include <list>
+#include <vector>
 #include "common.h"
 
 class Front;
@@ -21,6 +21,8 @@ class Front;
 
 #define PRIORITY_OWA			100		// outside working area
 
+#define PRIORITY_DEFERRED		0x7fffffe0	// would grow out of a partitioned region, left for the stitch pass
+
 #define PRIORITY_FAILSAFE_ANY		0x7ffffff0
 #define PRIORITY_FAILSAFE		0x7ffffffe
 #define PRIORITY_FAILSAFE_WILLFAIL	0x7fffffff
@@ -32,11 +34,18 @@ class Front;
 
 class ProjectionResult {
     public:
+    ProjectionResult() : max_step(-1), ticket(0), speculated(false) { }
     Point3 position;
     Vector3 normal;
+    real_type max_step;    // the guidance at position if a projector thread already worked it out, otherwise -1
     volatile int result;   // success/boundary/fail/notfinished...
+
+    int ticket;            // identifies the outstanding request, so cancelled/stale work can be dropped
+    bool speculated;       // already pushed to the front of the work queue by the look-ahead
 };
 
+class FrontElementPool;
+
 class FrontElement {
     public:
 
@@ -45,33 +54,81 @@ class FrontElement {
 
     FrontElement() { }
     FrontElement(const Point3 &p, const Vector3 &n, int vi, real_type step)
-	: position(p), normal(n), vertindex(vi), priority(0x7fffffff,1e34), max_step(step), flags(0) { }
+	: position(p), normal(n), max_step(step), vertindex(vi), priority(0x7fffffff,1e34), flags(0) { }
 
 
+    // the fields that get hit on every front walk / kd tree query are kept together at the front
+
     // info about the vertex
     Point3 position;
     Vector3 normal;
 
+    // how far we can step from this spot
+    real_type max_step;
+
+    // neighbors on the front - the front is a circular list
+    FrontElement *next;
+    FrontElement *prev;
+
+    // we need to know which front we're actually a part of
+    Front *front;
+
     // the index for the output file (triangles share vertices)
     int vertindex;
 
     // the priority of the edge starting at this vertex
     priority_type priority;
 	
-    // how far we can step from this spot
-    real_type max_step;
-
     int flags;
 
+    // keep track of the position in the heap so we can update it's priority
+    int heap_position;
 	
     ProjectionResult proj_res;
+};
 
 
-    // keep track of the position in the heap so we can update it's priority
-    int heap_position;
 
-    // we need to know which front we're actually a part of
-    Front *front;
+// handle to an element on a front, stays valid until the element is removed from its front
+class FrontElementHandle {
+    public:
+    FrontElementHandle() : e(NULL) { }
+    FrontElementHandle(FrontElement *_e) : e(_e) { }
+
+    FrontElement* operator->() const { return e; }
+    FrontElement& operator*() const { return *e; }
+    bool operator==(const FrontElementHandle &rhs) const { return e == rhs.e; }
+    bool operator!=(const FrontElementHandle &rhs) const { return e != rhs.e; }
+
+    private:
+    FrontElement *e;
+};
+
+
+
+// slab allocator for front elements - keeps elements packed together in memory and
+// avoids going through the general allocator for every vertex added to a front
+class FrontElementPool {
+    public:
+    FrontElementPool() : free_list(NULL) { }
+    ~FrontElementPool();
+
+    FrontElement* Allocate(const FrontElement &e);
+    void Free(FrontElement *e);
+
+    private:
+    // don't allow copies
+    FrontElementPool(const FrontElementPool &rhs) {
+	BREAK;
+    }
+    FrontElementPool& operator=(const FrontElementPool &rhs) {
+	BREAK;
+	return *this;
+    }
+
+    static const int slab_size = 4096;
+    std::vector<FrontElement*> slabs;
+    FrontElement *free_list;	// chained through next
 };
 
 
@@ -80,12 +137,11 @@ class Front {
 
     public:
 
-    typedef std::list<FrontElement> fel;	// front element list
-    typedef fel::iterator feli;		// front element list iterator, basically just pointers to FrontElement's,
-                                        // nice because they don't get invalidated when shuffeling them around in the lists
+    typedef FrontElementHandle feli;	// front element handle, basically just pointers to FrontElement's,
+                                        // nice because they don't get invalidated when shuffeling them around in the fronts
 
 
-    Front();
+    Front(FrontElementPool *_pool);
 
     // add an element to the end of the list - useful for creating the inital fronts
     feli AddElement(FrontElement &e);
@@ -100,13 +156,13 @@ class Front {
 
 
     // get the next/prev element on the front
-    feli FirstElement();
-    static feli NextElement(feli i);
-    static feli PrevElement(feli i);
+    feli FirstElement() { return head; }
+    static feli NextElement(feli i) { return i->next; }
+    static feli PrevElement(feli i) { return i->prev; }
     static void RemoveElement(feli i);
     static feli InsertElement(feli next, FrontElement &e);
 
-    bool empty() { return elements.empty(); }
+    bool empty() { return head == NULL; }
     void verify();
 
     private:
@@ -119,8 +175,12 @@ class Front {
 	return *this;
     }
 
+    // link a copy of e into the list just before next
+    static FrontElement* Link(FrontElement *next, const FrontElement &e, Front *f);
+
 
-    fel elements;
+    FrontElement *head;
+    FrontElementPool *pool;
 
 };
 
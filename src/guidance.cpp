@@ -3,6 +3,8 @@
 #include "common.h"
 #include "guidance.h"
 #include "parallel.h"
+#include "profile.h"
+#include "task_pool.h"
 
 #include <iostream>
 #include <iterator>
@@ -40,16 +42,24 @@ real_type GuidanceField::MaxCurvatureToIdeal(real_type curvature) const {
 }
 
 
-real_type GuidanceField::MaxStepLength(const Point3 &p, int ignore) 
+real_type GuidanceField::MaxStepLength(const Point3 &p, int ignore) const
 {
+    ProfileTimer pt(PROF_TIME_MAXSTEP);
+    Profile::Count(PROF_MAXSTEP_CALLS);
+    int visited=0;
+
     real_type len = max_step;
+    if (ignore<0 && SizingGridLookup(p, len))
+	return len;
+    len = max_step;
     real_type checked_rad=0;
 
-    OrderedPointTraverseStart(p);
+    void *traverse = OrderedPointTraverseStart(p);
     do {
 
-	int checkp = OrderedPointTraverseNext(checked_rad);
+	int checkp = OrderedPointTraverseNext(traverse, checked_rad);
 	if (checkp < 0) break;
+	visited++;
 
 	if (checkp == ignore) continue;
 
@@ -64,23 +74,265 @@ real_type GuidanceField::MaxStepLength(const Point3 &p, int ignore)
     } while (checked_rad < (len/(1-reduction)));
 
 
-    OrderedPointTraverseEnd();
+    OrderedPointTraverseEnd(traverse);
+    Profile::Count(PROF_MAXSTEP_VISITED, visited);
+    Profile::Maximum(PROF_MAX_MAXSTEP_VISITED, visited);
     return len;
 }
 
 
 
-real_type GuidanceField::MaxStepLengthD(const Point3 &p, int &stepto) 
+///////////////////////////////////////////////////////////////////////////////
+// sizing grid
+//
+// the field is f(p) = clamp(min_i StepRequired(|p-x_i|, i), min_step, max_step).  over a cell,
+// StepRequired for a point is at least its value at the nearest spot in the cell, and the
+// minimum is at most the smallest value any point takes at its farthest corner.  points whose
+// lower bound is above that can't be the minimum anywhere in the cell, and the leaves keep
+// just the rest, which makes a query exact everywhere in the cell, not only away from its edges.
+
+static const int sizing_max_depth = 14;
+static const int sizing_split_depth = 2;	// subtrees below this are built in parallel
+
+class SizingGridTask {
+    public:
+    int node;
+    Point3 center;
+    real_type half;
+    int depth;
+    vector<int> cands;
+    vector<SizingGridNode> nodes;
+    vector<int> points;
+};
+
+
+bool GuidanceField::SizingGridLookup(const Point3 &p, real_type &len) const {
+
+    if (sizing_nodes.empty())
+	return false;
+
+    Point3 c = sizing_center;
+    real_type half = sizing_half;
+    for (int j=0; j<3; j++) {
+	if (fabs(p[j] - c[j]) > half)
+	    return false;
+    }
+
+    int n = 0;
+    while (sizing_nodes[n].child >= 0) {
+	half *= 0.5;
+	int oct = 0;
+	for (int j=0; j<3; j++) {
+	    if (p[j] >= c[j]) {
+		oct |= 1<<j;
+		c[j] += half;
+	    } else {
+		c[j] -= half;
+	    }
+	}
+	n = sizing_nodes[n].child + oct;
+    }
+
+    const SizingGridNode &leaf = sizing_nodes[n];
+    if (leaf.count < 0) {
+	Profile::Count(PROF_SIZING_FALLBACKS);
+	return false;
+    }
+
+    len = leaf.value;
+    for (int i=leaf.start; i<leaf.start+leaf.count; i++) {
+	const SizingGridPoint &sp = sizing_all[sizing_points[i]];
+	real_type d = sqrt(Point3::squared_distance(p, sp.p));
+	len = std::min(len, (1-reduction)*d + reduction*sp.ideal);
+    }
+    if (len<min_step)
+	len = min_step;
+
+    Profile::Count(PROF_SIZING_HITS);
+    Profile::Count(PROF_MAXSTEP_VISITED, leaf.count);
+    Profile::Maximum(PROF_MAX_MAXSTEP_VISITED, leaf.count);
+    return true;
+}
+
+
+void GuidanceField::BuildSizingNode(const vector<SizingGridPoint> &all, int leaf_size, int node,
+				    const Point3 &center, real_type half, int depth, const vector<int> &cands,
+				    vector<SizingGridNode> &nodes, vector<int> &points,
+				    vector<SizingGridTask*> *defer) const {
+
+    if (defer && depth == sizing_split_depth) {
+	SizingGridTask *t = new SizingGridTask;
+	t->node = node;
+	t->center = center;
+	t->half = half;
+	t->depth = depth;
+	t->cands = cands;
+	defer->push_back(t);
+	return;
+    }
+
+    // bounds on each point's StepRequired over the cell, from the nearest and farthest corner
+    real_type smallest = max_step;
+    vector<real_type> lower(cands.size());
+    for (unsigned i=0; i<cands.size(); i++) {
+	const SizingGridPoint &sp = all[cands[i]];
+	real_type near2=0, far2=0;
+	for (int j=0; j<3; j++) {
+	    real_type d = fabs(sp.p[j] - center[j]);
+	    if (d > half) near2 += (d-half)*(d-half);
+	    far2 += (d+half)*(d+half);
+	}
+	lower[i] = (1-reduction)*sqrt(near2) + reduction*sp.ideal;
+	smallest = std::min(smallest, (1-reduction)*sqrt(far2) + reduction*sp.ideal);
+    }
+
+    SizingGridNode &leaf = nodes[node];
+    leaf.child = -1;
+    leaf.start = 0;
+    leaf.count = 0;
+    leaf.value = max_step;
+
+    // everything in the cell gets clamped to min_step
+    if (smallest <= min_step) {
+	leaf.value = min_step;
+	return;
+    }
+
+    // a little generous for rounding
+    real_type cutoff = smallest * 1.0001;
+    vector<int> kept;
+    for (unsigned i=0; i<cands.size(); i++) {
+	if (lower[i] <= cutoff)
+	    kept.push_back(cands[i]);
+    }
+
+    // only refine where some point is close, out in empty space the lists shrink too slowly to be worth it
+    real_type nearest = HUGE_VAL;
+    for (unsigned i=0; i<kept.size(); i++)
+	nearest = std::min(nearest, Point3::distance(center, all[kept[i]].p));
+    bool refine = ((int)kept.size() > leaf_size && depth < sizing_max_depth &&
+		   nearest <= 2*half*sqrt(3.0));
+    if (!refine) {
+	if ((int)kept.size() > leaf_size && (depth < sizing_max_depth || (int)kept.size() > 16*leaf_size)) {
+	    leaf.count = -1;
+	} else {
+	    leaf.start = points.size();
+	    leaf.count = kept.size();
+	    points.insert(points.end(), kept.begin(), kept.end());
+	}
+	return;
+    }
+
+    int child = nodes.size();
+    nodes[node].child = child;
+    nodes.resize(child + 8);
+    real_type chalf = half*0.5;
+    for (int oct=0; oct<8; oct++) {
+	Point3 cc = center;
+	for (int j=0; j<3; j++)
+	    cc[j] += (oct & (1<<j)) ? chalf : -chalf;
+	BuildSizingNode(all, leaf_size, child+oct, cc, chalf, depth+1, kept, nodes, points, defer);
+    }
+}
+
+
+void GuidanceField::ParallelSizingGrid(int begin, int end, const vector<SizingGridPoint> &all, int leaf_size,
+				       vector<SizingGridTask*> &tasks) const {
+    for (int i=begin; i<end; i++) {
+	SizingGridTask &t = *tasks[i];
+	t.nodes.resize(1);
+	BuildSizingNode(all, leaf_size, 0, t.center, t.half, t.depth, t.cands, t.nodes, t.points, NULL);
+	vector<int>().swap(t.cands);
+    }
+}
+
+
+void GuidanceField::BuildSizingGrid(int leaf_size) {
+
+    double start = get_time_seconds();
+    cerr << "[TIMING] Building sizing grid..." << endl;
+
+    sizing_nodes.clear();
+    sizing_points.clear();
+    sizing_all.clear();
+
+    // the points the traversal can return - some fields only keep part of ideal_length
+    vector<SizingGridPoint> &all = sizing_all;
+    real_type sd;
+    void *traverse = OrderedPointTraverseStart(Point3(0,0,0));
+    for (int i=OrderedPointTraverseNext(traverse, sd); i>=0; i=OrderedPointTraverseNext(traverse, sd)) {
+	SizingGridPoint sp;
+	sp.p = PointLocation(i);
+	sp.ideal = ideal_length[i];
+	all.push_back(sp);
+    }
+    OrderedPointTraverseEnd(traverse);
+    if (all.empty())
+	return;
+
+    Box3 bbox(all[0].p, all[0].p);
+    for (unsigned i=1; i<all.size(); i++)
+	bbox.update(all[i].p);
+    sizing_center = bbox.centroid();
+    sizing_half = 0.55 * std::max(bbox.x_length(), std::max(bbox.y_length(), bbox.z_length())) + 1e-6;
+
+    vector<int> cands(all.size());
+    for (unsigned i=0; i<cands.size(); i++)
+	cands[i] = i;
+
+    vector<SizingGridTask*> tasks;
+    sizing_nodes.resize(1);
+    BuildSizingNode(all, leaf_size, 0, sizing_center, sizing_half, 0, cands, sizing_nodes, sizing_points, &tasks);
+    vector<int>().swap(cands);
+
+    // the subtrees vary a lot in size, so hand them out one at a time
+    ParallelFor(0, (int)tasks.size(), 1, makeClassFunctor(this, &GuidanceField::ParallelSizingGrid), all, leaf_size, tasks);
+
+    // splice the subtrees in, their roots replace the placeholders
+    for (unsigned i=0; i<tasks.size(); i++) {
+	SizingGridTask &t = *tasks[i];
+	int noff = (int)sizing_nodes.size() - 1;
+	int poff = sizing_points.size();
+	for (unsigned n=0; n<t.nodes.size(); n++) {
+	    SizingGridNode sn = t.nodes[n];
+	    if (sn.child >= 0) sn.child += noff;
+	    if (sn.count > 0) sn.start += poff;
+	    if (n==0)
+		sizing_nodes[t.node] = sn;
+	    else
+		sizing_nodes.push_back(sn);
+	}
+	sizing_points.insert(sizing_points.end(), t.points.begin(), t.points.end());
+	delete tasks[i];
+    }
+
+    int fallbacks = 0;
+    for (unsigned i=0; i<sizing_nodes.size(); i++) {
+	if (sizing_nodes[i].count < 0) fallbacks++;
+    }
+
+    cerr << "[TIMING] Sizing grid with " << sizing_nodes.size() << " nodes, " << sizing_points.size()
+	 << " points (" << fallbacks << " leaves use the traversal) built in " << get_time_seconds()-start << " seconds" << endl;
+}
+
+
+
+real_type GuidanceField::MaxStepLengthD(const Point3 &p, int &stepto) const
 {
+    ProfileTimer pt(PROF_TIME_MAXSTEP);
+    Profile::Count(PROF_MAXSTEP_CALLS);
+    int visited=0;
+
     real_type len = max_step;
     real_type checked_rad=0;
     stepto = -1;
 
-    OrderedPointTraverseStart(p);
+    void *traverse = OrderedPointTraverseStart(p);
     do {
 
-	int checkp = OrderedPointTraverseNext(checked_rad);
+	int checkp = OrderedPointTraverseNext(traverse, checked_rad);
 	if (checkp < 0) break;
+	visited++;
 
 	// apparently the distance returned by the ordered traverse isn't the actual distance!
 	checked_rad = sqrt(checked_rad);
@@ -99,7 +351,9 @@ real_type GuidanceField::MaxStepLengthD(const Point3 &p, int &stepto)
     } while (checked_rad < (len/(1-reduction)));
 
 
-    OrderedPointTraverseEnd();
+    OrderedPointTraverseEnd(traverse);
+    Profile::Count(PROF_MAXSTEP_VISITED, visited);
+    Profile::Maximum(PROF_MAX_MAXSTEP_VISITED, visited);
     return len;
 }
 
@@ -219,8 +473,28 @@ void GuidanceField::ResampleCurve(vector<Point3> &ip, vector< vector<Vector3> >
 
 
 
+// one bisection step of the trimming, run as a task on the pool
+class TrimSplitTask {
+    public:
+    const GuidanceField *field;
+    vector<int> ipts;
+    vector<int> *marked;
+    TaskGroup *group;
+};
+
+// one stride of a bin's sorted points
+class TrimStrideTask {
+    public:
+    const GuidanceField *field;
+    int nt, id;
+    const vector< std::pair<real_type,int> > *points;
+    ConeBoxKDTree<int, GuidanceField> *kd;
+    vector<int> *marked;
+};
+
+
 void GuidanceField::ParallelTrim(int nt, int id, 
-				 vector< std::pair<real_type,int> > &points,
+				 const vector< std::pair<real_type,int> > &points,
 				 ConeBoxKDTree<int, GuidanceField> &kd,
 				 vector<int> &marked) const {
     real_type t = 1-reduction;
@@ -241,53 +515,108 @@ void GuidanceField::ParallelTrim(int nt, int id,
 }
 
 
+void GuidanceField::TrimStrideMain(void *arg) {
+    TrimStrideTask *t = (TrimStrideTask*)arg;
+    t->field->ParallelTrim(t->nt, t->id, *t->points, *t->kd, *t->marked);
+}
+
+void GuidanceField::TrimSplitMain(void *arg) {
+    TrimSplitTask *t = (TrimSplitTask*)arg;
+    t->field->RecursiveTrim(*t->group, t->ipts, *t->marked);
+    delete t;
+}
+
+
+// the points of a bin are visited smallest step first.  each thread takes every nt'th one,
+// so they all stay near the front of the order
+void GuidanceField::TrimBin(const vector<int> &ipts, vector<int> &marked) const {
+
+    cerr<<"trimming bin with "<<ipts.size()<<" points"<<endl;
 
-void GuidanceField::RecursiveTrim(const vector<int> &ipts, vector<int> &marked) const {
+    vector< std::pair<real_type,int> >  sorted(ipts.size());
+    for (unsigned i=0; i<ipts.size(); ++i) {
+	sorted[i].first = StepRequired(0,ipts[i]);
+	sorted[i].second = ipts[i];
+    }
+    sort(sorted.begin(), sorted.end());
+
+    ConeBoxKDTree<int, GuidanceField> kd(ipts, *this);
+
+    TaskPool &pool = TaskPool::Get();
+    int nt = pool.NumThreads();
+    vector<TrimStrideTask> strides(nt);
+    TaskGroup group;
+    for (int i=0; i<nt; i++) {
+	strides[i].field = this;
+	strides[i].nt = nt;
+	strides[i].id = i;
+	strides[i].points = &sorted;
+	strides[i].kd = &kd;
+	strides[i].marked = &marked;
+	pool.Spawn(group, &GuidanceField::TrimStrideMain, &strides[i]);
+    }
+    pool.Wait(group);
+}
+
+
+// bins cover disjoint points, so the two halves can be trimmed at the same time
+void GuidanceField::RecursiveTrim(TaskGroup &group, vector<int> &ipts, vector<int> &marked) const {
 
     extern int trim_bin_size;
     if ((int)ipts.size() < trim_bin_size) {
+	TrimBin(ipts, marked);
+	return;
+    }
 
-	cerr<<"trimming bin with "<<ipts.size()<<" points"<<endl;
+    // compute the bounding box
+    Box3 bbox(PointLocation(ipts[0]), PointLocation(ipts[0]));
+    for (unsigned i=1; i<ipts.size(); i++) {
+	bbox.update(PointLocation(ipts[i]));
+    }
 
-	vector< std::pair<real_type,int> >  sorted(ipts.size());
-	for (unsigned i=0; i<ipts.size(); ++i) {
-	    sorted[i].first = StepRequired(0,ipts[i]);
-	    sorted[i].second = ipts[i];
-	}
-	sort(sorted.begin(), sorted.end());
+    TrimSplitTask *sides[2];
+    for (int s=0; s<2; s++) {
+	sides[s] = new TrimSplitTask;
+	sides[s]->field = this;
+	sides[s]->marked = &marked;
+	sides[s]->group = &group;
+	sides[s]->ipts.reserve((int)(ipts.size()*0.6));
+    }
 
-	ConeBoxKDTree<int, GuidanceField> kd(ipts, *this);
-	ParallelExecutor(idealNumThreads, makeClassFunctor(this, &GuidanceField::ParallelTrim), sorted, kd, marked);
+    int axis = 0;
+    if (bbox.y_length() > bbox.x_length() && bbox.y_length() > bbox.z_length()) axis=1;
+    if (bbox.z_length() > bbox.x_length() && bbox.z_length() > bbox.y_length()) axis=2;
 
-    } else {
-	// compute the bounding box
-	Box3 bbox(PointLocation(ipts[0]), PointLocation(ipts[0]));
-	for (unsigned i=1; i<ipts.size(); i++) {
-	    bbox.update(PointLocation(ipts[i]));
-	}
+    real_type split = bbox.centroid()[axis];
+
+    for (unsigned i=0; i<ipts.size(); i++) {
 
-	vector<int> sides[2];
-	sides[0].reserve((int)(ipts.size()*0.6));
-	sides[1].reserve((int)(ipts.size()*0.6));
+	if (PointLocation(ipts[i])[axis] < split)
+	    sides[0]->ipts.push_back(ipts[i]);
+	else
+	    sides[1]->ipts.push_back(ipts[i]);
+    }
+    vector<int>().swap(ipts);
 
-	int axis = 0;
-	if (bbox.y_length() > bbox.x_length() && bbox.y_length() > bbox.z_length()) axis=1;
-	if (bbox.z_length() > bbox.x_length() && bbox.z_length() > bbox.y_length()) axis=2;
+    TaskPool &pool = TaskPool::Get();
+    pool.Spawn(group, &GuidanceField::TrimSplitMain, sides[0]);
+    pool.Spawn(group, &GuidanceField::TrimSplitMain, sides[1]);
+}
 
-	real_type split = bbox.centroid()[axis];
 
-	for (unsigned i=0; i<ipts.size(); i++) {
+void GuidanceField::TrimPass(int pass, vector<int> &ipts, vector<int> &marked) const {
 
-	    if (PointLocation(ipts[i])[axis] < split)
-		sides[0].push_back(ipts[i]);
-	    else
-		sides[1].push_back(ipts[i]);
-	}
+    double pass_start = get_time_seconds();
 
-	RecursiveTrim(sides[0], marked);
-	RecursiveTrim(sides[1], marked);
-    }
+    TaskGroup group;
+    RecursiveTrim(group, ipts, marked);
+    TaskPool::Get().Wait(group);
 
+    int nmarked = marked.size() - std::accumulate(marked.begin(), marked.end(), 0);
+    cerr<<"Pass "<<pass<<endl;
+    cerr<<"Num points kept: "<<nmarked<<endl;
+    cerr<<"total points: "<<marked.size()<<endl;
+    cerr<<"[TIMING] Trim pass "<<pass<<" completed in "<<get_time_seconds()-pass_start<<" seconds"<<endl;
 }
 
 
@@ -301,6 +630,7 @@ void GuidanceField::Trim(vector<int> &marked) const {
 	return;
     }
 
+    ProfileTimer pt(PROF_TIME_GUIDANCE_TRIM);
     double trim_start = get_time_seconds();
     cerr << "[TIMING] Trimming guidance field..." << endl;
 
@@ -311,15 +641,7 @@ void GuidanceField::Trim(vector<int> &marked) const {
     }
 
 
-    RecursiveTrim(ipts, marked);
-
-    int nmarked = marked.size() - std::accumulate(marked.begin(), marked.end(), 0);
-    cerr<<"Pass 1"<<endl;
-    cerr<<"Num points kept: "<<nmarked<<endl;
-    cerr<<"total points: "<<marked.size()<<endl;
-    
-
-
+    TrimPass(1, ipts, marked);
 
     ipts.resize(0);
     for (int i=0; i<NumPoints(); i++) {
@@ -327,12 +649,7 @@ void GuidanceField::Trim(vector<int> &marked) const {
 	    ipts.push_back(i);
     }
 
-    RecursiveTrim(ipts, marked);
-
-    nmarked = marked.size() - std::accumulate(marked.begin(), marked.end(), 0);
-    cerr<<"Pass 2"<<endl;
-    cerr<<"Num points kept: "<<nmarked<<endl;
-    cerr<<"total points: "<<marked.size()<<endl;
+    TrimPass(2, ipts, marked);
 
     double trim_elapsed = get_time_seconds() - trim_start;
     cerr << "[TIMING] Guidance field trimming completed in " << trim_elapsed << " seconds" << endl;
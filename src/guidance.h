@@ -8,20 +8,46 @@
 
 #include "conekdtree.h"
 
+// a guidance point as the sizing grid keeps it
+class SizingGridPoint {
+    public:
+    Point3 p;
+    real_type ideal;
+};
+
+class SizingGridNode {
+    public:
+    int child;		// first of the 8 children, -1 for a leaf
+    int start;		// the leaf's points, in sizing_points
+    int count;		// -1 if there were too many, and the leaf asks the traversal instead
+    real_type value;	// the answer when none of the points are any smaller
+};
+
+class SizingGridTask;
+class TaskGroup;
+
+
 class GuidanceField {
     public:
 
     GuidanceField(real_type _rho, real_type _min, real_type _max, real_type _reduction)
-	: rho(_rho), min_step(_min), max_step(_max), reduction(_reduction) { };
+	: rho(_rho), min_step(_min), max_step(_max), reduction(_reduction), sizing_half(0) { };
     virtual ~GuidanceField() {};
 
 
     virtual const Point3& PointLocation(int i) const = 0;
-    virtual void OrderedPointTraverseStart(const Point3 &p) = 0;
-    virtual int OrderedPointTraverseNext(real_type &squared_dist) = 0;
-    virtual void OrderedPointTraverseEnd() = 0;
+    // the traversal state lives in the returned context rather than the field, so any number
+    // of threads can traverse at once.  End must be called to free it
+    virtual void* OrderedPointTraverseStart(const Point3 &p) const = 0;
+    virtual int OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const = 0;
+    virtual void OrderedPointTraverseEnd(void *ctx) const = 0;
 
-    real_type MaxStepLength(const Point3 &p, int ignore=-1);
+    // safe to call from several threads, as long as the field isn't being changed
+    real_type MaxStepLength(const Point3 &p, int ignore=-1) const;
+
+    // build an octree that answers most MaxStepLength queries by checking the few points that
+    // can set the minimum in the cell.  the field mustn't change afterwards
+    void BuildSizingGrid(int leaf_size);
 
     void ResampleCurve(vector<Point3> &ip, vector< vector<Vector3> > &in,
 		       vector<Point3> &op, vector< vector<Vector3> > &on,
@@ -69,13 +95,31 @@ class GuidanceField {
     private:
 
     real_type StepRequired(real_type dist, int to) const;
-    real_type MaxStepLengthD(const Point3 &p, int &stepto);
-
-    void RecursiveTrim(const vector<int> &ipts, vector<int> &marked) const;  // writes into ipts!
+    real_type MaxStepLengthD(const Point3 &p, int &stepto) const;
+
+    bool SizingGridLookup(const Point3 &p, real_type &len) const;
+    void BuildSizingNode(const vector<SizingGridPoint> &all, int leaf_size, int node,
+			 const Point3 &center, real_type half, int depth, const vector<int> &cands,
+			 vector<SizingGridNode> &nodes, vector<int> &points,
+			 vector<SizingGridTask*> *defer) const;
+    void ParallelSizingGrid(int begin, int end, const vector<SizingGridPoint> &all, int leaf_size,
+			    vector<SizingGridTask*> &tasks) const;
+
+    vector<SizingGridNode> sizing_nodes;
+    vector<int> sizing_points;			// indices into sizing_all
+    vector<SizingGridPoint> sizing_all;
+    Point3 sizing_center;
+    real_type sizing_half;
+
+    void TrimPass(int pass, vector<int> &ipts, vector<int> &marked) const;
+    void RecursiveTrim(TaskGroup &group, vector<int> &ipts, vector<int> &marked) const;  // clears ipts!
+    void TrimBin(const vector<int> &ipts, vector<int> &marked) const;
     void ParallelTrim(int nt, int id, 
-		      std::vector< std::pair<real_type,int> > &points,
+		      const std::vector< std::pair<real_type,int> > &points,
 		      ConeBoxKDTree<int, GuidanceField> &kd,
 		      vector<int> &marked) const;
+    static void TrimSplitMain(void *arg);
+    static void TrimStrideMain(void *arg);
 };
 
 
@@ -0,0 +1,268 @@
+#include "common.h"
+#include "guidance_cache.h"
+#include <stdio.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// directory to keep the cached fields in, NULL turns caching off
+char *guidance_cache = NULL;
+
+
+static const char guidance_cache_magic[8] = { 'A','F','G','F','C','0','2','\n' };
+static const int guidance_cache_version = 2;
+
+// everything is native-endian, and every array after the header starts 8 byte aligned
+class GuidanceCacheHeader {
+    public:
+    char magic[8];
+    int version;
+    int kind;
+    int params[5];
+    int npoints;
+    unsigned long long input_hash;
+    double rho;
+    double min_step;
+    double max_step;
+    double reduction;
+    double bbox[6];
+    int npositions;
+    int max_in_cell;
+    int kd_nodes;
+    int kd_objects;
+};
+
+
+static size_t Aligned(size_t s) {
+    return (s + 7) & ~(size_t)7;
+}
+
+// where each array lives in the file, and the total size
+static size_t GuidanceCacheLayout(const GuidanceCacheHeader &h, size_t offsets[6]) {
+    size_t o = Aligned(sizeof(GuidanceCacheHeader));
+    offsets[0] = o;	o = Aligned(o + sizeof(double)*(size_t)h.npoints);
+    offsets[1] = o;	o = Aligned(o + sizeof(double)*3*(size_t)h.npositions);
+    offsets[2] = o;	o = Aligned(o + (size_t)h.npositions);
+    offsets[3] = o;	o = Aligned(o + sizeof(int)*(size_t)h.kd_nodes);
+    offsets[4] = o;	o = Aligned(o + sizeof(double)*(size_t)h.kd_nodes);
+    offsets[5] = o;	o = Aligned(o + sizeof(int)*(size_t)h.kd_objects);
+    return o;
+}
+
+
+unsigned long long GuidanceCacheHash(const void *data, size_t size, unsigned long long h) {
+    const unsigned char *c = (const unsigned char*)data;
+    for (size_t i=0; i<size; i++) {
+	h ^= c[i];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+
+bool GuidanceCacheEnabled() {
+    return guidance_cache != NULL;
+}
+
+
+GuidanceCacheKey::GuidanceCacheKey(int _kind, unsigned long long _input_hash, double _rho, double _min_step, double _max_step, double _reduction)
+    : kind(_kind), input_hash(_input_hash), rho(_rho), min_step(_min_step), max_step(_max_step), reduction(_reduction) {
+
+    extern bool trim_guidance;
+    extern int trim_bin_size;
+    for (int i=0; i<5; i++) params[i] = 0;
+    params[3] = trim_guidance;
+    params[4] = trim_bin_size;
+}
+
+
+bool GuidanceCacheKey::operator==(const GuidanceCacheKey &k) const {
+    for (int i=0; i<5; i++) {
+	if (params[i] != k.params[i]) return false;
+    }
+    return (kind == k.kind && input_hash == k.input_hash &&
+	    rho == k.rho && min_step == k.min_step && max_step == k.max_step && reduction == k.reduction);
+}
+
+
+std::string GuidanceCacheKey::Filename() const {
+    if (!guidance_cache) return std::string();
+
+    unsigned long long h = GuidanceCacheHash(&kind, sizeof(kind));
+    h = GuidanceCacheHash(params, sizeof(params), h);
+    h = GuidanceCacheHash(&input_hash, sizeof(input_hash), h);
+    h = GuidanceCacheHash(&rho, sizeof(rho), h);
+    h = GuidanceCacheHash(&min_step, sizeof(min_step), h);
+    h = GuidanceCacheHash(&max_step, sizeof(max_step), h);
+    h = GuidanceCacheHash(&reduction, sizeof(reduction), h);
+
+    char name[32];
+    sprintf(name, "/%016llx.gfc", h);
+    return std::string(guidance_cache) + name;
+}
+
+
+
+GuidanceCacheData::GuidanceCacheData() :
+    npoints(0), ideal_length(NULL), npositions(0), positions(NULL), marked(NULL),
+    max_in_cell(0), kd_nodes(0), kd_objects(0), kd_node_codes(NULL), kd_cuts(NULL), kd_object_ids(NULL) {
+    for (int i=0; i<6; i++) bbox[i] = 0;
+}
+
+
+
+GuidanceCacheFile::GuidanceCacheFile() : map(NULL), size(0) {
+}
+
+
+bool GuidanceCacheFile::Open(const GuidanceCacheKey &key) {
+
+    Close();
+
+    std::string fname = key.Filename();
+    if (fname.empty()) return false;
+
+#ifdef WIN32
+    FILE *f = fopen(fname.c_str(), "rb");
+    if (!f) return false;
+    _fseeki64(f, 0, SEEK_END);
+    size = (size_t)_ftelli64(f);
+    _fseeki64(f, 0, SEEK_SET);
+    map = new char[size];
+    bool ok = (fread(map, 1, size, f) == size);
+    fclose(f);
+    if (!ok) {
+	Close();
+	return false;
+    }
+#else
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(GuidanceCacheHeader)) {
+	close(fd);
+	return false;
+    }
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	map = NULL;
+	return false;
+    }
+#endif
+
+    if (size < sizeof(GuidanceCacheHeader)) {
+	Close();
+	return false;
+    }
+
+    const GuidanceCacheHeader &h = *(const GuidanceCacheHeader*)map;
+    GuidanceCacheKey fkey(h.kind, h.input_hash, h.rho, h.min_step, h.max_step, h.reduction);
+    for (int i=0; i<5; i++) fkey.params[i] = h.params[i];
+
+    size_t offsets[6];
+    if (memcmp(h.magic, guidance_cache_magic, sizeof(h.magic)) || h.version != guidance_cache_version ||
+	!(fkey == key) || GuidanceCacheLayout(h, offsets) != size) {
+	cerr<<"guidance cache "<<fname<<" doesn't match, ignoring it"<<endl;
+	Close();
+	return false;
+    }
+
+    const char *base = (const char*)map;
+    data.npoints = h.npoints;
+    data.ideal_length = (const double*)(base + offsets[0]);
+    data.npositions = h.npositions;
+    data.positions = h.npositions ? (const double*)(base + offsets[1]) : NULL;
+    data.marked = h.npositions ? (const unsigned char*)(base + offsets[2]) : NULL;
+    data.max_in_cell = h.max_in_cell;
+    for (int i=0; i<6; i++) data.bbox[i] = h.bbox[i];
+    data.kd_nodes = h.kd_nodes;
+    data.kd_objects = h.kd_objects;
+    data.kd_node_codes = (const int*)(base + offsets[3]);
+    data.kd_cuts = (const double*)(base + offsets[4]);
+    data.kd_object_ids = (const int*)(base + offsets[5]);
+
+    cerr<<"using cached guidance field "<<fname<<endl;
+    return true;
+}
+
+
+void GuidanceCacheFile::Close() {
+    if (map) {
+#ifdef WIN32
+	delete [] (char*)map;
+#else
+	munmap(map, size);
+#endif
+    }
+    map = NULL;
+    size = 0;
+    data = GuidanceCacheData();
+}
+
+
+
+static bool WriteAligned(FILE *f, const void *p, size_t bytes) {
+    static const char zeros[8] = { 0 };
+    if (bytes && fwrite(p, 1, bytes, f) != bytes) return false;
+    size_t pad = Aligned(bytes) - bytes;
+    return (!pad || fwrite(zeros, 1, pad, f) == pad);
+}
+
+
+bool WriteGuidanceCache(const GuidanceCacheKey &key, const GuidanceCacheData &data) {
+
+    std::string fname = key.Filename();
+    if (fname.empty()) return false;
+
+    GuidanceCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, guidance_cache_magic, sizeof(h.magic));
+    h.version = guidance_cache_version;
+    h.kind = key.kind;
+    for (int i=0; i<5; i++) h.params[i] = key.params[i];
+    h.npoints = data.npoints;
+    h.input_hash = key.input_hash;
+    h.rho = key.rho;
+    h.min_step = key.min_step;
+    h.max_step = key.max_step;
+    h.reduction = key.reduction;
+    for (int i=0; i<6; i++) h.bbox[i] = data.bbox[i];
+    h.npositions = data.npositions;
+    h.max_in_cell = data.max_in_cell;
+    h.kd_nodes = data.kd_nodes;
+    h.kd_objects = data.kd_objects;
+
+    // write next to it and rename, so another run never maps half a file
+    std::string tmpname = fname + ".tmp";
+    FILE *f = fopen(tmpname.c_str(), "wb");
+    if (!f) {
+	cerr<<"couldn't open "<<tmpname<<" for writing"<<endl;
+	return false;
+    }
+
+    bool ok = (WriteAligned(f, &h, sizeof(h)) &&
+	       WriteAligned(f, data.ideal_length, sizeof(double)*(size_t)data.npoints) &&
+	       WriteAligned(f, data.positions, sizeof(double)*3*(size_t)data.npositions) &&
+	       WriteAligned(f, data.marked, (size_t)data.npositions) &&
+	       WriteAligned(f, data.kd_node_codes, sizeof(int)*(size_t)data.kd_nodes) &&
+	       WriteAligned(f, data.kd_cuts, sizeof(double)*(size_t)data.kd_nodes) &&
+	       WriteAligned(f, data.kd_object_ids, sizeof(int)*(size_t)data.kd_objects));
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpname.c_str(), fname.c_str()) != 0) {
+	cerr<<"couldn't write guidance cache "<<fname<<endl;
+	remove(tmpname.c_str());
+	return false;
+    }
+
+    cerr<<"wrote guidance cache "<<fname<<endl;
+    return true;
+}
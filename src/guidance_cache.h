@@ -0,0 +1,116 @@
+#ifndef __GUIDANCE_CACHE_H
+#define __GUIDANCE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+// binary cache of built guidance fields, so re-meshing the same input with different output
+// settings can skip the curvature and trimming.  a field is found by a hash of its input and
+// every parameter that changes it, and the file header has to match all of them before it's used.
+
+
+enum GuidanceCacheKind {
+    GUIDANCE_CACHE_MESH = 1,
+    GUIDANCE_CACHE_ISO = 2,
+};
+
+
+// FNV-1a, chain calls by passing the last result back in
+unsigned long long GuidanceCacheHash(const void *data, size_t size, unsigned long long h=14695981039346656037ULL);
+
+
+class GuidanceCacheKey {
+    public:
+    GuidanceCacheKey(int kind, unsigned long long input_hash, double rho, double min_step, double max_step, double reduction);
+
+    bool operator==(const GuidanceCacheKey &k) const;
+
+    // the file for this key in the cache directory, empty if there's no cache
+    std::string Filename() const;
+
+    int kind;
+    int params[5];		// field specific, plus whatever trimming depends on
+    unsigned long long input_hash;
+    double rho;
+    double min_step;
+    double max_step;
+    double reduction;
+};
+
+
+// a guidance field as it's stored - the kd-tree indexes the points that survived trimming
+class GuidanceCacheData {
+    public:
+    GuidanceCacheData();
+
+    int npoints;
+    const double *ideal_length;
+    int npositions;			// 0 when the field's points come from its input, else npoints
+    const double *positions;		// 3 per point
+    const unsigned char *marked;	// trimmed away
+
+    int max_in_cell;
+    double bbox[6];
+    int kd_nodes;
+    int kd_objects;
+    const int *kd_node_codes;		// as from KDTree::Serialize
+    const double *kd_cuts;
+    const int *kd_object_ids;
+};
+
+
+// a cache file mapped into memory, the pointers in data stay valid until it's closed
+class GuidanceCacheFile {
+    public:
+    GuidanceCacheFile();
+    ~GuidanceCacheFile() { Close(); }
+
+    // false if there's no file for key or it doesn't match
+    bool Open(const GuidanceCacheKey &key);
+    void Close();
+
+    GuidanceCacheData data;
+
+    private:
+    void *map;
+    size_t size;
+};
+
+
+bool GuidanceCacheEnabled();
+bool WriteGuidanceCache(const GuidanceCacheKey &key, const GuidanceCacheData &data);
+
+
+// point data's kd-tree arrays at a flattened copy of kd, kept in the vectors
+template <class KDTREE>
+void GuidanceCacheStoreTree(const KDTREE &kd, GuidanceCacheData &data,
+			    std::vector<int> &codes, std::vector<double> &cuts, std::vector<int> &objects) {
+    std::vector<real_type> rcuts;
+    kd.Serialize(codes, rcuts, objects);
+    cuts.assign(rcuts.begin(), rcuts.end());
+
+    data.max_in_cell = kd.GetMaxInCell();
+    for (int i=0; i<3; i++) {
+	data.bbox[i] = kd.GetBBox().min_point()[i];
+	data.bbox[3+i] = kd.GetBBox().max_point()[i];
+    }
+    data.kd_nodes = codes.size();
+    data.kd_objects = objects.size();
+    data.kd_node_codes = codes.empty() ? NULL : &codes[0];
+    data.kd_cuts = cuts.empty() ? NULL : &cuts[0];
+    data.kd_object_ids = objects.empty() ? NULL : &objects[0];
+}
+
+// rebuild the kd-tree that was stored, over the points getpoint gives
+template <class KDTREE, class GETPOINT>
+KDTREE* GuidanceCacheLoadTree(const GuidanceCacheData &data, const GETPOINT &getpoint) {
+    Box3 bbox(Point3((real_type)data.bbox[0], (real_type)data.bbox[1], (real_type)data.bbox[2]),
+	      Point3((real_type)data.bbox[3], (real_type)data.bbox[4], (real_type)data.bbox[5]));
+    KDTREE *kd = new KDTREE(data.max_in_cell, bbox, getpoint);
+    kd->Deserialize(data.kd_node_codes, data.kd_cuts, data.kd_object_ids);
+    return kd;
+}
+
+
+#endif
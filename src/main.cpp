@@ -16,6 +16,7 @@
 #include "output_controller_obj.h"
 #include "output_controller_reeb.h"
 #include "output_controller_hhm.h"
+#include "output_controller_smb.h"
 #include "output_controller_gui.h"
 #include "edgeflipper.h"
 #include "crease.h"
@@ -24,6 +25,9 @@
 #include "PC_io.h"
 
 #include "parallel.h"
+#include "profile.h"
+#include "point_tiles.h"
+#include "output_controller_clip.h"
 
 
 using namespace std;
@@ -36,6 +40,31 @@ int idealNumThreads = 8;
 int idealNumThreads = 1;
 #endif
 
+// how many of the best grow edges the triangulator keeps projecting ahead of the front
+int projection_lookahead = 0;
+
+// split the volume into this many cells per axis and triangulate them concurrently (0 disables)
+static int partition_cells = 0;
+
+// how much of a bricked (.bvol) volume to keep mapped at once
+int brick_cache_mb = 1024;
+
+// use uncompressed raw and nrrd volumes in place, in their own sample type, instead of converting them
+bool map_volumes = true;
+
+// store volumes in morton order inside small tiles instead of row major
+static bool morton_volumes = false;
+
+// how much of a point cloud to sort in memory at once when converting it to .bpts
+static int point_sort_mb = 1024;
+
+// only triangulate the part of a .bpts file inside this box.  the points within point_halo of it are
+// loaded too, so the mls surface near its faces is the same as with the whole cloud - a negative
+// halo is worked out from the point spacing
+static bool use_point_region = false;
+static Box3 point_region;
+static real_type point_halo = -1;
+
 
 // Reeb graph stuff
 OutputControllerReeb *reeb = NULL;
@@ -63,6 +92,7 @@ const TriangleMesh *ctetshell = &tetshell;
 
 static char *save_field = NULL;
 static char *load_field = NULL;
+extern char *guidance_cache;
 char *outname = "outmesh.m";
 static char *reebname = "reeb_out.txt";
 static real_type rho = (real_type)(M_PI * 2.0 / 32.0); // ~ 0.2
@@ -71,6 +101,7 @@ static real_type min_step = (real_type) 0;
 static real_type max_step = (real_type) 1000000;
 static real_type reduction = (real_type)0.8;
 static real_type radius_factor = 2.0f;
+extern real_type mls_frame_reuse;
 static bool csg_guidance_blend = true;
 static bool failsafe = true;	
 static int small_crease = 20;
@@ -84,6 +115,7 @@ bool trim_guidance = true;
 real_type proj_tol = 1e-3;
 int trim_bin_size = 1000000;
 int grid_intersect_overestimate = 0;
+static int sizing_grid = 0;
 real_type bad_connect_priority = 1e34;
 real_type boundary_dist = 0;
 real_type noise_threshold = 0;
@@ -195,6 +227,17 @@ bool endswith(const char *s, const char *end) {
 }
 
 
+// pick the mesh writer from the output file's extension
+OutputController* NewFileOutputController(const char *fname) {
+    if (fname && endswith(fname, ".smb"))
+	return new OutputControllerSMB(fname);
+    else if (fname && endswith(fname, ".obj"))
+	return new OutputControllerOBJ(fname);
+    else
+	return new OutputControllerHHM(fname);
+}
+
+
 /////////////////////////////////////////////////////////////////////////////////
 
 void do_gui() {
@@ -363,9 +406,10 @@ int do_tri_mesh(int argc, char* argv[]) {
     TriangleMesh &mesh = meshes[0];
     MeshProjector projector(mesh);
     guidance = new MeshGuidanceField(csubdiv, mesh, rho, min_step, max_step, reduction);
-    OutputController::AddControllerToBack(output_controller_head, new OutputControllerHHM(outname));
+    OutputController::AddControllerToBack(output_controller_head, NewFileOutputController(outname));
     if (gui)
 	OutputController::AddControllerToBack(output_controller_head, gui);
+    if (sizing_grid) guidance->BuildSizingGrid(sizing_grid);
     controller = new ControllerWrapper(guidance, &projector, output_controller_head);
 
 
@@ -617,6 +661,7 @@ int do_csg(int argc, char* argv[]) {
 
 	OutputControllerHHM *hhmout = new OutputControllerHHM(outname);
 	OutputController::AddControllerToBack(output_controller_head, hhmout);
+	if (sizing_grid) guidance->BuildSizingGrid(sizing_grid);
 	controller = new ControllerWrapper(guidance, NULL, output_controller_head);
 	triangulator = new Triangulator(*controller);
 
@@ -726,6 +771,7 @@ int do_csg(int argc, char* argv[]) {
 	    OutputController::AddControllerToBack(output_controller_head, gui);
 	OutputControllerHHM *hhmout = new OutputControllerHHM(outname);
 	OutputController::AddControllerToBack(output_controller_head, hhmout);
+	if (sizing_grid) guidance->BuildSizingGrid(sizing_grid);
 	controller = new ControllerWrapper(guidance, NULL, output_controller_head);
 	triangulator = new Triangulator(*controller);
 
@@ -749,12 +795,58 @@ int do_csg(int argc, char* argv[]) {
 }
 
 
-int do_tri_vol(int argc, char* argv[]) {
-    assert(argc>1 && argv[1][0]!='-');
-    real_type isoval = atof(argv[1]);
-    bool bspline=false;
-    if (argc>2 && !stricmp(argv[2], "bspline"))
-	bspline=true;
+// project one of the candidate points onto the isosurface and start a two vertex front there
+static bool IsoSeedFront(const IsoSurfaceProjector &projector, const vector<Point3> &candidates,
+			 vector<Point3> &pts, vector<Vector3> &norms) {
+
+    for (unsigned attempt=0; attempt<candidates.size(); attempt++) {
+	Point3 startpoint;
+	Vector3 startnorm;
+
+	if (projector.ProjectPoint(candidates[attempt], startpoint, startnorm) != PROJECT_SUCCESS) {
+	    cerr<<"seed point projection failed"<<endl;
+	    continue;
+	}
+
+	if (!((IsoSurfaceGuidanceField*)guidance)->NormalAtPoint(startpoint, startnorm)) {
+	    cerr<<"couldn't get normal"<<endl;
+	    continue; //exit(0);
+	}
+	real_type size = guidance->MaxStepLength(startpoint);
+	      
+	Vector3 udir, vdir;
+	PerpVectors(startnorm, udir, vdir);
+	  
+ 
+	Point3 proj_p;
+	Vector3 proj_n;
+
+	if (projector.ProjectPoint(startpoint + size * udir, proj_p, proj_n) != PROJECT_SUCCESS) {
+	    cerr<<"initial edge point projection failed"<<endl;
+	    allow_outside = false;
+	    continue;
+	}
+
+	pts.resize(2);
+	norms.resize(2);
+	pts[0]   = startpoint;
+	norms[0] = startnorm;
+	pts[1]   = proj_p;
+	norms[1] = proj_n;
+	return true;
+    }
+
+    return false;
+}
+
+
+// triangulate one isosurface of the volume to outname.  prefiltered is GetBSplineValues() if the
+// caller already has them, otherwise they're computed here when they're needed.  false if there
+// was nothing to seed the surface from
+static bool TriangulateIsoValue(real_type isoval, bool bspline, const real_type *prefiltered) {
+
+    if (!bspline || cvolume->OutOfCore())
+	prefiltered = NULL;
 
     if (triangulator)	delete triangulator;	triangulator=NULL;
     if (guidance)		delete guidance;		guidance=NULL;
@@ -762,61 +854,61 @@ int do_tri_vol(int argc, char* argv[]) {
 
 
 
-    // get the marching cubes mesh
-    // wrap it in a local scope so it gets destructed before doing the triangulation
-    // so that huge volumes (512^3) don't destroy our computers
+    // find the marching cubes boundaries and seeds straight from the volume, without ever
+    // building the mesh, so that huge volumes (512^3) don't destroy our computers
     cerr<<"running marching cubes"<<endl;
     vector< vector<Point3> > cc_seeds;
-    vector< vector<int> > boundaries;
+    vector<int> cc_seed_component;
+    vector< vector<Point3> > cell_seeds;	// for partition_cells
+    vector<int> cell_seed_region;
+    vector<int> cell_seed_component;
+    vector<Box3> regions;
     vector< vector<Vector3> > nloops;
     vector< vector<Point3> > ploops;
     vector< vector<Point3> > ipts;
     vector< vector<Vector3> > inorms;
     IsoSurfaceProjector projector(*cvolume, isoval, bspline);
+    real_type *own_values = NULL;
 	    
     {
-	TriangleMesh mc_mesh;
+	MarchingCubesSeeds mc_seeds;
 	{
 	    bool oldflips = OutputControllerEdgeFlipper::DoFlips;
 	    OutputControllerEdgeFlipper::DoFlips = false;
 
-	    real_type *orig_values = volume.CopyValues();
-		
-	    if (bspline) {
-		real_type *bvals = cvolume->GetBSplineValues();
-		critical_section->enter();
-		volume.SetValues(bvals);
-		critical_section->leave();
-		delete [] bvals;
-	    }
+	    // march the prefiltered values in place of the samples, and keep them for the guidance
+	    // field - bricked volumes get prefiltered on the fly instead
+	    if (bspline && !cvolume->OutOfCore() && !prefiltered)
+		prefiltered = own_values = cvolume->GetBSplineValues();
 
+	    FindMarchingCubesSeeds(*cvolume, isoval, bspline && cvolume->OutOfCore(), partition_cells, mc_seeds, prefiltered);
 
-	    OutputControllerITS *oc_its = new OutputControllerITS();
-	    controller = new ControllerWrapper(NULL, NULL, oc_its);	// to catch the mc output
-	    MarchingCubes(*cvolume, *controller, isoval);
+	    // the full mesh is only needed to look at
+	    if (gui) {
+		TriangleMesh mc_mesh;
+		OutputControllerITS *oc_its = new OutputControllerITS();
+		controller = new ControllerWrapper(NULL, NULL, oc_its);	// to catch the mc output
+		MarchingCubes(*cvolume, *controller, isoval, bspline && cvolume->OutOfCore(), prefiltered);
 
-	    ITS2TM(oc_its->triangulation, mc_mesh);
-	    delete oc_its;  oc_its=NULL;
-	    delete controller; controller = NULL;
+		ITS2TM(oc_its->triangulation, mc_mesh);
+		delete oc_its;  oc_its=NULL;
+		delete controller; controller = NULL;
 
-	    volume.SetValues(orig_values);
-	    delete [] orig_values;
+		critical_section->enter();
+		meshes[0] = mc_mesh;
+		meshes[0].BuildStrips();
+		critical_section->leave();
+	    }
 
 	    OutputControllerEdgeFlipper::DoFlips = oldflips;
 
 	}
 
 
-	critical_section->enter();
-	meshes[0] = mc_mesh;
-	meshes[0].BuildStrips();
-	critical_section->leave();
-
 	redrawAndWait(' ');
 
 
 	cerr<<"adding boundaries as initial fronts"<<endl;
-	mc_mesh.GetBoundaries(boundaries);
 
 
 	IndexedTriangleSet tribox;
@@ -855,10 +947,15 @@ int do_tri_vol(int argc, char* argv[]) {
 
 
 
-	guidance = new IsoSurfaceGuidanceField(projector, *cvolume, bspline, rho, min_step, max_step, reduction);
-	OutputController::AddControllerToBack(output_controller_head, new OutputControllerHHM(outname));
+	guidance = new IsoSurfaceGuidanceField(projector, *cvolume, bspline, rho, min_step, max_step, reduction, prefiltered);
+	if (own_values) delete [] own_values;
+	own_values = NULL;
+	prefiltered = NULL;
+
+	OutputController::AddControllerToBack(output_controller_head, NewFileOutputController(outname));
 	if (gui)
 	    OutputController::AddControllerToBack(output_controller_head, gui);
+	if (sizing_grid) guidance->BuildSizingGrid(sizing_grid);
 	controller = new ControllerWrapper(guidance, &projector, output_controller_head);
 
 	redrawAndWait(' ');
@@ -866,17 +963,15 @@ int do_tri_vol(int argc, char* argv[]) {
 
 
 
-	ploops.resize(boundaries.size());
-	nloops.resize(boundaries.size());
+	ploops.resize(mc_seeds.boundaries.size());
+	nloops.resize(mc_seeds.boundaries.size());
 
-	for (unsigned i=0 ;i<boundaries.size(); i++) {
-	    reverse(boundaries[i]);
-	    for (unsigned j=0; j<boundaries[i].size(); j++) {
-		ploops[i].push_back(mc_mesh.verts[boundaries[i][j]].point);
-	    }
+	for (unsigned i=0 ;i<mc_seeds.boundaries.size(); i++) {
+	    ploops[i] = mc_seeds.boundaries[i];
+	    reverse(ploops[i]);
 	}
 
-	for (unsigned l=0; l<boundaries.size(); l++) {
+	for (unsigned l=0; l<ploops.size(); l++) {
 	  
 	    nloops[l].resize(ploops[l].size());
 
@@ -939,76 +1034,46 @@ int do_tri_vol(int argc, char* argv[]) {
 
 
 
-	// find the connected components to use as seeds 
-	cerr<<"finding connected components"<<endl;
-	if (1){
-	    vector<bool> flooded(mc_mesh.verts.size());
-	    for (unsigned i=0;i<mc_mesh.verts.size(); i++) {
-		flooded[i]=false;
-	    }
-	    
-	    
-	    while (1) {
-	    
-		int startv=-1;
-		for (unsigned i=0; i<flooded.size(); i++) {
-		    if (!flooded[i]) {
-			if (mc_mesh.verts[startv].someface < 0) {
-			    flooded[i] = true;
-			} else {
-			    startv=i; break;
-			}
-		    }
-		}
-		if (startv<0) break;
-
-		if (mc_mesh.verts[startv].someface < 0)
-		    cerr<<"someface < 0"<<endl;
-
+	// seed the closed connected components, the others get started from their boundaries
+	cc_seeds = mc_seeds.component_seeds;
+	cc_seed_component = mc_seeds.component_ids;
+	cerr<<cc_seeds.size()<<" cc seeds"<<endl;
 
-		vector<int> component_points;
-		component_points.push_back(startv);
 
-	    
-		vector<int> toflood;
-		toflood.push_back(startv);
-		flooded[startv] = true;
-		bool boundary = mc_mesh.VertOnBoundary(startv);
-	    
-		while (!toflood.empty()) {
-		    int tf = toflood.back();
-		    toflood.pop_back();
-		    for (TriangleMesh::VertexVertexIteratorI vi(mc_mesh, tf); !vi.done(); ++vi) {
-			int tf2 = *vi;
-			if (flooded[tf2]) continue;
-			flooded[tf2]=true;
-			component_points.push_back(tf2);
-			boundary |= mc_mesh.VertOnBoundary(tf2);
-			toflood.push_back(tf2);
-		    }
+	// seed every piece of the surface inside each partition cell
+	if (partition_cells > 0) {
+	    int nc = partition_cells;
+	    Box3 vbox = cvolume->bounding_box();
+	    real_type cellsize[3] = { (vbox.x_max()-vbox.x_min()) / nc,
+				      (vbox.y_max()-vbox.y_min()) / nc,
+				      (vbox.z_max()-vbox.z_min()) / nc };
+
+	    std::map<int,int> cell_region;
+	    for (unsigned i=0; i<mc_seeds.piece_seeds.size(); i++) {
+		int cell = mc_seeds.piece_cell[i];
+
+		std::map<int,int>::iterator cri = cell_region.find(cell);
+		if (cri == cell_region.end()) {
+		    int cx = cell % nc, cy = (cell / nc) % nc, cz = cell / (nc*nc);
+		    regions.push_back(Box3(vbox.x_min() + cx*cellsize[0], vbox.y_min() + cy*cellsize[1], vbox.z_min() + cz*cellsize[2],
+					   vbox.x_min() + (cx+1)*cellsize[0], vbox.y_min() + (cy+1)*cellsize[1], vbox.z_min() + (cz+1)*cellsize[2]));
+		    cri = cell_region.insert(std::make_pair(cell, (int)regions.size()-1)).first;
 		}
 
-		if (!boundary) {
-		    // since seed point projections sometimes fail, we'll try up to 10 different seeds per connected component
-		    cc_seeds.push_back(vector<Point3>());
-		    for (int i=0; i<10; i++) {
-			int j = i*component_points.size() / 10;
-			cc_seeds.back().push_back(mc_mesh.verts[component_points[j]].point);
-		    }
-		} else {
-		    cerr<<"skipped connected component with boundary"<<endl;
-		}
+		cell_seeds.push_back(mc_seeds.piece_seeds[i]);
+		cell_seed_region.push_back(cri->second);
+		cell_seed_component.push_back(mc_seeds.piece_component[i]);
 	    }
-	}
 
-	cerr<<cc_seeds.size()<<" cc seeds"<<endl;
+	    cerr<<cell_seeds.size()<<" cell seeds in "<<regions.size()<<" regions"<<endl;
+	}
 	redrawAndWait(' ');
     }
 
 
     if (cc_seeds.size()==0  && ipts.size()==0) {
 	cerr<<"no seeds found!?!"<<endl;
-	exit(0);
+	return false;
     }
 
 
@@ -1018,62 +1083,151 @@ int do_tri_vol(int argc, char* argv[]) {
     }
     redrawAndWait(' ');
 
+    // the seeds inside each partition cell - only the ones that start well inside their region
+    vector< vector< vector<Point3> > > region_ipts(regions.size());
+    vector< vector< vector<Vector3> > > region_inorms(regions.size());
+    vector<bool> component_seeded;
+    for (unsigned i=0; i<cell_seeds.size(); i++) {
+	vector<Point3> pts;
+	vector<Vector3> norms;
+	if (!IsoSeedFront(projector, cell_seeds[i], pts, norms))
+	    continue;
+
+	const Box3 &r = regions[cell_seed_region[i]];
+	real_type margin = 2*Point3::distance(pts[0], pts[1]);
+	bool inside = true;
+	for (int p=0; p<2; p++) {
+	    inside &= (pts[p][0]-margin >= r.x_min() && pts[p][0]+margin <= r.x_max() &&
+		       pts[p][1]-margin >= r.y_min() && pts[p][1]+margin <= r.y_max() &&
+		       pts[p][2]-margin >= r.z_min() && pts[p][2]+margin <= r.z_max());
+	}
+	if (!inside) continue;
+
+	region_ipts[cell_seed_region[i]].push_back(pts);
+	region_inorms[cell_seed_region[i]].push_back(norms);
+	if (cell_seed_component[i] >= (int)component_seeded.size())
+	    component_seeded.resize(cell_seed_component[i]+1, false);
+	component_seeded[cell_seed_component[i]] = true;
+    }
+
     for (unsigned i=0; i<cc_seeds.size(); i++) {
-	Point3 startpoint;
-	Vector3 startnorm;
+	// already being started from inside a region
+	if (cc_seed_component[i] < (int)component_seeded.size() && component_seeded[cc_seed_component[i]])
+	    continue;
 
-	bool success = false;
+	ipts.push_back(vector<Point3>());
+	inorms.push_back(vector<Vector3>());
+	if (!IsoSeedFront(projector, cc_seeds[i], ipts.back(), inorms.back())) {
+	    cerr<<"couldn't get initial front on connected component!"<<endl;
+	    ipts.pop_back();
+	    inorms.pop_back();
+	}
+    }
+    redrawAndWait(' ');
 
-	for (int attempt=0; attempt<cc_seeds[i].size(); attempt++) {
-	    if (projector.ProjectPoint(cc_seeds[i][attempt], startpoint, startnorm) != PROJECT_SUCCESS) {
-		cerr<<"seed point projection failed"<<endl;
-		continue;
-	    }
 
-	    if (!((IsoSurfaceGuidanceField*)guidance)->NormalAtPoint(startpoint, startnorm)) {
-		cerr<<"couldn't get normal"<<endl;
-		continue; //exit(0);
-	    }
-	    real_type size = guidance->MaxStepLength(startpoint);
-	      
-	    Vector3 udir, vdir;
-	    PerpVectors(startnorm, udir, vdir);
-	  
- 
-	    Point3 proj_p;
-	    Vector3 proj_n;
+    if (partition_cells > 0) {
+	Triangulator::GoPartitioned(*controller, true, regions, region_ipts, region_inorms, ipts, inorms, failsafe);
+    } else {
+	triangulator = new Triangulator(*controller);
+	triangulator->SetFlipOutput(true);
+	triangulator->Go(ipts, inorms, failsafe);
+    }
 
-	    if (projector.ProjectPoint(startpoint + size * udir, proj_p, proj_n) != PROJECT_SUCCESS) {
-		cerr<<"initial edge point projection failed"<<endl;
-		allow_outside = false;
-		continue;
-	    }
+    if (cvolume->OutOfCore())
+	cerr << "[TIMING] Brick cache: " << cvolume->BrickLoads() << " brick loads" << endl;
 
-	    ipts.push_back(vector<Point3>());
-	    inorms.push_back(vector<Vector3>());
-	    ipts.back().resize(2);
-	    inorms.back().resize(2);
+    return true;
+}
 
-	    ipts.back()[0]   = startpoint;
-	    inorms.back()[0] = startnorm;
-	    ipts.back()[1]   = proj_p;
-	    inorms.back()[1] = proj_n;
 
-	    success = true;
-	    break;
-	}
+int do_tri_vol(int argc, char* argv[]) {
+    assert(argc>1 && argv[1][0]!='-');
+    real_type isoval = atof(argv[1]);
+    bool bspline=false;
+    if (argc>2 && !stricmp(argv[2], "bspline"))
+	bspline=true;
 
-	if (!success)
-	    cerr<<"couldn't get initial front on connected component!"<<endl;
+    if (!TriangulateIsoValue(isoval, bspline, NULL))
+	exit(0);
+
+    if (bspline)
+	return 3;
+    else
+	return 2;
+}
 
+
+// each level gets outname with the isovalue before its extension, out.m -> out_0.5.m
+static std::string IsoLevelName(const char *name, real_type isoval) {
+    std::string base(name);
+    std::string ext;
+    std::string::size_type dot = base.rfind('.');
+    if (dot != std::string::npos && base.find('/', dot) == std::string::npos) {
+	ext = base.substr(dot);
+	base = base.substr(0, dot);
     }
-    redrawAndWait(' ');
+    char level[64];
+    sprintf(level, "_%g", (double)isoval);
+    return base + level + ext;
+}
 
 
-    triangulator = new Triangulator(*controller);
-    triangulator->SetFlipOutput(true);
-    triangulator->Go(ipts, inorms, failsafe);
+// several isosurfaces of the same volume, one after the other.  the volume, its prefiltered
+// values and its min/max pyramid are shared by all of them
+int do_tri_vol_batch(int argc, char* argv[]) {
+    assert(argc>1 && argv[1][0]!='-');
+
+    vector<real_type> isovals;
+    for (const char *c=argv[1]; *c; ) {
+	char *end;
+	real_type v = (real_type)strtod(c, &end);
+	if (end == c) {
+	    cerr<<"tri_vol_batch wants isovalues separated by commas: "<<argv[1]<<endl;
+	    return 2;
+	}
+	isovals.push_back(v);
+	c = end;
+	if (*c == ',') c++;
+    }
 
+    bool bspline=false;
+    if (argc>2 && !stricmp(argv[2], "bspline"))
+	bspline=true;
+
+    real_type *bvals = (bspline && !cvolume->OutOfCore()) ? cvolume->GetBSplineValues() : NULL;
+
+    // each level's writer gets attached after whatever was already there, and is closed before the next
+    OutputController *last = output_controller_head;
+    while (last && last->child)
+	last = last->child;
+
+    char *batch_outname = outname;
+    for (unsigned i=0; i<isovals.size(); i++) {
+	std::string name = IsoLevelName(batch_outname, isovals[i]);
+	cerr<<"isovalue "<<isovals[i]<<" -> "<<name<<endl;
+	outname = (char*)name.c_str();
+
+	if (!TriangulateIsoValue(isovals[i], bspline, bvals))
+	    cerr<<"nothing to triangulate at isovalue "<<isovals[i]<<endl;
+
+	// nothing may write to the level's file once it's closed
+	if (triangulator) delete triangulator;
+	triangulator = NULL;
+	if (controller) delete controller;
+	controller = NULL;
+
+	OutputController *&link = (last) ? last->child : output_controller_head;
+	OutputController *writer = link;
+	link = NULL;
+	if (writer) {
+	    if (writer->child == gui) writer->child = NULL;	// the gui stays
+	    delete writer;
+	}
+    }
+    outname = batch_outname;
+
+    if (bvals) delete [] bvals;
 
     if (bspline)
 	return 3;
@@ -1110,9 +1264,10 @@ int do_tri_tet(int argc, char* argv[]) {
 
 
     guidance = new TetMeshGuidanceField(*projector, rho, min_step, max_step, reduction);
-    OutputController::AddControllerToBack(output_controller_head, new OutputControllerHHM(outname));
+    OutputController::AddControllerToBack(output_controller_head, NewFileOutputController(outname));
     if (gui)
 	OutputController::AddControllerToBack(output_controller_head, gui);
+    if (sizing_grid) guidance->BuildSizingGrid(sizing_grid);
     controller = new ControllerWrapper(guidance, projector, output_controller_head);
 
 
@@ -1324,22 +1479,20 @@ int do_marchingcubes(int argc, char* argv[]) {
     if (guidance)		delete guidance;		guidance=NULL;
     if (controller)		delete controller;		controller=NULL;
 
-    if (bspline) {
-	real_type *bvals = cvolume->GetBSplineValues();
+    if (bspline && !cvolume->OutOfCore()) {
 	critical_section->enter();
-	volume.SetValues(bvals);
+	volume.PrefilterBSpline();
 	critical_section->leave();
-	delete [] bvals;
     }
 
     bool oldflips = OutputControllerEdgeFlipper::DoFlips;
     OutputControllerEdgeFlipper::DoFlips = false;
 
-    OutputController::AddControllerToBack(output_controller_head, new OutputControllerHHM(outname));
+    OutputController::AddControllerToBack(output_controller_head, NewFileOutputController(outname));
     if (gui)
 	OutputController::AddControllerToBack(output_controller_head, gui);
     controller = new ControllerWrapper(NULL, NULL, output_controller_head);	// for the output
-    MarchingCubes(*cvolume, *controller, isoval);
+    MarchingCubes(*cvolume, *controller, isoval, bspline && cvolume->OutOfCore());
 
     OutputControllerEdgeFlipper::DoFlips = oldflips;
 
@@ -1363,7 +1516,7 @@ int do_marchingtets(int argc, char* argv[]) {
     bool oldflips = OutputControllerEdgeFlipper::DoFlips;
     OutputControllerEdgeFlipper::DoFlips = false;
 
-    OutputController::AddControllerToBack(output_controller_head, new OutputControllerHHM(outname));
+    OutputController::AddControllerToBack(output_controller_head, NewFileOutputController(outname));
     if (gui)
 	OutputController::AddControllerToBack(output_controller_head, gui);
     controller = new ControllerWrapper(NULL, NULL, output_controller_head);	// for the output
@@ -1406,9 +1559,13 @@ int do_tri_smoothmls(int argc, char* argv[]) {
 	cerr << "Saved guidance field." << endl;
     }
 
+    // the halo is only there to get the surface right near the region's faces
+    if (use_point_region)
+	OutputController::AddControllerToBack(output_controller_head, new OutputControllerClip(point_region));
     if (gui)
 	OutputController::AddControllerToBack(output_controller_head, gui);
-    OutputController::AddControllerToBack(output_controller_head, new OutputControllerHHM(outname));
+    OutputController::AddControllerToBack(output_controller_head, NewFileOutputController(outname));
+    if (sizing_grid) guidance->BuildSizingGrid(sizing_grid);
     controller = new ControllerWrapper(guidance, &projector, output_controller_head);
 
 
@@ -1760,6 +1917,55 @@ int do_save_vol(int argc, char* argv[]) {
     return 2;
 }
 
+int do_bench_spline(int argc, char* argv[]) {
+    assert(argc>1 && argv[1][0]!='-');
+    BenchmarkSplineKernel(atoi(argv[1]));
+    return 2;
+}
+
+int do_bench_layout(int argc, char* argv[]) {
+    assert(argc>2 && argv[1][0]!='-' && argv[2][0]!='-');
+    bool bspline = (argc>3 && !stricmp(argv[3], "bspline"));
+    BenchmarkVolumeLayout(volume, atof(argv[1]), bspline, atoi(argv[2]));
+    return (bspline) ? 4 : 3;
+}
+
+int do_profile(int argc, char* argv[]) {
+    assert(argc>1 && argv[1][0]!='-');
+    Profile::WriteAtExit(argv[1]);
+    return 2;
+}
+
+int do_brick_vol(int argc, char* argv[]) {
+    assert(argc>2 && argv[1][0]!='-' && argv[2][0]!='-');
+    RegularVolume conv;
+    if (!conv.ConvertToBricked(argv[1], argv[2]))
+	cerr<<"couldn't convert "<<argv[1]<<" to "<<argv[2]<<endl;
+    return 3;
+}
+
+int do_point_tiles(int argc, char* argv[]) {
+    assert(argc>2 && argv[1][0]!='-' && argv[2][0]!='-');
+    if (!ConvertToPointTiles(argv[1], argv[2], point_sort_mb))
+	cerr<<"couldn't convert "<<argv[1]<<" to "<<argv[2]<<endl;
+    return 3;
+}
+
+int do_point_region(int argc, char* argv[]) {
+    if (argc < 7) {
+	cerr<<"point_region requires 6 parameters"<<endl;
+	return 1;
+    }
+    point_region = Box3(Point3(atof(argv[1]), atof(argv[2]), atof(argv[3])),
+			Point3(atof(argv[4]), atof(argv[5]), atof(argv[6])));
+    use_point_region = true;
+    if (argc > 7 && argv[7][0] != '-') {
+	point_halo = atof(argv[7]);
+	return 8;
+    }
+    return 7;
+}
+
 int do_rho_N(int argc, char* argv[])
 {
     if ((argc < 2) || (argv[1][0] == '-'))
@@ -2094,12 +2300,31 @@ bool read_surface(const char *fname, int i) {
 	    return false;
 	}
 	volume.Read(fname);
+	if (morton_volumes)
+	    volume.SetMortonLayout(true);
     } else if (endswith(fname, ".obj")) {
 	read_obj(fname, points);
     } else if (endswith(fname, ".offt")) {
 	tetmesh.ReadOFF(fname);
     } else if (endswith(fname, ".pc")) {
 	read_pc(fname);
+    } else if (endswith(fname, ".bpts")) {
+	if (!use_point_region) {
+	    if (!ReadPointTiles(fname, points))
+		return false;
+	} else {
+	    // the support radius is radius_factor times a weighted average of the 8th nearest
+	    // neighbor distances.  twice that covers the mls neighborhoods at the box faces, and
+	    // the vertices of the triangles that straddle them
+	    real_type halo = point_halo;
+	    if (halo < 0)
+		halo = 2 * radius_factor * PointTileSpacing(fname, point_region, 8);
+	    Box3 grown(Point3(point_region.min_point()[0]-halo, point_region.min_point()[1]-halo, point_region.min_point()[2]-halo),
+		       Point3(point_region.max_point()[0]+halo, point_region.max_point()[1]+halo, point_region.max_point()[2]+halo));
+	    cerr<<"loading the region with a halo of "<<halo<<endl;
+	    if (!ReadPointTiles(fname, points, &grown))
+		return false;
+	}
     } else {
 	cerr<<"unknown file type: "<<fname<<endl;
 	return false;
@@ -2180,6 +2405,7 @@ int main(int argc, char* argv[]) {
     CL_ADD_FUN(cl,save_mesh1,         "name : save mesh[1] to a file");
     CL_ADD_FUN(cl,save_pts,           "name : save pointset to a file");
     CL_ADD_FUN(cl,save_vol,           "name : save volume to a file");
+    CL_ADD_FUN(cl,brick_vol,          "src dst.bvol : convert a volume to the bricked format a slab at a time, for volumes larger than memory");
     CL_ADD_VAR(cl,rho,                ": angle subtended on the osculating sphere");
     CL_ADD_FUN(cl,rho_N,              "N: # of edges that a circle is divided to");
     CL_ADD_VAR(cl,draw_messages,      ": draw the debug messages on the sceen?  good for screenshots");
@@ -2188,13 +2414,14 @@ int main(int argc, char* argv[]) {
 
     CL_ADD_VAR(cl,sharp,             "ang : cosine of angle between triangle normals for edge to be considered sharp feature (default, -1 - no sharp features are handled)");
     CL_ADD_VAR(cl,small_crease,       "edge_count : creases with less than <edge_count> edges will be discarded (default 20)");
-    CL_ADD_VAR(cl,outname,            ": the file to output the mesh to");
+    CL_ADD_VAR(cl,outname,            ": the file to output the mesh to (.m, .obj, or binary streaming .smb)");
     CL_ADD_VAR(cl,save_field,         ": name of the file to write the guidance field to");
     CL_ADD_VAR(cl,load_field,         ": name of the file to load the guidance field from");
     CL_ADD_VAR(cl,min_step,           ": minimum edge length allowed");
     CL_ADD_VAR(cl,max_step,           ": maximum edge length allowed");
     CL_ADD_VAR(cl,reduction,          ": percent reduction allowed in a single step");
     CL_ADD_VAR(cl,radius_factor,      ": set radius factor for mls triangulation");
+    CL_ADD_VAR(cl,mls_frame_reuse,    "f : start an mls plane fit from the thread's last one when the point moved less than f times the support radius, 0 for never");
     CL_ADD_VAR(cl,csg_guidance_blend, ": blend guidance field into existing edge lengths");
     CL_ADD_VAR(cl,failsafe,           ": close any holes that failed to be triangulated");
     CL_ADD_VAR(cl,adamson,            ": use adamson projection instead of standard mls - 0=standard mls, 1=adamson with weighted ave of normals, 2=adamson with covariance normals from weighted average, 3=adamson with covariance normals from point");
@@ -2204,6 +2431,7 @@ int main(int argc, char* argv[]) {
     CL_ADD_FUN(cl,tri_mesh,           "subdiv : triangulate the mesh, applying subdiv iterations of loop subdivision before computing curvature");
     CL_ADD_FUN(cl,tri_smoothmls,      ".obj: triangulate a smooth mls surface");
     CL_ADD_FUN(cl,tri_vol,            "isovalue <bspline>: triangulate an isosurface from the volume");
+    CL_ADD_FUN(cl,tri_vol_batch,      "iso1,iso2,... <bspline>: triangulate several isosurfaces from the volume, one file each, named from outname");
     CL_ADD_FUN(cl,tri_tet,            "isovalue: triangulate an isosurface from the tet mesh");
     CL_ADD_FUN(cl,marchingcubes,      "isovalue: extract an isosurface from the regular volume");
     CL_ADD_FUN(cl,marchingtets,       "isovalue: extract an isosurface from the tet volume");
@@ -2212,6 +2440,8 @@ int main(int argc, char* argv[]) {
     CL_ADD_VAR(cl,trim_guidance,      ": trim the guindance field or use the full point set");
     CL_ADD_VAR(cl,trim_bin_size,      ": when to stop subdivision for guidance field trimming");
     CL_ADD_VAR(cl,proj_tol,           ": the termination condition for newton stepping onto isosurfaces");
+    CL_ADD_VAR(cl,sizing_grid,        "n : answer max step queries from an octree with up to n guidance points per leaf (0 disables, 32 is reasonable)");
+    CL_ADD_VAR(cl,guidance_cache,     "dir : keep built guidance fields in dir and reuse them when the input and parameters match");
     CL_ADD_VAR(cl,grid_intersect_overestimate,           ": how many neighboring cells to check for intersection when building guidance field");
     CL_ADD_VAR(cl,bad_connect_priority, ": if the triangle priority (circumradius/inradius) is < this, don't consider that triangle");
     CL_ADD_VAR(cl,boundary_dist,      ": boundary detection parameter for triangle soups - 0 disables (uses topological boundaries), I recommend -0.2.  Negative is relative, positive is absolute");
@@ -2231,6 +2461,17 @@ int main(int argc, char* argv[]) {
 
 
     CL_ADD_VAR(cl,idealNumThreads,    "num : set the ideal number of execution threads");
+    CL_ADD_VAR(cl,projection_lookahead, "num : speculatively project the best num grow edges ahead of the front (0 disables)");
+    CL_ADD_FUN(cl,bench_spline,       "n : time n tricubic value+gradient+hessian evaluations, fused kernel vs sparse coefficients");
+    CL_ADD_FUN(cl,profile,            "file.json : write the pipeline counters and phase timers to file.json on exit");
+    CL_ADD_VAR(cl,brick_cache_mb,     "mb : how much of a bricked volume to keep mapped at once");
+    CL_ADD_VAR(cl,map_volumes,        ": map uncompressed volumes in place in their own sample type instead of converting them to floats");
+    CL_ADD_VAR(cl,morton_volumes,     ": store volumes read after this in morton order within 32^3 tiles, for fewer cache misses when projecting");
+    CL_ADD_FUN(cl,bench_layout,       "iso n [bspline] : project n points onto the loaded volume's isosurface with row major and morton sample layouts");
+    CL_ADD_FUN(cl,point_tiles,        "src dst.bpts : sort a .obj or .pc point cloud into spatially sorted binary chunks, without holding it all in memory");
+    CL_ADD_VAR(cl,point_sort_mb,      "mb : how much of a point cloud point_tiles sorts in memory at once");
+    CL_ADD_FUN(cl,point_region,       "x0 y0 z0 x1 y1 z1 <halo> : only triangulate the part of a .bpts file inside this box, loading the points within halo of it too (estimated from the point spacing if not given)");
+    CL_ADD_VAR(cl,partition_cells,    "num : tri_vol splits the volume into num^3 regions that are triangulated in parallel, then stitched (0 disables)");
 
 
     if (argc < 2) {
@@ -2261,6 +2502,15 @@ int main(int argc, char* argv[]) {
     }
 
 
+    // the input is read before the commands run, but a .bpts file needs the region and the radius
+    // factor to know which points to load
+    for (int i=toskip; i<argc; i++) {
+	if (stricmp(argv[i], "-point_region")==0)
+	    do_point_region(argc-i, argv+i);
+	else if (stricmp(argv[i], "-radius_factor")==0 && i+1<argc)
+	    radius_factor = atof(argv[i+1]);
+    }
+
     critical_section->enter();
 
     if (argc>toskip && argv[toskip][0] != '-')
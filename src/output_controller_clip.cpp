@@ -0,0 +1,53 @@
+#include "common.h"
+#include "output_controller_clip.h"
+
+bool OutputControllerClip::Inside(const Point3 &p) const
+{
+    for (int i=0; i<3; i++) {
+	if (p[i] < box.min_point()[i] || p[i] >= box.max_point()[i])
+	    return false;
+    }
+    return true;
+}
+
+void OutputControllerClip::AddVertex(int index, const Point3 &p, const Vector3 &n, bool boundary)
+{
+    // hold on to it until we know whether a triangle inside wants it
+    if (index >= (int)verts.size())
+	verts.resize(index+1);
+    verts[index].p = p;
+    verts[index].n = n;
+    verts[index].boundary = boundary;
+    verts[index].out = -1;
+}
+
+void OutputControllerClip::AddTriangle(int index, int v1, int v2, int v3)
+{
+    int vi[3] = { v1, v2, v3 };
+    Point3 c((verts[v1].p[0] + verts[v2].p[0] + verts[v3].p[0]) / 3,
+	     (verts[v1].p[1] + verts[v2].p[1] + verts[v3].p[1]) / 3,
+	     (verts[v1].p[2] + verts[v2].p[2] + verts[v3].p[2]) / 3);
+    if (!Inside(c))
+	return;
+
+    for (int i=0; i<3; i++) {
+	PendingVertex &v = verts[vi[i]];
+	if (v.out < 0) {
+	    v.out = nextVertex++;
+	    if (child)
+		child->AddVertex(v.out, v.p, v.n, v.boundary);
+	}
+	vi[i] = v.out;
+    }
+
+    if (child)
+	child->AddTriangle(nextTriangle++, vi[0], vi[1], vi[2]);
+}
+
+void OutputControllerClip::Finish()
+{
+    verts.clear();
+    nextVertex = 0;
+    nextTriangle = 0;
+    if (child) child->Finish();
+}
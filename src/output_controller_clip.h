@@ -0,0 +1,35 @@
+#ifndef __OUTPUT_CONTROLLER_CLIP_H
+#define __OUTPUT_CONTROLLER_CLIP_H
+
+#include "triangulator.h"
+#include <vector>
+
+// passes on only the triangles whose centroid is in a box, with the vertices they use numbered
+// again from 0.  the box is half open, so regions that share a face never both keep a triangle
+class OutputControllerClip : public OutputController
+{
+public:
+    OutputControllerClip(const Box3 &_box) : box(_box), nextVertex(0), nextTriangle(0) {};
+    virtual ~OutputControllerClip() {};
+    virtual void AddVertex(int index, const Point3 &p, const Vector3 &n, bool boundary);
+    virtual void AddTriangle(int index, int v1, int v2, int v3);
+    virtual void Finish();
+
+protected:
+    class PendingVertex {
+	public:
+	Point3 p;
+	Vector3 n;
+	bool boundary;
+	int out;		// index it was passed on as, -1 until a triangle uses it
+    };
+
+    bool Inside(const Point3 &p) const;
+
+    Box3 box;
+    std::vector<PendingVertex> verts;
+    int nextVertex;
+    int nextTriangle;
+};
+
+#endif
@@ -9,7 +9,7 @@ void OutputControllerHHM::AddVertex(int index, const Point3 &p, const Vector3 &n
 		if (vkey)
 			(*fout) <<" "<<vkey;
 
-		(*fout)<<endl;
+		(*fout)<<'\n';
     }
 
     if (child)
@@ -23,7 +23,7 @@ void OutputControllerHHM::AddTriangle(int index, int v1, int v2, int v3)
 	cerr<<"bogus triangle"<<endl;
     if (fout) {
 	// 0 index not allowed? increase all indiced by 1 for .m files
-	(*fout) << "Face  "<<(index+1)<<" "<<(v1+1)<<" "<<(v2+1)<<" "<<(v3+1)<<endl;
+	(*fout) << "Face  "<<(index+1)<<" "<<(v1+1)<<" "<<(v2+1)<<" "<<(v3+1)<<'\n';
     }
 
     if (child)
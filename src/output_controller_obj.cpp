@@ -5,8 +5,8 @@ void OutputControllerOBJ::AddVertex(int index, const Point3 &p, const Vector3 &n
 {
     if (fout) {
 	// 0 index not allowed? increase all indiced by 1 for .m files
-	(*fout) << "v "<<p[0]<<" "<<p[1]<<" "<<p[2]<<endl;
-	(*fout) << "vn "<<n[0]<<" "<<n[1]<<" "<<n[2]<<endl;
+	(*fout) << "v "<<p[0]<<" "<<p[1]<<" "<<p[2]<<'\n';
+	(*fout) << "vn "<<n[0]<<" "<<n[1]<<" "<<n[2]<<'\n';
     }
 
     if (child)
@@ -17,7 +17,7 @@ void OutputControllerOBJ::AddTriangle(int index, int v1, int v2, int v3)
 {
     if (fout) {
 	// 0 index not allowed? increase all indiced by 1 for .m files
-	(*fout) << "f "<<v1<<" "<<v2<<" "<<v3<<endl;
+	(*fout) << "f "<<v1<<" "<<v2<<" "<<v3<<'\n';
     }
 
     if (child)
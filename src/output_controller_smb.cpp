@@ -0,0 +1,166 @@
+#include "common.h"
+#include "output_controller_smb.h"
+
+
+StreamFileWriter::StreamFileWriter(const char *filename, int bufsize) :
+    capacity(bufsize), fill(0), pending(false), quit(false), thread(NULL) {
+
+    f = (filename) ? fopen(filename, "wb") : NULL;
+    if (!f) {
+	if (filename) cerr<<"couldn't open "<<filename<<" for writing"<<endl;
+	return;
+    }
+
+    bufs[0].reserve(capacity);
+    bufs[1].reserve(capacity);
+    thread = new thlib::Thread(WriterThreadMain, this, 0);
+}
+
+
+// hand the full buffer to the writer thread and start filling the other one
+void StreamFileWriter::Submit() {
+    if (!f) {
+	bufs[fill].clear();
+	return;
+    }
+
+    cond.enter();
+    while (pending)
+	cond.wait();
+    fill = 1-fill;
+    bufs[fill].clear();
+    pending = true;
+    cond.broadcast();
+    cond.leave();
+}
+
+
+void* StreamFileWriter::WriterThreadMain(void *arg) {
+
+    StreamFileWriter *w = (StreamFileWriter*)arg;
+
+    while (1) {
+	w->cond.enter();
+	while (!w->pending && !w->quit)
+	    w->cond.wait();
+	if (!w->pending) {
+	    w->cond.leave();
+	    break;
+	}
+	const vector<char> &buf = w->bufs[1-w->fill];
+	w->cond.leave();
+
+	if (buf.size() && fwrite(&buf[0], 1, buf.size(), w->f) != buf.size())
+	    cerr<<"error writing mesh"<<endl;
+
+	w->cond.enter();
+	w->pending = false;
+	w->cond.broadcast();
+	w->cond.leave();
+    }
+
+    return NULL;
+}
+
+
+void StreamFileWriter::Close() {
+    if (!f) return;
+
+    Submit();
+
+    cond.enter();
+    quit = true;
+    cond.broadcast();
+    cond.leave();
+
+    int *ret;
+    thread->join((void**)&ret);
+    delete thread;  thread=NULL;
+
+    fclose(f);
+    f = NULL;
+}
+
+
+
+OutputControllerSMB::OutputControllerSMB(const char *filename) :
+    nverts(0), ntris(0) {
+    writer = new StreamFileWriter(filename);
+    writer->Write("AFSMB01\n", 8);
+}
+
+
+void OutputControllerSMB::AddVertex(int index, const Point3 &p, const Vector3 &n, bool boundary)
+{
+    char tag = 'v';
+    float xyz[3] = { (float)p[0], (float)p[1], (float)p[2] };
+    writer->Write(&tag, 1);
+    writer->Write(&index, sizeof(int));
+    writer->Write(xyz, sizeof(xyz));
+    nverts++;
+
+    ActiveVertex &av = active[index];
+    av.boundary = boundary;
+    av.ntris = 0;
+
+    if (child)
+	child->AddVertex(index, p, n, boundary);
+}
+
+
+void OutputControllerSMB::AddTriangle(int index, int v1, int v2, int v3)
+{
+    char tag = 'f';
+    int vi[3] = { v1, v2, v3 };
+    writer->Write(&tag, 1);
+    writer->Write(vi, sizeof(vi));
+    ntris++;
+
+    Touch(v1, v2, v3);
+    Touch(v2, v3, v1);
+    Touch(v3, v1, v2);
+
+    if (child)
+	child->AddTriangle(index, v1, v2, v3);
+}
+
+
+// count the new triangle around v, and finalize it if that closes its fan
+void OutputControllerSMB::Touch(int v, int o1, int o2) {
+    std::map<int,ActiveVertex>::iterator ai = active.find(v);
+    if (ai == active.end()) return;
+
+    ActiveVertex &av = ai->second;
+    av.ntris++;
+    if (std::find(av.nbrs.begin(), av.nbrs.end(), o1) == av.nbrs.end())	av.nbrs.push_back(o1);
+    if (std::find(av.nbrs.begin(), av.nbrs.end(), o2) == av.nbrs.end())	av.nbrs.push_back(o2);
+
+    if (!av.boundary && av.ntris == (int)av.nbrs.size()) {
+	active.erase(ai);
+	FinalizeVertex(v);
+    }
+}
+
+
+void OutputControllerSMB::FinalizeVertex(int v) {
+    char tag = 'x';
+    writer->Write(&tag, 1);
+    writer->Write(&v, sizeof(int));
+}
+
+
+void OutputControllerSMB::Finish()
+{
+    // whatever is left is on the boundary or an unfinished front
+    for (std::map<int,ActiveVertex>::iterator ai=active.begin(); ai!=active.end(); ++ai)
+	FinalizeVertex(ai->first);
+    active.clear();
+
+    char tag = 'e';
+    writer->Write(&tag, 1);
+    writer->Write(&nverts, sizeof(int));
+    writer->Write(&ntris, sizeof(int));
+    writer->Close();
+
+    if (child) child->Finish();
+}
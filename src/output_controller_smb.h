@@ -0,0 +1,83 @@
+#ifndef __OUTPUT_CONTROLLER_SMB_H
+#define __OUTPUT_CONTROLLER_SMB_H
+
+#include "triangulator.h"
+#include <map>
+#include <algorithm>
+#include <stdio.h>
+
+
+// double buffered file writer - one buffer fills up while a thread writes the other one out
+class StreamFileWriter
+{
+public:
+    StreamFileWriter(const char *filename, int bufsize=1<<20);
+    ~StreamFileWriter() { Close(); }
+
+    bool IsOpen() const { return f!=NULL; }
+
+    void Write(const void *data, int size) {
+	if ((int)bufs[fill].size() + size > capacity)
+	    Submit();
+	const char *c = (const char*)data;
+	bufs[fill].insert(bufs[fill].end(), c, c+size);
+    }
+
+    void Close();
+
+protected:
+    void Submit();
+    static void* WriterThreadMain(void *arg);
+
+    FILE *f;
+    int capacity;
+    vector<char> bufs[2];
+    int fill;			// the buffer being filled, the other one belongs to the writer thread while pending
+
+    thlib::Condition cond;
+    bool pending;
+    bool quit;
+    thlib::Thread *thread;
+};
+
+
+
+// binary streaming mesh output, in the spirit of the SMA/SMB streaming meshes: vertices,
+// triangles and vertex finalizations interleaved in the order they're created.  a vertex is
+// finalized once the triangles around it close up (like the edge flipper's OnFront test), or
+// at the end for boundary vertices.
+//
+// every record is a one byte tag followed by native-endian 32-bit fields:
+//   'v' index x y z	(int, 3 floats)
+//   'f' v1 v2 v3	(ints)
+//   'x' index		(no triangle after this uses the vertex)
+//   'e' nverts ntris	(end of stream)
+// after an 8 byte header "AFSMB01\n".
+class OutputControllerSMB : public OutputController
+{
+public:
+    OutputControllerSMB(const char *filename);
+    virtual ~OutputControllerSMB() { delete writer; };
+    virtual void AddVertex(int index, const Point3 &p, const Vector3 &n, bool boundary);
+    virtual void AddTriangle(int index, int v1, int v2, int v3);
+    virtual void Finish();
+
+protected:
+
+    class ActiveVertex {
+	public:
+	bool boundary;
+	int ntris;
+	vector<int> nbrs;
+    };
+
+    void Touch(int v, int o1, int o2);
+    void FinalizeVertex(int v);
+
+    StreamFileWriter *writer;
+    std::map<int,ActiveVertex> active;
+    int nverts;
+    int ntris;
+};
+
+#endif
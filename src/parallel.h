@@ -2,6 +2,9 @@
 #ifndef AFRONT_PARALLEL_H
 #define AFRONT_PARALLEL_H
 
+#include "task_pool.h"
+#include <algorithm>
+
 
 /*
 some examples
@@ -30,6 +33,18 @@ int bi=0;
 char *s="";
 ParallelExecutor(idealNumThreads, pe2, bi, s);
 
+-------------
+// to hand out a range in chunks to whichever thread is free, for uneven work
+
+void pf(int begin, int end, vector<float> &v) {
+  for (int i=begin; i<end; i++) ...
+}
+
+ParallelFor(0, n, 16, pf, v);
+
+
+Both run on the persistent TaskPool, so no threads get created per call, and either one can be
+called from inside another - a waiting thread runs other tasks until its own are done.
 
 
 // To add more versions for more parameters to your functions, you have to define the appropriate macro's below,
@@ -171,41 +186,20 @@ class ParallelExecutorParameters0 {
 	};
 
 
-// functions of type void* f(void*) - these are the threadmain's
+// functions of type void f(void*) - these are the pool tasks
 #define PE_STUB(np)							\
     template <typename Functor PE_TEMPLATE_ADD_DEF##np>			\
-	void* ParallelExecutorStub##np(void *arg) {			\
+	void ParallelExecutorStub##np(void *arg) {			\
 	ParallelExecutorClassBase<Functor> *pec = (ParallelExecutorClassBase<Functor>*)arg; \
 	ParallelExecutorParameters##np PE_TEMPLATE_CALL##np *params = (ParallelExecutorParameters##np PE_TEMPLATE_CALL##np*)pec->params; \
 	pec->f(pec->numThreads, pec->id PE_PARAMETER_ADD_CALL##np(params->p)); \
-	return 0;							\
     }
 
 
-
-
-// make sure you don't try to recursively call in parallel - I've already made this mistake once!
-inline void ParallelExecutorCheck(bool start) {
-  static int count = 0;
-  static thlib::CSObject cs;
-
-  cs.enter();
-  if (start) {
-    if (count > 0)
-      cerr<<"starting parallel executor recursively?!?!"<<endl;
-    count++;
-  } else {
-    count--;
-  }
-  cs.leave();
-}
-
-
-// the real work - create the set of threads, have them run, then join them back together
+// the real work - hand the ids to the pool, run the last one here, then help out until they're done
 #define PARALLEL_EXECUTOR(np)						\
     template <typename Functor PE_TEMPLATE_ADD_DEF##np>				\
 	void ParallelExecutor(const int reqThreads, Functor f PE_PARAMETER_ADD_DEF##np(T,&p)) { \
-	ParallelExecutorCheck(true);					\
 	ParallelExecutorParameters##np PE_TEMPLATE_CALL##np params PE_PARAMETER_CONSTRUCT##np(p); \
 	vector< ParallelExecutorClassBase<Functor> > pec(reqThreads);	\
 	for (int i=0; i<reqThreads; i++) {				\
@@ -214,17 +208,65 @@ inline void ParallelExecutorCheck(bool start) {
 	    pec[i].f = f;						\
 	    pec[i].params = &params;					\
 	}								\
-	vector<thlib::Thread *> threads(reqThreads-1);			\
+	TaskPool &pool = TaskPool::Get();				\
+	TaskGroup group;						\
 	for (int i=0; i<reqThreads-1; i++) {				\
-	    threads[i] = new thlib::Thread(&ParallelExecutorStub##np<Functor PE_TEMPLATE_ADD_CALL##np>, (void*)&pec[i], 0); \
+	    pool.Spawn(group, &ParallelExecutorStub##np<Functor PE_TEMPLATE_ADD_CALL##np>, (void*)&pec[i]); \
 	}								\
 	ParallelExecutorStub##np<Functor PE_TEMPLATE_ADD_CALL##np>(&pec[reqThreads-1]); \
-	for (int i=0; i<reqThreads-1; i++) {				\
-	    int *status;						\
-	    threads[i]->join((void**)&status);				\
-	    delete threads[i];						\
+	pool.Wait(group);						\
+    }
+
+
+
+// the range being handed out by ParallelFor
+template <typename Functor>
+class ParallelForClassBase {
+ public:
+  thlib::CSObject cs;
+  int next;
+  int last;
+  int grain;
+
+  Functor f;
+  void *params;
+};
+
+#define PF_STUB(np)							\
+    template <typename Functor PE_TEMPLATE_ADD_DEF##np>			\
+	void ParallelForStub##np(void *arg) {				\
+	ParallelForClassBase<Functor> *pfc = (ParallelForClassBase<Functor>*)arg; \
+	ParallelExecutorParameters##np PE_TEMPLATE_CALL##np *params = (ParallelExecutorParameters##np PE_TEMPLATE_CALL##np*)pfc->params; \
+	while (1) {							\
+	    pfc->cs.enter();						\
+	    int begin = pfc->next;					\
+	    int end = std::min(begin + pfc->grain, pfc->last);		\
+	    pfc->next = end;						\
+	    pfc->cs.leave();						\
+	    if (begin >= end) break;					\
+	    pfc->f(begin, end PE_PARAMETER_ADD_CALL##np(params->p));	\
+	}								\
+    }
+
+// f(begin, end, params...) for chunks of [first,last) with grain items each, until there are none left
+#define PARALLEL_FOR(np)						\
+    template <typename Functor PE_TEMPLATE_ADD_DEF##np>				\
+	void ParallelFor(int first, int last, int grain, Functor f PE_PARAMETER_ADD_DEF##np(T,&p)) { \
+	ParallelExecutorParameters##np PE_TEMPLATE_CALL##np params PE_PARAMETER_CONSTRUCT##np(p); \
+	ParallelForClassBase<Functor> pfc;				\
+	pfc.next = first;						\
+	pfc.last = last;						\
+	pfc.grain = std::max(grain, 1);					\
+	pfc.f = f;							\
+	pfc.params = &params;						\
+	TaskPool &pool = TaskPool::Get();				\
+	int nt = std::min(pool.NumThreads(), (last-first+pfc.grain-1) / pfc.grain); \
+	TaskGroup group;						\
+	for (int i=0; i<nt-1; i++) {					\
+	    pool.Spawn(group, &ParallelForStub##np<Functor PE_TEMPLATE_ADD_CALL##np>, (void*)&pfc); \
 	}								\
-	ParallelExecutorCheck(false);					\
+	ParallelForStub##np<Functor PE_TEMPLATE_ADD_CALL##np>(&pfc);	\
+	pool.Wait(group);						\
     }
 
 
@@ -250,6 +292,20 @@ PARALLEL_EXECUTOR(3)
 PARALLEL_EXECUTOR(4)
 PARALLEL_EXECUTOR(5)
 
+PF_STUB(0)
+PF_STUB(1)
+PF_STUB(2)
+PF_STUB(3)
+PF_STUB(4)
+PF_STUB(5)
+
+PARALLEL_FOR(0)
+PARALLEL_FOR(1)
+PARALLEL_FOR(2)
+PARALLEL_FOR(3)
+PARALLEL_FOR(4)
+PARALLEL_FOR(5)
+
 
 
 
@@ -0,0 +1,560 @@
+#include "common.h"
+#include "point_tiles.h"
+#include "profile.h"
+#include <stdio.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool endswith(const char *s, const char *end);
+
+static const char point_tile_magic[8] = { 'A','F','B','P','T','S','1','\n' };
+static const int point_tile_version = 1;
+
+// points in a chunk, and where the points start - the chunk table sits between the two
+static const int point_tile_chunk_points = 65536;
+static const size_t point_tile_align = 4096;
+
+// everything is native-endian
+class PointTileHeader {
+    public:
+    char magic[8];
+    int version;
+    int has_normals;
+    long long npoints;
+    int nchunks;
+    int chunk_points;
+    double bbox[6];
+};
+
+
+static size_t PointTileDataOffset(int nchunks) {
+    size_t o = sizeof(PointTileHeader) + sizeof(PointTileChunk)*(size_t)nchunks;
+    return (o + point_tile_align-1) & ~(point_tile_align-1);
+}
+
+
+
+// a point cloud read one point at a time, so it never has to fit in memory
+class PointTileSource {
+    public:
+    PointTileSource() : f(NULL), fn(NULL), normals(false), remaining(-1) { }
+    ~PointTileSource() { Close(); }
+
+    bool Open(const char *fname, bool want_normals) {
+	Close();
+	f = fopen(fname, "r");
+	if (!f) return false;
+
+	if (endswith(fname, ".pc")) {
+	    // a tag line, then comments around the point count
+	    char line[1000];
+	    if (!fgets(line, sizeof(line), f) || strncmp(line, "PC file", 7)) {
+		cerr<<"missing PC tag: "<<fname<<endl;
+		Close();
+		return false;
+	    }
+	    remaining = 0;
+	    while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') continue;
+		remaining = atoll(line);
+		break;
+	    }
+	} else if (want_normals) {
+	    // vn lines don't have to be next to their v, so they get their own cursor
+	    fn = fopen(fname, "r");
+	    normals = true;
+	}
+	return true;
+    }
+
+    void Close() {
+	if (f) fclose(f);
+	if (fn) fclose(fn);
+	f = fn = NULL;
+	normals = false;
+	remaining = -1;
+    }
+
+    bool Next(float p[3], float n[3]) {
+	char line[1000];
+
+	if (remaining >= 0) {
+	    while (remaining > 0 && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') continue;
+		remaining--;
+		double x,y,z;
+		if (sscanf(line, "%lf %lf %lf", &x, &y, &z) != 3) continue;
+		p[0]=(float)x;  p[1]=(float)y;  p[2]=(float)z;
+		n[0] = n[1] = n[2] = 0;
+		return true;
+	    }
+	    return false;
+	}
+
+	if (!NextObj(f, "v ", p)) return false;
+	if (!normals || !NextObj(fn, "vn ", n))
+	    n[0] = n[1] = n[2] = 0;
+	return true;
+    }
+
+    // for counting the normals in the first pass
+    bool NextNormal(float n[3]) {
+	return remaining < 0 && NextObj(f, "vn ", n);
+    }
+
+    private:
+    static bool NextObj(FILE *file, const char *tag, float v[3]) {
+	char line[1000];
+	int len = strlen(tag);
+	while (fgets(line, sizeof(line), file)) {
+	    if (strncmp(line, tag, len)) continue;
+	    double x,y,z;
+	    sscanf(line+len-1, "%lf %lf %lf", &x, &y, &z);
+	    v[0]=(float)x;  v[1]=(float)y;  v[2]=(float)z;
+	    return true;
+	}
+	return false;
+    }
+
+    FILE *f;
+    FILE *fn;
+    bool normals;
+    long long remaining;	// points left in a .pc file, -1 for .obj
+};
+
+
+
+// a point as it goes through the sort
+class PointTileRecord {
+    public:
+    unsigned long long code;
+    long long order;		// input position, so equal codes keep their order
+    float p[3];
+    float n[3];
+
+    bool operator<(const PointTileRecord &r) const {
+	return (code < r.code || (code == r.code && order < r.order));
+    }
+};
+
+
+// 21 bits from each axis, interleaved
+static unsigned long long MortonSpread(unsigned long long x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffffULL;
+    x = (x | (x << 16)) & 0x001f0000ff0000ffULL;
+    x = (x | (x <<  8)) & 0x100f00f00f00f00fULL;
+    x = (x | (x <<  4)) & 0x10c30c30c30c30c3ULL;
+    x = (x | (x <<  2)) & 0x1249249249249249ULL;
+    return x;
+}
+
+static unsigned long long MortonCode(const float p[3], const double bbox[6]) {
+    unsigned long long code = 0;
+    for (int i=0; i<3; i++) {
+	double ext = bbox[3+i] - bbox[i];
+	double t = (ext > 0) ? (p[i] - bbox[i]) / ext : 0;
+	t = std::max(0.0, std::min(1.0, t));
+	code |= MortonSpread((unsigned long long)(t * 0x1fffff)) << i;
+    }
+    return code;
+}
+
+
+
+// appends sorted points to the data part of the file, keeping track of the chunks
+class PointTileWriter {
+    public:
+    PointTileWriter(FILE *_f, bool _normals) : f(_f), normals(_normals), written(0), ok(true) { }
+
+    void Add(const PointTileRecord &r) {
+	if (written % point_tile_chunk_points == 0) {
+	    PointTileChunk c;
+	    memset(&c, 0, sizeof(c));
+	    for (int i=0; i<3; i++) {
+		c.bbox[i] = c.bbox[3+i] = r.p[i];
+	    }
+	    c.first = written;
+	    chunks.push_back(c);
+	}
+
+	PointTileChunk &c = chunks.back();
+	for (int i=0; i<3; i++) {
+	    c.bbox[i] = std::min(c.bbox[i], r.p[i]);
+	    c.bbox[3+i] = std::max(c.bbox[3+i], r.p[i]);
+	}
+	c.count++;
+
+	ok = ok && (fwrite(r.p, sizeof(float), 3, f) == 3);
+	if (normals)
+	    ok = ok && (fwrite(r.n, sizeof(float), 3, f) == 3);
+	written++;
+    }
+
+    FILE *f;
+    bool normals;
+    long long written;
+    bool ok;
+    std::vector<PointTileChunk> chunks;
+};
+
+
+// a sorted run on disk, read back a block at a time for the merge
+class PointTileRun {
+    public:
+    PointTileRun() : f(NULL), pos(0) { }
+
+    bool Fill() {
+	buf.resize(4096);
+	buf.resize(fread(&buf[0], sizeof(PointTileRecord), buf.size(), f));
+	pos = 0;
+	return !buf.empty();
+    }
+
+    const PointTileRecord& Top() const { return buf[pos]; }
+
+    bool Pop() {
+	return (++pos < buf.size() || Fill());
+    }
+
+    FILE *f;
+    std::vector<PointTileRecord> buf;
+    size_t pos;
+};
+
+class PointTileRunGreater {
+    public:
+    bool operator()(const PointTileRun *a, const PointTileRun *b) const {
+	return b->Top() < a->Top();
+    }
+};
+
+
+
+bool ConvertToPointTiles(const char *src, const char *dst, int sort_mb) {
+
+    double t_start = Profile::Now();
+
+    // first pass for the bounding box the codes are quantized to, and whether there are normals
+    PointTileSource in;
+    if (!in.Open(src, false)) {
+	cerr<<"couldn't open file "<<src<<endl;
+	return false;
+    }
+
+    PointTileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, point_tile_magic, sizeof(h.magic));
+    h.version = point_tile_version;
+    h.chunk_points = point_tile_chunk_points;
+    for (int i=0; i<3; i++) {
+	h.bbox[i] = 1e34;
+	h.bbox[3+i] = -1e34;
+    }
+
+    float p[3], n[3];
+    while (in.Next(p, n)) {
+	for (int i=0; i<3; i++) {
+	    h.bbox[i] = std::min(h.bbox[i], (double)p[i]);
+	    h.bbox[3+i] = std::max(h.bbox[3+i], (double)p[i]);
+	}
+	h.npoints++;
+    }
+
+    long long nnormals = 0;
+    if (in.Open(src, false)) {
+	while (in.NextNormal(n))
+	    nnormals++;
+    }
+    h.has_normals = (h.npoints > 0 && nnormals == h.npoints);
+    h.nchunks = (int)((h.npoints + point_tile_chunk_points-1) / point_tile_chunk_points);
+
+    if (h.npoints == 0) {
+	cerr<<"no points in "<<src<<endl;
+	return false;
+    }
+
+
+    // second pass sorts as much as fits into runs
+    if (!in.Open(src, h.has_normals)) {
+	cerr<<"couldn't open file "<<src<<endl;
+	return false;
+    }
+
+    size_t run_points = std::max((size_t)sort_mb * 1024*1024 / sizeof(PointTileRecord), (size_t)point_tile_chunk_points);
+    std::vector<PointTileRecord> buf;
+    std::vector<std::string> runnames;
+    bool ok = true;
+
+    long long order = 0;
+    while (ok) {
+	buf.clear();
+	PointTileRecord r;
+	while (buf.size() < run_points && in.Next(r.p, r.n)) {
+	    r.code = MortonCode(r.p, h.bbox);
+	    r.order = order++;
+	    buf.push_back(r);
+	}
+	if (buf.empty()) break;
+	std::sort(buf.begin(), buf.end());
+
+	// everything fit, so it goes straight to the output
+	if (runnames.empty() && order == h.npoints) break;
+
+	char suffix[32];
+	sprintf(suffix, ".run%d", (int)runnames.size());
+	runnames.push_back(std::string(dst) + suffix);
+	FILE *rf = fopen(runnames.back().c_str(), "wb");
+	ok = (rf && fwrite(&buf[0], sizeof(PointTileRecord), buf.size(), rf) == buf.size());
+	if (rf) ok = (fclose(rf) == 0) && ok;
+	if (!ok) cerr<<"couldn't write "<<runnames.back()<<endl;
+    }
+    in.Close();
+
+
+    // then the runs get merged into the chunks
+    std::string tmpname = std::string(dst) + ".tmp";
+    FILE *f = ok ? fopen(tmpname.c_str(), "wb") : NULL;
+    if (ok && !f) {
+	cerr<<"couldn't open "<<tmpname<<" for writing"<<endl;
+	ok = false;
+    }
+
+    if (ok) {
+	// the chunk table isn't known until the end
+	std::vector<char> zeros(PointTileDataOffset(h.nchunks), 0);
+	ok = (fwrite(&zeros[0], 1, zeros.size(), f) == zeros.size());
+    }
+
+    PointTileWriter out(f, h.has_normals != 0);
+    if (ok && runnames.empty()) {
+	for (size_t i=0; i<buf.size(); i++)
+	    out.Add(buf[i]);
+    } else if (ok) {
+	std::vector<PointTileRecord>().swap(buf);
+
+	std::vector<PointTileRun> runs(runnames.size());
+	std::priority_queue<PointTileRun*, std::vector<PointTileRun*>, PointTileRunGreater> merge;
+	for (size_t i=0; i<runs.size(); i++) {
+	    runs[i].f = fopen(runnames[i].c_str(), "rb");
+	    if (runs[i].f && runs[i].Fill())
+		merge.push(&runs[i]);
+	}
+
+	while (!merge.empty()) {
+	    PointTileRun *r = merge.top();
+	    merge.pop();
+	    out.Add(r->Top());
+	    if (r->Pop())
+		merge.push(r);
+	}
+
+	for (size_t i=0; i<runs.size(); i++) {
+	    if (runs[i].f) fclose(runs[i].f);
+	}
+    }
+
+    for (size_t i=0; i<runnames.size(); i++)
+	remove(runnames[i].c_str());
+
+    if (f) {
+	ok = ok && out.ok && out.written == h.npoints && (int)out.chunks.size() == h.nchunks;
+	ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+	    fwrite(&h, sizeof(h), 1, f) == 1 &&
+	    fwrite(&out.chunks[0], sizeof(PointTileChunk), out.chunks.size(), f) == out.chunks.size();
+	ok = (fclose(f) == 0) && ok;
+    }
+
+    // write next to it and rename, so nothing ever maps half a file
+    if (!ok || rename(tmpname.c_str(), dst) != 0) {
+	cerr<<"couldn't write point tiles "<<dst<<endl;
+	remove(tmpname.c_str());
+	return false;
+    }
+
+    cerr<<"[TIMING] Point tiles: "<<h.npoints<<" points in "<<h.nchunks<<" chunks, "
+	<<std::max((int)runnames.size(), 1)<<" sorted runs, "
+	<<(Profile::Now() - t_start)<<"s"<<endl;
+    return true;
+}
+
+
+
+PointTileFile::PointTileFile() : map(NULL), size(0), npoints(0), nchunks(0), has_normals(false), chunks(NULL), points(NULL) {
+    for (int i=0; i<6; i++) bbox[i] = 0;
+}
+
+
+bool PointTileFile::Open(const char *fname) {
+
+    Close();
+
+#ifdef WIN32
+    FILE *f = fopen(fname, "rb");
+    if (!f) return false;
+    _fseeki64(f, 0, SEEK_END);
+    size = (size_t)_ftelli64(f);
+    _fseeki64(f, 0, SEEK_SET);
+    map = new char[size];
+    bool ok = (fread(map, 1, size, f) == size);
+    fclose(f);
+    if (!ok) {
+	Close();
+	return false;
+    }
+#else
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PointTileHeader)) {
+	close(fd);
+	return false;
+    }
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	map = NULL;
+	return false;
+    }
+#endif
+
+    const PointTileHeader &h = *(const PointTileHeader*)map;
+    int stride = h.has_normals ? 6 : 3;
+    if (size < sizeof(PointTileHeader) ||
+	memcmp(h.magic, point_tile_magic, sizeof(h.magic)) || h.version != point_tile_version ||
+	h.nchunks < 0 || h.npoints < 0 ||
+	PointTileDataOffset(h.nchunks) + sizeof(float)*stride*(size_t)h.npoints != size) {
+	cerr<<fname<<" isn't a point tile file"<<endl;
+	Close();
+	return false;
+    }
+
+    const char *base = (const char*)map;
+    npoints = h.npoints;
+    nchunks = h.nchunks;
+    has_normals = (h.has_normals != 0);
+    for (int i=0; i<6; i++) bbox[i] = h.bbox[i];
+    chunks = (const PointTileChunk*)(base + sizeof(PointTileHeader));
+    points = (const float*)(base + PointTileDataOffset(h.nchunks));
+    return true;
+}
+
+
+void PointTileFile::Close() {
+    if (map) {
+#ifdef WIN32
+	delete [] (char*)map;
+#else
+	munmap(map, size);
+#endif
+    }
+    map = NULL;
+    size = 0;
+    npoints = 0;
+    nchunks = 0;
+    has_normals = false;
+    chunks = NULL;
+    points = NULL;
+}
+
+
+
+static bool ChunkOverlaps(const PointTileChunk &chunk, const Box3 &region) {
+    for (int i=0; i<3; i++) {
+	if (chunk.bbox[3+i] < region.min_point()[i] || chunk.bbox[i] > region.max_point()[i])
+	    return false;
+    }
+    return true;
+}
+
+
+real_type PointTileSpacing(const char *fname, const Box3 &region, int k) {
+
+    PointTileFile file;
+    if (!file.Open(fname)) {
+	cerr<<"couldn't read "<<fname<<endl;
+	return 0;
+    }
+
+    vector<int> overlap;
+    for (int c=0; c<file.NumChunks(); c++) {
+	if (ChunkOverlaps(file.Chunk(c), region))
+	    overlap.push_back(c);
+    }
+
+    // a chunk is a run along the morton curve, so a point's nearest neighbors are mostly in its own
+    // chunk.  the ones at a chunk's edges come out a bit far, which only makes a halo wider
+    static const int sample_chunks = 16;
+    static const int samples_per_chunk = 8;
+    int stride = file.Stride();
+    vector<real_type> kth;
+    vector<real_type> d2;
+    for (int i=0; i<sample_chunks && i<(int)overlap.size(); i++) {
+	int c = overlap[(size_t)i * overlap.size() / std::min((int)overlap.size(), sample_chunks)];
+	const PointTileChunk &chunk = file.Chunk(c);
+	if (chunk.count <= k) continue;
+
+	const float *p = file.Points(c);
+	for (int s=0; s<samples_per_chunk; s++) {
+	    const float *q = p + stride * (size_t)((s*2+1) * (long long)chunk.count / (2*samples_per_chunk));
+	    d2.clear();
+	    for (int j=0; j<chunk.count; j++) {
+		const float *o = p + stride*(size_t)j;
+		d2.push_back((real_type)((o[0]-q[0])*(o[0]-q[0]) + (o[1]-q[1])*(o[1]-q[1]) + (o[2]-q[2])*(o[2]-q[2])));
+	    }
+	    // the point itself is at 0
+	    std::nth_element(d2.begin(), d2.begin()+k, d2.end());
+	    kth.push_back(sqrt(d2[k]));
+	}
+    }
+
+    if (kth.empty())
+	return 0;
+    std::nth_element(kth.begin(), kth.begin()+kth.size()/2, kth.end());
+    return kth[kth.size()/2];
+}
+
+
+bool ReadPointTiles(const char *fname, surfel_set &points, const Box3 *region) {
+
+    PointTileFile file;
+    if (!file.Open(fname)) {
+	cerr<<"couldn't read "<<fname<<endl;
+	return false;
+    }
+
+    // a chunk outside the region is never touched, so its pages are never read in
+    int used = 0;
+    long long loaded = 0;
+    int stride = file.Stride();
+    for (int c=0; c<file.NumChunks(); c++) {
+	const PointTileChunk &chunk = file.Chunk(c);
+	if (region && !ChunkOverlaps(chunk, *region))
+	    continue;
+	used++;
+
+	const float *p = file.Points(c);
+	for (int j=0; j<chunk.count; j++, p+=stride) {
+	    Point3 pt(p[0], p[1], p[2]);
+	    if (region && !region->contains(pt)) continue;
+
+	    if (file.HasNormals())
+		points.insert_vertex(pt, Vector3(p[3], p[4], p[5]));
+	    else
+		points.insert_vertex(pt);
+	    loaded++;
+	}
+    }
+
+    cerr<<"read "<<loaded<<" of "<<file.NumPoints()<<" points from "<<used<<" of "<<file.NumChunks()<<" chunks of "<<fname<<endl;
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef __POINT_TILES_H
+#define __POINT_TILES_H
+
+#include <vector>
+#include <stddef.h>
+
+// binary point clouds for inputs too big to parse as text.  the points are sorted along a
+// morton curve and cut into fixed size chunks, each with its bounding box, so points that are
+// close in space are close in the file and a region can be loaded by touching only the chunks
+// that overlap it.  whatever gets loaded is triangulated like any other point set, held and
+// indexed all at once.
+
+
+// one run of consecutive points in the file
+class PointTileChunk {
+    public:
+    float bbox[6];
+    long long first;
+    int count;
+    int pad;
+};
+
+
+// a .bpts file mapped into memory, the pointers stay valid until it's closed
+class PointTileFile {
+    public:
+    PointTileFile();
+    ~PointTileFile() { Close(); }
+
+    bool Open(const char *fname);
+    void Close();
+
+    long long NumPoints() const { return npoints; }
+    int NumChunks() const { return nchunks; }
+    bool HasNormals() const { return has_normals; }
+    const double* BBox() const { return bbox; }
+
+    const PointTileChunk& Chunk(int c) const { return chunks[c]; }
+
+    // 3 floats of position per point, followed by 3 of normal if the file has them
+    int Stride() const { return has_normals ? 6 : 3; }
+    const float* Points(int c) const { return points + Stride()*chunks[c].first; }
+
+    private:
+    void *map;
+    size_t size;
+
+    long long npoints;
+    int nchunks;
+    bool has_normals;
+    double bbox[6];
+    const PointTileChunk *chunks;
+    const float *points;
+};
+
+
+// sort a .obj or .pc point cloud into dst, never holding more than sort_mb of it in memory
+bool ConvertToPointTiles(const char *src, const char *dst, int sort_mb);
+
+// the median distance from a point to its k-th nearest neighbor, sampled from the chunks
+// overlapping region.  0 if there aren't enough points to tell
+real_type PointTileSpacing(const char *fname, const Box3 &region, int k);
+
+// add the points of a .bpts file to points, only the ones inside region if it's given.  to
+// triangulate one region of a larger cloud, load a region grown by the mls support radius and keep
+// only the output inside the original box (see OutputControllerClip)
+bool ReadPointTiles(const char *fname, surfel_set &points, const Box3 *region=NULL);
+
+#endif
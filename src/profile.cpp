@@ -0,0 +1,176 @@
+#include "common.h"
+#include "profile.h"
+#include <ThreadLib/threadslib.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+
+static const char *counter_names[PROF_NUM_COUNTERS] = {
+    "max_step_calls",
+    "max_step_points_visited",
+    "sizing_grid_hits",
+    "sizing_grid_fallbacks",
+    "project_calls",
+    "project_failures",
+    "project_iterations",
+    "mls_neighborhood_reused",
+    "mls_neighborhood_extracted",
+    "triangle_legal_calls",
+    "triangle_legal_rejects",
+    "kdtree_inserts",
+    "kdtree_removes",
+    "kdtree_local_rebuilds",
+    "kdtree_rebuilt_objects",
+    "heap_pushes",
+    "heap_pops",
+    "heap_removes",
+    "heap_updates",
+    "output_vertices",
+    "output_triangles",
+};
+
+static const char *maximum_names[PROF_NUM_MAXIMUMS] = {
+    "max_step_points_visited",
+    "project_iterations",
+};
+
+static const char *timer_names[PROF_NUM_TIMERS] = {
+    "max_step_length",
+    "project_point",
+    "output_controllers",
+    "guidance_build",
+    "guidance_trim",
+    "marching_cubes_seeds",
+    "triangulate",
+};
+
+
+ProfileBlock::ProfileBlock() {
+    Clear();
+}
+
+void ProfileBlock::Clear() {
+    for (int i=0; i<PROF_NUM_COUNTERS; i++)	counts[i] = 0;
+    for (int i=0; i<PROF_NUM_MAXIMUMS; i++)	maximums[i] = 0;
+    for (int i=0; i<PROF_NUM_TIMERS; i++)	{ seconds[i] = 0;  calls[i] = 0; }
+}
+
+void ProfileBlock::Accumulate(const ProfileBlock &b) {
+    for (int i=0; i<PROF_NUM_COUNTERS; i++)	counts[i] += b.counts[i];
+    for (int i=0; i<PROF_NUM_MAXIMUMS; i++)	maximums[i] = std::max(maximums[i], b.maximums[i]);
+    for (int i=0; i<PROF_NUM_TIMERS; i++)	{ seconds[i] += b.seconds[i];  calls[i] += b.calls[i]; }
+}
+
+
+
+#ifdef WIN32
+__declspec(thread) ProfileBlock *Profile::local = NULL;
+#else
+__thread ProfileBlock *Profile::local = NULL;
+#endif
+
+
+// blocks of running threads, and the sum of the ones that have exited
+static thlib::CSObject profile_cs;
+static vector<ProfileBlock*> profile_live;
+static ProfileBlock profile_retired;
+static double profile_start = Profile::Now();
+static const char *profile_filename = NULL;
+
+
+#ifndef WIN32
+static pthread_key_t profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+
+// fold an exiting thread's block into the retired total
+static void RetireProfileBlock(void *p) {
+    ProfileBlock *b = (ProfileBlock*)p;
+    profile_cs.enter();
+    profile_retired.Accumulate(*b);
+    profile_live.erase(std::find(profile_live.begin(), profile_live.end(), b));
+    profile_cs.leave();
+    delete b;
+}
+
+static void MakeProfileKey() {
+    pthread_key_create(&profile_key, RetireProfileBlock);
+}
+#endif
+
+
+ProfileBlock* Profile::NewLocalBlock() {
+    ProfileBlock *b = new ProfileBlock();
+
+    profile_cs.enter();
+    profile_live.push_back(b);
+    profile_cs.leave();
+
+#ifndef WIN32
+    pthread_once(&profile_key_once, MakeProfileKey);
+    pthread_setspecific(profile_key, b);
+#endif
+    return b;
+}
+
+
+void Profile::Total(ProfileBlock &total) {
+    profile_cs.enter();
+    total = profile_retired;
+    for (unsigned i=0; i<profile_live.size(); i++)
+	total.Accumulate(*profile_live[i]);
+    profile_cs.leave();
+}
+
+
+bool Profile::WriteJSON(const char *filename) {
+
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+	cerr<<"couldn't open "<<filename<<" for writing"<<endl;
+	return false;
+    }
+
+    ProfileBlock total;
+    Total(total);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"wall_seconds\": %.6f,\n", Now() - profile_start);
+
+    fprintf(f, "  \"counters\": {\n");
+    for (int i=0; i<PROF_NUM_COUNTERS; i++)
+	fprintf(f, "    \"%s\": %lld%s\n", counter_names[i], total.counts[i], (i+1<PROF_NUM_COUNTERS) ? "," : "");
+    fprintf(f, "  },\n");
+
+    fprintf(f, "  \"maximums\": {\n");
+    for (int i=0; i<PROF_NUM_MAXIMUMS; i++)
+	fprintf(f, "    \"%s\": %lld%s\n", maximum_names[i], total.maximums[i], (i+1<PROF_NUM_MAXIMUMS) ? "," : "");
+    fprintf(f, "  },\n");
+
+    // summed over threads, so these can add up to more than the wall time
+    fprintf(f, "  \"timers\": {\n");
+    for (int i=0; i<PROF_NUM_TIMERS; i++)
+	fprintf(f, "    \"%s\": { \"seconds\": %.6f, \"calls\": %lld }%s\n", timer_names[i], total.seconds[i], total.calls[i],
+		(i+1<PROF_NUM_TIMERS) ? "," : "");
+    fprintf(f, "  }\n");
+
+    fprintf(f, "}\n");
+    fclose(f);
+    return true;
+}
+
+
+void Profile::WriteAtExitHandler() {
+    if (profile_filename && WriteJSON(profile_filename))
+	cerr<<"wrote profile to "<<profile_filename<<endl;
+}
+
+void Profile::WriteAtExit(const char *filename) {
+    if (!profile_filename)
+	atexit(WriteAtExitHandler);
+    profile_filename = filename;
+}
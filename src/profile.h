@@ -0,0 +1,132 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+// lightweight always-on instrumentation - counters and scoped timers accumulate into a block
+// per thread, so the hot paths never take a lock, and get summed up when the report is written
+
+#ifndef WIN32
+#include <time.h>
+#endif
+
+
+enum ProfileCounter {
+    PROF_MAXSTEP_CALLS,
+    PROF_MAXSTEP_VISITED,		// guidance points looked at by the ordered traversal or a sizing grid leaf
+    PROF_SIZING_HITS,
+    PROF_SIZING_FALLBACKS,		// sizing grid leaves that had to use the traversal
+    PROF_PROJECT_CALLS,
+    PROF_PROJECT_FAILURES,
+    PROF_PROJECT_ITERATIONS,		// newton steps inside the projectors that count them
+    PROF_MLS_NBHD_REUSED,		// mls projections that found their sample's neighbors already sorted
+    PROF_MLS_NBHD_EXTRACTED,
+    PROF_TRIANGLE_LEGAL_CALLS,
+    PROF_TRIANGLE_LEGAL_REJECTS,
+    PROF_KD_INSERTS,
+    PROF_KD_REMOVES,
+    PROF_KD_REBUILDS,
+    PROF_KD_REBUILT_OBJECTS,
+    PROF_HEAP_PUSHES,
+    PROF_HEAP_POPS,
+    PROF_HEAP_REMOVES,
+    PROF_HEAP_UPDATES,
+    PROF_OUTPUT_VERTICES,
+    PROF_OUTPUT_TRIANGLES,
+    PROF_NUM_COUNTERS
+};
+
+// largest single value seen, for things where the average hides the problem
+enum ProfileMaximum {
+    PROF_MAX_MAXSTEP_VISITED,
+    PROF_MAX_PROJECT_ITERATIONS,
+    PROF_NUM_MAXIMUMS
+};
+
+enum ProfileTimerId {
+    PROF_TIME_MAXSTEP,
+    PROF_TIME_PROJECT,
+    PROF_TIME_OUTPUT,
+    PROF_TIME_GUIDANCE_BUILD,
+    PROF_TIME_GUIDANCE_TRIM,
+    PROF_TIME_MC_SEEDS,
+    PROF_TIME_TRIANGULATE,
+    PROF_NUM_TIMERS
+};
+
+
+class ProfileBlock {
+    public:
+    ProfileBlock();
+    void Clear();
+    void Accumulate(const ProfileBlock &b);
+
+    long long counts[PROF_NUM_COUNTERS];
+    long long maximums[PROF_NUM_MAXIMUMS];
+    double seconds[PROF_NUM_TIMERS];
+    long long calls[PROF_NUM_TIMERS];
+};
+
+
+class Profile {
+    public:
+
+    static ProfileBlock& Local() {
+	if (!local) local = NewLocalBlock();
+	return *local;
+    }
+
+    static void Count(ProfileCounter c, long long n=1) {
+	Local().counts[c] += n;
+    }
+
+    static void Maximum(ProfileMaximum m, long long v) {
+	ProfileBlock &b = Local();
+	if (v > b.maximums[m]) b.maximums[m] = v;
+    }
+
+    static double Now() {
+#ifdef WIN32
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+    }
+
+    // sum of every thread that has ever recorded anything
+    static void Total(ProfileBlock &total);
+
+    static bool WriteJSON(const char *filename);
+
+    // write the report to filename when the program exits
+    static void WriteAtExit(const char *filename);
+
+    private:
+    static ProfileBlock* NewLocalBlock();
+    static void WriteAtExitHandler();
+
+#ifdef WIN32
+    static __declspec(thread) ProfileBlock *local;
+#else
+    static __thread ProfileBlock *local;
+#endif
+};
+
+
+// adds the time until it goes out of scope
+class ProfileTimer {
+    public:
+    ProfileTimer(ProfileTimerId _id) : id(_id), start(Profile::Now()) { }
+    ~ProfileTimer() {
+	ProfileBlock &b = Profile::Local();
+	b.seconds[id] += Profile::Now() - start;
+	b.calls[id]++;
+    }
+
+    private:
+    ProfileTimerId id;
+    double start;
+};
+
+
+#endif
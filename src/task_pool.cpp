@@ -0,0 +1,159 @@
+#include "common.h"
+#include "task_pool.h"
+#include <algorithm>
+
+extern int idealNumThreads;
+
+
+// which deque belongs to this thread, 0 for threads the pool didn't start
+#ifdef WIN32
+static __declspec(thread) int task_pool_slot = 0;
+#else
+static __thread int task_pool_slot = 0;
+#endif
+
+
+class TaskPoolWorkerStart {
+    public:
+    TaskPool *pool;
+    int slot;
+};
+
+
+TaskPool& TaskPool::Get() {
+    // never destroyed, the workers just sleep until the process exits
+    static TaskPool *pool = new TaskPool(std::max(idealNumThreads-1, 0));
+    return *pool;
+}
+
+
+TaskPool::TaskPool(int nworkers) : queued(0) {
+    for (int i=0; i<nworkers+1; i++)
+	deques.push_back(new TaskDeque);
+
+    for (int i=0; i<nworkers; i++) {
+	TaskPoolWorkerStart *start = new TaskPoolWorkerStart;
+	start->pool = this;
+	start->slot = i+1;
+	workers.push_back(new thlib::Thread(&TaskPool::WorkerMain, (void*)start, 0));
+    }
+}
+
+
+int TaskPool::CurrentSlot() {
+    return task_pool_slot;
+}
+
+
+void* TaskPool::WorkerMain(void *arg) {
+    TaskPoolWorkerStart *start = (TaskPoolWorkerStart*)arg;
+    TaskPool *pool = start->pool;
+    task_pool_slot = start->slot;
+    delete start;
+
+    while (1) {
+	Task t;
+	if (pool->Take(task_pool_slot, t)) {
+	    pool->Run(t);
+	    continue;
+	}
+
+	pool->cond.enter();
+	while (pool->queued <= 0)
+	    pool->cond.wait();
+	pool->cond.leave();
+    }
+    return NULL;
+}
+
+
+void TaskPool::Spawn(TaskGroup &g, TaskFunction f, void *arg) {
+
+    // count it before anyone can finish it
+    cond.enter();
+    g.outstanding++;
+    cond.leave();
+
+    Task t;
+    t.f = f;
+    t.arg = arg;
+    t.group = &g;
+
+    TaskDeque &d = *deques[CurrentSlot()];
+    d.cs.enter();
+    d.tasks.push_back(t);
+    d.cs.leave();
+
+    cond.enter();
+    queued++;
+    cond.signal();
+    cond.leave();
+}
+
+
+// newest from our own deque, otherwise the oldest from someone else's
+bool TaskPool::Take(int slot, Task &t) {
+
+    bool found = false;
+    TaskDeque &own = *deques[slot];
+    own.cs.enter();
+    if (!own.tasks.empty()) {
+	t = own.tasks.back();
+	own.tasks.pop_back();
+	found = true;
+    }
+    own.cs.leave();
+
+    for (unsigned i=1; !found && i<deques.size(); i++) {
+	TaskDeque &victim = *deques[(slot+i) % deques.size()];
+	victim.cs.enter();
+	if (!victim.tasks.empty()) {
+	    t = victim.tasks.front();
+	    victim.tasks.pop_front();
+	    found = true;
+	}
+	victim.cs.leave();
+    }
+
+    if (found) {
+	cond.enter();
+	queued--;
+	cond.leave();
+    }
+    return found;
+}
+
+
+void TaskPool::Run(const Task &t) {
+    t.f(t.arg);
+
+    cond.enter();
+    if (--t.group->outstanding == 0)
+	cond.broadcast();
+    cond.leave();
+}
+
+
+void TaskPool::Wait(TaskGroup &g) {
+
+    int slot = CurrentSlot();
+    while (1) {
+	cond.enter();
+	bool done = (g.outstanding == 0);
+	cond.leave();
+	if (done)
+	    return;
+
+	Task t;
+	if (Take(slot, t)) {
+	    Run(t);
+	    continue;
+	}
+
+	// nothing to help with - sleep until something is spawned or the group finishes
+	cond.enter();
+	while (g.outstanding > 0 && queued <= 0)
+	    cond.wait();
+	cond.leave();
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef __TASK_POOL_H
+#define __TASK_POOL_H
+
+#include <ThreadLib/threadslib.h>
+#include <deque>
+#include <vector>
+
+// a process-wide set of worker threads that stay alive between parallel sections, each with
+// its own deque of tasks.  a thread runs its newest tasks first and steals the oldest ones from
+// the others when it runs out, so recursive splits get handed out in big pieces.  a thread
+// waiting on a group runs tasks while it waits, so tasks can spawn more tasks and wait on them.
+
+
+typedef void (*TaskFunction)(void *arg);
+
+
+// the tasks spawned for one piece of work, to be waited on together
+class TaskGroup {
+    public:
+    TaskGroup() : outstanding(0) { }
+
+    private:
+    friend class TaskPool;
+    int outstanding;		// guarded by the pool's condition
+};
+
+
+class TaskPool {
+    public:
+
+    // started the first time it's used, with idealNumThreads-1 workers
+    static TaskPool& Get();
+
+    // the workers plus whoever is waiting
+    int NumThreads() const { return (int)deques.size(); }
+
+    void Spawn(TaskGroup &g, TaskFunction f, void *arg);
+
+    // runs tasks until everything spawned into g has finished
+    void Wait(TaskGroup &g);
+
+
+    private:
+    TaskPool(int nworkers);
+
+    class Task {
+	public:
+	TaskFunction f;
+	void *arg;
+	TaskGroup *group;
+    };
+
+    class TaskDeque {
+	public:
+	thlib::CSObject cs;
+	std::deque<Task> tasks;
+    };
+
+    bool Take(int slot, Task &t);
+    void Run(const Task &t);
+    static int CurrentSlot();
+    static void* WorkerMain(void *arg);
+
+    std::vector<TaskDeque*> deques;	// 0 is shared by the threads that aren't workers
+    std::vector<thlib::Thread*> workers;
+
+    thlib::Condition cond;		// sleeping workers and waiters
+    int queued;
+};
+
+
+#endif
@@ -11,7 +11,7 @@
 
 
 MeshCSGGuidanceField::MeshCSGGuidanceField(int curv_sub, const TriangleMesh &mesh1, const TriangleMesh &mesh2, const vector<int> pointsides[2], vector< vector<Point3> > &curves, real_type rho, real_type min_step, real_type max_step, real_type reduction)
-    : GuidanceField(rho, min_step, max_step, reduction), kdGetPoint(), kdOrderedTraverse(NULL) {
+    : GuidanceField(rho, min_step, max_step, reduction), kdGetPoint() {
 
 
     // use the regular guidance field to find the point curvatures
@@ -59,7 +59,6 @@ MeshCSGGuidanceField::MeshCSGGuidanceField(int curv_sub, const TriangleMesh &mes
 
 
 MeshCSGGuidanceField::~MeshCSGGuidanceField() {
-    if (kdOrderedTraverse) delete kdOrderedTraverse;
     delete kdtree;
 }
 
@@ -69,21 +68,18 @@ int MeshCSGGuidanceField::ClosestPoint(const Point3 &p) {
 }
 
 
-void MeshCSGGuidanceField::OrderedPointTraverseStart(const Point3 &p) {
-
-    if (kdOrderedTraverse)
-	delete kdOrderedTraverse;
-    kdOrderedTraverse = new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
+void* MeshCSGGuidanceField::OrderedPointTraverseStart(const Point3 &p) const {
+    return new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
 }
 
-int MeshCSGGuidanceField::OrderedPointTraverseNext(real_type &squared_dist) {
-    if (kdOrderedTraverse->empty()) return -1;
-    return kdOrderedTraverse->GetNext(squared_dist);
+int MeshCSGGuidanceField::OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const {
+    kdtree_type::OrderedIncrementalTraverse *traverse = (kdtree_type::OrderedIncrementalTraverse*)ctx;
+    if (traverse->empty()) return -1;
+    return traverse->GetNext(squared_dist);
 }
 
-void MeshCSGGuidanceField::OrderedPointTraverseEnd() {
-    delete kdOrderedTraverse;
-    kdOrderedTraverse = NULL;
+void MeshCSGGuidanceField::OrderedPointTraverseEnd(void *ctx) const {
+    delete (kdtree_type::OrderedIncrementalTraverse*)ctx;
 }
 
 
@@ -690,7 +686,7 @@ void MeshCSGGuidanceField::BlendGuidance(bool blend, const TriangleMesh* meshes[
 
 
 MeshPSCSGGuidanceField::MeshPSCSGGuidanceField(int curv_sub, const TriangleMesh &mesh, const surfel_set &points, CProjection &psprojector, vector< vector<Point3> > &curves, real_type rho, real_type min_step, real_type max_step, real_type reduction, int adamson)
-    : GuidanceField(rho, min_step, max_step, reduction), kdGetPoint(), kdOrderedTraverse(NULL) {
+    : GuidanceField(rho, min_step, max_step, reduction), kdGetPoint() {
 
 
 
@@ -748,7 +744,6 @@ MeshPSCSGGuidanceField::MeshPSCSGGuidanceField(int curv_sub, const TriangleMesh
 
 
 MeshPSCSGGuidanceField::~MeshPSCSGGuidanceField() {
-    if (kdOrderedTraverse) delete kdOrderedTraverse;
     delete kdtree;
 }
 
@@ -758,21 +753,18 @@ int MeshPSCSGGuidanceField::ClosestPoint(const Point3 &p) {
 }
 
 
-void MeshPSCSGGuidanceField::OrderedPointTraverseStart(const Point3 &p) {
-
-    if (kdOrderedTraverse)
-	delete kdOrderedTraverse;
-    kdOrderedTraverse = new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
+void* MeshPSCSGGuidanceField::OrderedPointTraverseStart(const Point3 &p) const {
+    return new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
 }
 
-int MeshPSCSGGuidanceField::OrderedPointTraverseNext(real_type &squared_dist) {
-    if (kdOrderedTraverse->empty()) return -1;
-    return kdOrderedTraverse->GetNext(squared_dist);
+int MeshPSCSGGuidanceField::OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const {
+    kdtree_type::OrderedIncrementalTraverse *traverse = (kdtree_type::OrderedIncrementalTraverse*)ctx;
+    if (traverse->empty()) return -1;
+    return traverse->GetNext(squared_dist);
 }
 
-void MeshPSCSGGuidanceField::OrderedPointTraverseEnd() {
-    delete kdOrderedTraverse;
-    kdOrderedTraverse = NULL;
+void MeshPSCSGGuidanceField::OrderedPointTraverseEnd(void *ctx) const {
+    delete (kdtree_type::OrderedIncrementalTraverse*)ctx;
 }
 
 
@@ -1027,17 +1019,17 @@ void MeshPSCSGGuidanceField::InitPointSides(const TriangleMesh &m, const surfel_
     // get all the mesh points to check
     for (int l=0; l<(int)loops.size(); l++) {
 	for (int ll=0; ll<(int)loops[l].size(); ll++) {
-	    OrderedPointTraverseStart(loops[l][ll]);
+	    void *traverse = OrderedPointTraverseStart(loops[l][ll]);
 	    while(1) {
 		real_type sdist;
-		int next = OrderedPointTraverseNext(sdist);
+		int next = OrderedPointTraverseNext(traverse, sdist);
 		if (next < 0) break;
 		if (sqrt(sdist) > 0.003) break;
 		if (next < (int)m.verts.size()) {
 		    sides[next] = 10;
 		}
 	    }
-	    OrderedPointTraverseEnd();
+	    OrderedPointTraverseEnd(traverse);
 	}
     }
     cerr<<"got mesh points to check"<<endl;
@@ -1057,11 +1049,11 @@ void MeshPSCSGGuidanceField::InitPointSides(const TriangleMesh &m, const surfel_
 	if (sides[v] != 10) continue;
 	sides[v] = 0;
 
-	OrderedPointTraverseStart(m.verts[v].point);
+	void *traverse = OrderedPointTraverseStart(m.verts[v].point);
 
 	while(1) {
 	    real_type sdist;
-	    int next = OrderedPointTraverseNext(sdist);
+	    int next = OrderedPointTraverseNext(traverse, sdist);
 	    if (next < 0) break;
 	    //			if (sqrt(sdist) > 0.01) break;
 	    if (next >= (int)m.verts.size() && next <(int)m.verts.size()+(int)points.size()) {
@@ -1074,7 +1066,7 @@ void MeshPSCSGGuidanceField::InitPointSides(const TriangleMesh &m, const surfel_
 		break;
 	    }
 	}
-	OrderedPointTraverseEnd();
+	OrderedPointTraverseEnd(traverse);
 
 	if (sides[v] < 0) sides[v]=-2;
 	else if (sides[v] > 0) sides[v]=2;
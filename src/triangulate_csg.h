@@ -44,9 +44,9 @@ class MeshCSGGuidanceField : public GuidanceField {
     ~MeshCSGGuidanceField();
 
     int ClosestPoint(const Point3 &p);
-    void OrderedPointTraverseStart(const Point3 &p);
-    int OrderedPointTraverseNext(real_type &squared_dist);
-    void OrderedPointTraverseEnd();
+    void* OrderedPointTraverseStart(const Point3 &p) const;
+    int OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const;
+    void OrderedPointTraverseEnd(void *ctx) const;
     const Point3& PointLocation(int i) const;
     int NumPoints() const;
 
@@ -75,7 +75,6 @@ class MeshCSGGuidanceField : public GuidanceField {
     typedef gtb::KDTree<int, real_type, GetPoint> kdtree_type;
     kdtree_type *kdtree;
     GetPoint kdGetPoint;
-    kdtree_type::OrderedIncrementalTraverse *kdOrderedTraverse;
 };
 
 
@@ -88,9 +87,9 @@ class MeshPSCSGGuidanceField : public GuidanceField {
     ~MeshPSCSGGuidanceField();
 
     int ClosestPoint(const Point3 &p);
-    void OrderedPointTraverseStart(const Point3 &p);
-    int OrderedPointTraverseNext(real_type &squared_dist);
-    void OrderedPointTraverseEnd();
+    void* OrderedPointTraverseStart(const Point3 &p) const;
+    int OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const;
+    void OrderedPointTraverseEnd(void *ctx) const;
     const Point3& PointLocation(int i) const;
     int NumPoints() const;
 
@@ -124,7 +123,6 @@ class MeshPSCSGGuidanceField : public GuidanceField {
     typedef gtb::KDTree<int, real_type, GetPoint> kdtree_type;
     kdtree_type *kdtree;
     GetPoint kdGetPoint;
-    kdtree_type::OrderedIncrementalTraverse *kdOrderedTraverse;
 };
 
 
@@ -4,6 +4,8 @@
 #include "triangulator.h"
 #include "triangulate_iso.h"
 #include "parallel.h"
+#include "guidance_cache.h"
+#include "profile.h"
 
 #ifndef WIN32
 #define HAS_ZLIB
@@ -13,50 +15,1067 @@
 #include <zlib.h>
 #endif
 
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+#include <lib/mlslib/NR/nr.h>	// for zbrent?!?!?
+
+
+const real_type theta_step = M_PI_2/30;
+const real_type zbrent_tol = 1e-3;
+
+real_type iso_scale = 1; //1e9;
+
+bool endswith(const char *s, const char *end);
+
+
+#define ISO_CIRCULAR_PROJECTION
+
+// a 1d filter run along each axis in turn.  taps[k] weighs the sample k-center away, and off the
+// edge of the volume the edge sample gets repeated (clamp) or the tap is dropped and the rest
+// renormalized
+class SeparableFilter {
+    public:
+    void SetBSpline() {
+	taps.clear();
+	taps.push_back(1/6.0);
+	taps.push_back(4/6.0);
+	taps.push_back(1/6.0);
+	center = 1;
+	clamp = true;
+    }
+
+    vector<double> taps;
+    int center;
+    bool clamp;
+};
+
+
+extern int curvature_sub;
+extern int brick_cache_mb;
+extern bool map_volumes;
+
+
+#define DIM 256
+
+template <typename T>
+    int round_to_minus_inf(const T &x) {
+    return ((x>=0) ?
+	    (int)x :
+	    (int)x - 1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// bricked volumes
+//
+// a .bvol file is a 4k text header followed by brick_size^3 blocks of floats, x fastest
+// within a brick and bricks ordered the same way.  the bricks along the upper edges are
+// padded out by repeating the last sample, so every brick is the same size and starts on a
+// page boundary.
+
+static const int brick_header_bytes = 4096;
+static const int default_brick_size = 32;
+
+
+static bool WriteBrickHeader(FILE *f, const int dim[3], const real_type aspect[3], int brick_size) {
+    char header[brick_header_bytes];
+    memset(header, 0, brick_header_bytes);
+    sprintf(header, "BVOL1\nsizes: %d %d %d\nspacings: %g %g %g\nbrick: %d\n",
+	    dim[0], dim[1], dim[2], aspect[0], aspect[1], aspect[2], brick_size);
+    return (fwrite(header, 1, brick_header_bytes, f) == brick_header_bytes);
+}
+
+
+// pages the bricks of a .bvol file in on demand, keeping about max_bricks of them mapped.  the
+// bricks are split between shards, each with its own lock and lru list, so threads only wait on
+// each other when they miss in the same shard.  each thread keeps the last brick it looked at
+// pinned and reads it without locking, so most lookups never touch a lock at all.  a thread only
+// ever holds one pin, so a shard goes past its share of max_bricks by at most the thread count
+class BrickPin;
+
+class BrickCache {
+    public:
+    BrickCache(const char *fname, const int _dim[3], int _brick_size, int _max_bricks);
+    ~BrickCache();
+
+    bool Ok() const { return opened; }
+
+    // safe to call from any thread
+    float Lookup(int x, int y, int z) const;
+
+    // nbrs[x][y][z] is the sample at (idx[0][x], idx[1][y], idx[2][z]), the indices along each axis
+    // in increasing order
+    void Gather(const int idx[3][4], double nbrs[4][4][4]) const;
+
+    int Loads() const;
+
+    // let go of the brick a thread is holding, if its cache is still around
+    static void ReleasePin(BrickPin *p);
+
+    private:
+    enum { NUM_SHARDS = 16 };
+
+    class Slot {
+	public:
+	int brick;
+	const float *values;
+	int pins;		// threads reading it without the lock, it can't be evicted until they let go
+	int prev, next;		// lru list, most recent first
+    };
+
+    class Shard {
+	public:
+	Shard() : head(-1), tail(-1), loads(0) { }
+	thlib::CSObject cs;
+	vector<Slot> slots;
+	int head, tail;
+	int loads;
+    };
+
+    const BrickPin* Repin(int b) const;
+    const float* Pin(int b) const;
+    void Unpin(int b) const;
+    void Unlink(Shard &s, int i) const;
+    void PushFront(Shard &s, int i) const;
+    const float* Map(int b) const;
+    void Unmap(const float *v) const;
+
+    bool opened;
+#ifdef WIN32
+    FILE *file;
+    mutable thlib::CSObject file_cs;	// the shards share the file position
+#else
+    int fd;
+#endif
+    int id;				// index in brick_caches
+    int nbricks[3];
+    int shift, mask;
+    size_t brick_bytes;
+    int shard_bricks;			// max_bricks split between the shards
+
+    mutable Shard shards[NUM_SHARDS];
+    mutable vector<int> slot_of;	// brick -> slot in its shard, -1 if not resident.  guarded by the shard
+};
+
+
+// the brick each thread read last, and which cache it came from.  it stays pinned until the thread
+// moves on to another brick, or exits
+class BrickPin {
+    public:
+    BrickPin() : cache(-1), brick(-1), values(NULL) { }
+    int cache;
+    int brick;
+    const float *values;
+};
+
+#ifdef WIN32
+static __declspec(thread) BrickPin *brick_pin = NULL;
+#else
+static __thread BrickPin *brick_pin = NULL;
+#endif
+
+// every cache ever made, by id, NULL once it's gone.  a pin left on a cache that's been deleted is
+// just forgotten, the cache unmapped the brick
+static thlib::CSObject brick_caches_cs;
+static vector<BrickCache*> brick_caches;
+
+
+// give a thread's pin back when it exits, the same as profile.cpp does with its counters
+#ifdef WIN32
+static DWORD brick_pin_key = FLS_OUT_OF_INDEXES;
+
+static VOID NTAPI ExitBrickPin(PVOID p) {
+    BrickCache::ReleasePin((BrickPin*)p);
+    delete (BrickPin*)p;
+}
+#else
+static pthread_key_t brick_pin_key;
+static pthread_once_t brick_pin_key_once = PTHREAD_ONCE_INIT;
+
+static void ExitBrickPin(void *p) {
+    BrickCache::ReleasePin((BrickPin*)p);
+    delete (BrickPin*)p;
+}
+
+static void MakeBrickPinKey() {
+    pthread_key_create(&brick_pin_key, ExitBrickPin);
+}
+#endif
+
+static BrickPin* NewBrickPin() {
+    BrickPin *p = new BrickPin();
+#ifdef WIN32
+    brick_caches_cs.enter();
+    if (brick_pin_key == FLS_OUT_OF_INDEXES)
+	brick_pin_key = FlsAlloc(ExitBrickPin);
+    brick_caches_cs.leave();
+    FlsSetValue(brick_pin_key, p);
+#else
+    pthread_once(&brick_pin_key_once, MakeBrickPinKey);
+    pthread_setspecific(brick_pin_key, p);
+#endif
+    return p;
+}
+
+
+void BrickCache::ReleasePin(BrickPin *p) {
+    if (p->cache < 0) return;
+    brick_caches_cs.enter();
+    if (brick_caches[p->cache])
+	brick_caches[p->cache]->Unpin(p->brick);
+    brick_caches_cs.leave();
+    p->cache = -1;
+    p->brick = -1;
+    p->values = NULL;
+}
+
+
+inline float BrickCache::Lookup(int x, int y, int z) const {
+    int b = ((z>>shift)*nbricks[1] + (y>>shift))*nbricks[0] + (x>>shift);
+    const BrickPin *p = brick_pin;
+    if (!p || b != p->brick || id != p->cache)
+	p = Repin(b);
+    return p->values[((((z&mask)<<shift) + (y&mask))<<shift) + (x&mask)];
+}
+
+
+// move this thread's pin to brick b
+const BrickPin* BrickCache::Repin(int b) const {
+    BrickPin *p = brick_pin;
+    if (!p)
+	p = brick_pin = NewBrickPin();
+
+    const float *v = Pin(b);
+    if (p->cache == id)
+	Unpin(p->brick);
+    else
+	ReleasePin(p);
+    p->cache = id;
+    p->brick = b;
+    p->values = v;
+    return p;
+}
+
+
+// the four indices along an axis fall in at most two bricks, so go a brick at a time rather than
+// bouncing between them
+void BrickCache::Gather(const int idx[3][4], double nbrs[4][4][4]) const {
+
+    int split[3];
+    for (int a=0; a<3; a++) {
+	split[a] = 4;
+	for (int j=1; j<4 && split[a]==4; j++) {
+	    if ((idx[a][j]>>shift) != (idx[a][0]>>shift))
+		split[a] = j;
+	}
+    }
+
+    for (int part=0; part<8; part++) {
+	int lo[3], hi[3];
+	for (int a=0; a<3; a++) {
+	    lo[a] = ((part>>a)&1) ? split[a] : 0;
+	    hi[a] = ((part>>a)&1) ? 4 : split[a];
+	}
+	for (int z=lo[2]; z<hi[2]; z++) {
+	    for (int y=lo[1]; y<hi[1]; y++) {
+		for (int x=lo[0]; x<hi[0]; x++) {
+		    nbrs[x][y][z] = (double)Lookup(idx[0][x], idx[1][y], idx[2][z]);
+		}
+	    }
+	}
+    }
+}
+
+
+BrickCache::BrickCache(const char *fname, const int _dim[3], int _brick_size, int _max_bricks)
+    : opened(false) {
+
+    brick_caches_cs.enter();
+    id = brick_caches.size();
+    brick_caches.push_back(this);
+    brick_caches_cs.leave();
+
+    shift=0;
+    while ((1<<shift) < _brick_size) shift++;
+    mask = _brick_size-1;
+    brick_bytes = sizeof(float) * _brick_size*_brick_size*_brick_size;
+    shard_bricks = std::max(1, _max_bricks / NUM_SHARDS);
+
+    for (int i=0; i<3; i++)
+	nbricks[i] = (_dim[i] + _brick_size-1) / _brick_size;
+    slot_of.resize(nbricks[0]*nbricks[1]*nbricks[2], -1);
+
+#ifdef WIN32
+    file = fopen(fname, "rb");
+    opened = (file != NULL);
+#else
+    fd = open(fname, O_RDONLY);
+    opened = (fd >= 0);
+#endif
+}
+
+
+BrickCache::~BrickCache() {
+    // threads still holding one of these bricks find the cache gone when they let go
+    brick_caches_cs.enter();
+    brick_caches[id] = NULL;
+    brick_caches_cs.leave();
+
+    for (int s=0; s<NUM_SHARDS; s++) {
+	for (unsigned i=0; i<shards[s].slots.size(); i++)
+	    Unmap(shards[s].slots[i].values);
+    }
+#ifdef WIN32
+    if (file) fclose(file);
+#else
+    if (fd >= 0) close(fd);
+#endif
+}
+
+
+int BrickCache::Loads() const {
+    int loads = 0;
+    for (int s=0; s<NUM_SHARDS; s++) {
+	shards[s].cs.enter();
+	loads += shards[s].loads;
+	shards[s].cs.leave();
+    }
+    return loads;
+}
+
+
+const float* BrickCache::Map(int b) const {
+
+    size_t offset = brick_header_bytes + (size_t)b * brick_bytes;
+
+#ifdef WIN32
+    float *v = new float[brick_bytes/sizeof(float)];
+    file_cs.enter();
+    _fseeki64(file, offset, SEEK_SET);
+    bool ok = (fread(v, 1, brick_bytes, file) == brick_bytes);
+    file_cs.leave();
+    if (!ok) {
+	cerr<<"couldn't read brick "<<b<<endl;
+	BREAK;
+    }
+    return v;
+#else
+    void *v = mmap(NULL, brick_bytes, PROT_READ, MAP_SHARED, fd, (off_t)offset);
+    if (v == MAP_FAILED) {
+	cerr<<"couldn't map brick "<<b<<endl;
+	BREAK;
+    }
+    return (const float*)v;
+#endif
+}
+
+
+void BrickCache::Unmap(const float *v) const {
+#ifdef WIN32
+    delete [] v;
+#else
+    munmap((void*)v, brick_bytes);
+#endif
+}
+
+
+void BrickCache::Unlink(Shard &s, int i) const {
+    Slot &slot = s.slots[i];
+    if (slot.prev >= 0) s.slots[slot.prev].next = slot.next; else s.head = slot.next;
+    if (slot.next >= 0) s.slots[slot.next].prev = slot.prev; else s.tail = slot.prev;
+    slot.prev = slot.next = -1;
+}
+
+
+void BrickCache::PushFront(Shard &s, int i) const {
+    Slot &slot = s.slots[i];
+    slot.prev = -1;
+    slot.next = s.head;
+    if (s.head >= 0) s.slots[s.head].prev = i;
+    s.head = i;
+    if (s.tail < 0) s.tail = i;
+}
+
+
+// make brick b resident and most recently used, and hold it until Unpin
+const float* BrickCache::Pin(int b) const {
+
+    Shard &s = shards[b % NUM_SHARDS];
+    s.cs.enter();
+
+    int i = slot_of[b];
+    if (i < 0) {
+	// throw out the least recently used brick nobody is reading, or grow if they all are
+	i = s.tail;
+	while (i >= 0 && s.slots[i].pins > 0)
+	    i = s.slots[i].prev;
+
+	if ((int)s.slots.size() < shard_bricks || i < 0) {
+	    Slot fresh;
+	    fresh.brick = -1;
+	    fresh.values = NULL;
+	    fresh.pins = 0;
+	    fresh.prev = fresh.next = -1;
+	    s.slots.push_back(fresh);
+	    i = (int)s.slots.size()-1;
+	} else {
+	    Unlink(s, i);
+	    slot_of[s.slots[i].brick] = -1;
+	    Unmap(s.slots[i].values);
+	}
+
+	s.slots[i].values = Map(b);
+	s.slots[i].brick = b;
+	slot_of[b] = i;
+	s.loads++;
+    } else {
+	Unlink(s, i);
+    }
+
+    PushFront(s, i);
+    s.slots[i].pins++;
+    const float *v = s.slots[i].values;
+
+    s.cs.leave();
+    return v;
+}
+
+
+void BrickCache::Unpin(int b) const {
+    Shard &s = shards[b % NUM_SHARDS];
+    s.cs.enter();
+    s.slots[slot_of[b]].pins--;
+    s.cs.leave();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// raw volume files
+
+
+MappedSamples::MappedSamples() : map(NULL), size(0), type(FLOAT), count(0), swap(false), scale(1) {
+}
+
+
+bool MappedSamples::Open(const char *fname, SampleType _type, size_t _count, bool bigendian, real_type _scale) {
+
+    Close();
+
+    static const size_t type_bytes[3] = { sizeof(unsigned char), sizeof(short), sizeof(float) };
+    size_t bytes = type_bytes[_type] * _count;
+
+#ifdef WIN32
+    FILE *f = fopen(fname, "rb");
+    if (!f) return false;
+    map = new char[bytes];
+    size = bytes;
+    bool ok = (fread(map, 1, bytes, f) == bytes);
+    fclose(f);
+    if (!ok) {
+	cerr<<"volume file too short!"<<endl;
+	Close();
+	return false;
+    }
+#else
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < bytes) {
+	cerr<<"volume file too short!"<<endl;
+	close(fd);
+	return false;
+    }
+    size = bytes;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	map = NULL;
+	return false;
+    }
+#endif
+
+    type = _type;
+    count = _count;
+    swap = bigendian;
+    scale = _scale;
+    return true;
+}
+
+
+void MappedSamples::Close() {
+    if (map) {
+#ifdef WIN32
+	delete [] (char*)map;
+#else
+	munmap(map, size);
+#endif
+    }
+    map = NULL;
+    size = count = 0;
+}
+
+
+template <typename T>
+    void MappedSamples::GatherType(const int dim[3], const int idx[3][4], double nbrs[4][4][4]) const {
+    const T *v = (const T*)map;
+    for (int x=0; x<4; x++) {
+	for (int y=0; y<4; y++) {
+	    for (int z=0; z<4; z++) {
+		nbrs[x][y][z] = (double)Convert(v[((size_t)idx[2][z]*dim[1] + idx[1][y])*dim[0] + idx[0][x]]);
+	    }
+	}
+    }
+}
+
+
+void MappedSamples::Gather(const int dim[3], const int idx[3][4], double nbrs[4][4][4]) const {
+    switch (type) {
+    case UCHAR: GatherType<unsigned char>(dim, idx, nbrs); break;
+    case SHORT: GatherType<short>(dim, idx, nbrs); break;
+    default:    GatherType<float>(dim, idx, nbrs); break;
+    }
+}
+
+
+template <typename T>
+    void MappedSamples::CopyType(real_type *out) const {
+    const T *v = (const T*)map;
+    for (size_t i=0; i<count; i++)
+	out[i] = Convert(v[i]);
+}
+
+
+void MappedSamples::Copy(real_type *out) const {
+    switch (type) {
+    case UCHAR: CopyType<unsigned char>(out); break;
+    case SHORT: CopyType<short>(out); break;
+    default:    CopyType<float>(out); break;
+    }
+}
+
+
+// a raw volume file read front to back, gzipped or not
+class VolumeSource {
+    public:
+    VolumeSource(FILE *_f) : f(_f) {
+#ifdef HAS_ZLIB
+	gz = NULL;
+#endif
+    }
+#ifdef HAS_ZLIB
+    VolumeSource(gzFile _gz) : f(NULL), gz(_gz) { }
+#endif
+
+    bool Read(void *buf, size_t bytes) {
+#ifdef HAS_ZLIB
+	if (gz) return (gzread(gz, buf, (unsigned)bytes) == (int)bytes);
+#endif
+	return (fread(buf, 1, bytes, f) == bytes);
+    }
+
+    private:
+    FILE *f;
+#ifdef HAS_ZLIB
+    gzFile gz;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+RegularVolume::RegularVolume() {
+    dim[0]=dim[1]=dim[2]=0;
+    aspect[0]=aspect[1]=aspect[2]=1;
+    invalidate_all();
+    data = NULL;
+    samples = NULL;
+    bricks = NULL;
+    convert_dst = NULL;
+    boundary_cells = 0;
+    morton = false;
+    ranges[0] = ranges[1] = NULL;
+}
+
+
+RegularVolume::~RegularVolume() {
+    Clear();
+}
+
+
+// drop the samples, in whatever form they're held, before reading new ones
+void RegularVolume::Clear() {
+    if (data) delete [] data;
+    if (samples) delete samples;
+    if (bricks) delete bricks;
+    data = NULL;
+    samples = NULL;
+    bricks = NULL;
+
+    morton = false;
+    for (int i=0; i<3; i++)
+	morton_offsets[i].clear();
+
+    ClearValueRanges();
+    invalidate_all();
+}
+
+
+// mapped samples become an ordinary real_type array
+void RegularVolume::LoadSamples() {
+    if (!samples) return;
+    data = CopyValues();
+    delete samples;
+    samples = NULL;
+}
+
+
+real_type* RegularVolume::CopyValues() const {
+    real_type *ret = new real_type[StorageSize()];
+    if (samples)
+	samples->Copy(ret);
+    else
+	memcpy(ret, data, sizeof(real_type)*StorageSize());
+    return ret;
+}
+
+
+real_type RegularVolume::BrickedValue(int x, int y, int z) const {
+    return bricks->Lookup(x,y,z);
+}
+
+
+void RegularVolume::ClearValueRanges() {
+    for (int i=0; i<2; i++) {
+	if (ranges[i]) delete ranges[i];
+	ranges[i] = NULL;
+    }
+}
+
+
+const MinMaxPyramid& RegularVolume::ValueRanges(bool bspline, const real_type *prefiltered) const {
+
+    if (!ranges[bspline]) {
+	double t_start = Profile::Now();
+
+	// prefiltering the whole volume is much cheaper than evaluating every point on its own
+	real_type *values = NULL;
+	if (bspline && !prefiltered && !OutOfCore())
+	    prefiltered = values = GetBSplineValues();
+
+	ranges[bspline] = new MinMaxPyramid;
+	ranges[bspline]->Build(*this, bspline, (bspline) ? prefiltered : NULL);
+	if (values) delete [] values;
+
+	cerr<<"[TIMING] Min/max pyramid: "<<ranges[bspline]->NumBlocks(0)<<"x"<<ranges[bspline]->NumBlocks(1)<<"x"<<ranges[bspline]->NumBlocks(2)
+	    <<" blocks in "<<(Profile::Now() - t_start)<<"s"<<endl;
+    }
+    return *ranges[bspline];
+}
+
+
+
+void MinMaxPyramid::Build(const RegularVolume &v, bool bspline, const real_type *values) {
+
+    for (int i=0; i<3; i++)
+	dim[i] = v.GetDim(i);
+
+    nblocks.clear();
+    ranges.clear();
+
+    vector<int> nb(3);
+    for (int i=0; i<3; i++)
+	nb[i] = std::max((dim[i]-1 + BLOCK-1) / BLOCK, 1);
+    nblocks.push_back(nb);
+    while (nb[0]>1 || nb[1]>1 || nb[2]>1) {
+	for (int i=0; i<3; i++)
+	    nb[i] = (nb[i]+1) / 2;
+	nblocks.push_back(nb);
+    }
+
+    ranges.resize(nblocks.size());
+    for (unsigned l=0; l<nblocks.size(); l++) {
+	ranges[l].resize(2*nblocks[l][0]*nblocks[l][1]*nblocks[l][2]);
+	for (unsigned j=0; j<ranges[l].size(); j+=2) {
+	    ranges[l][j+0] = 1e34;
+	    ranges[l][j+1] = -1e34;
+	}
+    }
+
+    // each slab of finest blocks reads its own points, so the points on the boundary are read twice
+    ParallelFor(0, nblocks[0][2], 1, makeClassFunctor(this, &MinMaxPyramid::BuildSlab), v, bspline, values);
+
+    for (unsigned l=1; l<nblocks.size(); l++) {
+	for (int bz=0; bz<nblocks[l-1][2]; bz++) {
+	    for (int by=0; by<nblocks[l-1][1]; by++) {
+		for (int bx=0; bx<nblocks[l-1][0]; bx++) {
+		    const real_type *c = Range(l-1, bx, by, bz);
+		    real_type *p = Range(l, bx/2, by/2, bz/2);
+		    p[0] = std::min(p[0], c[0]);
+		    p[1] = std::max(p[1], c[1]);
+		}
+	    }
+	}
+    }
+}
+
+
+void MinMaxPyramid::BuildSlab(int begin, int end, const RegularVolume &v, bool bspline, const real_type *values) {
+
+    vector<real_type> row(dim[0]);
+
+    for (int bz=begin; bz<end; bz++) {
+	int zend = std::min(BLOCK*(bz+1), dim[2]-1);
+	for (int z=BLOCK*bz; z<=zend; z++) {
+	    for (int y=0; y<dim[1]; y++) {
+
+		for (int x=0; x<dim[0]; x++) {
+		    row[x] = (values) ? values[v.xyz2index(x,y,z)] :
+			(bspline) ? v.BSplineValue(x,y,z) : v.GetValue(x,y,z);
+		}
+
+		// a point on a block boundary is in the blocks on both sides
+		int by[2] = { std::min(y/BLOCK, nblocks[0][1]-1), (y%BLOCK==0 && y>0) ? y/BLOCK-1 : -1 };
+
+		for (int bx=0; bx<nblocks[0][0]; bx++) {
+		    real_type mm[2] = { 1e34, -1e34 };
+		    int xend = std::min(BLOCK*(bx+1), dim[0]-1);
+		    for (int x=BLOCK*bx; x<=xend; x++) {
+			mm[0] = std::min(mm[0], row[x]);
+			mm[1] = std::max(mm[1], row[x]);
+		    }
+
+		    for (int j=0; j<2; j++) {
+			if (by[j] < 0) continue;
+			real_type *r = Range(0, bx, by[j], bz);
+			r[0] = std::min(r[0], mm[0]);
+			r[1] = std::max(r[1], mm[1]);
+		    }
+		}
+	    }
+	}
+    }
+}
+
+
+bool MinMaxPyramid::Active(int level, int bx, int by, int bz, real_type isovalue, int pad) const {
+
+    // enough neighbors to cover pad cells
+    int size = BLOCK << level;
+    int r = (pad + size-1) / size;
+    const vector<int> &nb = nblocks[level];
+
+    real_type mm[2] = { 1e34, -1e34 };
+    for (int z=std::max(bz-r,0); z<=std::min(bz+r,nb[2]-1); z++) {
+	for (int y=std::max(by-r,0); y<=std::min(by+r,nb[1]-1); y++) {
+	    for (int x=std::max(bx-r,0); x<=std::min(bx+r,nb[0]-1); x++) {
+		const real_type *c = Range(level, x, y, z);
+		mm[0] = std::min(mm[0], c[0]);
+		mm[1] = std::max(mm[1], c[1]);
+	    }
+	}
+    }
+    return Straddles(mm, isovalue);
+}
+
+
+void MinMaxPyramid::ActiveBlocks(int level, int bx, int by, int bz, real_type isovalue, int pad, vector<int> &blocks) const {
+
+    if (!Active(level, bx, by, bz, isovalue, pad))
+	return;
+
+    if (level == 0) {
+	blocks.push_back(BlockIndex(bx, by, bz));
+	return;
+    }
+
+    const vector<int> &nb = nblocks[level-1];
+    for (int z=2*bz; z<std::min(2*bz+2, nb[2]); z++) {
+	for (int y=2*by; y<std::min(2*by+2, nb[1]); y++) {
+	    for (int x=2*bx; x<std::min(2*bx+2, nb[0]); x++) {
+		ActiveBlocks(level-1, x, y, z, isovalue, pad, blocks);
+	    }
+	}
+    }
+}
+
+
+void MinMaxPyramid::ActiveBlocks(real_type isovalue, int pad, vector<int> &blocks) const {
+    blocks.clear();
+    ActiveBlocks(nblocks.size()-1, 0, 0, 0, isovalue, pad, blocks);
+}
+
+
+void MinMaxPyramid::BlockCells(int block, int lo[3], int hi[3]) const {
+    int b[3] = { block % nblocks[0][0], (block / nblocks[0][0]) % nblocks[0][1], block / (nblocks[0][0]*nblocks[0][1]) };
+    for (int i=0; i<3; i++) {
+	lo[i] = BLOCK*b[i];
+	hi[i] = std::min(BLOCK*(b[i]+1), dim[i]-1);
+    }
+}
+
+
+bool MinMaxPyramid::RowActive(int y, int z, real_type isovalue) const {
+    int by = std::min(y/BLOCK, nblocks[0][1]-1);
+    int bz = std::min(z/BLOCK, nblocks[0][2]-1);
+    for (int bx=0; bx<nblocks[0][0]; bx++) {
+	if (Straddles(Range(0, bx, by, bz), isovalue))
+	    return true;
+    }
+    return false;
+}
+
+
+void MinMaxPyramid::UniformPoints(int y, int z, real_type isovalue, real_type *vals, unsigned char *known) const {
+
+    int by[2] = { std::min(y/BLOCK, nblocks[0][1]-1), (y%BLOCK==0 && y>0) ? y/BLOCK-1 : -1 };
+    int bz[2] = { std::min(z/BLOCK, nblocks[0][2]-1), (z%BLOCK==0 && z>0) ? z/BLOCK-1 : -1 };
+
+    bool prev_uniform = true;
+    for (int bx=0; bx<nblocks[0][0]; bx++) {
+
+	// every block of the column the row passes through has to be on the same side
+	bool uniform = true;
+	real_type side = 0;
+	for (int j=0; j<2; j++) {
+	    for (int k=0; k<2; k++) {
+		if (by[j] < 0 || bz[k] < 0) continue;
+		const real_type *r = Range(0, bx, by[j], bz[k]);
+		if (Straddles(r, isovalue))
+		    uniform = false;
+		side = (r[0] > isovalue) ? r[0] : r[1];
+	    }
+	}
 
-#include <lib/mlslib/NR/nr.h>	// for zbrent?!?!?
+	// the first point is shared with the last block, the last gets redone by the next one
+	int xend = std::min(BLOCK*(bx+1), dim[0]-1);
+	for (int x=BLOCK*bx; x<=xend; x++) {
+	    known[x] = (uniform && (x > BLOCK*bx || prev_uniform));
+	    if (known[x])
+		vals[x] = side;
+	}
+	prev_uniform = uniform;
+    }
+}
 
 
-const real_type theta_step = M_PI_2/30;
-const real_type zbrent_tol = 1e-3;
 
-real_type iso_scale = 1; //1e9;
+// the size, spacing and every sample, for keying caches on the volume
+unsigned long long RegularVolume::ContentHash() const {
+    unsigned long long h = GuidanceCacheHash(dim, sizeof(dim));
+    h = GuidanceCacheHash(aspect, sizeof(aspect), h);
+    h = GuidanceCacheHash(&boundary_cells, sizeof(boundary_cells), h);
 
-bool endswith(const char *s, const char *end);
+    if (data && !morton)
+	return GuidanceCacheHash(data, sizeof(real_type)*(size_t)dim[0]*dim[1]*dim[2], h);
 
+    // a row at a time in the same order as the row major layout
+    vector<real_type> row(dim[0]);
+    for (int z=0; z<dim[2]; z++) {
+	for (int y=0; y<dim[1]; y++) {
+	    for (int x=0; x<dim[0]; x++)
+		row[x] = GetValue(x,y,z);
+	    h = GuidanceCacheHash(&row[0], sizeof(real_type)*row.size(), h);
+	}
+    }
+    return h;
+}
 
-#define ISO_CIRCULAR_PROJECTION
 
-extern int curvature_sub;
+int RegularVolume::BrickLoads() const {
+    return (bricks) ? bricks->Loads() : 0;
+}
 
 
-#define DIM 256
+bool RegularVolume::ReadBricked(const char *fname) {
 
-template <typename T>
-    int round_to_minus_inf(const T &x) {
-    return ((x>=0) ?
-	    (int)x :
-	    (int)x - 1);
+    Clear();
+
+    gtb::afree<FILE*> f(fopen(fname, "rb"), fclose);
+    if (f==0) {
+	cerr<<"couldn't open file "<<fname<<endl;
+	return false;
+    }
+
+    char header[brick_header_bytes+1];
+    if (fread(header, 1, brick_header_bytes, f) != brick_header_bytes) {
+	cerr<<"error reading bvol header"<<endl;
+	return false;
+    }
+    header[brick_header_bytes] = 0;
+
+    float faspect[3];
+    int brick_size = 0;
+    if (strncmp(header, "BVOL1\n", 6) ||
+	6 != sscanf(header, "BVOL1 sizes: %d %d %d spacings: %g %g %g",
+		    &dim[0], &dim[1], &dim[2], &faspect[0], &faspect[1], &faspect[2]) ||
+	!strstr(header, "brick: ") ||
+	1 != sscanf(strstr(header, "brick: "), "brick: %d", &brick_size) ||
+	brick_size<=0 || (brick_size & (brick_size-1))) {
+	cerr<<"error reading bvol header"<<endl;
+	return false;
+    }
+    aspect[0]=faspect[0]; aspect[1]=faspect[1]; aspect[2]=faspect[2];
+
+    size_t brick_bytes = sizeof(float) * brick_size*brick_size*brick_size;
+    int max_bricks = std::max(64, (int)(((size_t)brick_cache_mb<<20) / brick_bytes));
+
+    bricks = new BrickCache(fname, dim, brick_size, max_bricks);
+    if (!bricks->Ok()) {
+	cerr<<"couldn't open file "<<fname<<endl;
+	delete bricks;
+	bricks = NULL;
+	return false;
+    }
+
+    cerr<<"bricked volume "<<dim[0]<<"x"<<dim[1]<<"x"<<dim[2]<<", caching up to "<<max_bricks<<" "
+	<<brick_size<<"^3 bricks"<<endl;
+    return true;
 }
 
 
-RegularVolume::RegularVolume() {
-    dim[0]=dim[1]=dim[2]=0;
-    aspect[0]=aspect[1]=aspect[2]=1;
-    invalidate_all();
-    data = NULL;
-    boundary_cells = 0;
+bool RegularVolume::WriteBricked(const char *fname) const {
+
+    gtb::afree<FILE*> f(fopen(fname, "wb"), fclose);
+    if (f==0) {
+	cerr<<"couldn't open file "<<fname<<endl;
+	return false;
+    }
+
+    const int b = default_brick_size;
+    if (!WriteBrickHeader(f, dim, aspect, b))
+	return false;
+
+    vector<float> brick(b*b*b);
+    for (int bz=0; bz<dim[2]; bz+=b) {
+	for (int by=0; by<dim[1]; by+=b) {
+	    for (int bx=0; bx<dim[0]; bx+=b) {
+
+		for (int z=0; z<b; z++) {
+		    int zi = std::min(bz+z, dim[2]-1);
+		    for (int y=0; y<b; y++) {
+			int yi = std::min(by+y, dim[1]-1);
+			for (int x=0; x<b; x++) {
+			    brick[(z*b+y)*b+x] = (float)GetValue(std::min(bx+x, dim[0]-1), yi, zi);
+			}
+		    }
+		}
+
+		if (fwrite(&brick[0], sizeof(float), brick.size(), f) != brick.size()) {
+		    cerr<<"error writing "<<fname<<endl;
+		    return false;
+		}
+	    }
+	}
+    }
+
+    return true;
 }
 
 
-RegularVolume::~RegularVolume() {
-    if (data) delete [] data;
+// stream a raw volume out in bricks, only ever holding one slab of brick_size slices
+template <typename SOURCETYPE>
+    bool RegularVolume::BrickSource(VolumeSource &src, bool bigendian, const char *dst) {
+
+    gtb::afree<FILE*> out(fopen(dst, "wb"), fclose);
+    if (out==0) {
+	cerr<<"couldn't open file "<<dst<<endl;
+	return false;
+    }
+
+    const int b = default_brick_size;
+    if (!WriteBrickHeader(out, dim, aspect, b))
+	return false;
+
+    vector<float> slab((size_t)dim[0]*dim[1]*b);
+    vector<SOURCETYPE> row(dim[0]);
+    vector<float> brick(b*b*b);
+
+    real_type min_val = 1e34;
+    real_type max_val =-1e34;
+
+    for (int bz=0; bz<dim[2]; bz+=b) {
+
+	int nz = std::min(b, dim[2]-bz);
+	for (int z=0; z<nz; z++) {
+	    for (int y=0; y<dim[1]; y++) {
+
+		if (!src.Read(&row[0], sizeof(SOURCETYPE)*dim[0])) {
+		    cerr<<"volume file too short!"<<endl;
+		    return false;
+		}
+
+		for (int x=0; x<dim[0]; x++) {
+		    if (bigendian) {
+			char* endianswap = (char*)&row[x];
+			for (unsigned j=0; j<sizeof(SOURCETYPE)/2; j++) {
+			    std::swap(endianswap[j], endianswap[sizeof(SOURCETYPE)-j-1]);
+			}
+		    }
+
+		    real_type v = (real_type)row[x] * iso_scale;
+		    slab[((size_t)z*dim[1] + y)*dim[0] + x] = (float)v;
+
+		    min_val = std::min(min_val,v);
+		    max_val = std::max(max_val,v);
+		}
+	    }
+	}
+
+	for (int by=0; by<dim[1]; by+=b) {
+	    for (int bx=0; bx<dim[0]; bx+=b) {
+
+		for (int z=0; z<b; z++) {
+		    int zi = std::min(z, nz-1);
+		    for (int y=0; y<b; y++) {
+			int yi = std::min(by+y, dim[1]-1);
+			for (int x=0; x<b; x++) {
+			    int xi = std::min(bx+x, dim[0]-1);
+			    brick[(z*b+y)*b+x] = slab[((size_t)zi*dim[1] + yi)*dim[0] + xi];
+			}
+		    }
+		}
+
+		if (fwrite(&brick[0], sizeof(float), brick.size(), out) != brick.size()) {
+		    cerr<<"error writing "<<dst<<endl;
+		    return false;
+		}
+	    }
+	}
+    }
+
+    cerr<<"min value: "<<min_val<<endl;
+    cerr<<"max value: "<<max_val<<endl;
+
+    return true;
+}
+
+
+bool RegularVolume::ConvertToBricked(const char *src, const char *dst) {
+
+    convert_dst = dst;
+    bool ret = Read(src);
+    convert_dst = NULL;
+
+    // anything that can't be streamed (generated) just got loaded normally
+    if (ret && data)
+	ret = WriteBricked(dst);
+
+    return ret;
 }
 
 
 template <typename SOURCETYPE>
     bool RegularVolume::ReadSource(const char *fname, bool bigendian) {
 
+    Clear();
+
     real_type min_val = 1e34;
     real_type max_val =-1e34;
 
@@ -76,8 +1095,13 @@ template <typename SOURCETYPE>
 	    return false;
 	}
 
-	data = new real_type[dim[0]*dim[1]*dim[2]];
-	for (int i=0; i<(dim[0]*dim[1]*dim[2]); i++) {
+	if (convert_dst) {
+	    VolumeSource src(f);
+	    return BrickSource<SOURCETYPE>(src, bigendian, convert_dst);
+	}
+
+	data = new real_type[(size_t)dim[0]*dim[1]*dim[2]];
+	for (size_t i=0; i<(size_t)dim[0]*dim[1]*dim[2]; i++) {
 	    SOURCETYPE s;
 	    gzread(f, &s, sizeof(SOURCETYPE));
 
@@ -115,7 +1139,7 @@ template <typename SOURCETYPE>
 	if (dim[2] == 0) {
 
 	    fseek(f, 0, SEEK_END);
-	    int size = ftell(f);
+	    long size = ftell(f);
 
 	    if (size % (sizeof(SOURCETYPE)*dim[0]*dim[1])) {
 		cerr<<"volume file size strange: "<<size<<"!"<<endl;
@@ -125,12 +1149,30 @@ template <typename SOURCETYPE>
 	    dim[2] = size/(sizeof(SOURCETYPE)*dim[0]*dim[1]);
 	}
 
+	if (convert_dst) {
+	    fseek(f, 0, SEEK_SET);
+	    VolumeSource src(f);
+	    return BrickSource<SOURCETYPE>(src, bigendian, convert_dst);
+	}
+
+	// use the file in place, nothing is read until it's looked at
+	if (map_volumes) {
+	    size_t n = (size_t)dim[0]*dim[1]*dim[2];
+	    samples = new MappedSamples;
+	    if (samples->Open(fname, MappedSamples::TypeOf(SOURCETYPE()), n, bigendian, iso_scale)) {
+		cerr<<"mapped "<<n<<" samples of "<<fname<<endl;
+		return true;
+	    }
+	    delete samples;
+	    samples = NULL;
+	    return false;
+	}
 
-	data = new real_type[dim[0]*dim[1]*dim[2]];
+	data = new real_type[(size_t)dim[0]*dim[1]*dim[2]];
 
 	fseek(f, 0, SEEK_SET);
 
-	for (int i=0; i<(dim[0]*dim[1]*dim[2]); i++) {
+	for (size_t i=0; i<(size_t)dim[0]*dim[1]*dim[2]; i++) {
 	    SOURCETYPE s;
 	    fread(&s, sizeof(SOURCETYPE), 1, f);
 
@@ -233,9 +1275,13 @@ template <typename SOURCETYPE>
 	return false;
     }
 
-    for (int i=0; i<(dim[0]*dim[1]*dim[2]); i++) {
-	SOURCETYPE s = (SOURCETYPE)data[i];
-	fwrite(&s, sizeof(SOURCETYPE), 1, f);
+    for (int z=0; z<dim[2]; z++) {
+	for (int y=0; y<dim[1]; y++) {
+	    for (int x=0; x<dim[0]; x++) {
+		SOURCETYPE s = (SOURCETYPE)GetValue(x,y,z);
+		fwrite(&s, sizeof(SOURCETYPE), 1, f);
+	    }
+	}
     }
 
     return true;
@@ -248,6 +1294,8 @@ bool RegularVolume::Write(const char *fname) const {
 	return WriteSource<short>(fname);
     } else if (endswith(fname, ".float.vol")) {
 	return WriteSource<float>(fname);
+    } else if (endswith(fname, ".bvol")) {
+	return WriteBricked(fname);
     } else {
 	return false;
     }
@@ -256,6 +1304,8 @@ bool RegularVolume::Write(const char *fname) const {
 
 bool RegularVolume::Read(const char *fname) {
 
+    Clear();
+
     if (!stricmp(fname, "*gensphere.vol")) {
 	GenSphere();
 	return true;
@@ -279,6 +1329,8 @@ bool RegularVolume::Read(const char *fname) {
 	return ReadSource<float>(fname);
     } else if (endswith(fname, ".nhdr")) {
 	return ReadNRRD(fname);
+    } else if (endswith(fname, ".bvol")) {
+	return ReadBricked(fname);
     } else {
 	cerr<<"unknown volume format: "<<fname<<endl;
 	return false;
@@ -304,7 +1356,7 @@ void RegularVolume::GenSphere() {
 	for (int y=0; y<dim[1]; y++) {
 	    for (int z=0; z<dim[2]; z++) {
 		//				GetValue(x,y,z) = (real_type)(short)sqrt((double)(sx*(x-dim[0]/2)*(x-dim[0]/2) + sy*(y-dim[1]/2)*(y-dim[1]/2) + sz*(z-dim[2]/2)*(z-dim[2]/2)));
-		GetValue(x,y,z) = (real_type)sqrt((double)(sx*aspect[0]*aspect[0]*(x-dim[0]/2)*(x-dim[0]/2) + 
+		data[xyz2index(x,y,z)] = (real_type)sqrt((double)(sx*aspect[0]*aspect[0]*(x-dim[0]/2)*(x-dim[0]/2) + 
 							   sy*aspect[1]*aspect[1]*(y-dim[1]/2)*(y-dim[1]/2) + 
 							   sz*aspect[2]*aspect[2]*(z-dim[2]/2)*(z-dim[2]/2)));
 		//				GetValue(x,y,z) *= GetValue(x,y,z);
@@ -318,72 +1370,189 @@ void RegularVolume::Smooth(int width) {
 
     if (Empty()) return;
 
-    real_type *ndata = new real_type[dim[0]*dim[1]*dim[2]];
-
-    for (int x=0; x<dim[0]; x++) {
-	for (int y=0; y<dim[1]; y++) {
-	    for (int z=0; z<dim[2]; z++) {
+    if (OutOfCore()) {
+	cerr<<"can't smooth a bricked volume"<<endl;
+	return;
+    }
+    LoadSamples();
 
-		real_type sum=0;
-		ndata[xyz2index(x,y,z)] = 0;
+    // a tent of width samples, renormalized where it hangs off the edge
+    SeparableFilter f;
+    f.center = width/2;
+    f.clamp = false;
+    for (int k=0; k<width; k++)
+	f.taps.push_back((width/2 + 1 - fabs((real_type)(width/2) - k)) / (width/2 + 1));
 
-		for (int x2=0; x2<width; x2++) {
-		    for (int y2=0; y2<width; y2++) {
-			for (int z2=0; z2<width; z2++) {
+    Filter(data, f);
+    ClearValueRanges();
+}
 
-			    int xi = x+x2 - width/2;
-			    int yi = y+y2 - width/2;
-			    int zi = z+z2 - width/2;
 
-			    if (xi<0 || xi>=dim[0]) continue;
-			    if (yi<0 || yi>=dim[1]) continue;
-			    if (zi<0 || zi>=dim[2]) continue;
+void RegularVolume::PrefilterBSpline() {
 
-			    real_type xweight = (width/2 + 1 - fabs((real_type)(width/2) - x2)) / (width/2 + 1);
-			    real_type yweight = (width/2 + 1 - fabs((real_type)(width/2) - y2)) / (width/2 + 1);
-			    real_type zweight = (width/2 + 1 - fabs((real_type)(width/2) - z2)) / (width/2 + 1);
+    if (OutOfCore()) {
+	cerr<<"can't prefilter a bricked volume in memory"<<endl;
+	return;
+    }
 
-			    real_type weight = xweight*yweight*zweight;
-			    sum += weight;
+    LoadSamples();
+    SeparableFilter f;
+    f.SetBSpline();
+    Filter(data, f);
+    ClearValueRanges();
+}
 
-			    ndata[xyz2index(x,y,z)] += weight * GetValue(xi,yi,zi);
 
-			}
-		    }
-		}
+// one pass per axis.  x and y filter a z plane at a time, z takes a y plane at a time, so every
+// pass runs down whole rows of x and each plane only needs a copy of itself to read from
+void RegularVolume::Filter(real_type *vals, const SeparableFilter &f) const {
+    for (int axis=0; axis<3; axis++) {
+	int nplanes = (axis==2) ? dim[1] : dim[2];
+	ParallelFor(0, nplanes, 1, makeClassFunctor(this, &RegularVolume::FilterPlanes), vals, axis, f);
+    }
+}
 
-		ndata[xyz2index(x,y,z)] /= sum;
 
+void RegularVolume::FilterPlanes(int begin, int end, real_type *vals, int axis, const SeparableFilter &f) const {
+
+    // the plane is rows of x, down y for the x and y passes, down z for the z pass
+    int nrows = (axis==2) ? dim[2] : dim[1];
+    int n = dim[axis];
+    vector<real_type> plane(nrows*dim[0]);
+    vector<double> acc(dim[0]);
+    vector<real_type> result(dim[0]);	// rows of x aren't contiguous in the morton layout
+
+    // which rows (or x samples) land on each output, and their weights
+    vector<int> src;
+    vector<double> weight;
+    vector<int> first(n+1);
+    for (int i=0; i<n; i++) {
+	first[i] = src.size();
+	double sum = 0;
+	for (unsigned k=0; k<f.taps.size(); k++) {
+	    int j = i + (int)k - f.center;
+	    if (j<0 || j>=n) {
+		if (!f.clamp) continue;
+		j = std::max(0, std::min(j, n-1));
 	    }
+	    src.push_back(j);
+	    weight.push_back(f.taps[k]);
+	    sum += f.taps[k];
 	}
+	for (unsigned k=first[i]; k<weight.size(); k++)
+	    weight[k] /= sum;
     }
+    first[n] = src.size();
+
+    for (int pi=begin; pi<end; pi++) {
+
+	for (int r=0; r<nrows; r++) {
+	    int y = (axis==2) ? pi : r;
+	    int z = (axis==2) ? r : pi;
+	    if (!morton) {
+		const real_type *row = &vals[xyz2index(0,y,z)];
+		std::copy(row, row+dim[0], &plane[r*dim[0]]);
+	    } else {
+		for (int x=0; x<dim[0]; x++)
+		    plane[r*dim[0] + x] = vals[xyz2index(x,y,z)];
+	    }
+	}
 
+	for (int r=0; r<nrows; r++) {
+	    int y = (axis==2) ? pi : r;
+	    int z = (axis==2) ? r : pi;
+	    real_type *out = (morton) ? &result[0] : &vals[xyz2index(0,y,z)];
+
+	    if (axis == 0) {
+		const real_type *in = &plane[r*dim[0]];
+		for (int x=0; x<dim[0]; x++) {
+		    double sum = 0;
+		    for (int k=first[x]; k<first[x+1]; k++)
+			sum += weight[k] * in[src[k]];
+		    out[x] = (real_type)sum;
+		}
+	    } else {
+
+		// whole rows at a time, so the inner loop runs straight down x
+		std::fill(acc.begin(), acc.end(), 0.0);
+		for (int k=first[r]; k<first[r+1]; k++) {
+		    const real_type *in = &plane[src[k]*dim[0]];
+		    double w = weight[k];
+		    for (int x=0; x<dim[0]; x++)
+			acc[x] += w * in[x];
+		}
+		for (int x=0; x<dim[0]; x++)
+		    out[x] = (real_type)acc[x];
+	    }
 
-    delete [] data;
-    data = ndata;
-
+	    if (morton) {
+		for (int x=0; x<dim[0]; x++)
+		    vals[xyz2index(x,y,z)] = result[x];
+	    }
+	}
+    }
 }
 
 
 
 void RegularVolume::Gather(const int cell[3], double nbrs[4][4][4]) const {
 
+    int idx[3][4];
+    for (int i=0; i<3; i++) {
+	for (int j=0; j<4; j++) {
+	    int t = cell[i]+j-1;
+	    if (t<0) t=0;
+	    else if (t>=dim[i]) t=dim[i]-1;
+	    idx[i][j] = t;
+	}
+    }
+
+    if (bricks) {
+	bricks->Gather(idx, nbrs);
+	return;
+    }
+
+    if (samples) {
+	samples->Gather(dim, idx, nbrs);
+	return;
+    }
+
+    // the index is a sum of a part per axis in either layout
+    size_t off[3][4];
+    for (int j=0; j<4; j++) {
+	off[0][j] = xyz2index(idx[0][j], 0, 0);
+	off[1][j] = xyz2index(0, idx[1][j], 0);
+	off[2][j] = xyz2index(0, 0, idx[2][j]);
+    }
+
     for (int x=0; x<4; x++) {
-	int xi = cell[0]+x-1;
-	if (xi<0) xi=0;
-	else if (xi>=dim[0]) xi=dim[0]-1;
 	for (int y=0; y<4; y++) {
-	    int yi = cell[1]+y-1;
-	    if (yi<0) yi=0;
-	    else if (yi>=dim[1]) yi=dim[1]-1;
 	    for (int z=0; z<4; z++) {
-		int zi = cell[2]+z-1;
-		if (zi<0) zi=0;
-		else if (zi>=dim[2]) zi=dim[2]-1;
-		nbrs[x][y][z] = (double)GetValue(xi, yi, zi);
+		nbrs[x][y][z] = (double)data[off[0][x] + off[1][y] + off[2][z]];
+	    }
+	}
+    }
+}
+
+
+// at a knot the cubic bspline is just the (1 4 1)/6 tensor product stencil
+real_type RegularVolume::BSplineValue(int x, int y, int z) const {
+
+    static const double w[3] = { 1/6.0, 4/6.0, 1/6.0 };
+
+    int cell[3] = { x, y, z };
+    double nbrs[4][4][4];
+    Gather(cell, nbrs);
+
+    double sum=0;
+    for (int i=0; i<3; i++) {
+	for (int j=0; j<3; j++) {
+	    for (int k=0; k<3; k++) {
+		sum += w[i]*w[j]*w[k]*nbrs[i][j][k];
 	    }
 	}
     }
+    return (real_type)sum;
 }
 
 
@@ -408,8 +1577,77 @@ bool RegularVolume::LocalInfo(const Point3 &p, int cell[3], double xl[3]) const
 
 
 
-int RegularVolume::xyz2index(int x, int y, int z) const {
-    return (z*dim[0]*dim[1] + y*dim[0] + x);
+// the morton layout is tiles of morton_tile^3 samples, in row major order, with the samples of a
+// tile in morton order - the bits of x, y and z interleaved, x lowest.  the edge tiles are padded
+static const int morton_tile_bits = 5;
+static const int morton_tile = 1<<morton_tile_bits;
+
+
+size_t RegularVolume::StorageSize() const {
+    if (!morton)
+	return (size_t)dim[0]*dim[1]*dim[2];
+    size_t n = 1;
+    for (int i=0; i<3; i++)
+	n *= (size_t)((dim[i] + morton_tile-1) / morton_tile) * morton_tile;
+    return n;
+}
+
+
+void RegularVolume::SetMortonLayout(bool m) {
+
+    if (Empty() || (m == morton && !samples))
+	return;
+
+    if (OutOfCore()) {
+	cerr<<"a bricked volume is already tiled"<<endl;
+	return;
+    }
+
+    LoadSamples();
+    if (m == morton)
+	return;
+
+    // the part of the index from each axis: the tile's offset plus the coordinate's bits in the
+    // tile, spread out to every third bit
+    if (m) {
+	int ntiles[3];
+	for (int i=0; i<3; i++)
+	    ntiles[i] = (dim[i] + morton_tile-1) / morton_tile;
+	size_t tile_stride[3] = { 1, (size_t)ntiles[0], (size_t)ntiles[0]*ntiles[1] };
+	for (int i=0; i<3; i++) {
+	    morton_offsets[i].resize(dim[i]);
+	    for (int c=0; c<dim[i]; c++) {
+		size_t spread = 0;
+		for (int b=0; b<morton_tile_bits; b++)
+		    spread |= (size_t)((c>>b)&1) << (3*b + i);
+		morton_offsets[i][c] = (size_t)(c>>morton_tile_bits) * tile_stride[i] * morton_tile*morton_tile*morton_tile + spread;
+	    }
+	}
+    }
+
+    real_type *old = data;
+    morton = m;
+    data = new real_type[StorageSize()];
+    memset(data, 0, sizeof(real_type)*StorageSize());
+
+    for (int z=0; z<dim[2]; z++) {
+	for (int y=0; y<dim[1]; y++) {
+	    for (int x=0; x<dim[0]; x++) {
+		size_t row_major = ((size_t)z*dim[1] + y)*dim[0] + x;
+		size_t tiled = morton_offsets[0][x] + morton_offsets[1][y] + morton_offsets[2][z];
+		if (m)
+		    data[tiled] = old[row_major];
+		else
+		    data[row_major] = old[tiled];
+	    }
+	}
+    }
+    delete [] old;
+
+    if (!m) {
+	for (int i=0; i<3; i++)
+	    morton_offsets[i].clear();
+    }
 }
 
 
@@ -442,49 +1680,19 @@ void RegularVolume::compute_centroid() const {
 
 
 
-void RegularVolume::GetBSplineValuesParallel(int nt, int id, const TrivariateSpline<double> &spline, real_type *ret) const {
-
-    for (int z=id; z<dim[2]; z+=nt) {
-	for (int y=0; y<dim[1]; y++) {
-	    for (int x=0; x<dim[0]; x++) {
-
-		int cell[3];
-		double nbrs[4][4][4];
-		double xl[3];
-
-		Point3 p((real_type)x*aspect[0], (real_type)y*aspect[1], (real_type)z*aspect[2]);
-
-		real_type val;
-
-		if (!LocalInfo(p, cell, xl)) {
-		    val = data[xyz2index(x,y,z)];
-		    cerr<<"!LocalInfo"<<endl;
-		} else {
-		    Gather(cell, nbrs);
-		    val = spline.Eval(aspect[0], aspect[1], aspect[2], nbrs, xl);
-		}
-
-		ret[xyz2index(x,y,z)] = val;
-	    }
-	}
-    }
-}
-
-
 real_type* RegularVolume::GetBSplineValues() const {
 
-    real_type *ret = new real_type[dim[0]*dim[1]*dim[2]];
-
-    extern bool allow_outside;
-    bool oldallow=allow_outside;
-    allow_outside=true;
-
-    TrivariateSpline<double> spline;
-    spline.SetCoefsBSpline();
-    ParallelExecutor(idealNumThreads, makeClassFunctor(this, &RegularVolume::GetBSplineValuesParallel), spline, ret);
-
-    allow_outside=oldallow;
+    if (OutOfCore()) {
+	cerr<<"can't prefilter a bricked volume in memory"<<endl;
+	BREAK;
+	return NULL;
+    }
 
+    // at the grid points the spline is the same 1 4 1 filter BSplineValue uses
+    real_type *ret = CopyValues();
+    SeparableFilter f;
+    f.SetBSpline();
+    Filter(ret, f);
     return ret;
 }
 
@@ -518,6 +1726,8 @@ int IsoSurfaceProjector::ProjectPoint(const Point3 &fp, Point3 &tp, Vector3 &tn)
     while (1) {
 
 	iter++;
+	Profile::Count(PROF_PROJECT_ITERATIONS);
+	Profile::Maximum(PROF_MAX_PROJECT_ITERATIONS, iter);
 	if (iter>50) {
 	    cerr<<"!";
 	    return PROJECT_FAILURE;
@@ -539,8 +1749,7 @@ int IsoSurfaceProjector::ProjectPoint(const Point3 &fp, Point3 &tp, Vector3 &tn)
 
 
 	double gradient[3];
-	spline.Gradient(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, gradient);
-	double f = spline.Eval(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl);
+	double f = spline.EvalGradient(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, gradient);
 
 	double step = -(f-isovalue) / (gradient[0]*gradient[0] + gradient[1]*gradient[1] + gradient[2]*gradient[2]);
 
@@ -581,6 +1790,8 @@ int IsoSurfaceProjector::ProjectPointInCell(const Point3 &fp, Point3 &tp, Vector
     while (1) {
 
 	iter++;
+	Profile::Count(PROF_PROJECT_ITERATIONS);
+	Profile::Maximum(PROF_MAX_PROJECT_ITERATIONS, iter);
 	if (iter>50) {
 	    cerr<<"!";
 	    return PROJECT_FAILURE;
@@ -603,8 +1814,7 @@ int IsoSurfaceProjector::ProjectPointInCell(const Point3 &fp, Point3 &tp, Vector
 
 
 	double gradient[3];
-	spline.Gradient(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, gradient);
-	double f = spline.Eval(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl);
+	double f = spline.EvalGradient(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, gradient);
 
 	double step = -(f-isovalue) / (gradient[0]*gradient[0] + gradient[1]*gradient[1] + gradient[2]*gradient[2]);
 
@@ -744,7 +1954,7 @@ int IsoSurfaceProjector::ProjectPoint(const FrontElement &base1, const FrontElem
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void IsoSurfaceGuidanceField::BuildGuidanceParallel(int nt, int id, real_type isovalue, IsoSurfaceProjector &projector, const real_type *values) { 
+void IsoSurfaceGuidanceField::BuildGuidanceParallel(int nt, int id, real_type isovalue, IsoSurfaceProjector &projector, bool bspline, const real_type *values, const vector<int> &blocks) { 
 
     vector<Point3> mypoints;
     vector<Vector3> mynorms;
@@ -756,9 +1966,16 @@ void IsoSurfaceGuidanceField::BuildGuidanceParallel(int nt, int id, real_type is
     mycurvatures.reserve(10000);
 
 
-    for (int z=0+id; z<volume.GetDim(2)-1; z+=nt) {
-	for (int y=0; y<volume.GetDim(1)-1; y++) {
-	    for (int x=0; x<volume.GetDim(0)-1; x++) {
+    // only the blocks that can have a cell that passes the test below, built before we started
+    const MinMaxPyramid &ranges = volume.ValueRanges(bspline, values);
+
+    for (unsigned b=id; b<blocks.size(); b+=nt) {
+      int lo[3], hi[3];
+      ranges.BlockCells(blocks[b], lo, hi);
+
+      for (int z=lo[2]; z<hi[2]; z++) {
+	for (int y=lo[1]; y<hi[1]; y++) {
+	    for (int x=lo[0]; x<hi[0]; x++) {
 	      
 
 		real_type max = -1e34;
@@ -777,7 +1994,8 @@ void IsoSurfaceGuidanceField::BuildGuidanceParallel(int nt, int id, real_type is
 				    t[i] = volume.GetDim(i)-1;
 			    }
 
-			    real_type f = values[volume.xyz2index(t[0],t[1],t[2])];
+			    real_type f = (values) ? values[volume.xyz2index(t[0],t[1],t[2])] :
+				(bspline) ? volume.BSplineValue(t[0],t[1],t[2]) : volume.GetValue(t[0],t[1],t[2]);
 			    max = std::max(max, f);
 			    min = std::min(min, f);
 			}
@@ -850,6 +2068,7 @@ void IsoSurfaceGuidanceField::BuildGuidanceParallel(int nt, int id, real_type is
 		}
 	    }
 	}
+      }
     }
 
     cs.enter();
@@ -871,8 +2090,10 @@ void IsoSurfaceGuidanceField::BuildGuidanceParallel(int nt, int id, real_type is
 
 
 
-IsoSurfaceGuidanceField::IsoSurfaceGuidanceField(IsoSurfaceProjector &projector, const RegularVolume &vol, bool bspline, real_type rho, real_type min_step, real_type max_step, real_type reduction)
-    : GuidanceField(rho, min_step, max_step, reduction), volume(vol), kdGetPoint(), kdOrderedTraverse(NULL), guidanceNormals(NULL) {
+IsoSurfaceGuidanceField::IsoSurfaceGuidanceField(IsoSurfaceProjector &projector, const RegularVolume &vol, bool bspline, real_type rho, real_type min_step, real_type max_step, real_type reduction, const real_type *prefiltered)
+    : GuidanceField(rho, min_step, max_step, reduction), volume(vol), kdGetPoint(), guidanceNormals(NULL) {
+
+    ProfileTimer pt(PROF_TIME_GUIDANCE_BUILD);
 
     if (bspline)
 	spline.SetCoefsBSpline();
@@ -887,9 +2108,26 @@ IsoSurfaceGuidanceField::IsoSurfaceGuidanceField(IsoSurfaceProjector &projector,
 
 
     real_type isovalue = projector.GetIsoValue();
-    real_type *values = (bspline) ? volume.GetBSplineValues() : volume.CopyValues();
-    ParallelExecutor(idealNumThreads, makeClassFunctor(this,&IsoSurfaceGuidanceField::BuildGuidanceParallel), isovalue, projector, values);
-    delete [] values;
+
+    extern int grid_intersect_overestimate;
+    GuidanceCacheKey key(GUIDANCE_CACHE_ISO, 0, rho, min_step, max_step, reduction);
+    key.params[0] = bspline;
+    key.params[1] = curvature_sub;
+    key.params[2] = grid_intersect_overestimate;
+    if (GuidanceCacheEnabled()) {
+	float iso = (float)isovalue;
+	key.input_hash = GuidanceCacheHash(&iso, sizeof(iso), volume.ContentHash());
+	if (LoadCache(key))
+	    return;
+    }
+
+    // only prefilter the whole volume when it fits in memory, otherwise evaluate as we go
+    real_type *own_values = (bspline && !prefiltered && !volume.OutOfCore()) ? volume.GetBSplineValues() : NULL;
+    const real_type *values = (bspline && prefiltered) ? prefiltered : own_values;
+    vector<int> blocks;
+    volume.ValueRanges(bspline, values).ActiveBlocks(isovalue, grid_intersect_overestimate, blocks);
+    ParallelExecutor(idealNumThreads, makeClassFunctor(this,&IsoSurfaceGuidanceField::BuildGuidanceParallel), isovalue, projector, bspline, values, blocks);
+    if (own_values) delete [] own_values;
 
     // setup the kdtree
     kdtree = new kdtree_type(10, volume.bounding_box(), kdGetPoint);
@@ -923,8 +2161,9 @@ IsoSurfaceGuidanceField::IsoSurfaceGuidanceField(IsoSurfaceProjector &projector,
 	    keep_curv.push_back(ideal_length[i]);
 	}
     }
-    kdGetPoint.allpoints = keepers;
-    ideal_length = keep_curv;
+    // keepers and keep_curv end up with the untrimmed field, for the cache
+    kdGetPoint.allpoints.swap(keepers);
+    ideal_length.swap(keep_curv);
 
 
     if (guidanceNormals) {
@@ -953,13 +2192,66 @@ IsoSurfaceGuidanceField::IsoSurfaceGuidanceField(IsoSurfaceProjector &projector,
 	kdtree->Insert(i);
     kdtree->MakeTree();
 
+    if (GuidanceCacheEnabled())
+	SaveCache(key, keepers, keep_curv, marked);
+
+    cerr<<"Guidance field with "<<kdGetPoint.allpoints.size()<<" points"<<endl;
+
+}
+
+
+// only the points that survived trimming get used, the same as a fresh build
+bool IsoSurfaceGuidanceField::LoadCache(const GuidanceCacheKey &key) {
+
+    GuidanceCacheFile cache;
+    if (!cache.Open(key))
+	return false;
+
+    const GuidanceCacheData &d = cache.data;
+    if (d.npositions != d.npoints)
+	return false;
+
+    kdGetPoint.allpoints.clear();
+    ideal_length.clear();
+    for (int i=0; i<d.npoints; i++) {
+	if (!d.marked[i]) {
+	    kdGetPoint.allpoints.push_back(Point3((real_type)d.positions[i*3+0], (real_type)d.positions[i*3+1], (real_type)d.positions[i*3+2]));
+	    ideal_length.push_back((real_type)d.ideal_length[i]);
+	}
+    }
+    kdtree = GuidanceCacheLoadTree<kdtree_type>(d, kdGetPoint);
+
     cerr<<"Guidance field with "<<kdGetPoint.allpoints.size()<<" points"<<endl;
+    return true;
+}
 
+
+void IsoSurfaceGuidanceField::SaveCache(const GuidanceCacheKey &key, const vector<Point3> &points,
+					const vector<real_type> &ideal, const vector<int> &marked) const {
+
+    vector<double> positions(points.size()*3);
+    for (unsigned i=0; i<points.size(); i++) {
+	for (int j=0; j<3; j++)
+	    positions[i*3+j] = points[i][j];
+    }
+    vector<double> dideal(ideal.begin(), ideal.end());
+    vector<unsigned char> trimmed(marked.begin(), marked.end());
+
+    GuidanceCacheData d;
+    d.npoints = points.size();
+    d.ideal_length = dideal.empty() ? NULL : &dideal[0];
+    d.npositions = points.size();
+    d.positions = positions.empty() ? NULL : &positions[0];
+    d.marked = trimmed.empty() ? NULL : &trimmed[0];
+
+    vector<int> codes, objects;
+    vector<double> cuts;
+    GuidanceCacheStoreTree(*kdtree, d, codes, cuts, objects);
+    WriteGuidanceCache(key, d);
 }
 
 
 IsoSurfaceGuidanceField::~IsoSurfaceGuidanceField() {
-    if (kdOrderedTraverse) delete kdOrderedTraverse;
     delete kdtree;
 }
 
@@ -969,20 +2261,18 @@ int IsoSurfaceGuidanceField::ClosestPoint(const Point3 &p) {
 }
 
 
-void IsoSurfaceGuidanceField::OrderedPointTraverseStart(const Point3 &p) {
-    if (kdOrderedTraverse)
-	delete kdOrderedTraverse;
-    kdOrderedTraverse = new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
+void* IsoSurfaceGuidanceField::OrderedPointTraverseStart(const Point3 &p) const {
+    return new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
 }
 
-int IsoSurfaceGuidanceField::OrderedPointTraverseNext(real_type &squared_dist) {
-    if (kdOrderedTraverse->empty()) return -1;
-    return kdOrderedTraverse->GetNext(squared_dist);
+int IsoSurfaceGuidanceField::OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const {
+    kdtree_type::OrderedIncrementalTraverse *traverse = (kdtree_type::OrderedIncrementalTraverse*)ctx;
+    if (traverse->empty()) return -1;
+    return traverse->GetNext(squared_dist);
 }
 
-void IsoSurfaceGuidanceField::OrderedPointTraverseEnd() {
-    delete kdOrderedTraverse;
-    kdOrderedTraverse = NULL;
+void IsoSurfaceGuidanceField::OrderedPointTraverseEnd(void *ctx) const {
+    delete (kdtree_type::OrderedIncrementalTraverse*)ctx;
 }
 
 
@@ -1057,10 +2347,8 @@ bool IsoSurfaceGuidanceField::CurvatureAtPoint(const Point3 &p, real_type &k1, r
     typedef gtb::tmat3<double> mat3;
 
     mat3 H;
-    spline.Hessian(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, H);
-
     double gradient[3];
-    spline.Gradient(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, gradient);
+    spline.EvalGradientHessian(volume.GetAspect(0), volume.GetAspect(1), volume.GetAspect(2), nbrs, xl, gradient, H);
 
     
     gtb::tVector3<double> normal(gradient[0], gradient[1], gradient[2]);
@@ -1092,19 +2380,153 @@ bool IsoSurfaceGuidanceField::CurvatureAtPoint(const Point3 &p, real_type &k1, r
 
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// time value+gradient+hessian through the fused kernel against the sparse coefficient path
+// on random neighborhoods, and make sure they agree
+void BenchmarkSplineKernel(int n) {
 
+    const double aspect[3] = { 1, 1, 2 };
+    const int num_nbrs = 64;
 
+    vector<double> samples(num_nbrs*64);
+    vector<double> locals(n*3);
+    for (unsigned i=0; i<samples.size(); i++)
+	samples[i] = myran1f(0);
+    for (int i=0; i<n; i++) {
+	for (int j=0; j<3; j++)
+	    locals[i*3+j] = myran1f(0) * aspect[j];
+    }
 
+    for (int kind=0; kind<2; kind++) {
+
+	TrivariateSpline<double> spline;
+	if (kind==0)
+	    spline.SetCoefsBSpline();
+	else
+	    spline.SetCoefsCatmullRom();
+
+	double sum_sparse=0, sum_fused=0, max_err=0;
+
+	double start = Profile::Now();
+	for (int i=0; i<n; i++) {
+	    const double (*p)[4][4] = (const double (*)[4][4])&samples[(i%num_nbrs)*64];
+	    const double *x = &locals[i*3];
+	    double g[3];
+	    gtb::tmat3<double> h;
+	    sum_sparse += spline.EvalSparse(aspect[0], aspect[1], aspect[2], p, x);
+	    spline.GradientSparse(aspect[0], aspect[1], aspect[2], p, x, g);
+	    spline.HessianSparse(aspect[0], aspect[1], aspect[2], p, x, h);
+	    sum_sparse += g[0] + h[0][1];
+	}
+	double sparse_time = Profile::Now() - start;
+
+	start = Profile::Now();
+	for (int i=0; i<n; i++) {
+	    const double (*p)[4][4] = (const double (*)[4][4])&samples[(i%num_nbrs)*64];
+	    const double *x = &locals[i*3];
+	    double g[3];
+	    gtb::tmat3<double> h;
+	    sum_fused += spline.EvalGradientHessian(aspect[0], aspect[1], aspect[2], p, x, g, h);
+	    sum_fused += g[0] + h[0][1];
+	}
+	double fused_time = Profile::Now() - start;
+
+	// compare every output on a subset
+	for (int i=0; i<std::min(n, 1000); i++) {
+	    const double (*p)[4][4] = (const double (*)[4][4])&samples[(i%num_nbrs)*64];
+	    const double *x = &locals[i*3];
+	    double g1[3], g2[3];
+	    gtb::tmat3<double> h1, h2;
+	    double f1 = spline.EvalSparse(aspect[0], aspect[1], aspect[2], p, x);
+	    spline.GradientSparse(aspect[0], aspect[1], aspect[2], p, x, g1);
+	    spline.HessianSparse(aspect[0], aspect[1], aspect[2], p, x, h1);
+	    double f2 = spline.EvalGradientHessian(aspect[0], aspect[1], aspect[2], p, x, g2, h2);
+
+	    max_err = std::max(max_err, fabs(f1-f2));
+	    for (int j=0; j<3; j++) {
+		max_err = std::max(max_err, fabs(g1[j]-g2[j]));
+		for (int k=0; k<3; k++)
+		    max_err = std::max(max_err, fabs(h1[j][k]-h2[j][k]));
+	    }
+	}
 
+	cerr << "[TIMING] " << ((kind==0) ? "B-spline" : "Catmull-Rom") << " value+gradient+hessian x" << n
+	     << ": sparse " << sparse_time << "s, fused " << fused_time << "s ("
+	     << sparse_time / std::max(fused_time, 1e-9) << "x), max difference " << max_err
+	     << " (checksums " << sum_sparse << " " << sum_fused << ")" << endl;
+    }
+}
 
 
+// project the same points onto an isosurface of v with the samples row major and in morton order.
+// the starting points are in random cells the surface passes through, scattered over the whole
+// volume the way the projections of a big front are
+void BenchmarkVolumeLayout(RegularVolume &v, real_type isovalue, bool bspline, int n) {
 
+    if (v.Empty() || v.OutOfCore()) {
+	cerr<<"bench_layout needs a volume in memory"<<endl;
+	return;
+    }
 
+    vector<Point3> starts;
+    for (int tries=0; (int)starts.size()<n && tries<1000*n; tries++) {
+	int c[3];
+	for (int i=0; i<3; i++)
+	    c[i] = std::min((int)(myran1f(0) * (v.GetDim(i)-1)), v.GetDim(i)-2);
 
+	int below=0, above=0;
+	for (int k=0; k<8; k++) {
+	    real_type f = v.GetValue(c[0]+(k&1), c[1]+((k>>1)&1), c[2]+(k>>2));
+	    if (f < isovalue) below++; else above++;
+	}
+	if (!below || !above)
+	    continue;
 
+	Point3 p;
+	for (int i=0; i<3; i++)
+	    p[i] = (real_type)(v.GetAspect(i) * (c[i] + myran1f(0)));
+	starts.push_back(p);
+    }
 
+    if (starts.empty()) {
+	cerr<<"isovalue "<<isovalue<<" isn't in the volume"<<endl;
+	return;
+    }
 
+    bool was = v.MortonLayout();
+    for (int layout=0; layout<2; layout++) {
+	v.SetMortonLayout(layout==1);
+	IsoSurfaceProjector projector(v, isovalue, bspline);
+
+	// just the neighborhood lookups first, then the whole projection
+	double sum=0;
+	double start = Profile::Now();
+	for (unsigned i=0; i<starts.size(); i++) {
+	    int cell[3];
+	    double nbrs[4][4][4];
+	    for (int j=0; j<3; j++)
+		cell[j] = round_to_minus_inf(starts[i][j]/v.GetAspect(j));
+	    v.Gather(cell, nbrs);
+	    sum += nbrs[1][2][3];
+	}
+	double gather_time = Profile::Now() - start;
+
+	int projected=0;
+	start = Profile::Now();
+	for (unsigned i=0; i<starts.size(); i++) {
+	    Point3 tp;
+	    Vector3 tn;
+	    if (projector.ProjectPoint(starts[i], tp, tn) == PROJECT_SUCCESS) {
+		projected++;
+		sum += tp[0] + tp[1] + tp[2];
+	    }
+	}
+	double project_time = Profile::Now() - start;
 
-
-
+	cerr << "[TIMING] " << ((layout==0) ? "Row major" : "Morton") << " layout, " << starts.size() << " points: gather "
+	     << gather_time << "s, project " << project_time << "s ("
+	     << starts.size() / std::max(project_time, 1e-9) << " projections/s, " << projected << " converged, checksum " << sum << ")" << endl;
+    }
+    v.SetMortonLayout(was);
+}
@@ -2,13 +2,71 @@
 #ifndef _TRIANGULATE_ISO
 #define	_TRIANGULATE_ISO
 
+#if defined(__SSE2__) || defined(_M_X64)
+#define SPLINE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+
+// four running sums for the tensor product contraction, one per z sample.
+// the z samples of a gathered neighborhood are contiguous, so each sample row is one vector op
+template <typename T>
+    class SplineLanes {
+    public:
+
+    void zero() { v[0]=v[1]=v[2]=v[3]=0; }
+
+    // this += s*row
+    void madd(T s, const T row[4]) {
+	v[0]+=s*row[0]; v[1]+=s*row[1]; v[2]+=s*row[2]; v[3]+=s*row[3];
+    }
+    void madd(T s, const SplineLanes &l) { madd(s, l.v); }
+
+    T dot(const T w[4]) const {
+	return v[0]*w[0] + v[1]*w[1] + v[2]*w[2] + v[3]*w[3];
+    }
+
+    private:
+    T v[4];
+};
+
+
+#ifdef SPLINE_SSE2
+template <>
+    class SplineLanes<double> {
+    public:
+
+    void zero() { lo = hi = _mm_setzero_pd(); }
+
+    void madd(double s, const double row[4]) {
+	__m128d ss = _mm_set1_pd(s);
+	lo = _mm_add_pd(lo, _mm_mul_pd(ss, _mm_loadu_pd(row)));
+	hi = _mm_add_pd(hi, _mm_mul_pd(ss, _mm_loadu_pd(row+2)));
+    }
+    void madd(double s, const SplineLanes &l) {
+	__m128d ss = _mm_set1_pd(s);
+	lo = _mm_add_pd(lo, _mm_mul_pd(ss, l.lo));
+	hi = _mm_add_pd(hi, _mm_mul_pd(ss, l.hi));
+    }
+
+    double dot(const double w[4]) const {
+	__m128d d = _mm_add_pd(_mm_mul_pd(lo, _mm_loadu_pd(w)), _mm_mul_pd(hi, _mm_loadu_pd(w+2)));
+	return _mm_cvtsd_f64(_mm_add_sd(d, _mm_unpackhi_pd(d, d)));
+    }
+
+    private:
+    __m128d lo, hi;
+};
+#endif
+
 
 
 template <typename T>
     class TrivariateSpline {
     public:
 
-    TrivariateSpline() { }
+    TrivariateSpline() : is_bspline(false) { }
 
 	
     void SetCoefsCatmullRom(real_type tau=0.5) {
@@ -23,10 +81,102 @@ template <typename T>
 					       -3/6.0,  0/6.0,  3/6.0, 0/6.0,
 					       3/6.0, -6/6.0,  3/6.0, 0/6.0,
 					       -1/6.0,  3/6.0, -3/6.0, 1/6.0));
+	is_bspline = true;
+    }
+
+
+    T Eval(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3]) const {
+	T value, gradient[3];
+	Evaluate<0>(xaspect, yaspect, zaspect, p, x, value, gradient, NULL);
+	return value;
+    }
+
+    void Gradient(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], T gradient[3]) const {
+	T value;
+	Evaluate<1>(xaspect, yaspect, zaspect, p, x, value, gradient, NULL);
+    }
+
+    void Hessian(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], gtb::tmat3<T> &hessian) const {
+	T value, gradient[3];
+	Evaluate<2>(xaspect, yaspect, zaspect, p, x, value, gradient, &hessian);
+    }
+
+    // value and gradient from the same pass over the samples
+    T EvalGradient(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], T gradient[3]) const {
+	T value;
+	Evaluate<1>(xaspect, yaspect, zaspect, p, x, value, gradient, NULL);
+	return value;
+    }
+
+    // value, gradient and hessian from the same pass over the samples
+    T EvalGradientHessian(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], T gradient[3], gtb::tmat3<T> &hessian) const {
+	T value;
+	Evaluate<2>(xaspect, yaspect, zaspect, p, x, value, gradient, &hessian);
+	return value;
+    }
+
+
+    // the separable kernel - ORDER is how many derivatives to compute (0-2), so the
+    // unneeded sums drop out at compile time.  the 4x4x4 neighborhood gets contracted
+    // along y, then x, leaving 4 lanes per output that get dotted with the z weights
+    template <int ORDER>
+	void Evaluate(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3],
+		      T &value, T gradient[3], gtb::tmat3<T> *hessian) const {
+
+	// weights and their first/second derivatives along each axis
+	T wx[3][4], wy[3][4], wz[3][4];
+	AxisWeights(x[0], 1/xaspect, wx);
+	AxisWeights(x[1], 1/yaspect, wy);
+	AxisWeights(x[2], 1/zaspect, wz);
+
+	SplineLanes<T> v, vx, vy, vxx, vxy, vyy;
+	v.zero(); vx.zero(); vy.zero(); vxx.zero(); vxy.zero(); vyy.zero();
+
+	for (int i=0; i<4; i++) {
+
+	    SplineLanes<T> s, sy, syy;
+	    s.zero(); sy.zero(); syy.zero();
+
+	    for (int j=0; j<4; j++) {
+		s.madd(wy[0][j], p[i][j]);
+		if (ORDER>0) sy.madd(wy[1][j], p[i][j]);
+		if (ORDER>1) syy.madd(wy[2][j], p[i][j]);
+	    }
+
+	    v.madd(wx[0][i], s);
+	    if (ORDER>0) {
+		vx.madd(wx[1][i], s);
+		vy.madd(wx[0][i], sy);
+	    }
+	    if (ORDER>1) {
+		vxx.madd(wx[2][i], s);
+		vxy.madd(wx[1][i], sy);
+		vyy.madd(wx[0][i], syy);
+	    }
+	}
+
+	value = v.dot(wz[0]);
+
+	if (ORDER>0) {
+	    gradient[0] = vx.dot(wz[0]);
+	    gradient[1] = vy.dot(wz[0]);
+	    gradient[2] = v.dot(wz[1]);
+	}
+
+	if (ORDER>1) {
+	    gtb::tmat3<T> &h = *hessian;
+	    h[0][0] = vxx.dot(wz[0]);
+	    h[1][1] = vyy.dot(wz[0]);
+	    h[2][2] = v.dot(wz[2]);
+	    h[0][1] = h[1][0] = vxy.dot(wz[0]);
+	    h[0][2] = h[2][0] = vx.dot(wz[1]);
+	    h[1][2] = h[2][1] = vy.dot(wz[1]);
+	}
     }
 
 
-    T Eval(T xaspect, T yaspect, T zaspect, const T p[4][4][4], T x[3]) const {
+    // the original sparse coefficient evaluation, kept around as a reference for the fused kernel
+    T EvalSparse(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3]) const {
 
 	T xscale = 1.0 / xaspect;
 	T yscale = 1.0 / yaspect;
@@ -55,7 +205,7 @@ template <typename T>
     }
 
 
-    void Gradient(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], T gradient[3]) const {
+    void GradientSparse(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], T gradient[3]) const {
 
 	T xscale = 1.0 / xaspect;
 	T yscale = 1.0 / yaspect;
@@ -90,7 +240,7 @@ template <typename T>
     }
 
 
-    void Hessian(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], gtb::tmat3<T> &hessian) const {
+    void HessianSparse(T xaspect, T yaspect, T zaspect, const T p[4][4][4], const T x[3], gtb::tmat3<T> &hessian) const {
 
 	T xscale = 1.0 / xaspect;
 	T yscale = 1.0 / yaspect;
@@ -141,6 +291,13 @@ template <typename T>
 
     void CoefsFromMatrix(const gtb::tMatrix4<T> &m) {
 
+	for (int r=0; r<4; r++) {
+	    for (int c=0; c<4; c++) {
+		basis[r][c] = m[r][c];
+	    }
+	}
+	is_bspline = false;
+
 	int indexing[4][4][4];	// for computing the index of a sample
 
 	vector<coefterm> afterZremoval[4][4];
@@ -205,6 +362,45 @@ template <typename T>
     }
     private:
 
+    // w[0] are the weights of the 4 samples along one axis at local coordinate x,
+    // w[1] and w[2] their first and second derivatives (in world units)
+    void AxisWeights(T x, T scale, T w[3][4]) const {
+
+	T t = x*scale;
+
+	if (is_bspline) {
+	    T s = 1-t;
+	    T t2 = t*t;
+	    w[0][0] = s*s*s * (T)(1/6.0);
+	    w[0][1] = (3*t2*t - 6*t2 + 4) * (T)(1/6.0);
+	    w[0][2] = (-3*t2*t + 3*t2 + 3*t + 1) * (T)(1/6.0);
+	    w[0][3] = t2*t * (T)(1/6.0);
+
+	    w[1][0] = -s*s * (T)0.5 * scale;
+	    w[1][1] = ((T)1.5*t2 - 2*t) * scale;
+	    w[1][2] = ((T)-1.5*t2 + t + (T)0.5) * scale;
+	    w[1][3] = t2 * (T)0.5 * scale;
+
+	    T scale2 = scale*scale;
+	    w[2][0] = s * scale2;
+	    w[2][1] = (3*t - 2) * scale2;
+	    w[2][2] = (1 - 3*t) * scale2;
+	    w[2][3] = t * scale2;
+	    return;
+	}
+
+	// anything else (catmull-rom) straight from the basis matrix
+	T pows[4] = { 1, t, t*t, t*t*t };
+	for (int c=0; c<4; c++) {
+	    w[0][c] = basis[0][c] + basis[1][c]*pows[1] + basis[2][c]*pows[2] + basis[3][c]*pows[3];
+	    w[1][c] = (basis[1][c] + 2*basis[2][c]*pows[1] + 3*basis[3][c]*pows[2]) * scale;
+	    w[2][c] = (2*basis[2][c] + 6*basis[3][c]*pows[1]) * scale*scale;
+	}
+    }
+
+    T basis[4][4];
+    bool is_bspline;
+
     class coefterm {
 	public:
 	coefterm(T c, int s, int _xpow, int _ypow, int _zpow) {
@@ -258,7 +454,116 @@ template <typename T>
 
 
 
+class BrickCache;
+class GuidanceCacheKey;
+class RegularVolume;
+class SeparableFilter;
+class VolumeSource;
+
+
+// the smallest and largest sample over blocks of cells, and over blocks of those blocks, so finding
+// the cells an isosurface passes through can skip whole regions that are all above or all below it.
+// it doesn't depend on the isovalue, so it's built once and reused for every isovalue
+class MinMaxPyramid {
+    public:
+    enum { BLOCK = 8 };		// cells on a side of a finest block
+
+    // block b covers cells [BLOCK*b, BLOCK*(b+1)), so the grid points [BLOCK*b, BLOCK*(b+1)].
+    // the samples come from values if it's given, otherwise from the volume, prefiltered if bspline
+    void Build(const RegularVolume &v, bool bspline, const real_type *values);
+
+    int NumBlocks(int i) const { return nblocks[0][i]; }
+    int BlockIndex(int bx, int by, int bz) const { return (bz*nblocks[0][1] + by)*nblocks[0][0] + bx; }
+
+    // the cells [lo,hi) of a finest block
+    void BlockCells(int block, int lo[3], int hi[3]) const;
+
+    // the finest blocks with samples on both sides of (or at) isovalue, once their cells are grown
+    // by pad cells on every side - in an order that keeps neighboring blocks together
+    void ActiveBlocks(real_type isovalue, int pad, vector<int> &blocks) const;
+
+    // whether any block of the row of cells (y,z) has samples on both sides of (or at) isovalue
+    bool RowActive(int y, int z, real_type isovalue) const;
+
+    // for a row of grid points (y,z), the points whose blocks are all strictly above or all
+    // strictly below isovalue get a value on the same side in vals, and known set.  nothing that
+    // only compares them against isovalue can tell the difference
+    void UniformPoints(int y, int z, real_type isovalue, real_type *vals, unsigned char *known) const;
+
+    private:
+
+    static bool Straddles(const real_type *mm, real_type isovalue) { return (mm[0]<=isovalue && mm[1]>=isovalue); }
+    const real_type* Range(int level, int bx, int by, int bz) const {
+	return &ranges[level][2*((bz*nblocks[level][1] + by)*nblocks[level][0] + bx)];
+    }
+    real_type* Range(int level, int bx, int by, int bz) {
+	return &ranges[level][2*((bz*nblocks[level][1] + by)*nblocks[level][0] + bx)];
+    }
+    bool Active(int level, int bx, int by, int bz, real_type isovalue, int pad) const;
+    void ActiveBlocks(int level, int bx, int by, int bz, real_type isovalue, int pad, vector<int> &blocks) const;
+    void BuildSlab(int begin, int end, const RegularVolume &v, bool bspline, const real_type *values);
+
+    int dim[3];
+    vector< vector<int> > nblocks;		// 3 per level, finest first, down to a single block
+    vector< vector<real_type> > ranges;		// min,max per block per level
+};
+
+// the samples of an uncompressed volume file, mapped in and left in the file's own type, so a byte
+// volume takes a quarter of the memory and nothing is read until it's touched.  they're byte
+// swapped and scaled to real_type as they're looked up
+class MappedSamples {
+    public:
+    enum SampleType { UCHAR, SHORT, FLOAT };
+
+    static SampleType TypeOf(unsigned char) { return UCHAR; }
+    static SampleType TypeOf(short) { return SHORT; }
+    static SampleType TypeOf(float) { return FLOAT; }
+
+    MappedSamples();
+    ~MappedSamples() { Close(); }
+
+    // the first count samples of fname
+    bool Open(const char *fname, SampleType type, size_t count, bool bigendian, real_type scale);
+    void Close();
+
+    real_type Value(size_t i) const {
+	switch (type) {
+	case UCHAR: return Convert(((const unsigned char*)map)[i]);
+	case SHORT: return Convert(((const short*)map)[i]);
+	default:    return Convert(((const float*)map)[i]);
+	}
+    }
+
+    // nbrs[x][y][z] is the sample at (idx[0][x], idx[1][y], idx[2][z]) of a dim sized volume
+    void Gather(const int dim[3], const int idx[3][4], double nbrs[4][4][4]) const;
+
+    // every sample, converted
+    void Copy(real_type *out) const;
+
+    private:
+    template <typename T> real_type Convert(T s) const {
+	if (swap) {
+	    char *b = (char*)&s;
+	    for (unsigned j=0; j<sizeof(T)/2; j++)
+		std::swap(b[j], b[sizeof(T)-j-1]);
+	}
+	return (real_type)s * scale;
+    }
+    template <typename T> void GatherType(const int dim[3], const int idx[3][4], double nbrs[4][4][4]) const;
+    template <typename T> void CopyType(real_type *out) const;
+
+    void *map;
+    size_t size;
+    SampleType type;
+    size_t count;
+    bool swap;
+    real_type scale;
+};
+
+
 // a function sampled on a regular grid
+// either held in memory, mapped from a raw file in its own sample type, or paged in from a bricked
+// .bvol file through a bounded brick cache
 class RegularVolume : public gtb::tModel<real_type> {
 
     public:
@@ -269,6 +574,11 @@ class RegularVolume : public gtb::tModel<real_type> {
     bool Write(const char *fname) const;
 
     bool ReadNRRD(const char *fname);
+    bool ReadBricked(const char *fname);
+    bool WriteBricked(const char *fname) const;
+
+    // convert any volume Read() understands to a .bvol, a few slices at a time, without loading it
+    bool ConvertToBricked(const char *src, const char *dst);
 
     template <typename SOURCETYPE>
 	bool ReadSource(const char *fname, bool bigendian=false);
@@ -276,43 +586,89 @@ class RegularVolume : public gtb::tModel<real_type> {
     template <typename SOURCETYPE>
 	bool WriteSource(const char *fname) const;
 
-    real_type& GetValue(int x, int y, int z) const { return data[xyz2index(x,y,z)]; }
+    real_type GetValue(int x, int y, int z) const {
+	if (data) return data[xyz2index(x,y,z)];
+	if (samples) return samples->Value(xyz2index(x,y,z));
+	return BrickedValue(x,y,z);
+    }
     int GetDim(int i) const { return dim[i]; }
     real_type GetAspect(int i) const { return aspect[i]; }
     int GetBoundaryCells() const { return boundary_cells; }
-    bool Empty() const { return (data==NULL); }
+    bool Empty() const { return (data==NULL && samples==NULL && bricks==NULL); }
+    bool OutOfCore() const { return (bricks!=NULL); }
 
+    // both are done in place a line at a time, along each axis in turn
     void Smooth(int width);
+    void PrefilterBSpline();		// the samples become GetBSplineValues()
 
     // Model stuff
     void compute_bounding_box() const;
     void compute_centroid() const;
 
-    int xyz2index(int x, int y, int z) const;
+    // where a sample lives in data, and in arrays from CopyValues() and GetBSplineValues()
+    size_t xyz2index(int x, int y, int z) const {
+	if (!morton) return ((size_t)z*dim[1] + y)*dim[0] + x;
+	return morton_offsets[0][x] + morton_offsets[1][y] + morton_offsets[2][z];
+    }
+
+    // row major, or morton order inside 32^3 tiles so the 4x4x4 neighborhoods Gather reads sit
+    // together.  arrays from CopyValues() and GetBSplineValues() are in the layout they were made
+    // in, so get them again after changing it.  mapped samples get loaded first
+    void SetMortonLayout(bool m);
+    bool MortonLayout() const { return morton; }
 
     void Gather(const int cell[3], double nbrs[4][4][4]) const;
 
     bool LocalInfo(const Point3 &p, int cell[3], double xl[3]) const;
 
+    // the value of the bspline at a grid point, without building the whole prefiltered volume
+    real_type BSplineValue(int x, int y, int z) const;
+
+    // the rest of these need the volume in memory.  the ones that change the values convert mapped
+    // samples to real_type first
     real_type* GetBSplineValues() const;
-    void SetValues(real_type *v) { memcpy(data, v, sizeof(real_type)*dim[0]*dim[1]*dim[2]); }
-    real_type* CopyValues() const {
-	real_type *ret = new real_type[dim[0]*dim[1]*dim[2]];
-	memcpy(ret, data, sizeof(real_type)*dim[0]*dim[1]*dim[2]);	  
-	return ret;
-    }
+    void SetValues(real_type *v) { LoadSamples(); ClearValueRanges(); memcpy(data, v, sizeof(real_type)*StorageSize()); }
+    real_type* SwapValues(real_type *v) { LoadSamples(); ClearValueRanges(); real_type *ret=data; data=v; return ret; }
+    real_type* CopyValues() const;
+
+    // brick loads so far, for the timing output
+    int BrickLoads() const;
+
+    // min/max blocks over the samples, or over the prefiltered bspline values, built the first time
+    // they're asked for and kept until the values change.  the caller can pass in GetBSplineValues()
+    // if it already has them.  builds in parallel, so don't call it from inside a parallel section
+    const MinMaxPyramid& ValueRanges(bool bspline, const real_type *prefiltered=NULL) const;
+
+    unsigned long long ContentHash() const;
 
 
     private:
 
-    void GetBSplineValuesParallel(int nt, int id, const TrivariateSpline<double> &spline, real_type *ret) const;
+    void Filter(real_type *vals, const SeparableFilter &f) const;
+    void FilterPlanes(int begin, int end, real_type *vals, int axis, const SeparableFilter &f) const;
+
+    real_type BrickedValue(int x, int y, int z) const;
+
+    void Clear();
+    void ClearValueRanges();
+    void LoadSamples();
+    size_t StorageSize() const;
+
+    template <typename SOURCETYPE>
+	bool BrickSource(VolumeSource &src, bool bigendian, const char *dst);
 
     void GenSphere();
 
     int dim[3];
     real_type aspect[3];
     real_type *data;
+    MappedSamples *samples;
+    BrickCache *bricks;
+    const char *convert_dst;	// set while ConvertToBricked is reading the source
     int boundary_cells;
+    bool morton;
+    vector<size_t> morton_offsets[3];	// added up for the index, per axis
+    mutable MinMaxPyramid *ranges[2];	// samples, prefiltered
 };
 
 
@@ -391,13 +747,14 @@ class IsoSurfaceProjector : public SurfaceProjector {
 class IsoSurfaceGuidanceField : public GuidanceField {
     public:
 
-    IsoSurfaceGuidanceField(IsoSurfaceProjector &projector, const RegularVolume &vol, bool bspline, real_type rho, real_type min_step, real_type max_step, real_type reduction);
+    // prefiltered can pass in GetBSplineValues() if the caller already has them
+    IsoSurfaceGuidanceField(IsoSurfaceProjector &projector, const RegularVolume &vol, bool bspline, real_type rho, real_type min_step, real_type max_step, real_type reduction, const real_type *prefiltered=NULL);
     ~IsoSurfaceGuidanceField();
 
     int ClosestPoint(const Point3 &p);
-    void OrderedPointTraverseStart(const Point3 &p);
-    int OrderedPointTraverseNext(real_type &squared_dist);
-    void OrderedPointTraverseEnd();
+    void* OrderedPointTraverseStart(const Point3 &p) const;
+    int OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const;
+    void OrderedPointTraverseEnd(void *ctx) const;
     const Point3& PointLocation(int i) const;
     int NumPoints() const;
 
@@ -409,7 +766,9 @@ class IsoSurfaceGuidanceField : public GuidanceField {
 
     private:
 
-    void BuildGuidanceParallel(int nt, int id, real_type isovalue, IsoSurfaceProjector &projector, const real_type *values);
+    void BuildGuidanceParallel(int nt, int id, real_type isovalue, IsoSurfaceProjector &projector, bool bspline, const real_type *values, const vector<int> &blocks);
+    bool LoadCache(const GuidanceCacheKey &key);
+    void SaveCache(const GuidanceCacheKey &key, const vector<Point3> &points, const vector<real_type> &ideal, const vector<int> &marked) const;
 
     TrivariateSpline<double> spline;
     const RegularVolume &volume;
@@ -426,7 +785,6 @@ class IsoSurfaceGuidanceField : public GuidanceField {
     typedef gtb::KDTree<int, real_type, GetPoint> kdtree_type;
     kdtree_type *kdtree;
     GetPoint kdGetPoint;
-    kdtree_type::OrderedIncrementalTraverse *kdOrderedTraverse;
 
     vector<Vector3> *guidanceNormals;
 };
@@ -434,7 +792,32 @@ class IsoSurfaceGuidanceField : public GuidanceField {
 
 
 
-void MarchingCubes(const RegularVolume &v, TriangulatorController &tc, real_type isovalue);
+// prefiltered, if given, is GetBSplineValues() and is marched instead of the samples
+void MarchingCubes(const RegularVolume &v, TriangulatorController &tc, real_type isovalue, bool bspline=false, const real_type *prefiltered=NULL);
+
+
+// what tri_vol needs from the marching cubes surface, collected while marching instead of
+// building the mesh
+class MarchingCubesSeeds {
+    public:
+
+    // where the surface leaves the volume, oriented like TriangleMesh::GetBoundaries
+    vector< vector<Point3> > boundaries;
+
+    // up to 10 points spread over each closed connected component
+    vector< vector<Point3> > component_seeds;
+    vector<int> component_ids;
+
+    // with partition cells, points on each piece of the surface inside a cell
+    vector< vector<Point3> > piece_seeds;
+    vector<int> piece_cell;		// (z*n + y)*n + x
+    vector<int> piece_component;	// matches component_ids
+};
+
+void FindMarchingCubesSeeds(const RegularVolume &v, real_type isovalue, bool bspline, int partition_cells, MarchingCubesSeeds &seeds, const real_type *prefiltered=NULL);
+
+void BenchmarkSplineKernel(int n);
+void BenchmarkVolumeLayout(RegularVolume &v, real_type isovalue, bool bspline, int n);
 
 
 
@@ -4,7 +4,9 @@
 #include "triangulator.h"
 #include "triangulate_mesh.h"
 #include "parallel.h"
+#include "guidance_cache.h"
 #include <sys/time.h>
+#include <algorithm>
 
 
 //#define CLOSEST_POINT_PROJECTION
@@ -677,119 +679,595 @@ real_type ExtendedQuadricCurvature(const Point3 &center, const vector<Point3> &p
 
 
 
-MeshGuidanceField::~MeshGuidanceField() {
-    if (kdOrderedTraverse)		delete kdOrderedTraverse;
-    delete kdtree;
-}
+// a few rings of the mesh around one vertex, loop subdivided on its own so the curvature can
+// see the subdivided surface without subdividing the whole mesh.  uses the same rules, vertex
+// and face numbering and ring order as TriangleMesh::LoopSubdivide and VertexVertexIteratorI.
+class SubdivisionPatch {
+    public:
 
-MeshGuidanceField::MeshGuidanceField(int curv_sub, const TriangleMesh &mesh, real_type rho, real_type min_step, real_type max_step, real_type reduction)
-    : GuidanceField(rho, min_step, max_step, reduction), kdGetPoint(mesh), kdOrderedTraverse(NULL) {
+    // faces touching any vertex within radius rings of v
+    void Extract(const TriangleMesh &mesh, int v, int radius, vector<int> &faces);
 
+    // keep only the faces touching a vertex within radius rings of the center
+    void Crop(int radius, vector<int> &ring);
 
-    // setup the kdtree
-    kdtree = new kdtree_type(10, mesh.bounding_box(), kdGetPoint);
-    for (unsigned i=0; i<mesh.verts.size(); i++)
-        kdtree->Insert(i, false);
-    kdtree->MakeTree();
+    void LoopSubdivide(vector<int> &ring);
+    void SetNormals();
 
+    // returns whether the vertex is on the boundary, like VertexVertexIteratorI::isonedge
+    bool Ring(int v, vector<int> &ring) const;
+    bool OnBoundary(int v) const;
+    const Point3& Point(int v) const { return points[v]; }
+    const Vector3& Normal(int v) const { return normals[v]; }
 
-    mls::GaussianWeightFunction<double> wf;
-    wf.set_radius(1);
+    int center;
 
+    private:
 
-    TriangleMesh cmesh = mesh;
-    for (int i=0; i<curv_sub; i++) {
-	cmesh.LoopSubdivide();
+    int VertIndex(int f, int v) const {
+	return (fverts[f*3+0]==v) ? 0 : ((fverts[f*3+1]==v) ? 1 : 2);
     }
+    int FirstFace(int v) const;
+    void SetSomeFaces();
+
+    vector<Point3> points;
+    vector<Vector3> normals;
+    vector<int> someface;
+    vector<int> fverts;		// 3 per face
+    vector<int> fnbrs;		// face across the edge fverts[i],fverts[i+1]
+
+    // scratch
+    vector<Point3> npoints;
+    vector<int> nfverts;
+    vector<int> nfnbrs;
+    vector<int> index;
+    vector<int> fmap;
+};
 
-    double curvature_start = get_time_seconds();
-    cerr << "[TIMING] Computing curvature for " << mesh.verts.size() << " vertices..." << endl;
 
-    for (unsigned v=0; v<mesh.verts.size(); v++) {
+void SubdivisionPatch::Extract(const TriangleMesh &mesh, int v, int radius, vector<int> &faces) {
 
+    // vertices within radius rings, then every face touching one of them
+    vector<int> &inner = index;
+    inner.clear();
+    inner.push_back(v);
+    for (int r=0; r<radius; r++) {
+	unsigned n = inner.size();
+	for (unsigned i=0; i<n; i++) {
+	    for (TriangleMesh::VertexVertexIteratorI vi(mesh, inner[i]); !vi.done(); ++vi)
+		inner.push_back(*vi);
+	}
+	std::sort(inner.begin(), inner.end());
+	inner.erase(std::unique(inner.begin(), inner.end()), inner.end());
+    }
 
-	// fit a polynomial
-	const int numrings = 3;
-	vector< std::set<int> > rings(numrings+1);
-	rings[0].insert(v);
+    faces.clear();
+    for (unsigned i=0; i<inner.size(); i++) {
+	for (TriangleMesh::VertexFaceIteratorI fi(mesh, inner[i]); !fi.done(); ++fi) {
+	    faces.push_back(*fi);
+	}
+    }
+    std::sort(faces.begin(), faces.end());
+    faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+
+    // keep the mesh's relative order of vertices and faces
+    vector<int> &gverts = inner;
+    gverts.clear();
+    for (unsigned i=0; i<faces.size(); i++) {
+	for (int j=0; j<3; j++)
+	    gverts.push_back(mesh.faces[faces[i]].verts[j]);
+    }
+    std::sort(gverts.begin(), gverts.end());
+    gverts.erase(std::unique(gverts.begin(), gverts.end()), gverts.end());
+
+    points.resize(gverts.size());
+    for (unsigned i=0; i<gverts.size(); i++)
+	points[i] = mesh.verts[gverts[i]].point;
+
+    fverts.resize(faces.size()*3);
+    fnbrs.resize(faces.size()*3);
+    for (unsigned i=0; i<faces.size(); i++) {
+	const TriangleMeshFace &f = mesh.faces[faces[i]];
+	for (int j=0; j<3; j++) {
+	    fverts[i*3+j] = std::lower_bound(gverts.begin(), gverts.end(), f.verts[j]) - gverts.begin();
+
+	    vector<int>::const_iterator n = std::lower_bound(faces.begin(), faces.end(), f.nbrs[j]);
+	    fnbrs[i*3+j] = (n != faces.end() && *n == f.nbrs[j]) ? (n - faces.begin()) : -1;
+	}
+    }
+    center = std::lower_bound(gverts.begin(), gverts.end(), v) - gverts.begin();
 
-	for (int r=0; r<numrings; r++) {
-	    rings[r+1] = rings[r];
+    SetSomeFaces();
+}
 
-	    for (std::set<int>::iterator i=rings[r].begin(); i!=rings[r].end(); ++i) {
 
-		for (TriangleMesh::VertexVertexIteratorI vi(cmesh, *i); !vi.done(); ++vi) {
-		    rings[r+1].insert(*vi);
-		}
+void SubdivisionPatch::Crop(int radius, vector<int> &ring) {
+
+    // breadth first distances from the center
+    vector<int> &dist = index;
+    dist.assign(points.size(), -1);
+    vector<int> &queue = nfverts;
+    queue.clear();
+    queue.push_back(center);
+    dist[center] = 0;
+    for (unsigned q=0; q<queue.size(); q++) {
+	int v = queue[q];
+	if (dist[v] >= radius) continue;
+	Ring(v, ring);
+	for (unsigned i=0; i<ring.size(); i++) {
+	    if (dist[ring[i]] < 0) {
+		dist[ring[i]] = dist[v]+1;
+		queue.push_back(ring[i]);
 	    }
 	}
+    }
 
-	vector<Point3> nbrhood;
-	Vector3 normest = cmesh.verts[v].normal;
-	for (unsigned r=0; r<rings.size(); r++) {
-	    for (std::set<int>::iterator i=rings[r].begin(); i!=rings[r].end(); ++i) {
-		nbrhood.push_back(cmesh.verts[*i].point);
-		normest += cmesh.verts[*i].normal;
-	    }
+    // faces touching the inside, and the vertices they use
+    int nf = fverts.size()/3;
+    fmap.resize(nf);
+    int nkept = 0;
+    for (int f=0; f<nf; f++) {
+	bool keep = false;
+	for (int j=0; j<3; j++) {
+	    int d = dist[fverts[f*3+j]];
+	    if (d >= 0 && d <= radius) keep = true;
 	}
-	normest.normalize();
+	fmap[f] = keep ? nkept++ : -1;
+    }
 
-	real_type kmax = ExtendedQuadricCurvature(cmesh.verts[v].point, nbrhood, normest);
+    // the adjacency just gets renumbered, faces cut off become boundary
+    for (int f=0; f<nf; f++) {
+	if (fmap[f] < 0) continue;
+	for (int j=0; j<3; j++) {
+	    int n = fnbrs[f*3+j];
+	    fverts[fmap[f]*3+j] = fverts[f*3+j];
+	    fnbrs[fmap[f]*3+j] = (n < 0) ? -1 : fmap[n];
+	}
+    }
+    fverts.resize(nkept*3);
+    fnbrs.resize(nkept*3);
+
+    vector<int> &vmap = index;
+    vmap.assign(points.size(), -1);
+    for (unsigned i=0; i<fverts.size(); i++)
+	vmap[fverts[i]] = 0;
+
+    int nv = 0;
+    for (unsigned v=0; v<points.size(); v++) {
+	if (vmap[v] < 0) continue;
+	vmap[v] = nv;
+	points[nv++] = points[v];
+    }
+    points.resize(nv);
 
-	if (cmesh.VertOnBoundary(v)) {
+    for (unsigned i=0; i<fverts.size(); i++)
+	fverts[i] = vmap[fverts[i]];
+    center = vmap[center];
 
-	    const int num =2;
+    SetSomeFaces();
+}
 
-	    vector<int> eptsi;
-	    eptsi.push_back(v);
-            
-	    for (int i=0; i<num; i++) {
-		TriangleMesh::VertexVertexIteratorI vi(cmesh, eptsi.back());
-		eptsi.push_back(*vi);
-	    }
 
-	    reverse(eptsi);
+// the last face using each vertex, like TriangleMesh::build_structures
+void SubdivisionPatch::SetSomeFaces() {
+    someface.assign(points.size(), -1);
+    for (unsigned i=0; i<fverts.size(); i++)
+	someface[fverts[i]] = i/3;
+}
+
+
+// rotate clockwise as far as possible, like VertexFaceIterator
+int SubdivisionPatch::FirstFace(int v) const {
+    int f = someface[v];
+    if (f < 0) return -1;
+    do {
+	int n = fnbrs[f*3+VertIndex(f, v)];
+	if (n == -1) break;
+	f = n;
+    } while (f != someface[v]);
+    return f;
+}
+
+
+bool SubdivisionPatch::Ring(int v, vector<int> &ring) const {
+
+    ring.clear();
+    int first = FirstFace(v);
+    if (first < 0) return false;
+
+    bool onedge = (fnbrs[first*3+VertIndex(first, v)] == -1);
+    if (onedge)
+	ring.push_back(fverts[first*3+(VertIndex(first, v)+1)%3]);
+
+    int f = first;
+    do {
+	int vi = VertIndex(f, v);
+	ring.push_back(fverts[f*3+(vi+2)%3]);
+	f = fnbrs[f*3+(vi+2)%3];
+    } while (f != -1 && f != first);
+
+    return onedge;
+}
+
+
+bool SubdivisionPatch::OnBoundary(int v) const {
+    int first = FirstFace(v);
+    return (first >= 0 && fnbrs[first*3+VertIndex(first, v)] == -1);
+}
+
+
+void SubdivisionPatch::LoopSubdivide(vector<int> &ring) {
+
+    int nv = points.size();
+    int nf = fverts.size()/3;
+
+    npoints.resize(nv);
+    for (int v=0; v<nv; v++) {
+
+	bool onedge = Ring(v, ring);
 
+	Point3 np(0,0,0);
+	if (onedge) {
+	    np.add_scaled(points[v], 6.0/8.0);
+	    np.add_scaled(points[ring.front()], 1.0/8.0);
+	    np.add_scaled(points[ring.back()], 1.0/8.0);
+	} else {
+	    double alpha = (ring.size()>3) ? (3.0/(8.0*ring.size())) : (3.0/16.0);	// warren weights
+	    np.add_scaled(points[v], 1.0-ring.size()*alpha);
+	    for (unsigned i=0; i<ring.size(); i++) {
+		np.add_scaled(points[ring[i]], alpha);
+	    }
+	}
+	npoints[v] = np;
+    }
 
-	    for (int i=0; i<num; i++) {
-		TriangleMesh::VertexVertexIteratorI vi(cmesh, eptsi.back());
-		eptsi.push_back(0);
-		while (!vi.done()) {
-		    eptsi.back() = *vi;
-		    ++vi;
+    // one new vertex per edge, made by the lower numbered face
+    vector<int> &nvi = index;
+    nvi.resize(nf*3);
+    for (int f=0; f<nf; f++) {
+	for (int i=0; i<3; i++) {
+	    int n = fnbrs[f*3+i];
+	    if (n < f) {
+		const Point3 &p0 = points[fverts[f*3+i]];
+		const Point3 &p1 = points[fverts[f*3+(i+1)%3]];
+
+		Point3 np(0,0,0);
+		if (n < 0) {
+		    np.add_scaled(p0, 0.5);
+		    np.add_scaled(p1, 0.5);
+		} else {
+		    np.add_scaled(p0, 3.0/8.0);
+		    np.add_scaled(p1, 3.0/8.0);
+		    np.add_scaled(points[fverts[f*3+(i+2)%3]], 1.0/8.0);
+		    np.add_scaled(points[fverts[n*3+(VertIndex(n, fverts[f*3+i])+1)%3]], 1.0/8.0);
 		}
+
+		nvi[f*3+i] = npoints.size();
+		npoints.push_back(np);
 	    }
+	}
+    }
 
+    for (int f=0; f<nf; f++) {
+	for (int i=0; i<3; i++) {
+	    int n = fnbrs[f*3+i];
+	    if (n > f)
+		nvi[f*3+i] = nvi[n*3+(VertIndex(n, fverts[f*3+i])+2)%3];
+	}
+    }
 
-	    vector<Point3> epts;
-	    vector<real_type> weights;
-	    for (unsigned i=0; i<eptsi.size(); i++) {
-		epts.push_back(cmesh.verts[eptsi[i]].point);
-		weights.push_back(1);
+    nfverts.resize(nf*12);
+    for (int f=0; f<nf; f++) {
+	const int *v = &fverts[f*3];
+	const int *e = &nvi[f*3];
+	int *nfv = &nfverts[f*12];
+	nfv[0] = v[0];  nfv[1]  = e[0];  nfv[2]  = e[2];
+	nfv[3] = v[1];  nfv[4]  = e[1];  nfv[5]  = e[0];
+	nfv[6] = v[2];  nfv[7]  = e[2];  nfv[8]  = e[1];
+	nfv[9] = e[0];  nfv[10] = e[1];  nfv[11] = e[2];
+    }
+
+    // child k of a face is at its vertex k, with edges (first half of edge k, the middle
+    // triangle, second half of edge k-1).  across a parent edge the halves swap children.
+    nfnbrs.resize(nf*12);
+    for (int f=0; f<nf; f++) {
+	int *nfn = &nfnbrs[f*12];
+	for (int k=0; k<3; k++) {
+	    nfn[k*3+1] = f*4+3;
+	    nfn[9+k] = f*4+(k+1)%3;
+	}
+
+	for (int i=0; i<3; i++) {
+	    int n = fnbrs[f*3+i];
+	    if (n < 0) {
+		nfn[i*3+0] = -1;
+		nfn[((i+1)%3)*3+2] = -1;
+	    } else {
+		int j = VertIndex(n, fverts[f*3+(i+1)%3]);
+		nfn[i*3+0] = n*4+(j+1)%3;
+		nfn[((i+1)%3)*3+2] = n*4+j;
 	    }
+	}
+    }
+
+    points.swap(npoints);
+    fverts.swap(nfverts);
+    fnbrs.swap(nfnbrs);
+    SetSomeFaces();
+}
+
+
+void SubdivisionPatch::SetNormals() {
+
+    normals.resize(points.size());
+    for (unsigned v=0; v<points.size(); v++) {
+	normals[v] = Vector3(0,0,0);
+
+	int first = FirstFace(v);
+	int f = first;
+	while (f >= 0) {
+	    Vector3 e1 = points[fverts[f*3+1]] - points[fverts[f*3+0]];
+	    Vector3 e2 = points[fverts[f*3+2]] - points[fverts[f*3+0]];
+	    Vector3 fn = e1.cross(e2);
+	    if (fn.length() != 0) {
+		fn.normalize();
+		normals[v] += fn;
+	    }
+
+	    f = fnbrs[f*3+(VertIndex(f, v)+2)%3];
+	    if (f == first) f = -1;
+	}
+	normals[v].normalize();
+    }
+}
+
+
+// the same interface on the mesh itself, for when there's no subdivision
+class CurvatureMesh {
+    public:
+    CurvatureMesh(const TriangleMesh &m) : mesh(m) { }
+
+    bool Ring(int v, vector<int> &ring) const {
+	ring.clear();
+	TriangleMesh::VertexVertexIteratorI vi(mesh, v);
+	for ( ; !vi.done(); ++vi)
+	    ring.push_back(*vi);
+	return vi.isonedge();
+    }
+    bool OnBoundary(int v) const { return mesh.VertOnBoundary(v); }
+    const Point3& Point(int v) const { return mesh.verts[v].point; }
+    const Vector3& Normal(int v) const { return mesh.verts[v].normal; }
+
+    const TriangleMesh &mesh;
+};
+
+
+
+// the rings are kept sorted and each one includes the ones inside it, like the std::sets they
+// replace, so the fit sees the same points in the same order
+const int curvature_rings = 3;
+class CurvatureScratch {
+    public:
+    vector<int> rings[curvature_rings+1];
+    vector<int> ring;
+    vector<Point3> nbrhood;
+    vector<int> eptsi;
+    vector<Point3> epts;
+    vector<real_type> weights;
+    SubdivisionPatch patch;
+};
+
+template <typename Surface>
+static real_type VertexMaxCurvature(const Surface &cmesh, int v, CurvatureScratch &cs) {
+
+    // fit a polynomial
+    cs.rings[0].clear();
+    cs.rings[0].push_back(v);
 
+    for (int r=0; r<curvature_rings; r++) {
+	vector<int> &next = cs.rings[r+1];
+	next = cs.rings[r];
 
-	    double k = edge_curvature(epts, weights);
+	for (unsigned i=0; i<cs.rings[r].size(); i++) {
+	    cmesh.Ring(cs.rings[r][i], cs.ring);
+	    next.insert(next.end(), cs.ring.begin(), cs.ring.end());
+	}
+
+	std::sort(next.begin(), next.end());
+	next.erase(std::unique(next.begin(), next.end()), next.end());
+    }
 
-	    if (fabs(k) > fabs(kmax))
-		kmax = k;
+    cs.nbrhood.clear();
+    Vector3 normest = cmesh.Normal(v);
+    for (int r=0; r<=curvature_rings; r++) {
+	for (unsigned i=0; i<cs.rings[r].size(); i++) {
+	    cs.nbrhood.push_back(cmesh.Point(cs.rings[r][i]));
+	    normest += cmesh.Normal(cs.rings[r][i]);
 	}
+    }
+    normest.normalize();
+
+    real_type kmax = ExtendedQuadricCurvature(cmesh.Point(v), cs.nbrhood, normest);
+
+    if (cmesh.OnBoundary(v)) {
+
+	const int num =2;
+
+	vector<int> &eptsi = cs.eptsi;
+	eptsi.clear();
+	eptsi.push_back(v);
+            
+	for (int i=0; i<num; i++) {
+	    cmesh.Ring(eptsi.back(), cs.ring);
+	    eptsi.push_back(cs.ring.front());
+	}
+
+	reverse(eptsi);
+
+
+	for (int i=0; i<num; i++) {
+	    cmesh.Ring(eptsi.back(), cs.ring);
+	    eptsi.push_back(cs.ring.back());
+	}
+
+
+	cs.epts.clear();
+	cs.weights.clear();
+	for (unsigned i=0; i<eptsi.size(); i++) {
+	    cs.epts.push_back(cmesh.Point(eptsi[i]));
+	    cs.weights.push_back(1);
+	}
+
+
+	double k = edge_curvature(cs.epts, cs.weights);
+
+	if (fabs(k) > fabs(kmax))
+	    kmax = k;
+    }
+
+    return kmax;
+}
+
+
+// curvature of v on the mesh after curv_sub loop subdivisions, by subdividing only the rings
+// the fit can see.  the patches hold the faces touching the vertices within some number of rings
+// of v.  the fit needs 3 rings, and the normals of the outer one need the faces touching it.  a
+// new vertex needs the old faces around its parent (or its edge's end), which is about half as
+// many rings out at the old level, so going back a level r rings need r/2+1.  each level gets
+// cropped back down to that so the patch doesn't grow 4x every time.
+static int PatchRadius(int levels_left) {
+    int r = curvature_rings;
+    for (int i=0; i<levels_left; i++)
+	r = r/2 + 1;
+    return r;
+}
+
+static real_type SubdividedVertexMaxCurvature(const TriangleMesh &mesh, int v, int curv_sub, CurvatureScratch &cs) {
+
+    // subdivision doesn't move a vertex with no faces
+    if (mesh.verts[v].someface < 0)
+	return VertexMaxCurvature(CurvatureMesh(mesh), v, cs);
+
+    SubdivisionPatch &patch = cs.patch;
+    patch.Extract(mesh, v, PatchRadius(curv_sub), cs.ring);
+    for (int i=curv_sub-1; i>=0; i--) {
+	patch.LoopSubdivide(cs.ring);
+	patch.Crop(PatchRadius(i), cs.ring);
+    }
+    patch.SetNormals();
+
+    return VertexMaxCurvature(patch, patch.center, cs);
+}
 
 
-	ideal_length.push_back(MaxCurvatureToIdeal(kmax));
+// threads take interleaved blocks of vertices, each reusing its own scratch space
+void MeshGuidanceField::CurvatureParallel(int nt, int id, const TriangleMesh &mesh, int curv_sub) {
 
+    const int block = 256;
+    int nv = ideal_length.size();
+    CurvatureScratch cs;
+    CurvatureMesh cmesh(mesh);
 
+    for (int b=id*block; b<nv; b+=nt*block) {
+	int end = std::min(b+block, nv);
+	for (int v=b; v<end; v++) {
+	    real_type k = (curv_sub > 0) ? SubdividedVertexMaxCurvature(mesh, v, curv_sub, cs) : VertexMaxCurvature(cmesh, v, cs);
+	    ideal_length[v] = MaxCurvatureToIdeal(k);
+	}
 
-	if ((int)(v * 100.0 / mesh.verts.size()) != (int)((v+1) * 100.0 / mesh.verts.size())) {
-	    cerr<<"                  \r"<<((int)((v+1) * 100.0 / mesh.verts.size()))<<"%"<<std::flush;
+	if (id==0 && (int)(b * 100.0 / nv) != (int)(end * 100.0 / nv)) {
+	    cerr<<"                  \r"<<((int)(end * 100.0 / nv))<<"%"<<std::flush;
 	}
+    }
+}
 
+
+// the points and connectivity, so edits made after reading the file still miss the cache
+static unsigned long long HashMesh(const TriangleMesh &mesh) {
+    int counts[2] = { (int)mesh.verts.size(), (int)mesh.faces.size() };
+    unsigned long long h = GuidanceCacheHash(counts, sizeof(counts));
+    for (unsigned i=0; i<mesh.verts.size(); i++) {
+	float p[3] = { (float)mesh.verts[i].point[0], (float)mesh.verts[i].point[1], (float)mesh.verts[i].point[2] };
+	h = GuidanceCacheHash(p, sizeof(p), h);
     }
+    for (unsigned i=0; i<mesh.faces.size(); i++)
+	h = GuidanceCacheHash(mesh.faces[i].verts, sizeof(mesh.faces[i].verts), h);
+    return h;
+}
+
+
+bool MeshGuidanceField::LoadCache(const GuidanceCacheKey &key) {
+
+    GuidanceCacheFile cache;
+    if (!cache.Open(key))
+	return false;
+
+    const GuidanceCacheData &d = cache.data;
+    if (d.npoints != (int)kdGetPoint.mesh.verts.size())
+	return false;
+
+    ideal_length.resize(d.npoints);
+    for (int i=0; i<d.npoints; i++)
+	ideal_length[i] = (real_type)d.ideal_length[i];
+    kdtree = GuidanceCacheLoadTree<kdtree_type>(d, kdGetPoint);
+    return true;
+}
+
+
+// the kd-tree indexes the mesh vertices, so positions and the trim mask aren't stored
+void MeshGuidanceField::SaveCache(const GuidanceCacheKey &key) const {
+
+    vector<double> ideal(ideal_length.begin(), ideal_length.end());
+
+    GuidanceCacheData d;
+    d.npoints = ideal.size();
+    d.ideal_length = ideal.empty() ? NULL : &ideal[0];
+
+    vector<int> codes, objects;
+    vector<double> cuts;
+    GuidanceCacheStoreTree(*kdtree, d, codes, cuts, objects);
+    WriteGuidanceCache(key, d);
+}
+
+
+MeshGuidanceField::~MeshGuidanceField() {
+    delete kdtree;
+}
+
+MeshGuidanceField::MeshGuidanceField(int curv_sub, const TriangleMesh &mesh, real_type rho, real_type min_step, real_type max_step, real_type reduction)
+    : GuidanceField(rho, min_step, max_step, reduction), kdGetPoint(mesh) {
+
+    GuidanceCacheKey key(GUIDANCE_CACHE_MESH, 0, rho, min_step, max_step, reduction);
+    key.params[0] = curv_sub;
+    if (GuidanceCacheEnabled()) {
+	key.input_hash = HashMesh(mesh);
+	if (LoadCache(key))
+	    return;
+    }
+
+
+    // setup the kdtree
+    kdtree = new kdtree_type(10, mesh.bounding_box(), kdGetPoint);
+    for (unsigned i=0; i<mesh.verts.size(); i++)
+        kdtree->Insert(i, false);
+    kdtree->MakeTree();
+
+
+    mls::GaussianWeightFunction<double> wf;
+    wf.set_radius(1);
+
+
+    ProfileTimer pt(PROF_TIME_GUIDANCE_BUILD);
+    double curvature_start = get_time_seconds();
+    cerr << "[TIMING] Computing curvature for " << mesh.verts.size() << " vertices..." << endl;
+
+    ideal_length.resize(mesh.verts.size());
+    ParallelExecutor(idealNumThreads, makeClassFunctor(this, &MeshGuidanceField::CurvatureParallel), mesh, curv_sub);
     cerr << std::endl;
 
     double curvature_elapsed = get_time_seconds() - curvature_start;
     cerr << "[TIMING] Curvature computation completed in " << curvature_elapsed << " seconds ("
-         << (mesh.verts.size() / curvature_elapsed) << " verts/sec)" << endl;
+         << (mesh.verts.size() / curvature_elapsed) << " verts/sec on " << idealNumThreads << " threads)" << endl;
 
     vector<int> marked; // for removal
     Trim(marked);
@@ -804,6 +1282,8 @@ MeshGuidanceField::MeshGuidanceField(int curv_sub, const TriangleMesh &mesh, rea
     }
     kdtree->MakeTree();
 
+    if (GuidanceCacheEnabled())
+	SaveCache(key);
 
 
 
@@ -1012,21 +1492,18 @@ int MeshGuidanceField::ClosestPoint(const Point3 &p) {
 }
 
 
-void MeshGuidanceField::OrderedPointTraverseStart(const Point3 &p) {
-
-    if (kdOrderedTraverse)
-	delete kdOrderedTraverse;
-    kdOrderedTraverse = new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
+void* MeshGuidanceField::OrderedPointTraverseStart(const Point3 &p) const {
+    return new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
 }
 
-int MeshGuidanceField::OrderedPointTraverseNext(real_type &squared_dist) {
-    if (kdOrderedTraverse->empty()) return -1;
-    return kdOrderedTraverse->GetNext(squared_dist);
+int MeshGuidanceField::OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const {
+    kdtree_type::OrderedIncrementalTraverse *traverse = (kdtree_type::OrderedIncrementalTraverse*)ctx;
+    if (traverse->empty()) return -1;
+    return traverse->GetNext(squared_dist);
 }
 
-void MeshGuidanceField::OrderedPointTraverseEnd() {
-    delete kdOrderedTraverse;
-    kdOrderedTraverse = NULL;
+void MeshGuidanceField::OrderedPointTraverseEnd(void *ctx) const {
+    delete (kdtree_type::OrderedIncrementalTraverse*)ctx;
 }
 
 
@@ -7,6 +7,8 @@
 #include "guidance.h"
 #include "triangulator.h"
 
+class GuidanceCacheKey;
+
 class MeshProjector : public SurfaceProjector {
     public:
     // stuff for the kdtree
@@ -48,9 +50,9 @@ class MeshGuidanceField : public GuidanceField {
     virtual ~MeshGuidanceField();
 
     int ClosestPoint(const Point3 &p);
-    void OrderedPointTraverseStart(const Point3 &p);
-    int OrderedPointTraverseNext(real_type &squared_dist);
-    void OrderedPointTraverseEnd();
+    void* OrderedPointTraverseStart(const Point3 &p) const;
+    int OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const;
+    void OrderedPointTraverseEnd(void *ctx) const;
     const Point3& PointLocation(int i) const;
     int NumPoints() const;
 
@@ -70,12 +72,14 @@ class MeshGuidanceField : public GuidanceField {
 
     private:
 
+    void CurvatureParallel(int nt, int id, const TriangleMesh &mesh, int curv_sub);
+    bool LoadCache(const GuidanceCacheKey &key);
+    void SaveCache(const GuidanceCacheKey &key) const;
     void MeanCurvaturesToSaliency(real_type rad);
     void MeanCurvaturesToSaliencyParallel(int nt, int id, real_type rad, const real_type rads[], vector<real_type> ave_curvatures[][2]);
 
     kdtree_type *kdtree;
     GetPointMesh kdGetPoint;
-    kdtree_type::OrderedIncrementalTraverse *kdOrderedTraverse;
 };
 
 
@@ -2,10 +2,17 @@
 #include "guidance.h"
 #include "triangulator.h"
 #include "triangulate_mls.h"
+#include "profile.h"
+#include <lib/mlslib/NR/nr.h>
 
 #include <cstdio>
 #include <algorithm>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#define MLS_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef WIN32
 #define NO_RMLS
 #endif
@@ -16,11 +23,104 @@
 
 using namespace std;
 
+
+// warm start the mls plane from the last one a thread fit, when the new point is closer to the
+// last one than this fraction of the support radius.  0 starts every fit from scratch - warm
+// starts converge faster but make the result depend on which thread got which point before
+real_type mls_frame_reuse = 0;
+
+
+typedef gtb::ss_kdtree<surfel_set>::t_surfel_tree MLSSampleTree;
+
+// the samples around one sample in order of distance, pulled from the kd-tree as far as any
+// query has needed.  a radius or k-nearest query around the sample is a prefix of this list,
+// so it gives exactly what _projector's extract() would
+class MLSNeighborList {
+    public:
+    MLSNeighborList() : sample(-1), traverse(NULL), last_use(0) { }
+    ~MLSNeighborList() { delete traverse; }
+
+    void Reset(const MLSSampleTree &tree, const Point3 &origin, int _sample) {
+	delete traverse;
+	traverse = new MLSSampleTree::OrderedIncrementalTraverse(tree, origin);
+	sample = _sample;
+	index.clear();
+	dist2.clear();
+    }
+
+    bool Pull() {
+	if (traverse->empty()) return false;
+	real_type d2;
+	index.push_back(traverse->GetNext(d2));
+	dist2.push_back(d2);
+	return true;
+    }
+
+    // everything closer than this has been pulled
+    real_type Covered2() const {
+	if (traverse->empty()) return (real_type)1e30;
+	return dist2.empty() ? 0 : dist2.back();
+    }
+
+    int sample;
+    MLSSampleTree::OrderedIncrementalTraverse *traverse;
+    vector<unsigned> index;
+    vector<real_type> dist2;
+    unsigned last_use;
+};
+
+
+#define MLS_CACHED_SAMPLES 4
+
+class MLSProjectionScratch {
+    public:
+    MLSProjectionScratch(const CProjection &projector, const void *_thread) :
+	thread(_thread), clock(0), recent(0), knn(projector.get_points()), nbhd(projector.get_points()),
+	poly(CProjection::gen_poly(projector._polynomial_degree)), frame_valid(false) {
+    }
+
+    const void *thread;
+
+    MLSNeighborList lists[MLS_CACHED_SAMPLES];
+    unsigned clock;
+    int recent;
+
+    GaussianWeightFunction theta;
+    surfelset_view knn;
+    surfelset_view nbhd;
+    surfel_set std_points;
+    aptr<CProjection::lPoly> poly;
+
+    // the neighborhood relative to the point being projected, padded to a multiple of 4
+    vector<float> x, y, z, mask;
+
+    bool frame_valid;
+    Point3 frame_r;
+    real_type frame_rst[3];
+};
+
+
+// unique per live thread, to find a thread's scratch without asking the os who it is
+#ifdef WIN32
+static __declspec(thread) char mls_thread_tag;
+static __declspec(thread) unsigned mls_last_id = 0;
+static __declspec(thread) MLSProjectionScratch *mls_last_scratch = NULL;
+#else
+static __thread char mls_thread_tag;
+static __thread unsigned mls_last_id = 0;
+static __thread MLSProjectionScratch *mls_last_scratch = NULL;
+#endif
+
+static unsigned mls_next_scratch_id = 1;
+
+
+
 SmoothMLSProjector::SmoothMLSProjector(surfel_set &surfels, int adamson):
     _wf(1.0f),
     _radius_wf(1.0f),
     _projector(surfels, 8, &_wf, &_radius_wf, 2, NULL),
-    _adamson(adamson)
+    _adamson(adamson),
+    scratch_id(mls_next_scratch_id++)
 {
     _projector.compute_points_radius();
     _projector.set_radius_factor(2.0f);
@@ -28,11 +128,317 @@ SmoothMLSProjector::SmoothMLSProjector(surfel_set &surfels, int adamson):
 
 SmoothMLSProjector::~SmoothMLSProjector()
 {
+    for (unsigned i=0; i<scratch.size(); i++)
+	delete scratch[i];
+}
+
+
+MLSProjectionScratch& SmoothMLSProjector::Scratch() const
+{
+    if (mls_last_id == scratch_id)
+	return *mls_last_scratch;
+
+    MLSProjectionScratch *s = NULL;
+    scratch_cs.enter();
+    for (unsigned i=0; i<scratch.size(); i++) {
+	if (scratch[i]->thread == &mls_thread_tag)
+	    s = scratch[i];
+    }
+    if (!s) {
+	s = new MLSProjectionScratch(_projector, &mls_thread_tag);
+	scratch.push_back(s);
+    }
+    scratch_cs.leave();
+
+    mls_last_id = scratch_id;
+    mls_last_scratch = s;
+    return *s;
+}
+
+
+// what _projector._kd.tree->FindMin(r) gives.  if r is close enough to the sample we last
+// worked around, its nearest sample has to be in that sample's list already
+int SmoothMLSProjector::NearestSample(MLSProjectionScratch &s, const Point3 &r) const
+{
+    MLSNeighborList &l = s.lists[s.recent];
+    if (l.sample >= 0) {
+	const surfel_set &points = _projector.get_points();
+	real_type d2 = Point3::squared_distance(r, points.vertex(l.sample));
+	if (4*d2 < l.Covered2()) {
+	    int best = -1;
+	    real_type bestd2 = 0;
+	    for (unsigned i=0; i<l.index.size(); i++) {
+		real_type id2 = (points.vertex(l.index[i]) - r).squared_length();
+		if (best < 0 || id2 < bestd2) {
+		    best = l.index[i];
+		    bestd2 = id2;
+		}
+		if (l.dist2[i] > 4*d2) break;
+	    }
+	    return best;
+	}
+    }
+    return _projector._kd.tree->FindMin(r);
+}
+
+
+static MLSNeighborList& NeighborList(MLSProjectionScratch &s, const CProjection &projector, int sample)
+{
+    s.clock++;
+    int oldest = 0;
+    for (int i=0; i<MLS_CACHED_SAMPLES; i++) {
+	if (s.lists[i].sample == sample) {
+	    Profile::Count(PROF_MLS_NBHD_REUSED);
+	    s.lists[i].last_use = s.clock;
+	    s.recent = i;
+	    return s.lists[i];
+	}
+	if (s.lists[i].last_use < s.lists[oldest].last_use)
+	    oldest = i;
+    }
+
+    Profile::Count(PROF_MLS_NBHD_EXTRACTED);
+    MLSNeighborList &l = s.lists[oldest];
+    l.Reset(*projector._kd.tree, projector.get_points().vertex(sample), sample);
+    l.last_use = s.clock;
+    s.recent = oldest;
+    return l;
+}
+
+
+// _projector.extract2(r, knn, nbhd)
+void SmoothMLSProjector::ExtractNeighbors(MLSProjectionScratch &s, const Point3 &r, int knn, surfelset_view &nbhd) const
+{
+    MLSNeighborList &l = NeighborList(s, _projector, NearestSample(s, r));
+    while ((int)l.index.size() < knn && l.Pull())
+	;
+
+    nbhd.clear();
+    int n = std::min(knn, (int)l.index.size());
+    nbhd.get_view().assign(l.index.begin(), l.index.begin()+n);
 }
 
+
+// _projector.extract2(r, radius, nbhd) - which, like the kd-tree's Traverse, includes the
+// first sample past the radius
+void SmoothMLSProjector::ExtractNeighbors(MLSProjectionScratch &s, const Point3 &r, real_type radius, surfelset_view &nbhd) const
+{
+    MLSNeighborList &l = NeighborList(s, _projector, NearestSample(s, r));
+    real_type radius2 = radius * radius;
+    while ((l.dist2.empty() || l.dist2.back() <= radius2) && l.Pull())
+	;
+
+    unsigned n = 0;
+    while (n < l.index.size() && (n == 0 || l.dist2[n-1] <= radius2))
+	n++;
+
+    nbhd.clear();
+    nbhd.get_view().assign(l.index.begin(), l.index.begin()+n);
+}
+
+
+
+#ifdef MLS_SSE2
+// exp for 4 floats, cephes' polynomial - good to about 2 ulp, which is far below anything the
+// plane fit can see
+static inline __m128 mls_exp_ps(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
+
+    __m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+    __m128i emm0 = _mm_cvttps_epi32(fx);
+    __m128 tmp = _mm_cvtepi32_ps(emm0);
+    fx = _mm_sub_ps(tmp, _mm_and_ps(_mm_cmpgt_ps(tmp, fx), _mm_set1_ps(1.0f)));	// floor
+
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440e-4f)));
+    __m128 z = _mm_mul_ps(x, x);
+
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, z), x);
+    y = _mm_add_ps(y, _mm_set1_ps(1.0f));
+
+    emm0 = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(0x7f)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(emm0));
+}
+
+static inline float mls_hsum_ps(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+
+// the mls plane energy for the plane with normal n through q=r+n*t - the gaussian weighted
+// mean squared distance of the neighbors, whose positions are relative to r
+class MLSPlaneEnergy {
+    public:
+    MLSPlaneEnergy(const MLSProjectionScratch &_s, real_type sigma) : s(_s), factor((float)(-1.0 / (2*sigma*sigma))) { }
+
+    real_type Eval(real_type pr, real_type ps, real_type pt) const {
+	Plane plane(gtb::tCPlaneRST<real_type>(pr, ps, pt));
+	const Vector3 &n = plane.normal();
+	const float nx=(float)n[0], ny=(float)n[1], nz=(float)n[2], t=(float)pt;
+	const float qx=nx*t, qy=ny*t, qz=nz*t;
+
+	float wsum, vsum;
+	unsigned N = s.x.size();
+#ifdef MLS_SSE2
+	__m128 vnx=_mm_set1_ps(nx), vny=_mm_set1_ps(ny), vnz=_mm_set1_ps(nz), vt=_mm_set1_ps(t);
+	__m128 vqx=_mm_set1_ps(qx), vqy=_mm_set1_ps(qy), vqz=_mm_set1_ps(qz), vf=_mm_set1_ps(factor);
+	__m128 ws=_mm_setzero_ps(), vs=_mm_setzero_ps();
+	for (unsigned i=0; i<N; i+=4) {
+	    __m128 x=_mm_loadu_ps(&s.x[i]), y=_mm_loadu_ps(&s.y[i]), z=_mm_loadu_ps(&s.z[i]);
+	    __m128 dx=_mm_sub_ps(x,vqx), dy=_mm_sub_ps(y,vqy), dz=_mm_sub_ps(z,vqz);
+	    __m128 d2=_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy)), _mm_mul_ps(dz,dz));
+	    __m128 w=_mm_mul_ps(mls_exp_ps(_mm_mul_ps(d2,vf)), _mm_loadu_ps(&s.mask[i]));
+	    __m128 qd=_mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vnx,x), _mm_mul_ps(vny,y)), _mm_mul_ps(vnz,z)), vt);
+	    ws=_mm_add_ps(ws, w);
+	    vs=_mm_add_ps(vs, _mm_mul_ps(_mm_mul_ps(qd,qd), w));
+	}
+	wsum = mls_hsum_ps(ws);
+	vsum = mls_hsum_ps(vs);
+#else
+	wsum = vsum = 0;
+	for (unsigned i=0; i<N; i++) {
+	    float dx=s.x[i]-qx, dy=s.y[i]-qy, dz=s.z[i]-qz;
+	    float w = expf((dx*dx + dy*dy + dz*dz) * factor) * s.mask[i];
+	    float qd = nx*s.x[i] + ny*s.y[i] + nz*s.z[i] - t;
+	    wsum += w;
+	    vsum += qd*qd*w;
+	}
+#endif
+
+	if (wsum < 1e-8f) return (real_type)1e8;
+	return (real_type)(vsum / wsum);
+    }
+
+    // what frprmn wants - 1 based
+    real_type operator()(real_type *rst) const {
+	return Eval(rst[1], rst[2], rst[3]);
+    }
+
+    // forward differences, like CProjection's RSTPlaneValueObject
+    void partial_derivatives(real_type *rst, real_type *pd) const {
+	real_type h = gtb::fp_sqrt_precision<real_type>();
+	real_type vp = Eval(rst[1], rst[2], rst[3]);
+	pd[1] = (Eval(rst[1]+h, rst[2], rst[3]) - vp) / h;
+	pd[2] = (Eval(rst[1], rst[2]+h, rst[3]) - vp) / h;
+	pd[3] = (Eval(rst[1], rst[2], rst[3]+h) - vp) / h;
+    }
+
+    private:
+    const MLSProjectionScratch &s;
+    float factor;
+};
+
+class MLSPlaneEnergyDerivatives {
+    public:
+    MLSPlaneEnergyDerivatives(const MLSPlaneEnergy &_e) : e(_e) { }
+    void operator()(real_type *rst, real_type *pd) const { e.partial_derivatives(rst, pd); }
+    private:
+    const MLSPlaneEnergy &e;
+};
+
+
+// CProjection::PowellMLSPlane, minimizing MLSPlaneEnergy instead
+bool SmoothMLSProjector::MLSPlane(MLSProjectionScratch &s, const Point3 &r, real_type radius, Plane &plane) const
+{
+    unsigned N = s.nbhd.size();
+    unsigned padded = (N+3) & ~3u;
+    s.x.resize(padded);	s.y.resize(padded);	s.z.resize(padded);
+    s.mask.resize(padded);
+    for (unsigned i=0; i<padded; i++) {
+	if (i < N) {
+	    const Point3 &p = s.nbhd.vertex(i);
+	    s.x[i] = (float)(p[0]-r[0]);
+	    s.y[i] = (float)(p[1]-r[1]);
+	    s.z[i] = (float)(p[2]-r[2]);
+	    s.mask[i] = 1;
+	} else {
+	    s.x[i] = s.y[i] = s.z[i] = s.mask[i] = 0;
+	}
+    }
+
+    real_type rst[4];
+    if (mls_frame_reuse > 0 && s.frame_valid &&
+	Point3::squared_distance(r, s.frame_r) < (mls_frame_reuse*radius) * (mls_frame_reuse*radius)) {
+	// same plane, measured from the new point
+	Plane last(gtb::tCPlaneRST<real_type>(s.frame_rst[0], s.frame_rst[1], s.frame_rst[2]));
+	rst[1] = s.frame_rst[0];
+	rst[2] = s.frame_rst[1];
+	rst[3] = s.frame_rst[2] + last.normal().dot(s.frame_r - r);
+    } else {
+	CProjection::PlaneInitialValues(s.nbhd, r, s.theta.influence_radius(0.95), rst[1], rst[2], rst[3]);
+    }
+
+    MLSPlaneEnergy energy(s, s.theta._sigma);
+    MLSPlaneEnergyDerivatives denergy(energy);
+    int iter;
+    real_type fret;
+    bool converged = NR::frprmn(&rst[0], 3, (real_type)1e-3f, &iter, &fret, energy, denergy);
+    Profile::Count(PROF_PROJECT_ITERATIONS, iter);
+    Profile::Maximum(PROF_MAX_PROJECT_ITERATIONS, iter);
+    if (!converged) {
+	s.frame_valid = false;
+	return false;
+    }
+
+    plane = Plane(gtb::tCPlaneRST<real_type>(rst[1], rst[2], rst[3]));
+
+    s.frame_valid = true;
+    s.frame_r = r;
+    s.frame_rst[0] = rst[1];
+    s.frame_rst[1] = rst[2];
+    s.frame_rst[2] = rst[3];
+    return true;
+}
+
+
+// CProjection::PowellProject / adamson_projection, through the scratch
+bool SmoothMLSProjector::MLSProject(const Point3 &r, Point3 &r1, Vector3 &n1) const
+{
+    MLSProjectionScratch &s = Scratch();
+
+    ExtractNeighbors(s, r, _projector._knn_radius, s.knn);
+    real_type radius = _projector.point_radius(s.knn, r);
+    ExtractNeighbors(s, r, radius, s.nbhd);
+
+    if (_adamson != 0)
+	return _projector.adamson_projection(s.nbhd, r, r1, n1, _adamson);
+
+    if (s.nbhd.size() < 6) return false;
+
+    radius = _projector.point_radius(s.nbhd, r);
+    s.theta.set_radius(radius/3.0);
+
+    Plane plane;
+    if (!MLSPlane(s, r, radius, plane))
+	return false;
+
+    plane_transformation T(plane, r);
+    Point3 q = T.FromPlane(Point3(0,0,0));
+    CProjection::WeightedPolyFit(s.nbhd, T, q, &s.theta, s.poly, s.std_points);
+
+    r1 = T.FromPlane(Point3(0, 0, s.poly->eval(0,0)));
+    if (s.nbhd.has_normals())
+	CProjection::normal0(T, s.poly, s.nbhd.normal(0), n1);
+    else
+	CProjection::normal0(T, s.poly, n1);
+    return true;
+}
+
+
 int SmoothMLSProjector::ProjectPoint(const Point3 &fp, Point3 &tp, Vector3 &tn) const
 {
-    return (_projector.PowellProject(fp, tp, tn) ? PROJECT_SUCCESS : PROJECT_FAILURE);
+    return (MLSProject(fp, tp, tn) ? PROJECT_SUCCESS : PROJECT_FAILURE);
 }
 
 int SmoothMLSProjector::ProjectPoint
@@ -44,11 +450,11 @@ int SmoothMLSProjector::ProjectPoint
     if (rmls) {
 #ifndef NO_RMLS
 
-	real_type radius = _projector.point_radius(fp);
-	gtb::surfelset_view nbhd(_projector.get_points());
+	MLSProjectionScratch &s = Scratch();
+	surfelset_view &nbhd = s.nbhd;
 
 	extern int rmls_knn;
-	_projector.extract2(fp, rmls_knn, nbhd);
+	ExtractNeighbors(s, fp, rmls_knn, nbhd);
 
 	// copy into a vector for rmls
 	vector<Point> neighbors;
@@ -67,13 +473,8 @@ int SmoothMLSProjector::ProjectPoint
 #else
 		cerr<<"no robust mls on windows right now"<<endl;
 #endif
-    } else
-		if (_adamson != 0) {
-	if (!_projector.adamson_projection(fp, tp, tn, _adamson))
-	    return PROJECT_FAILURE;
-    } else {
-	if (!_projector.PowellProject(fp, tp, tn))
-	    return PROJECT_FAILURE;
+    } else if (!MLSProject(fp, tp, tn)) {
+	return PROJECT_FAILURE;
     }
 
     if (fn.dot(tn) < 0)
@@ -115,7 +516,6 @@ SmoothMLSGuidanceField::SmoothMLSGuidanceField
      VectorField field, float field_epsilon):
 	GuidanceField(rho, min_step, max_step, reduction),
 	_projector(projector),
-	_kdOrderedTraverse(NULL),
 	_adamson(adamson)
 {
     ideal_length.resize(projector.get_points().size());
@@ -147,7 +547,6 @@ SmoothMLSGuidanceField::SmoothMLSGuidanceField
      real_type rho, real_type min_step, real_type max_step, real_type reduction, int adamson, const char *filename):
 	GuidanceField(rho, min_step, max_step, reduction),
 	_projector(projector),
-	_kdOrderedTraverse(NULL),
 	_adamson(adamson)
 {
     //    curv_radius.resize(projector.get_points().size());
@@ -175,21 +574,20 @@ int SmoothMLSGuidanceField::ClosestPoint(const Point3 &p)
 }
 
 
-void SmoothMLSGuidanceField::OrderedPointTraverseStart(const Point3 &p)
+void* SmoothMLSGuidanceField::OrderedPointTraverseStart(const Point3 &p) const
 {
-    if (_kdOrderedTraverse)
-	delete _kdOrderedTraverse;
-    _kdOrderedTraverse = new gtb::ss_kdtree<surfel_set>::t_surfel_tree::OrderedIncrementalTraverse(*_projector.get_kdtree().tree, p);
+    return new gtb::ss_kdtree<surfel_set>::t_surfel_tree::OrderedIncrementalTraverse(*_projector.get_kdtree().tree, p);
 }
 
-int SmoothMLSGuidanceField::OrderedPointTraverseNext(real_type &dist) {
-    if (_kdOrderedTraverse->empty()) return -1;
-    return _kdOrderedTraverse->GetNext(dist);
+int SmoothMLSGuidanceField::OrderedPointTraverseNext(void *ctx, real_type &dist) const {
+    gtb::ss_kdtree<surfel_set>::t_surfel_tree::OrderedIncrementalTraverse *traverse =
+	(gtb::ss_kdtree<surfel_set>::t_surfel_tree::OrderedIncrementalTraverse*)ctx;
+    if (traverse->empty()) return -1;
+    return traverse->GetNext(dist);
 }
 
-void SmoothMLSGuidanceField::OrderedPointTraverseEnd() {
-    delete _kdOrderedTraverse;
-    _kdOrderedTraverse = NULL;
+void SmoothMLSGuidanceField::OrderedPointTraverseEnd(void *ctx) const {
+    delete (gtb::ss_kdtree<surfel_set>::t_surfel_tree::OrderedIncrementalTraverse*)ctx;
 }
 
 const Point3& SmoothMLSGuidanceField::PointLocation(int i) const
@@ -6,6 +6,8 @@
 #include <vector>
 #include "common.h"
 
+class MLSProjectionScratch;
+
 class SmoothMLSProjector : public SurfaceProjector 
 {
     public:
@@ -27,6 +29,21 @@ class SmoothMLSProjector : public SurfaceProjector
     void SetRadiusFactor(real_type t) {
 	_projector.set_radius_factor(t);
     }
+
+
+    private:
+    // the same projections as _projector's, but re-entrant - each thread keeps its own weight
+    // function and buffers, and the sorted neighbors of the last few samples it projected near
+    MLSProjectionScratch& Scratch() const;
+    int NearestSample(MLSProjectionScratch &s, const Point3 &r) const;
+    void ExtractNeighbors(MLSProjectionScratch &s, const Point3 &r, int knn, surfelset_view &nbhd) const;
+    void ExtractNeighbors(MLSProjectionScratch &s, const Point3 &r, real_type radius, surfelset_view &nbhd) const;
+    bool MLSProject(const Point3 &r, Point3 &r1, Vector3 &n1) const;
+    bool MLSPlane(MLSProjectionScratch &s, const Point3 &r, real_type radius, Plane &plane) const;
+
+    unsigned scratch_id;
+    mutable thlib::CSObject scratch_cs;
+    mutable vector<MLSProjectionScratch*> scratch;
 };
 
 class SmoothMLSGuidanceField : public GuidanceField 
@@ -49,9 +66,9 @@ class SmoothMLSGuidanceField : public GuidanceField
 
 
     int ClosestPoint(const Point3 &p);
-    void OrderedPointTraverseStart(const Point3 &p);
-    int OrderedPointTraverseNext(real_type &dist);
-    void OrderedPointTraverseEnd();
+    void* OrderedPointTraverseStart(const Point3 &p) const;
+    int OrderedPointTraverseNext(void *ctx, real_type &dist) const;
+    void OrderedPointTraverseEnd(void *ctx) const;
     const Point3& PointLocation(int i) const;
 
     void Extract(vector<Point3> &pts, vector<Vector3> &norms, vector<real_type> &rad);
@@ -60,7 +77,6 @@ class SmoothMLSGuidanceField : public GuidanceField
 
     CProjection &_projector;
 
-    gtb::ss_kdtree<surfel_set>::t_surfel_tree::OrderedIncrementalTraverse *_kdOrderedTraverse;
 
     int _adamson;
 };
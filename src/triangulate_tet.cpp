@@ -1840,8 +1840,9 @@ void TetMeshGuidanceField::BuildGuidanceParallel(int nt, int id, real_type isova
 
 
 TetMeshGuidanceField::TetMeshGuidanceField(TetMeshProjector &proj, real_type rho, real_type min_step, real_type max_step, real_type reduction)
-    : GuidanceField(rho, min_step, max_step, reduction), projector(proj), kdGetPoint(), kdOrderedTraverse(NULL) {
+    : GuidanceField(rho, min_step, max_step, reduction), projector(proj), kdGetPoint() {
 
+    ProfileTimer pt(PROF_TIME_GUIDANCE_BUILD);
 
     real_type isovalue = projector.GetIsoValue();
     const TetMesh &mesh = projector.GetMesh();
@@ -1899,7 +1900,6 @@ TetMeshGuidanceField::TetMeshGuidanceField(TetMeshProjector &proj, real_type rho
 
 
 TetMeshGuidanceField::~TetMeshGuidanceField() {
-    if (kdOrderedTraverse) delete kdOrderedTraverse;
     delete kdtree;
 }
 
@@ -1909,20 +1909,18 @@ int TetMeshGuidanceField::ClosestPoint(const Point3 &p) {
 }
 
 
-void TetMeshGuidanceField::OrderedPointTraverseStart(const Point3 &p) {
-    if (kdOrderedTraverse)
-	delete kdOrderedTraverse;
-    kdOrderedTraverse = new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
+void* TetMeshGuidanceField::OrderedPointTraverseStart(const Point3 &p) const {
+    return new kdtree_type::OrderedIncrementalTraverse(*kdtree, p);
 }
 
-int TetMeshGuidanceField::OrderedPointTraverseNext(real_type &squared_dist) {
-    if (kdOrderedTraverse->empty()) return -1;
-    return kdOrderedTraverse->GetNext(squared_dist);
+int TetMeshGuidanceField::OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const {
+    kdtree_type::OrderedIncrementalTraverse *traverse = (kdtree_type::OrderedIncrementalTraverse*)ctx;
+    if (traverse->empty()) return -1;
+    return traverse->GetNext(squared_dist);
 }
 
-void TetMeshGuidanceField::OrderedPointTraverseEnd() {
-    delete kdOrderedTraverse;
-    kdOrderedTraverse = NULL;
+void TetMeshGuidanceField::OrderedPointTraverseEnd(void *ctx) const {
+    delete (kdtree_type::OrderedIncrementalTraverse*)ctx;
 }
 
 
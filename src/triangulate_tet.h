@@ -246,9 +246,9 @@ class TetMeshGuidanceField : public GuidanceField {
     ~TetMeshGuidanceField();
 
     int ClosestPoint(const Point3 &p);
-    void OrderedPointTraverseStart(const Point3 &p);
-    int OrderedPointTraverseNext(real_type &squared_dist);
-    void OrderedPointTraverseEnd();
+    void* OrderedPointTraverseStart(const Point3 &p) const;
+    int OrderedPointTraverseNext(void *ctx, real_type &squared_dist) const;
+    void OrderedPointTraverseEnd(void *ctx) const;
     const Point3& PointLocation(int i) const;
     int NumPoints() const;
 
@@ -273,7 +273,6 @@ class TetMeshGuidanceField : public GuidanceField {
     typedef gtb::KDTree<int, real_type, GetPoint> kdtree_type;
     kdtree_type *kdtree;
     GetPoint kdGetPoint;
-    kdtree_type::OrderedIncrementalTraverse *kdOrderedTraverse;
 
 };
 
@@ -7,7 +7,11 @@
 // set this to 0 if you want projections to happen immediately instead of in a different thread
 // WARNING: this will only work for projectors that don't have any state!
 extern int idealNumThreads;
-#define TRIANGULATOR_NUM_PROJECTORS (idealNumThreads/2) //(std::max(1,idealNumThreads-1))
+// the projectors sleep when idle and the main thread sleeps while waiting on them, so we can use every core
+#define TRIANGULATOR_NUM_PROJECTORS (idealNumThreads-1)
+
+// how many of the best grow edges to keep at the front of the projector queue (0 disables)
+extern int projection_lookahead;
 
 // Timing utility
 static double get_time_seconds() {
@@ -30,17 +34,24 @@ bool operator<(const FrontElement::priority_type &l, const FrontElement::priorit
 
 
 
-void Triangulator::CreateVertex(const Point3 &p, const Vector3 &n, FrontElement &fe, bool boundary) {
-    fe = FrontElement(p, n, numVertsAdded, controller.MaxStepLength(p));
-    controller.AddVertex(numVertsAdded, p, flipOutput?-n:n, boundary);
-    numVertsAdded++;
+void Triangulator::CreateVertex(const Point3 &p, const Vector3 &n, FrontElement &fe, bool boundary, real_type max_step) {
+    // the guidance field can be evaluated from any thread, only the output needs the lock
+    if (max_step < 0)
+	max_step = controller.MaxStepLength(p);
+    if (shared_cs) shared_cs->enter();
+    fe = FrontElement(p, n, *vert_count, max_step);
+    controller.AddVertex(*vert_count, p, flipOutput?-n:n, boundary);
+    (*vert_count)++;
+    if (shared_cs) shared_cs->leave();
 }
 
 
 void Triangulator::CreateTriangle(int v1, int v2, int v3) {
-    if (flipOutput)		controller.AddTriangle(numFacesAdded, v2, v1, v3);
-    else				controller.AddTriangle(numFacesAdded, v1, v2, v3);
-    numFacesAdded++;
+    if (shared_cs) shared_cs->enter();
+    if (flipOutput)		controller.AddTriangle(*face_count, v2, v1, v3);
+    else				controller.AddTriangle(*face_count, v1, v2, v3);
+    (*face_count)++;
+    if (shared_cs) shared_cs->leave();
 }
 
 void Triangulator::CreateTriangle(const feli v1, const feli v2, const feli v3) {
@@ -67,32 +78,134 @@ real_type ccwAngleAlmost(const Vector3 &norm, const Vector3 &_v1, const Vector3
 
 
 void Triangulator::RequestProjection(feli e) {
-    e->proj_res.result = PROJECT_INCOMPLETE;
+    // anything still outstanding for this edge is out of date now
+    CancelProjection(e);
 
     Point3 tentative_p;
     Vector3 tentative_n;
     feli n = Front::NextElement(e);
     GetTentativePoint(*e, *n, tentative_p, tentative_n);
 
-
-    if (TRIANGULATOR_NUM_PROJECTORS <= 0) {
+    e->proj_res.max_step = -1;
+    if (NumProjectors() <= 0) {
 	// just do it immediately
 	e->proj_res.result = controller.ProjectPoint(*e, *n,
 						     tentative_p, tentative_n,
 						     e->proj_res.position, e->proj_res.normal);
     } else {
-	// put it in the work queue
-	work_cs.enter();
+	// put it in the work queue and wake up a projector
 	real_type priority = PrioritizeEdgeGrow(*e, *n);
-	work_queue.push(ProjectionWork(priority, &e->proj_res, tentative_p, tentative_n, &*e, &*n));
-	work_cs.leave();
+	work_cond.enter();
+	e->proj_res.result = PROJECT_INCOMPLETE;
+	e->proj_res.ticket = work_next_ticket++;
+	e->proj_res.speculated = false;
+	work_pending[e->proj_res.ticket] = &e->proj_res;
+	work_queue.push(ProjectionWork(priority, e->proj_res.ticket, tentative_p, tentative_n, &*e, &*n));
+	work_cond.signal();
+	work_cond.leave();
     }
 }
 
 void Triangulator::WaitForProjection(feli e) {
+    proj_waits++;
+    if (e->proj_res.result != PROJECT_INCOMPLETE)
+	return;
+
+    // sleep until the projector that has our work tells us it's done
+    proj_stalls++;
+    double stall_start = get_time_seconds();
+
+    done_cond.enter();
     while (e->proj_res.result == PROJECT_INCOMPLETE) {
-	thlib::Thread::yield();
+	done_waiting = &e->proj_res;
+	done_cond.wait();
+    }
+    done_waiting = NULL;
+    done_cond.leave();
+
+    proj_stall_time += get_time_seconds() - stall_start;
+}
+
+// drop the request if no projector has started on it yet, otherwise wait for it to finish.
+// must be called before the edge is modified or removed from the front
+void Triangulator::CancelProjection(feli e) {
+    if (e->proj_res.result != PROJECT_INCOMPLETE)
+	return;
+
+    work_cond.enter();
+    std::map<int, ProjectionResult*>::iterator pi = work_pending.find(e->proj_res.ticket);
+    if (pi != work_pending.end()) {
+	work_pending.erase(pi);
+	e->proj_res.result = PROJECT_CANCELLED;
+    }
+    work_cond.leave();
+
+    if (e->proj_res.result == PROJECT_INCOMPLETE) {
+	// a projector is already working on it and is using the front elements
+	WaitForProjection(e);
+    }
+}
+
+
+// functor for walking the front heap in priority order without modifying it
+class HeapIndexLess {
+    public:
+    HeapIndexLess(const vector<Triangulator::feli> &_h) : h(_h) { }
+    // same ordering as the heap itself - a lower priority value is better
+    bool operator()(int l, int r) const { return h[r]->priority < h[l]->priority; }
+    const vector<Triangulator::feli> &h;
+};
+
+// push the projections for the best k grow edges to the front of the work queue, so they are
+// hopefully finished by the time they get to the top of the heap
+void Triangulator::SpeculateProjections(int k) {
+    if (k <= 0 || work_threads.empty())
+	return;
+
+    const vector<feli> &h = heap.contents();
+
+    // best-first search of the heap - children are never better than their parents
+    vector<int> open;
+    open.reserve(2*k+1);
+    HeapIndexLess hless(h);
+    if (h.size()) open.push_back(0);
+
+    int rank = 0;
+    bool pushed = false;
+
+    work_cond.enter();
+    while (!open.empty() && rank < k) {
+	std::pop_heap(open.begin(), open.end(), hless);
+	int i = open.back();
+	open.pop_back();
+
+	feli e = h[i];
+	if (e->priority.first != PRIORITY_GROW_EDGE)
+	    break;	// everything left is connect/failsafe/outside the working area
+
+	if (e->proj_res.result == PROJECT_INCOMPLETE && !e->proj_res.speculated &&
+	    work_pending.find(e->proj_res.ticket) != work_pending.end()) {
+
+	    Point3 tentative_p;
+	    Vector3 tentative_n;
+	    feli n = Front::NextElement(e);
+	    GetTentativePoint(*e, *n, tentative_p, tentative_n);
+
+	    // rank 0 gets the highest priority, and all of them are above any regular request
+	    real_type priority = std::numeric_limits<real_type>::max() / (rank+2);
+	    work_queue.push(ProjectionWork(priority, e->proj_res.ticket, tentative_p, tentative_n, &*e, &*n));
+	    e->proj_res.speculated = true;
+	    pushed = true;
+	}
+	rank++;
+
+	unsigned lc = 2*i+1;
+	if (lc < h.size())   { open.push_back(lc);   std::push_heap(open.begin(), open.end(), hless); }
+	if (lc+1 < h.size()) { open.push_back(lc+1); std::push_heap(open.begin(), open.end(), hless); }
     }
+    if (pushed)
+	work_cond.broadcast();
+    work_cond.leave();
 }
 
 
@@ -100,27 +213,45 @@ void* Triangulator::ProjectorThreadMain(void* arg) {
 
     Triangulator *tri = (Triangulator*)arg;
 
-    while (!tri->work_quit) {
+    while (1) {
 
 	ProjectionWork pw;
-	bool havework = false;
-    
-	tri->work_cs.enter();
-	if (tri->work_queue.size()) {
-	    pw = tri->work_queue.top();
-	    tri->work_queue.pop();
-	    havework=true;
+
+	tri->work_cond.enter();
+	while (!tri->work_quit && tri->work_queue.empty()) {
+	    tri->work_cond.wait();
 	}
-	tri->work_cs.leave();
+	if (tri->work_quit) {
+	    tri->work_cond.leave();
+	    break;
+	}
+	pw = tri->work_queue.top();
+	tri->work_queue.pop();
 
-	if (havework) {
-	    pw.pr->result = tri->controller.ProjectPoint(*pw.base1, *pw.base2,
-							 pw.fp, pw.fn,
-							 pw.pr->position, pw.pr->normal);
-	} else {
-	    thlib::Thread::yield();
-	    //    sleep(0);
+	// claim the ticket - if it's gone, the request was cancelled or another projector already took it
+	std::map<int, ProjectionResult*>::iterator pi = tri->work_pending.find(pw.ticket);
+	if (pi == tri->work_pending.end()) {
+	    tri->work_cond.leave();
+	    continue;
 	}
+	ProjectionResult *pr = pi->second;
+	tri->work_pending.erase(pi);
+	tri->work_cond.leave();
+
+	int result = tri->controller.ProjectPoint(*pw.base1, *pw.base2,
+						  pw.fp, pw.fn,
+						  pr->position, pr->normal);
+
+	// the new vertex will need its step length, so work it out here instead of on the main thread
+	if (result == PROJECT_SUCCESS)
+	    pr->max_step = tri->controller.MaxStepLength(pr->position);
+
+	// publish the result, only waking the main thread if it's actually waiting on this one
+	tri->done_cond.enter();
+	pr->result = result;
+	if (tri->done_waiting == pr)
+	    tri->done_cond.signal();
+	tri->done_cond.leave();
     }
     return NULL;
 }
@@ -585,7 +716,7 @@ real_type PointSegmentDistance(const Point3 &p, const Point3 &e1, const Point3 &
 }
 
 
-bool Triangulator::TriangleLegal(const feli e1, const feli e2, const feli *across, const Point3 &across_p, const Vector3 &across_n, vector<feli> *possible_intersects, bool *isclose) const {
+bool Triangulator::CheckTriangleLegal(const feli e1, const feli e2, const feli *across, const Point3 &across_p, const Vector3 &across_n, vector<feli> *possible_intersects, bool *isclose) const {
 
     if (isclose)
 	*isclose = false;
@@ -964,10 +1095,10 @@ void Triangulator::ConnectTriangle(feli e1, feli across, bool dofailsafe)
 	feli i2next = Front::NextElement(i2);
 
 	// i1 and i2 don't point to the same place anymore, so remove and re-insert them into the kd tree
-	WaitForProjection(i1);
-	WaitForProjection(i2);
-	kdtree.Remove(*this, i1);
-	kdtree.Remove(*this, i2);
+	CancelProjection(i1);
+	CancelProjection(i2);
+	KDRemove(i1);
+	KDRemove(i2);
 
 	// we're reaching across to another vert - either have to split or merge
 	feli n1,n2;	// the 2 new verts that will be created (dups of existing ones)
@@ -988,11 +1119,11 @@ void Triangulator::ConnectTriangle(feli e1, feli across, bool dofailsafe)
 	RequestProjection(i2);
 	heap.push(n1);
 	heap.push(n2);
-	kdtree.Insert(*this, n1);
-	kdtree.Insert(*this, n2);
+	KDInsert(n1);
+	KDInsert(n2);
 
-	kdtree.Insert(*this, i1);
-	kdtree.Insert(*this, i2);
+	KDInsert(i1);
+	KDInsert(i2);
 
 
 
@@ -1018,18 +1149,18 @@ void Triangulator::ConnectTriangle(feli e1, feli across, bool dofailsafe)
 
     // close a front
     if (e1ear && e2ear) {
-	WaitForProjection(e1);
-	WaitForProjection(e2);
-	WaitForProjection(across);
+	CancelProjection(e1);
+	CancelProjection(e2);
+	CancelProjection(across);
 		
 	// remove all 3 edges from the kdtree and heap
 	heap.remove(e1->heap_position);
 	heap.remove(e2->heap_position);
 	heap.remove(across->heap_position);
 
-	kdtree.Remove(*this, e1);
-	kdtree.Remove(*this, e2);
-	kdtree.Remove(*this, across);
+	KDRemove(e1);
+	KDRemove(e2);
+	KDRemove(across);
 
 	// now remove them from the front - free's the FrontElement structure!
 	Front::RemoveElement(e1);
@@ -1050,16 +1181,16 @@ void Triangulator::ConnectTriangle(feli e1, feli across, bool dofailsafe)
 
 
 	// remove e1 from everything, remove across from the kdtree
-	WaitForProjection(e1);
-	WaitForProjection(across);
+	CancelProjection(e1);
+	CancelProjection(across);
 	heap.remove(e1->heap_position);
-	kdtree.Remove(*this, e1);
-	kdtree.Remove(*this, across);
+	KDRemove(e1);
+	KDRemove(across);
 	Front::RemoveElement(e1);
 
 	// re-add across since e1 has been removed
 	RequestProjection(across);
-	kdtree.Insert(*this, across);
+	KDInsert(across);
 
 	if (failsafe) {
 	    PrioritizeEdgeFailsafe(across);
@@ -1074,16 +1205,16 @@ void Triangulator::ConnectTriangle(feli e1, feli across, bool dofailsafe)
 
 
 
-void Triangulator::GrowEdge(feli e1, const Point3 &p, const Vector3 &v) {
+void Triangulator::GrowEdge(feli e1, const Point3 &p, const Vector3 &v, real_type max_step) {
 
-    WaitForProjection(e1);
+    CancelProjection(e1);
 
     // remove the old edge from the kd tree
-    kdtree.Remove(*this, e1);
+    KDRemove(e1);
 
     // insert the new vertex
     FrontElement fe;
-    CreateVertex(p, v, fe, false);
+    CreateVertex(p, v, fe, false, max_step);
     feli ne = Front::InsertElement(Front::NextElement(e1), fe);
 
     ne->flags |= FRONT_FLAG_FROM_GROW;
@@ -1092,11 +1223,11 @@ void Triangulator::GrowEdge(feli e1, const Point3 &p, const Vector3 &v) {
 
     // add e1 back (since it now connects to a new vert)
     RequestProjection(e1);
-    kdtree.Insert(*this, e1);
+    KDInsert(e1);
 
     // add the new edge to the kdtree and heap
     RequestProjection(ne);
-    kdtree.Insert(*this, ne);
+    KDInsert(ne);
     heap.push(ne);
 
     // reset the priority on the edges that may be 
@@ -1124,19 +1255,19 @@ void Triangulator::SetupInitialCreaseFronts
 {
     vector<int> index_map;
     for (unsigned i=0; i<points.size(); ++i) {
-	index_map.push_back(numVertsAdded++);
+	index_map.push_back((*vert_count)++);
 	controller.AddVertex(index_map[i], points[i], 
 			     flipOutput?onormals[i]:-onormals[i], true);
     }
 
     for (unsigned i=0; i<corner_triangles.size(); i+=3)
-	controller.AddTriangle(numFacesAdded++, 
+	controller.AddTriangle((*face_count)++, 
 			       corner_triangles[i],
 			       corner_triangles[i+1],
 			       corner_triangles[i+2]);
 
     for (unsigned i=0; i<indices.size(); ++i) {
-	Front *front = new Front();
+	Front *front = new Front(&pool);
 	for (unsigned j=0; j<indices[i].size(); ++j) {
 	    const Point3 &p(points[indices[i][j]]);
 	    FrontElement fe(p,
@@ -1149,7 +1280,7 @@ void Triangulator::SetupInitialCreaseFronts
 	do {
 	    RequestProjection(f);
 	    heap.push(f);
-	    kdtree.Insert(*this, f);
+	    KDInsert(f);
 	    f = Front::NextElement(f);
 	} while (f != front->FirstElement());
 	fronts.push_back(front);
@@ -1160,7 +1291,7 @@ void Triangulator::SetupInitialFronts(const vector< vector<Point3> > &ipts, cons
 
     for (unsigned i=0; i<ipts.size(); i++) {
 
-	Front *front = new Front();
+	Front *front = new Front(&pool);
 
 	for (unsigned j=0; j<ipts[i].size(); j++) {
 
@@ -1177,7 +1308,7 @@ void Triangulator::SetupInitialFronts(const vector< vector<Point3> > &ipts, cons
 	do {
 	    RequestProjection(f);
 	    heap.push(f);
-	    kdtree.Insert(*this, f);
+	    KDInsert(f);
 
 	    f = Front::NextElement(f);
 
@@ -1218,7 +1349,7 @@ void Triangulator::UpdateWorkingArea(feli e) {
 	do {
 	    feli ne = Front::NextElement(fe);
 
-	    if (fe->priority.first<PRIORITY_FAILSAFE_ANY && fe->priority.first>=PRIORITY_OWA &&
+	    if (fe->priority.first<PRIORITY_DEFERRED && fe->priority.first>=PRIORITY_OWA &&
 		Point3::distance(workingAreaCenter, fe->position)<=workingAreaRadius &&
 		Point3::distance(workingAreaCenter, ne->position)<=workingAreaRadius) {
 
@@ -1231,14 +1362,62 @@ void Triangulator::UpdateWorkingArea(feli e) {
 
     }
 
-    dbgClear();
-    DbgSpheres::add(workingAreaCenter, workingAreaRadius, 0, 0, 1, 0.5);
+    if (!partitioned) {
+	dbgClear();
+	DbgSpheres::add(workingAreaCenter, workingAreaRadius, 0, 0, 1, 0.5);
+    }
+
+    // the kd-tree keeps itself balanced as edges come and go, so there's no need to rebuild it here
+
+    if (!partitioned)
+	redrawAndWait(' ');
+}
+
 
-    if (heap.contents().size()) {
-	kdtree.ReBuild(heap.contents(), *this);
+// keep the kd-tree up to date, tracking how much work its local rebuilds are doing
+void Triangulator::KDInsert(feli e) {
+    double start = get_time_seconds();
+    int moved = kdtree.Insert(*this, e);
+    Profile::Count(PROF_KD_INSERTS);
+    if (moved) {
+	kd_rebuilds++;
+	kd_rebuilt_objects += moved;
+	Profile::Count(PROF_KD_REBUILDS);
+	Profile::Count(PROF_KD_REBUILT_OBJECTS, moved);
     }
+    kd_time += get_time_seconds() - start;
+}
+
+void Triangulator::KDRemove(feli e) {
+    double start = get_time_seconds();
+    int moved;
+    kdtree.Remove(*this, e, moved);
+    Profile::Count(PROF_KD_REMOVES);
+    if (moved) {
+	kd_rebuilds++;
+	kd_rebuilt_objects += moved;
+	Profile::Count(PROF_KD_REBUILDS);
+	Profile::Count(PROF_KD_REBUILT_OBJECTS, moved);
+    }
+    kd_time += get_time_seconds() - start;
+}
+
+
+// is p far enough inside our region that a triangle grown from e can't reach another region
+bool Triangulator::InRegion(const feli e, const Point3 &p) const {
+    if (!partitioned)
+	return true;
 
-    redrawAndWait(' ');
+    real_type margin = 2 * std::max(e->max_step, Front::NextElement(e)->max_step);
+    return (p[0]-margin >= region.x_min() && p[0]+margin <= region.x_max() &&
+	    p[1]-margin >= region.y_min() && p[1]+margin <= region.y_max() &&
+	    p[2]-margin >= region.z_min() && p[2]+margin <= region.z_max());
+}
+
+void Triangulator::DeferEdge(feli e) {
+    e->priority.first = PRIORITY_DEFERRED;
+    e->priority.second = 0;
+    heap.update_position(e->heap_position);
 }
 
 
@@ -1284,19 +1463,29 @@ void Triangulator::Go
 void Triangulator::Go
     (const vector< vector<Point3> > &ipts, const vector< vector<Vector3> > &inorms, bool failsafe)
 {
+    ProfileTimer pt(PROF_TIME_TRIANGULATE);
     StartWorkerThreads();
     SetupInitialFronts(ipts, inorms);
 
     vector< vector<int> > failsafe_holes;
 
     double triangulation_start = get_time_seconds();
-    int triangles_at_start = 0;
+    int triangles_at_start = *face_count;
     int num_projector_threads = work_threads.size();
-    cerr << "[TIMING] Starting triangulation (using " << num_projector_threads << " projector threads)..." << endl;
+    if (!partitioned)
+	cerr << "[TIMING] Starting triangulation (using " << num_projector_threads << " projector threads, look-ahead "
+	     << projection_lookahead << ")..." << endl;
+    proj_waits = proj_stalls = 0;
+    proj_stall_time = 0;
+    kd_rebuilds = kd_rebuilt_objects = 0;
+    kd_time = 0;
 
     while (!heap.empty()) {
 	feli top = heap.top();
 
+	// only deferred/failsafe edges left - the stitch pass has to deal with them
+	if (partitioned && top->priority.first >= PRIORITY_DEFERRED)
+	    break;
 
 	if (top->priority.first == PRIORITY_GROW_EDGE) {
 
@@ -1304,6 +1493,7 @@ void Triangulator::Go
 	    if (top != heap.top() || top->priority.first != PRIORITY_GROW_EDGE) continue;
 
 	    feli e2 = Front::NextElement(top);
+	    SpeculateProjections(projection_lookahead);
 	    WaitForProjection(top);
 
 	    if (top->proj_res.result == PROJECT_BOUNDARY) {
@@ -1354,11 +1544,13 @@ void Triangulator::Go
 		    PrioritizeEdgeConnect(top);
 		}
 
+	    } else if (!InRegion(top, top->proj_res.position)) {
+		DeferEdge(top);
 	    } else {
 		bool isclose;
 		bool tl = TriangleLegal(top, e2, NULL, top->proj_res.position, top->proj_res.normal, NULL, &isclose);
 		if (tl && !isclose) {
-		    GrowEdge(top, top->proj_res.position, top->proj_res.normal);
+		    GrowEdge(top, top->proj_res.position, top->proj_res.normal, top->proj_res.max_step);
 		} else {
 		    PrioritizeEdgeConnect(top);
 		}
@@ -1393,9 +1585,9 @@ void Triangulator::Go
 
 			failsafe_holes.back().push_back(f->vertindex);
 				
-			WaitForProjection(f);
+			CancelProjection(f);
 			heap.remove(f->heap_position);
-			kdtree.Remove(*this, f);
+			KDRemove(f);
 			Front::RemoveElement(f);
 		    }
 
@@ -1419,13 +1611,19 @@ void Triangulator::Go
 	}
 
 	int stopevery = 10;
-	if (numFacesAdded % stopevery == 0) {
-	    fprintf(stderr, "                    \rNF: %d", numFacesAdded);
+	if (!partitioned && *face_count % stopevery == 0) {
+	    fprintf(stderr, "                    \rNF: %d", *face_count);
 	    fflush(stdout);
 	    redrawAndWait(' ');
 	}
     }
 
+    if (partitioned) {
+	// leave the fronts for the stitch pass, it'll finish the output
+	StopWorkerThreads();
+	return;
+    }
+
     controller.Finish();
 
     if (failsafe_holes.size() != 0) {
@@ -1456,11 +1654,16 @@ void Triangulator::Go
     fprintf(stderr, "\n");
 
     double triangulation_elapsed = get_time_seconds() - triangulation_start;
-    int triangles_generated = numFacesAdded - triangles_at_start;
+    int triangles_generated = *face_count - triangles_at_start;
 
     cerr << "[TIMING] Triangulation completed in " << triangulation_elapsed << " seconds" << endl;
     cerr << "[TIMING] Generated " << triangles_generated << " triangles ("
          << (triangles_generated / triangulation_elapsed) << " tris/sec)" << endl;
+    cerr << "[TIMING] Projection stalls: " << proj_stalls << " of " << proj_waits << " waits ("
+	 << (proj_waits ? 100.0*proj_stalls/proj_waits : 0.0) << "%), "
+	 << proj_stall_time << " seconds (" << (100.0*proj_stall_time/triangulation_elapsed) << "% of triangulation)" << endl;
+    cerr << "[TIMING] KD-tree: " << kd_time << " seconds in insert/remove, " << kd_rebuilds << " local rebuilds moving "
+	 << kd_rebuilt_objects << " edges (" << kdtree.size() << " edges left in tree)" << endl;
 
     StopWorkerThreads();
 }
@@ -1539,6 +1742,148 @@ void Triangulator::ExtractFronts(vector< vector<Point3> > &fpts, vector< vector<
 
 
 
+void Triangulator::ExtractFrontElements(vector< vector<FrontElement> > &fes) {
+
+    for (unsigned fi=0; fi<fronts.size(); fi++) {
+	if (fronts[fi]->empty()) continue;
+
+	fes.push_back(vector<FrontElement>());
+	feli f = fronts[fi]->FirstElement();
+	do {
+	    CancelProjection(f);
+	    fes.back().push_back(*f);
+	    f = Front::NextElement(f);
+	} while (f != fronts[fi]->FirstElement());
+    }
+}
+
+
+void Triangulator::AdoptFronts(const vector< vector<FrontElement> > &fes) {
+
+    for (unsigned i=0; i<fes.size(); i++) {
+
+	Front *front = new Front(&pool);
+	for (unsigned j=0; j<fes[i].size(); j++) {
+	    FrontElement e = fes[i][j];
+	    e.priority = FrontElement::priority_type(0x7fffffff, 1e34);
+	    e.proj_res = ProjectionResult();
+	    e.proj_res.result = PROJECT_FAILURE;
+	    front->AddElement(e);
+	}
+
+	// projections get requested and priorities set in SetupInitialFronts
+	feli f = front->FirstElement();
+	do {
+	    heap.push(f);
+	    KDInsert(f);
+	    f = Front::NextElement(f);
+	} while (f != front->FirstElement());
+
+	fronts.push_back(front);
+    }
+}
+
+
+class RegionWork {
+    public:
+    TriangulatorController *controller;
+    bool flip;
+    const vector<Box3> *regions;
+    const vector< vector< vector<Point3> > > *region_ipts;
+    const vector< vector< vector<Vector3> > > *region_inorms;
+
+    // next region to hand out
+    int next;
+    thlib::CSObject next_cs;
+
+    // shared by all the triangulators
+    thlib::CSObject output_cs;
+    int num_verts;
+    int num_faces;
+
+    // the fronts each region couldn't finish
+    vector< vector< vector<FrontElement> > > leftover;
+};
+
+
+void* Triangulator::RegionThreadMain(void *arg) {
+
+    RegionWork *rw = (RegionWork*)arg;
+
+    while (1) {
+	rw->next_cs.enter();
+	int r = rw->next++;
+	rw->next_cs.leave();
+	if (r >= (int)rw->regions->size())
+	    break;
+
+	// already running one of these per thread, so no projector threads
+	Triangulator tri(*rw->controller);
+	tri.SetFlipOutput(rw->flip);
+	tri.SetNumProjectors(0);
+	tri.SetShared(&rw->output_cs, &rw->num_verts, &rw->num_faces);
+	tri.SetRegion((*rw->regions)[r]);
+	tri.Go((*rw->region_ipts)[r], (*rw->region_inorms)[r], false);
+	tri.ExtractFrontElements(rw->leftover[r]);
+    }
+    return NULL;
+}
+
+
+void Triangulator::GoPartitioned
+    (TriangulatorController &c, bool flip,
+     const vector<Box3> &regions,
+     const vector< vector< vector<Point3> > > &region_ipts,
+     const vector< vector< vector<Vector3> > > &region_inorms,
+     const vector< vector<Point3> > &ipts, const vector< vector<Vector3> > &inorms,
+     bool dofailsafe)
+{
+    RegionWork rw;
+    rw.controller = &c;
+    rw.flip = flip;
+    rw.regions = &regions;
+    rw.region_ipts = &region_ipts;
+    rw.region_inorms = &region_inorms;
+    rw.next = 0;
+    rw.num_verts = 0;
+    rw.num_faces = 0;
+    rw.leftover.resize(regions.size());
+
+    int num_threads = std::max(1, std::min(idealNumThreads, (int)regions.size()));
+    cerr << "[TIMING] Starting partitioned triangulation (" << regions.size() << " regions on "
+	 << num_threads << " threads)..." << endl;
+    double region_start = get_time_seconds();
+
+    vector<thlib::Thread*> threads(num_threads-1);
+    for (int i=0; i<num_threads-1; i++) {
+	threads[i] = new thlib::Thread(RegionThreadMain, &rw, 0);
+    }
+    RegionThreadMain(&rw);
+    for (int i=0; i<num_threads-1; i++) {
+	int *ret;
+	threads[i]->join((void**)&ret);
+	delete threads[i];
+    }
+
+    double region_elapsed = get_time_seconds() - region_start;
+    cerr << "[TIMING] Region pass completed in " << region_elapsed << " seconds, "
+	 << rw.num_faces << " triangles (" << (rw.num_faces / region_elapsed) << " tris/sec)" << endl;
+
+
+    // stitch everything the regions left behind together
+    Triangulator stitch(c);
+    stitch.SetFlipOutput(flip);
+    stitch.SetShared(NULL, &rw.num_verts, &rw.num_faces);
+    for (unsigned r=0; r<rw.leftover.size(); r++) {
+	stitch.AdoptFronts(rw.leftover[r]);
+	rw.leftover[r].clear();
+    }
+    cerr << "[TIMING] Stitching " << stitch.fronts.size() << " leftover fronts" << endl;
+    stitch.Go(ipts, inorms, dofailsafe);
+}
+
+
+
 // functions for the heap
 bool operator<(const Triangulator::feli &l, const Triangulator::feli &r) {
     // reverse the comparison since the heap wants high priority at the top
@@ -1552,28 +1897,44 @@ void heap_position(Triangulator::feli &i, int p) {
 
 
 Triangulator::Triangulator(TriangulatorController &c)
-    : controller(c), numVertsAdded(0), numFacesAdded(0), flipOutput(false), work_quit(false) {
+    : work_next_ticket(1), work_quit(false), done_waiting(NULL),
+      proj_waits(0), proj_stalls(0), proj_stall_time(0), kd_rebuilds(0), kd_rebuilt_objects(0), kd_time(0),
+      controller(c), numVertsAdded(0), numFacesAdded(0), flipOutput(false), numProjectors(-1),
+      shared_cs(NULL), vert_count(&numVertsAdded), face_count(&numFacesAdded), partitioned(false) {
 
 }
 
+int Triangulator::NumProjectors() const {
+    return (numProjectors >= 0) ? numProjectors : TRIANGULATOR_NUM_PROJECTORS;
+}
+
 void Triangulator::StartWorkerThreads() {
-    int num_proj = TRIANGULATOR_NUM_PROJECTORS;
+    int num_proj = NumProjectors();
+    work_quit = false;
     for (int i=0; i<num_proj; i++) {
 	work_threads.push_back(new thlib::Thread(ProjectorThreadMain, this, 0));
     }
 }
 
 void Triangulator::StopWorkerThreads() {
+    work_cond.enter();
     work_quit=true;
+    work_cond.broadcast();
+    work_cond.leave();
+
     for (unsigned i=0; i<work_threads.size(); i++) {
 	int *ret;
 	work_threads[i]->join((void**)&ret);
 	delete work_threads[i];
     }
+    work_threads.clear();
 }
 
 
 Triangulator::~Triangulator() {
+    for (unsigned i=0; i<fronts.size(); i++) {
+	delete fronts[i];
+    }
 }
 
 
@@ -1,16 +1,19 @@
 #ifndef _TRIANGULATOR_H
 #define _TRIANGULATOR_H
 
+#include <map>
 #include "front.h"
 #include "uheap.h"
 #include <gtb/gtb.hpp>
 #include "guidance.h"
+#include "profile.h"
 
 
 #define PROJECT_INCOMPLETE     -1       // projector thread hasn't gotten around to it yet
 #define PROJECT_SUCCESS		0
 #define PROJECT_FAILURE		1
 #define PROJECT_BOUNDARY	2	// failed because we tried crossing a boundary
+#define PROJECT_CANCELLED	3	// request was dropped before a projector got to it
 
 
 // this interface must be implemented and passed to the triangulator
@@ -26,7 +29,7 @@ class TriangulatorController {
     virtual void Finish() = 0;
 
     // how far are we allowed to step from this spot?
-    virtual real_type MaxStepLength(const Point3 &p) = 0;
+    virtual real_type MaxStepLength(const Point3 &p) const = 0;
 
     // project a point onto the surface
     virtual int ProjectPoint(const FrontElement &base1, const FrontElement &base2, const Point3 &fp, const Vector3 &fn, Point3 &tp, Vector3 &tn) const = 0;
@@ -122,10 +125,14 @@ class ControllerWrapper : public TriangulatorController
 
 
     void AddVertex(int index, const Point3 &p, const Vector3 &n, bool boundary) {
+	ProfileTimer pt(PROF_TIME_OUTPUT);
+	Profile::Count(PROF_OUTPUT_VERTICES);
 	output_c->AddVertex(index, p, n, boundary);
     }
 
     void AddTriangle(int index, int v1, int v2, int v3) {
+	ProfileTimer pt(PROF_TIME_OUTPUT);
+	Profile::Count(PROF_OUTPUT_TRIANGLES);
 	output_c->AddTriangle(index, v1, v2, v3);
     }
 
@@ -134,14 +141,19 @@ class ControllerWrapper : public TriangulatorController
     }
 
 
-    real_type MaxStepLength(const Point3 &p) {
+    real_type MaxStepLength(const Point3 &p) const {
 	return guidance->MaxStepLength(p);
     }
 
 
 
     int ProjectPoint(const FrontElement &base1, const FrontElement &base2, const Point3 &fp, const Vector3 &fn, Point3 &tp, Vector3 &tn) const {
-	return projector->ProjectPoint(base1, base2, fp, fn, tp, tn);
+	ProfileTimer pt(PROF_TIME_PROJECT);
+	Profile::Count(PROF_PROJECT_CALLS);
+	int ret = projector->ProjectPoint(base1, base2, fp, fn, tp, tn);
+	if (ret != PROJECT_SUCCESS)
+	    Profile::Count(PROF_PROJECT_FAILURES);
+	return ret;
     }
 
 
@@ -201,13 +213,40 @@ class Triangulator {
     real_type distance(const feli &i, const Point3 &from) const;
 
     void SetFlipOutput(bool f) { flipOutput=f; }
+    void SetNumProjectors(int n) { numProjectors=n; }
+
+    // share vertex/face numbering and output with other triangulators running at the same time
+    void SetShared(thlib::CSObject *cs, int *vcount, int *fcount) {
+	shared_cs=cs; vert_count=vcount; face_count=fcount;
+    }
+
+    // only grow vertices inside the region - anything that would leave it is deferred,
+    // and Go returns with the deferred fronts still in place instead of finishing the output
+    void SetRegion(const Box3 &r) { partitioned=true; region=r; }
+
+    // move fronts between triangulators (vertices are already in the output)
+    void ExtractFrontElements(vector< vector<FrontElement> > &fes);
+    void AdoptFronts(const vector< vector<FrontElement> > &fes);
+
+    /*!
+     * Triangulate the seed fronts of each region concurrently, each confined to its own
+     * region, then stitch all the fronts left over along the region boundaries together
+     * (along with ipts) in a single serial pass.  The regions must not overlap.
+     */
+    static void GoPartitioned
+	(TriangulatorController &c, bool flip,
+	 const vector<Box3> &regions,
+	 const vector< vector< vector<Point3> > > &region_ipts,
+	 const vector< vector< vector<Vector3> > > &region_inorms,
+	 const vector< vector<Point3> > &ipts, const vector< vector<Vector3> > &inorms,
+	 bool dofailsafe);
 
 
 
 
     private:
 
-    void CreateVertex(const Point3 &p, const Vector3 &n, FrontElement &fe, bool boundary);
+    void CreateVertex(const Point3 &p, const Vector3 &n, FrontElement &fe, bool boundary, real_type max_step=-1);
     void CreateTriangle(const feli v1, const feli v2, const feli v3);
     void CreateTriangle(int v1, int v2, int v3);
 
@@ -230,36 +269,63 @@ class Triangulator {
     real_type DistanceToFence(const feli &e1, const Point3 &p) const;
     real_type DistanceToFence(const Point3 &ep1, const Point3 &ep2, const Vector3 &en1, const Vector3 &en2, const Point3 &p) const;
     bool GrowthFromEdgeLegal(const feli e1, const Point3 &p) const;
-    bool TriangleLegal(const feli e1, const feli e2, const feli *across, const Point3 &across_p, const Vector3 &across_n, vector<feli> *possible_intersects, bool *isclose) const;
+    bool TriangleLegal(const feli e1, const feli e2, const feli *across, const Point3 &across_p, const Vector3 &across_n, vector<feli> *possible_intersects, bool *isclose) const {
+	Profile::Count(PROF_TRIANGLE_LEGAL_CALLS);
+	bool legal = CheckTriangleLegal(e1, e2, across, across_p, across_n, possible_intersects, isclose);
+	if (!legal) Profile::Count(PROF_TRIANGLE_LEGAL_REJECTS);
+	return legal;
+    }
+    bool CheckTriangleLegal(const feli e1, const feli e2, const feli *across, const Point3 &across_p, const Vector3 &across_n, vector<feli> *possible_intersects, bool *isclose) const;
 
     void ConnectTriangle(feli e1, feli across, bool dofailsafe);
-    void GrowEdge(feli e1, const Point3 &p, const Vector3 &v);
+    void GrowEdge(feli e1, const Point3 &p, const Vector3 &v, real_type max_step=-1);
+
+    bool InRegion(const feli e, const Point3 &p) const;
+    void DeferEdge(feli e);
+    static void* RegionThreadMain(void *arg);
+    int NumProjectors() const;
 
     void RequestProjection(feli e);
     void WaitForProjection(feli e);
     void CancelProjection(feli e);
+    void SpeculateProjections(int k);
     static void* ProjectorThreadMain(void *arg);
 
     class ProjectionWork {
 	public:
 	ProjectionWork() { };
-	ProjectionWork(real_type _priority, ProjectionResult *_pr, const Point3 &_fp, const Vector3 &_fn, const FrontElement *_base1, const FrontElement *_base2) :
-	    priority(_priority), pr(_pr), fp(_fp), fn(_fn), base1(_base1), base2(_base2) { }
+	ProjectionWork(real_type _priority, int _ticket, const Point3 &_fp, const Vector3 &_fn, const FrontElement *_base1, const FrontElement *_base2) :
+	    priority(_priority), ticket(_ticket), fp(_fp), fn(_fn), base1(_base1), base2(_base2) { }
 	bool operator<(const ProjectionWork &rhs) const {
 	    return (priority < rhs.priority);
 	}
 	real_type priority;
-	ProjectionResult *pr;
+	int ticket;
 	Point3 fp;
 	Vector3 fn;
 	const FrontElement *base1;
 	const FrontElement *base2;
     };
 
+    // pending projections, guarded by work_cond - projector threads sleep on it when the queue is empty.
+    // the queue only holds tickets, work_pending maps the ones still wanted to their results.  a ticket
+    // is erased when a projector claims it or the request is cancelled, so the queue can hold stale or
+    // duplicate (speculated) entries that point at front elements which no longer exist.
     gtb::fast_pq<ProjectionWork> work_queue;
+    std::map<int, ProjectionResult*> work_pending;
+    int work_next_ticket;
     volatile bool work_quit;
-    thlib::CSObject work_cs;
+    thlib::Condition work_cond;
     vector<thlib::Thread*> work_threads;
+
+    // the main thread sleeps on done_cond while the result it needs is still being projected
+    thlib::Condition done_cond;
+    ProjectionResult *done_waiting;
+
+    // how often the main thread had to sleep on a projection
+    int proj_waits;
+    int proj_stalls;
+    double proj_stall_time;
 	
 
     void StartWorkerThreads();
@@ -275,6 +341,12 @@ class Triangulator {
 
     void SetupInitialFronts(const vector< vector<Point3> > &ipts, const vector< vector<Vector3> > &inorms);
 
+    void KDInsert(feli e);
+    void KDRemove(feli e);
+    int kd_rebuilds;
+    int kd_rebuilt_objects;
+    double kd_time;
+
     void UpdateWorkingArea(feli e);
     real_type workingAreaRadius;
     Point3 workingAreaCenter;
@@ -283,6 +355,7 @@ class Triangulator {
 
     kdtree_type kdtree;
     heap_type	heap;
+    FrontElementPool pool;	// storage for the elements of all the fronts
     vector<Front*> fronts;
 
     TriangulatorController &controller;
@@ -290,6 +363,15 @@ class Triangulator {
     int numVertsAdded;
     int numFacesAdded;
     bool flipOutput;
+    int numProjectors;
+
+    // for running several triangulators at once - vertex/face numbering and output are shared
+    thlib::CSObject *shared_cs;
+    int *vert_count;
+    int *face_count;
+
+    bool partitioned;
+    Box3 region;
 
 };
 
@@ -5,6 +5,7 @@
 
 #include <vector>
 #include "common.h"
+#include "profile.h"
 #include <cassert>
 
 // updatable heap
@@ -33,9 +34,10 @@ public:
 
 	// put in at the end, and move it up the heap
 	void push(T &x) {
+		Profile::Count(PROF_HEAP_PUSHES);
 		heap_position(x, heap.size());
 		heap.push_back(x);
-		update_position(heap.size()-1);
+		fix_position(heap.size()-1);
 	}
 
 
@@ -43,10 +45,30 @@ public:
 	// move the back to the front, and push it back down the heap
 	void pop() {
         assert(size() > 0);
-		remove(0);
+		Profile::Count(PROF_HEAP_POPS);
+		remove_at(0);
 	}
 
 	void remove(int i) {
+		Profile::Count(PROF_HEAP_REMOVES);
+		remove_at(i);
+	}
+
+	const T& top() {
+		return heap.front();
+	}
+
+
+	// update the heap because the element at position i may be in the wrong place
+	// usefull for pushing/popping/updating priorities
+	void update_position(int i) {
+		Profile::Count(PROF_HEAP_UPDATES);
+		fix_position(i);
+	}
+
+
+	// the counted operations above are built from these
+	void remove_at(int i) {
         assert(i < size());
 		heap_position(heap[i], -1);
 
@@ -59,19 +81,11 @@ public:
 
 		// fix the heap
 		if ((size() > 0) && (i != size()))
-			update_position(i);
-	}
-
-	const T& top() {
-		return heap.front();
+			fix_position(i);
 	}
 
 
-
-
-	// update the heap because the element at position i may be in the wrong place
-	// usefull for pushing/popping/updating priorities
-	void update_position(int i) {
+	void fix_position(int i) {
 
         assert(i < size());
 
@@ -81,7 +95,7 @@ public:
 			std::swap(heap[i], heap[p]);
 			heap_position(heap[i], i);
 			heap_position(heap[p], p);
-			update_position(p);
+			fix_position(p);
 		}
 
 
@@ -103,7 +117,7 @@ public:
 			std::swap(heap[i], heap[maxc]);
 			heap_position(heap[i], i);
 			heap_position(heap[maxc], maxc);
-			update_position(maxc);
+			fix_position(maxc);
 		}
 	}
 